@@ -19,13 +19,29 @@
 #ifndef EXCEPTIONS
 #define EXCEPTIONS
 
+// modules, debug information, signal contexts and stacks are read through
+// Linux interfaces
+#ifndef __linux__
+#error "Cpp-stacktrace only supports Linux"
+#endif
+
+#include "stacktrace/FrameVariables.hpp"
+#include "stacktrace/ReportBuilder.hpp"
+#include "stacktrace/SignalFrames.hpp"
+#include "stacktrace/SourceCache.hpp"
+#include "stacktrace/StackScanner.hpp"
+#include "stacktrace/Symbolizer.hpp"
+#include <algorithm>
 #include <csignal>
 #include <cstdio>
 #include <cstdlib>
+#include <cstring>
 #include <execinfo.h>
 #include <iostream>
 #include <sstream>
 #include <stdint.h>
+#include <string>
+#include <vector>
 
 /*! \ingroup exceptions
  * Prints stack trace and throws a critical exception.
@@ -107,10 +123,85 @@ class Exceptions
 		static char* _programName;
 		return _programName;
 	}
+
+	// consecutive frames whose function starts with one of these prefixes are
+	// printed as a single line
+	static std::vector<std::string>& getFoldedPrefixes()
+	{
+		static std::vector<std::string> _foldedPrefixes;
+		return _foldedPrefixes;
+	}
+
+	// time given to the symbolization of a stack trace, in milliseconds
+	static int& getSymbolizationBudget()
+	{
+		static int _symbolizationBudget = 1000;
+		return _symbolizationBudget;
+	}
+
+	// whether stack traces end with the library's own metrics
+	static bool& getSelfMetricsInReports()
+	{
+		static bool _selfMetricsInReports;
+		return _selfMetricsInReports;
+	}
+
+	// innermost frames of a stack trace printed with their source lines, and
+	// lines printed before and after theirs
+	static int& getSourceSnippetFrames()
+	{
+		static int _sourceSnippetFrames;
+		return _sourceSnippetFrames;
+	}
+
+	static int& getSourceSnippetContext()
+	{
+		static int _sourceSnippetContext = 1;
+		return _sourceSnippetContext;
+	}
+
+	// innermost frames with debug information printed with their variables
+	// when a signal is caught
+	static int& getFrameVariablesFrames()
+	{
+		static int _frameVariablesFrames;
+		return _frameVariablesFrames;
+	}
 };
 
 void print_stacktrace(int calledFromSigInt);
+void append_stacktrace(ReportBuilder& report, int skip);
+void print_frames(void* const* buffer, int nptrs);
+void append_frames(ReportBuilder& report, void* const* buffer, int nptrs);
+void* get_lookup_address(void* const* frames, int i);
+int append_unwound_frames(ReportBuilder& report, void* const* frames,
+                          int nptrs, uintptr_t sp);
+void append_scanned_frames(ReportBuilder& report, uintptr_t sp,
+                           void* resumeAfter);
+void add_frame_folding(char const* prefix);
+void set_symbolization_budget(int milliseconds);
+void prewarm_symbolization(int threads);
+void set_symbolizer_cache_size(size_t bytes);
+void set_source_snippets(int frames, int context);
+void add_source_root(char const* directory);
+void append_source_snippet(ReportBuilder& report, char const* location);
+void set_frame_variables(int frames);
+void append_frame_variables(ReportBuilder& report, void const* ucontext,
+                            void* const* frames, int nptrs);
+void register_jit_code(void const* code, size_t size, char const* name);
+void unregister_jit_code(void const* code);
+void set_self_metrics_in_reports(bool enabled);
+void append_self_metrics(ReportBuilder& report);
+SymbolizerStats get_symbolizer_stats();
+int find_cycle(void* const* buffer, int nptrs, int first, int* repeats);
+bool function_has_prefix(char const* function, char const* prefix);
+int resolve_frames(char const* const program_name, void* const* addrs,
+                   int count, ResolvedFrame* frames);
+int resolve_frames(char const* const program_name, void* const* addrs,
+                   int count, ResolvedFrame* frames, int64_t deadline);
+int64_t get_report_deadline(ReportBuilder& report);
 void posix_signal_handler(int sig);
+void posix_signal_action(int sig, siginfo_t* info, void* ucontext);
 void set_signal_handler(sig_t handler);
 void init_exceptions(char* programName);
 int addr2line(char const* const program_name, void const* const addr,
@@ -119,85 +210,414 @@ int addr2line(char const* const program_name, void const* const addr,
 // prints formated stack trace with most information as possible
 // parameter indicates if the function is called by the signal handler or not
 //(to hide the call to the signal handler)
-inline void print_stacktrace(int calledFromSigInt)
+__attribute__((noinline)) inline void print_stacktrace(int calledFromSigInt)
+{
+	ReportBuilder report;
+	append_stacktrace(report, calledFromSigInt != 0 ? 2 : 1);
+	if(Exceptions::getSelfMetricsInReports())
+		append_self_metrics(report);
+	report.emit();
+}
+
+// formats the current stack trace into report, without the skip innermost
+// frames of the caller
+__attribute__((noinline)) inline void append_stacktrace(ReportBuilder& report,
+                                                        int skip)
 {
 	void* buffer[MAX_BACKTRACE_LINES];
-	char** strings;
 
-	int nptrs = backtrace(buffer, MAX_BACKTRACE_LINES);
-	strings   = backtrace_symbols(buffer, nptrs);
+	uint64_t start = SelfMetrics::now();
+	int nptrs      = backtrace(buffer, MAX_BACKTRACE_LINES);
+	SelfMetrics::time(SELF_CAPTURE, start);
+
+	// this function's frame
+	int i = 1 + skip;
+	append_unwound_frames(
+	    report, buffer + i, nptrs - i,
+	    reinterpret_cast<uintptr_t>(__builtin_frame_address(0)));
+}
+
+// formats frames unwound from the current stack, completing them when
+// unwinding stopped early; sp is within the stack of the innermost frame
+// returns the number of frames printed, the first ones being those given
+inline int append_unwound_frames(ReportBuilder& report, void* const* frames,
+                                 int nptrs, uintptr_t sp)
+{
+	// unwinding stopped at a signal trampoline, resume from the registers of
+	// the context the signal interrupted with the unwind information, then
+	// carry on below as if backtrace() had followed it
+	std::vector<void*> resumed;
+	SignalFrame const* signal = NULL;
+	if(nptrs > 0 && SignalFrames::isTrampoline(frames[nptrs - 1]))
+		signal = SignalFrames::findNotUnwound(frames, nptrs);
+	if(signal != NULL)
+	{
+		void* unwound[MAX_BACKTRACE_LINES];
+		int count = StackScanner::unwind(signal->context, unwound,
+		                                 MAX_BACKTRACE_LINES, &sp);
+		// the module table is busy, only the stack can be scanned
+		if(count == 0)
+		{
+			unwound[0] = reinterpret_cast<void*>(signal->pc);
+			sp         = signal->sp;
+			count      = 1;
+		}
+		resumed.assign(frames, frames + nptrs);
+		resumed.insert(resumed.end(), unwound, unwound + count);
+		frames = &resumed[0];
+		nptrs  = resumed.size();
+	}
+
+	// unwinding reached the entry point of the program or of the thread, the
+	// outermost frames being it and the C runtime function that calls main()
+	// or the thread's function, which are left out
+	if(nptrs > 0 && StackScanner::isStackEnd(frames[nptrs - 1]))
+	{
+		int printed = std::max(nptrs - 2, 0);
+		append_frames(report, frames, printed);
+		return printed;
+	}
+
+	// unwinding stopped anywhere else, look for the remaining frames in the
+	// stack
+	append_frames(report, frames, nptrs);
+	append_scanned_frames(report, sp, nptrs > 0 ? frames[nptrs - 1] : NULL);
+	return nptrs;
+}
+
+// formats the return addresses found in the stack from sp with their
+// confidence, see StackScanner; those up to resumeAfter, the outermost frame
+// already unwound, are left out if it is found
+inline void append_scanned_frames(ReportBuilder& report, uintptr_t sp,
+                                  void* resumeAfter)
+{
+	ScannedFrame scanned[MAX_BACKTRACE_LINES];
+	int found = StackScanner::scan(sp, scanned, MAX_BACKTRACE_LINES);
+	int first = 0;
+	for(int i = 0; i < found; ++i)
+		if(scanned[i].addr == resumeAfter)
+			first = i + 1;
+
+	// scanned addresses are return addresses, looked up at their call
+	void* addrs[MAX_BACKTRACE_LINES];
+	int count = found - first;
+	for(int i = 0; i < count; ++i)
+	{
+		scanned[i] = scanned[first + i];
+		addrs[i]   = static_cast<char*>(scanned[i].addr) - 1;
+	}
+
+	report << "Unwinding stopped, " << count
+	       << " frames found by scanning the stack:\n";
+	if(count == 0)
+		return;
+
+	std::vector<ResolvedFrame> resolved(count);
+	resolve_frames(Exceptions::getProgramName(), addrs, count, &resolved[0],
+	               get_report_deadline(report));
+	for(int i = 0; i < count; ++i)
+	{
+		ResolvedFrame const& frame = resolved[i];
+
+		report << "[?] " << scanned[i].addr;
+		if(frame.resolved)
+			report << " in " << frame.function << " at " << frame.location;
+		else
+		{
+			if(frame.function[0] != '\0')
+				report << " in " << frame.function;
+			if(frame.module[0] != '\0')
+				report << " (" << frame.module << "+"
+				       << reinterpret_cast<void const*>(frame.offset + 1)
+				       << ")";
+		}
+		report << " (scanned, "
+		       << StackScanner::getConfidenceName(scanned[i].confidence)
+		       << " confidence)\n";
+	}
+}
+
+// prints a captured stack, innermost frame first; frames are numbered so that
+// the outermost one is [0]
+inline void print_frames(void* const* buffer, int nptrs)
+{
+	ReportBuilder report;
+	append_frames(report, buffer, nptrs);
+	report.emit();
+}
 
-	if(strings == NULL)
+// formats a captured stack into report
+// repeated sequences of frames (recursion) are printed once, and each distinct
+// address is symbolized once
+inline void append_frames(ReportBuilder& report, void* const* buffer,
+                          int nptrs)
+{
+	if(nptrs <= 0)
+		return;
+
+	// symbolize each distinct address once
+	std::vector<void*> lookups(nptrs);
+	for(int i = 0; i < nptrs; ++i)
+		lookups[i] = get_lookup_address(buffer, i);
+	std::vector<void*> distinct(lookups);
+	std::sort(distinct.begin(), distinct.end());
+	distinct.erase(std::unique(distinct.begin(), distinct.end()),
+	               distinct.end());
+
+	std::vector<ResolvedFrame> resolved(distinct.size());
+	resolve_frames(Exceptions::getProgramName(), &distinct[0], distinct.size(),
+	               &resolved[0], get_report_deadline(report));
+
+	// resolved frame of each frame
+	std::vector<ResolvedFrame const*> frames(nptrs);
+	for(int i = 0; i < nptrs; ++i)
+		frames[i] = &resolved[std::lower_bound(distinct.begin(),
+		                                       distinct.end(), lookups[i])
+		                      - distinct.begin()];
+
+	std::vector<std::string> const& prefixes = Exceptions::getFoldedPrefixes();
+
+	// symbolized frames left to print with their source lines
+	int snippets = Exceptions::getSourceSnippetFrames();
+
+	for(int i = 0; i < nptrs;)
 	{
-		perror("backtrace_symbols");
-		exit(EXIT_FAILURE);
+		// fold consecutive frames having a known prefix
+		int folded         = 1;
+		char const* prefix = NULL;
+		for(size_t k = 0; k < prefixes.size() && frames[i]->function[0] != '\0';
+		    ++k)
+		{
+			prefix = prefixes[k].c_str();
+			if(!function_has_prefix(frames[i]->function, prefix))
+				continue;
+
+			while(i + folded < nptrs
+			      && function_has_prefix(frames[i + folded]->function, prefix))
+				++folded;
+			break;
+		}
+
+		if(folded > 1)
+		{
+			report << "[" << nptrs - i - 1 << "-" << nptrs - i - folded
+			       << "] " << folded << " " << prefix << " frames folded\n";
+			i += folded;
+			continue;
+		}
+
+		int repeats;
+		int cycle = find_cycle(buffer, nptrs, i, &repeats);
+
+		for(int j = i; j < i + std::max(cycle, 1); ++j)
+		{
+			ResolvedFrame const& frame = *frames[j];
+
+			report << "[" << nptrs - j - 1 << "] " << buffer[j];
+			// the handler of a signal returns there, the next frame being the
+			// instruction it interrupted
+			if(frame.module[0] != '\0' && SignalFrames::isTrampoline(buffer[j]))
+			{
+				SignalFrame const* signal
+				    = j + 1 < nptrs ? SignalFrames::find(buffer[j + 1]) : NULL;
+				if(signal != NULL)
+					report << " <signal " << signal->sig << ">\n";
+				else
+					report << " <signal>\n";
+				continue;
+			}
+			if(frame.resolved)
+				report << " in " << frame.function << " at " << frame.location;
+			// if addr2line failed or ran out of time, print what we can
+			else
+			{
+				if(frame.function[0] != '\0')
+					report << " in " << frame.function;
+				// the offset of the address printed, not of the one looked up
+				uintptr_t offset = frame.offset
+				                   + (static_cast<char*>(buffer[j])
+				                      - static_cast<char*>(lookups[j]));
+				if(frame.module[0] != '\0')
+					report << " (" << frame.module << "+"
+					       << reinterpret_cast<void const*>(offset) << ")";
+			}
+			report << "\n";
+
+			if(frame.resolved && snippets > 0)
+			{
+				append_source_snippet(report, frame.location);
+				--snippets;
+			}
+		}
+
+		if(cycle != 0)
+		{
+			report << "[" << nptrs - i - cycle - 1 << "-"
+			       << nptrs - i - cycle * repeats << "] frames "
+			       << nptrs - i - cycle << "-" << nptrs - i - 1 << " repeated "
+			       << repeats - 1 << " more times\n";
+			i += cycle * repeats;
+		}
+		else
+			++i;
+	}
+}
+
+// address the frame i of a captured stack is symbolized at: the return
+// address of a call may be the first instruction of the next line, or of the
+// next function after a call to a noreturn one, so it is looked up at the call
+// instead; only the instruction a signal interrupted is looked up as is
+inline void* get_lookup_address(void* const* frames, int i)
+{
+	bool interrupted = SignalFrames::isTrampoline(frames[i])
+	                   || (i > 0 && SignalFrames::isTrampoline(frames[i - 1]));
+	if(interrupted || frames[i] == NULL)
+		return frames[i];
+	return static_cast<char*>(frames[i]) - 1;
+}
+
+/*! \ingroup exceptions
+ * Prints consecutive frames whose function name starts with prefix as a single
+ * line in stack traces, for example "std::" or "boost::asio::".
+ */
+inline void add_frame_folding(char const* prefix)
+{
+	Exceptions::getFoldedPrefixes().push_back(prefix);
+}
+
+// tells if the qualified name of a demangled function starts with prefix, the
+// return type of templates being ignored
+inline bool function_has_prefix(char const* function, char const* prefix)
+{
+	char const* name = function;
+	int depth        = 0;
+
+	for(char const* c = function; *c != '\0'; ++c)
+	{
+		if(*c == '<' || *c == '{' || (*c == '(' && depth > 0))
+			++depth;
+		else if(*c == '>' || *c == '}' || (*c == ')' && depth > 0))
+			--depth;
+		else if(*c == '(' && depth == 0)
+			break;
+		else if(*c == ' ' && depth == 0)
+			name = c + 1;
 	}
 
-	int i = 1;
+	return strncmp(name, prefix, strlen(prefix)) == 0;
+}
 
-	if(calledFromSigInt != 0)
-		++i;
+// looks for a sequence of frames starting at first and repeated right after
+// itself (recursion); returns the length of the sequence covering the most
+// frames and sets repeats to its number of occurrences, or returns 0 if folding
+// wouldn't spare at least two lines
+inline int find_cycle(void* const* buffer, int nptrs, int first, int* repeats)
+{
+	int bestLength  = 0;
+	int bestCovered = 0;
+	*repeats        = 1;
 
-	for(; i < nptrs - 2; ++i)
+	for(int length = 1; first + 2 * length <= nptrs; ++length)
 	{
-		// if addr2line failed, print what we can
-		if(addr2line(Exceptions::getProgramName(), buffer[i], nptrs - 2 - i - 1)
-		   != 0)
-			std::cerr << "[" << nptrs - 2 - i - 1 << "] " << strings[i]
-			          << std::endl;
+		int count = 1;
+		while(first + (count + 1) * length <= nptrs
+		      && std::equal(buffer + first, buffer + first + length,
+		                    buffer + first + count * length))
+			++count;
+
+		if((count - 1) * length >= 2 && count * length > bestCovered)
+		{
+			bestLength  = length;
+			bestCovered = count * length;
+			*repeats    = count;
+		}
 	}
 
-	free(strings);
+	return bestLength;
 }
 
-inline void posix_signal_handler(int sig)
+__attribute__((noinline)) inline void posix_signal_handler(int sig)
 {
-	print_stacktrace(1);
+	void* buffer[MAX_BACKTRACE_LINES];
+
+	uint64_t start = SelfMetrics::now();
+	int nptrs      = backtrace(buffer, MAX_BACKTRACE_LINES);
+	SelfMetrics::time(SELF_CAPTURE, start);
+
+	// start at the signal frame, leaving the handlers out, or after this
+	// function's frame if it wasn't called by a signal
+	int first = SignalFrames::findTrampoline(buffer, nptrs);
+	if(first < 0)
+		first = 1;
+
+	// the frame after the trampoline is the interrupted one, whose stack is
+	// scanned if unwinding stops early, rather than the handler's
+	SignalFrame const* signal
+	    = first + 1 < nptrs ? SignalFrames::find(buffer[first + 1]) : NULL;
+	uintptr_t sp = reinterpret_cast<uintptr_t>(__builtin_frame_address(0));
+	if(signal != NULL)
+		sp = signal->sp;
+
+	ReportBuilder report;
+	int printed
+	    = append_unwound_frames(report, buffer + first, nptrs - first, sp);
+	if(signal != NULL)
+		append_frame_variables(report, signal->context, buffer + first,
+		                       printed);
 
 	switch(sig)
 	{
 		case SIGABRT:
-			std::cerr
-			    << "Caught SIGABRT: usually caused by an abort() or assert()"
-			    << std::endl;
+			report << "Caught SIGABRT: usually caused by an abort() or "
+			          "assert()\n";
 			break;
 
 		case SIGFPE:
-			std::cerr
-			    << "Caught SIGFPE: arithmetic exception, such as divide by zero"
-			    << std::endl;
-			;
+			report << "Caught SIGFPE: arithmetic exception, such as divide "
+			          "by zero\n";
 			break;
 
 		case SIGILL:
-			std::cerr << "Caught SIGILL: illegal instruction" << std::endl;
-			;
+			report << "Caught SIGILL: illegal instruction\n";
 			break;
 
 		case SIGINT:
-			std::cerr << "Caught SIGINT: interactive attention signal, "
-			             "probably a ctrl+c"
-			          << std::endl;
-			;
+			report << "Caught SIGINT: interactive attention signal, "
+			          "probably a ctrl+c\n";
 			break;
 
 		case SIGSEGV:
-			std::cerr << "Caught SIGSEGV: segfault" << std::endl;
-			;
+			report << "Caught SIGSEGV: segfault\n";
 			break;
 
 		case SIGTERM:
 		default:
-			std::cerr << "Caught SIGTERM: a termination request was sent to "
-			             "the program"
-			          << std::endl;
-			;
+			report << "Caught SIGTERM: a termination request was sent to "
+			          "the program\n";
 			break;
 	}
 
+	if(Exceptions::getSelfMetricsInReports())
+		append_self_metrics(report);
+	report.emit();
 	_Exit(EXIT_FAILURE);
 }
 
+// handler installed by init_exceptions(), which registers the interrupted
+// context so that stack traces can be followed through nested signals
+inline void posix_signal_action(int sig, siginfo_t* info, void* ucontext)
+{
+	(void) info;
+
+	// a fault while reporting one is reported once, then the program exits
+	static __thread int _reporting;
+	if(++_reporting > 2)
+		_Exit(EXIT_FAILURE);
+
+	SignalFrames::enter(sig, ucontext);
+	posix_signal_handler(sig);
+}
+
 inline void set_signal_handler(sig_t handler)
 {
 	signal(SIGABRT, handler);
@@ -212,8 +632,24 @@ inline void set_signal_handler(sig_t handler)
 // programName should be argv[0]
 inline void init_exceptions(char* programName)
 {
-	set_signal_handler(posix_signal_handler);
+	struct sigaction action;
+	memset(&action, 0, sizeof(action));
+	action.sa_sigaction = posix_signal_action;
+	// faults within handlers, such as a profiler's, are reported too
+	action.sa_flags = SA_SIGINFO | SA_NODEFER;
+	sigemptyset(&action.sa_mask);
+
+	int const signals[] = {SIGABRT, SIGFPE, SIGILL, SIGINT, SIGSEGV, SIGTERM};
+	for(size_t i = 0; i < sizeof(signals) / sizeof(signals[0]); ++i)
+		sigaction(signals[i], &action, NULL);
 	Exceptions::getProgramName() = programName;
+
+	// children of prefork servers print stack traces too
+	Symbolizer::guardFork();
+	SourceCache::guardFork();
+	StackScanner::guardFork();
+	FrameVariables::guardFork();
+	SelfMetrics::guardFork();
 }
 
 /* Resolve symbol name and source location given the path to the executable
@@ -223,78 +659,260 @@ inline void init_exceptions(char* programName)
 inline int addr2line(char const* const program_name, void const* const addr,
                      int lineNb)
 {
-	char addr2line_cmd[512] = {0};
+	void* addrs[1] = {const_cast<void*>(addr)};
+	ResolvedFrame frame;
 
-/* have addr2line map the address to the relent line in the code */
-#ifdef __APPLE__
-	/* apple does things differently... */
-	sprintf(addr2line_cmd, "atos -o %.256s %p", program_name, addr);
-#else
-	sprintf(addr2line_cmd, "addr2line -C -f -e %.256s %p", program_name, addr);
-#endif
+	if(resolve_frames(program_name, addrs, 1, &frame) != 1)
+		return 1;
 
-	/* This will print a nicely formatted string specifying the
-	function and source line of the address */
+	ReportBuilder report;
+	report << "[" << lineNb << "] " << addr << " in " << frame.function
+	       << " at " << frame.location << "\n";
+	report.emit();
 
-	FILE* fp;
-	char outLine1[1035];
-	char outLine2[1035];
+	return 0;
+}
 
-	/* Open the command for reading. */
-	fp = popen(addr2line_cmd, "r");
+// resolves the function name and source location of several addresses within
+// the symbolization budget, see Symbolizer
+// returns the number of addresses resolved down to the source line
+inline int resolve_frames(char const* const program_name, void* const* addrs,
+                          int count, ResolvedFrame* frames)
+{
+	int64_t budget = Exceptions::getSymbolizationBudget();
+	return resolve_frames(program_name, addrs, count, frames,
+	                      Symbolizer::now() + budget * 1000000);
+}
 
-	if(fp == NULL)
-		return 1;
+// same, with a deadline from Symbolizer::now()
+inline int resolve_frames(char const* const program_name, void* const* addrs,
+                          int count, ResolvedFrame* frames, int64_t deadline)
+{
+	return Symbolizer::resolve(program_name, addrs, count, frames, deadline);
+}
 
-	while(fgets(outLine1, sizeof(outLine1) - 1, fp) != NULL)
+// deadline of the symbolization of a report: all its frames share a single
+// budget, which starts with the first of them
+inline int64_t get_report_deadline(ReportBuilder& report)
+{
+	if(report.getDeadline() == 0)
 	{
-		// if we have a pair of lines
-		if(fgets(outLine2, sizeof(outLine2) - 1, fp) != NULL)
-		{
-			// if symbols are readable
-			if(outLine2[0] != '?')
-			{
-				// only let func name in outLine1
-				int i;
-
-				for(i = 0; i < 1035; ++i)
-				{
-					if(outLine1[i] == '\r' || outLine1[i] == '\n')
-					{
-						outLine1[i] = '\0';
-						break;
-					}
-				}
-
-				// don't display the whole path
-				int lastSlashPos = 0;
-
-				for(i = 0; i < 1035 && outLine2[i] != '\0'; ++i)
-				{
-					if(outLine2[i] == '/')
-						lastSlashPos = i + 1;
-				}
-
-				std::cerr << "[" << lineNb << "] " << addr << " in " << outLine1
-				          << " at " << outLine2 + lastSlashPos << std::flush;
-			}
-			else
-			{
-				pclose(fp);
-				return 1;
-			}
-		}
+		int64_t budget = Exceptions::getSymbolizationBudget();
+		report.setDeadline(Symbolizer::now() + budget * 1000000);
+	}
+	return report.getDeadline();
+}
+
+/*! \ingroup exceptions
+ * Sets the time given to the symbolization of each stack trace, shared by all
+ * the frames of a report (unwound, scanned and those printed with their
+ * variables).
+ *
+ * Once it is elapsed, the remaining frames are printed with their function
+ * name from the symbol table if any, their module and their offset in it. This
+ * bounds the time a crash report takes, whatever addr2line does.
+ */
+inline void set_symbolization_budget(int milliseconds)
+{
+	Exceptions::getSymbolizationBudget() = milliseconds;
+}
+
+/*! \ingroup exceptions
+ * Indexes the line tables of every loaded module, using up to threads threads
+ * per module.
+ *
+ * Reports then only search the indices instead of decoding line programs, at
+ * the cost of the memory of the indices. This is meant to be run at startup,
+ * from a background thread: reports can be made meanwhile.
+ */
+inline void prewarm_symbolization(int threads)
+{
+	Symbolizer::prewarm(threads);
+}
+
+/*! \ingroup exceptions
+ * Sets the memory given to the caches of resolved addresses, decoded line
+ * programs and demangled names, in bytes (SYMBOLIZER_CACHE_BYTES by default).
+ *
+ * The least recently used entries are evicted past it. The indices of
+ * prewarm_symbolization() and the symbol tables aren't counted.
+ */
+inline void set_symbolizer_cache_size(size_t bytes)
+{
+	Symbolizer::setCacheCapacity(bytes);
+}
+
+/*! \ingroup exceptions
+ * Prints the source lines around the location of the frames innermost
+ * symbolized frames of stack traces, with context lines before and after it;
+ * 0 frames (the default) prints none.
+ *
+ * Sources are searched in the directories given to add_source_root(). Each
+ * file is mapped and its lines indexed the first time it is printed, and
+ * missing files are remembered, so that a stack trace without sources takes
+ * no measurable time more.
+ */
+inline void set_source_snippets(int frames, int context = 1)
+{
+	Exceptions::getSourceSnippetFrames()  = frames;
+	Exceptions::getSourceSnippetContext() = context;
+}
+
+/*! \ingroup exceptions
+ * Adds a directory, with its subdirectories, where the sources printed by
+ * set_source_snippets() are searched. They are found by file name, the first
+ * one found winning.
+ */
+inline void add_source_root(char const* directory)
+{
+	SourceCache::addRoot(directory);
+}
+
+// prints the source lines around a "file:line" location
+inline void append_source_snippet(ReportBuilder& report, char const* location)
+{
+	// addr2line may add " (discriminator N)" after the line
+	char const* colon = strrchr(location, ':');
+	if(colon == NULL || colon[1] < '0' || colon[1] > '9')
+		return;
+
+	std::string file(location, colon - location);
+	SourceCache::appendSnippet(report, file.c_str(), atoi(colon + 1),
+	                           Exceptions::getSourceSnippetContext());
+}
+
+/*! \ingroup exceptions
+ * Prints the parameters and local variables of the innermost frames having
+ * debug information, up to frames of them, after the stack trace of a caught
+ * signal; 0 frames (the default) prints none.
+ *
+ * Only the compilation unit of each frame is read. Scalars are printed with
+ * their value, pointers with the address they hold and other types with their
+ * address; variables the compiler didn't keep at the frame's instruction are
+ * printed as optimized out. Supported on x86-64 and ARM64.
+ */
+inline void set_frame_variables(int frames)
+{
+	Exceptions::getFrameVariablesFrames() = frames;
+}
+
+// prints the variables of the innermost frames of the context a signal
+// interrupted, numbered as in its stack trace
+inline void append_frame_variables(ReportBuilder& report, void const* ucontext,
+                                   void* const* frames, int nptrs)
+{
+	int wanted = Exceptions::getFrameVariablesFrames();
+	if(wanted <= 0)
+		return;
+
+	// the section is left out once the report's budget is spent
+	int64_t deadline = get_report_deadline(report);
+	UnwindRegisters unwound[FRAMEVARIABLES_MAX_UNWIND];
+	int count = FrameVariables::unwind(ucontext, unwound,
+	                                   FRAMEVARIABLES_MAX_UNWIND, deadline);
+
+	std::vector<std::string> lines;
+	int printed = 0;
+	for(int i = 0; i < count && printed < wanted; ++i)
+	{
+		lines.clear();
+		if(!FrameVariables::describe(unwound[i], &lines, deadline))
+			continue;
+		if(printed++ == 0)
+			report << "Variables of the interrupted frames:\n";
+
+		void* pc     = reinterpret_cast<void*>(unwound[i].pc);
+		void* lookup = reinterpret_cast<void*>(unwound[i].lookupPc());
+		int j        = std::find(frames, frames + nptrs, pc) - frames;
+		ResolvedFrame frame;
+		resolve_frames(Exceptions::getProgramName(), &lookup, 1, &frame,
+		               deadline);
+
+		report << "[";
+		if(j < nptrs)
+			report << nptrs - j - 1;
 		else
-		{
-			pclose(fp);
-			return 1;
-		}
+			report << "?";
+		report << "] " << pc;
+		if(frame.resolved)
+			report << " in " << frame.function << " at " << frame.location;
+		else if(frame.function[0] != '\0')
+			report << " in " << frame.function;
+		report << "\n";
+		for(size_t k = 0; k < lines.size(); ++k)
+			report << "    " << lines[k] << "\n";
 	}
+}
+
+/*! \ingroup exceptions
+ * Names code generated at run time, so that its frames are printed with name
+ * instead of a raw address.
+ *
+ * Registering takes no lock and allocates nothing, a JIT can call it for each
+ * piece of code it generates; the newest of JIT_MAX_RANGES ranges are kept.
+ * Names longer than JIT_NAME_SIZE - 1 characters are cut. JITs writing
+ * /tmp/perf-<pid>.map instead are read without registering.
+ */
+inline void register_jit_code(void const* code, size_t size, char const* name)
+{
+	JitRegistry::add(code, size, name);
+}
 
-	/* close */
-	pclose(fp);
+/*! \ingroup exceptions
+ * Forgets the code registered at code, before its memory is freed or reused.
+ */
+inline void unregister_jit_code(void const* code)
+{
+	JitRegistry::remove(code);
+}
 
-	return 0;
+/*! \ingroup exceptions
+ * Returns the hits, misses, evictions and memory of the symbolizer's caches.
+ */
+inline SymbolizerStats get_symbolizer_stats()
+{
+	return Symbolizer::getStats();
+}
+
+/*! \ingroup exceptions
+ * Returns what the library has cost so far, summed over all threads: stack
+ * captures, symbolization, cache hits and misses, bytes written and dropped
+ * samples.
+ */
+inline SelfMetricsSnapshot get_self_metrics()
+{
+	return SelfMetrics::get();
+}
+
+/*! \ingroup exceptions
+ * Ends the stack traces printed by print_stacktrace() and the signal handler
+ * with the metrics of get_self_metrics().
+ */
+inline void set_self_metrics_in_reports(bool enabled)
+{
+	Exceptions::getSelfMetricsInReports() = enabled;
+}
+
+// formats the library's own metrics into report, on two lines
+inline void append_self_metrics(ReportBuilder& report)
+{
+	SelfMetricsSnapshot metrics = SelfMetrics::get();
+
+	report << "Stacktrace cost: captures " << metrics.getCount(SELF_CAPTURE)
+	       << " (" << metrics.totalNs[SELF_CAPTURE] / 1000 << "us, p99 < "
+	       << metrics.getPercentileNs(SELF_CAPTURE, 99) / 1000
+	       << "us), symbolized frames "
+	       << metrics.counters[SELF_SYMBOLIZED_FRAMES] << " ("
+	       << metrics.totalNs[SELF_SYMBOLIZATION] / 1000 << "us, p99 < "
+	       << metrics.getPercentileNs(SELF_SYMBOLIZATION, 99) / 1000
+	       << "us per stack)\n";
+	report << "Stacktrace cost: cache hits "
+	       << metrics.counters[SELF_CACHE_HITS] << ", cache misses "
+	       << metrics.counters[SELF_CACHE_MISSES]
+	       << ", bytes written " << metrics.counters[SELF_BYTES_WRITTEN]
+	       << " (" << metrics.getCount(SELF_EMIT)
+	       << " writes), dropped samples "
+	       << metrics.counters[SELF_DROPPED_SAMPLES] << "\n";
 }
 
 /*! Exception to be thrown by the CRITICAL macro
@@ -0,0 +1,287 @@
+/*
+        Copyright (C) 2017 Florian Cabot
+
+        This program is free software; you can redistribute it and/or modify
+        it under the terms of the GNU General Public License as published by
+        the Free Software Foundation; either version 3 of the License, or
+        (at your option) any later version.
+
+        This program is distributed in the hope that it will be useful,
+        but WITHOUT ANY WARRANTY; without even the implied warranty of
+        MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+        GNU General Public License for more details.
+
+        You should have received a copy of the GNU General Public License along
+        with this program; if not, write to the Free Software Foundation, Inc.,
+        51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+// Decodes the LEB128 operands of the line programs of a binary (this program
+// by default) with Leb128, which uses SSE2 on x86-64, and with a byte at a
+// time and BMI2 decoders, then times the build of the whole line index. Pass a
+// large binary with debug information for meaningful figures.
+
+#include "../stacktrace/Dwarf.hpp"
+#include "../stacktrace/Elf.hpp"
+#include "../stacktrace/Leb128.hpp"
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <time.h>
+#include <vector>
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <immintrin.h>
+#define BENCH_X86 1
+#endif
+
+// minimum time each decoder runs for, in ns
+#define BENCH_MIN_NS 500000000ull
+
+// builds of the line index, the fastest is printed
+#define BENCH_INDEX_RUNS 10
+
+static uint64_t now()
+{
+	timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return static_cast<uint64_t>(ts.tv_sec) * 1000000000ull + ts.tv_nsec;
+}
+
+static size_t decodeLeb128(char const* pos, char const* end, uint64_t* value)
+{
+	return Leb128::decodeUnsigned(pos, end, value);
+}
+
+// one-byte values inline, then a byte at a time, as Leb128 does without SSE2
+static size_t decodeScalar(char const* pos, char const* end, uint64_t* value)
+{
+	if(pos < end && (*pos & 0x80) == 0)
+	{
+		*value = static_cast<uint8_t>(*pos);
+		return 1;
+	}
+
+	uint64_t result = 0;
+	unsigned shift  = 0;
+	for(char const* p = pos; p < end; ++p)
+	{
+		uint8_t byte = *p;
+		if(shift < 64)
+			result |= static_cast<uint64_t>(byte & 0x7f) << shift;
+		shift += 7;
+		if((byte & 0x80) == 0)
+		{
+			*value = result;
+			return p - pos + 1;
+		}
+	}
+	return 0;
+}
+
+#ifdef BENCH_X86
+// length of the value at pos from the continuation bits of 16 bytes
+static size_t measure(char const* pos)
+{
+	__m128i bytes = _mm_loadu_si128(reinterpret_cast<__m128i const*>(pos));
+	unsigned more = _mm_movemask_epi8(bytes);
+	return __builtin_ctz(~more) + 1;
+}
+
+__attribute__((target("bmi2"))) static size_t
+    decodeBmi2(char const* pos, char const* end, uint64_t* value)
+{
+	if(pos < end && (*pos & 0x80) == 0)
+	{
+		*value = static_cast<uint8_t>(*pos);
+		return 1;
+	}
+	if(end - pos < 16)
+		return Leb128::decodeUnsigned(pos, end, value);
+
+	size_t length = measure(pos);
+	if(length > 10)
+		return Leb128::decodeUnsigned(pos, end, value);
+	uint64_t low;
+	memcpy(&low, pos, sizeof(low));
+	uint64_t groups = 0x7f7f7f7f7f7f7f7full;
+	if(length < 8)
+		groups >>= 8 * (8 - length);
+	uint64_t result = _pext_u64(low, groups);
+	if(length > 8)
+		result |= static_cast<uint64_t>(pos[8] & 0x7f) << 56;
+	if(length > 9)
+		result |= static_cast<uint64_t>(pos[9] & 0x01) << 63;
+	*value = result;
+	return length;
+}
+#endif
+
+// appends the position of every LEB128 operand of a line program, from its
+// opcodes to end
+static void collectProgram(DwarfReader reader, char const* opcodeLengths,
+                           int opcodeBase, std::vector<char const*>* values)
+{
+	while(!reader.atEnd())
+	{
+		int opcode = reader.u8();
+		if(opcode >= opcodeBase)
+			continue;
+		switch(opcode)
+		{
+			case 0:
+			{
+				values->push_back(reader.position());
+				uint64_t length = reader.uleb();
+				reader.skip(length);
+				break;
+			}
+			case 2: // advance_pc
+			case 3: // advance_line
+			case 4: // set_file
+			case 5: // set_column
+			case 12: // set_isa
+				values->push_back(reader.position());
+				reader.uleb();
+				break;
+			case 9: // fixed_advance_pc
+				reader.u16();
+				break;
+			default:
+				// unknown standard opcodes have their number of operands
+				for(int i = 0; opcode > 12 && i < opcodeLengths[opcode - 1];
+				    ++i)
+				{
+					values->push_back(reader.position());
+					reader.uleb();
+				}
+				break;
+		}
+	}
+}
+
+static void collectOperands(ElfSection const& line,
+                            std::vector<char const*>* values)
+{
+	DwarfReader units(line.data, line.data + line.size);
+	while(!units.atEnd())
+	{
+		bool is64;
+		uint64_t length = units.unitLength(&is64);
+		if(!units.ok() || length > units.remaining())
+			return;
+		char const* end = units.position() + length;
+		DwarfReader header(units.position(), end);
+		units.skip(length);
+
+		uint16_t version = header.u16();
+		if(version < 2 || version > 5)
+			continue;
+		if(version >= 5)
+			header.skip(2); // address and segment selector sizes
+		uint64_t headerLength = header.offset(is64);
+		if(headerLength > header.remaining())
+			continue;
+		char const* opcodes = header.position() + headerLength;
+		header.skip(version >= 4 ? 5 : 4);
+		int opcodeBase = header.u8();
+		if(!header.ok() || opcodeBase == 0)
+			continue;
+
+		collectProgram(DwarfReader(opcodes, end), header.position(),
+		               opcodeBase, values);
+	}
+}
+
+// returns the ns per value, and the sum of the values in checksum; the
+// decoder is a template argument so that it can be inlined, as in DwarfReader
+template <size_t (*decoder)(char const*, char const*, uint64_t*)>
+static double run(std::vector<char const*> const& values, char const* end,
+                  uint64_t* checksum)
+{
+	uint64_t start  = now();
+	uint64_t rounds = 0;
+	uint64_t sum    = 0;
+	do
+	{
+		for(size_t i = 0; i < values.size(); ++i)
+		{
+			uint64_t value = 0;
+			decoder(values[i], end, &value);
+			sum += value;
+		}
+		++rounds;
+	} while(now() - start < BENCH_MIN_NS);
+
+	*checksum = sum / rounds;
+	return static_cast<double>(now() - start) / (rounds * values.size());
+}
+
+int main(int argc, char* argv[])
+{
+	char const* path = argc > 1 ? argv[1] : "/proc/self/exe";
+	ElfFile elf;
+	ElfSection line;
+	if(!elf.open(path) || !elf.getSection(".debug_line", &line))
+	{
+		fprintf(stderr, "%s: no .debug_line\n", path);
+		return 1;
+	}
+
+	std::vector<char const*> values;
+	collectOperands(line, &values);
+	char const* end = line.data + line.size;
+	if(values.empty())
+	{
+		fprintf(stderr, "%s: no line program\n", path);
+		return 1;
+	}
+
+	size_t lengths[3] = {0, 0, 0};
+	for(size_t i = 0; i < values.size(); ++i)
+	{
+		uint64_t value;
+		size_t length = Leb128::decodeUnsigned(values[i], end, &value);
+		++lengths[length < 3 ? length - 1 : 2];
+	}
+	printf("%s: %zu bytes of .debug_line, %zu LEB128 operands\n", path,
+	       line.size, values.size());
+	printf("  1 byte %.1f%%, 2 bytes %.1f%%, more %.1f%%\n",
+	       100.0 * lengths[0] / values.size(),
+	       100.0 * lengths[1] / values.size(),
+	       100.0 * lengths[2] / values.size());
+
+	uint64_t expected;
+	printf("  Leb128 %.2f ns/value\n",
+	       run<decodeLeb128>(values, end, &expected));
+	uint64_t checksum;
+	printf("  scalar %.2f ns/value\n",
+	       run<decodeScalar>(values, end, &checksum));
+	if(checksum != expected)
+		fprintf(stderr, "scalar decoded other values\n");
+#ifdef BENCH_X86
+	__builtin_cpu_init();
+	if(__builtin_cpu_supports("bmi2"))
+	{
+		printf("  bmi2   %.2f ns/value\n",
+		       run<decodeBmi2>(values, end, &checksum));
+		if(checksum != expected)
+			fprintf(stderr, "bmi2 decoded other values\n");
+	}
+#endif
+
+	DwarfModule module;
+	if(!module.open(path))
+		return 1;
+	std::vector<DwarfLineEntry> index;
+	uint64_t fastest = ~static_cast<uint64_t>(0);
+	for(int i = 0; i < BENCH_INDEX_RUNS; ++i)
+	{
+		uint64_t start = now();
+		module.buildLineIndex(1, &index);
+		fastest = std::min(fastest, now() - start);
+	}
+	printf("line index: %zu rows in %.2f ms on one thread\n", index.size(),
+	       fastest / 1e6);
+	return 0;
+}
@@ -0,0 +1,99 @@
+/*
+        Copyright (C) 2017 Florian Cabot
+
+        This program is free software; you can redistribute it and/or modify
+        it under the terms of the GNU General Public License as published by
+        the Free Software Foundation; either version 3 of the License, or
+        (at your option) any later version.
+
+        This program is distributed in the hope that it will be useful,
+        but WITHOUT ANY WARRANTY; without even the implied warranty of
+        MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+        GNU General Public License for more details.
+
+        You should have received a copy of the GNU General Public License along
+        with this program; if not, write to the Free Software Foundation, Inc.,
+        51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#include "../stacktrace/FlameGraph.hpp"
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+
+static void usage(char const* program)
+{
+	std::cerr << "Usage: " << program
+	          << " [--title TITLE] [--width PIXELS] [--minwidth PIXELS]"
+	             " [--diff BASELINE] PROFILE > graph.svg\n"
+	             "Renders folded stacks (\"frame;frame;frame value\" lines) as"
+	             " an SVG flame graph.\n"
+	             "With --diff, frames are colored by how much their share grew"
+	             " (red) or shrank\n"
+	             "(blue) since BASELINE. A PROFILE of - reads the standard"
+	             " input.\n";
+}
+
+static bool readProfile(FlameGraph& graph, char const* path, bool baseline)
+{
+	size_t skipped;
+	if(strcmp(path, "-") == 0)
+		skipped = graph.readFolded(std::cin, baseline);
+	else
+	{
+		std::ifstream in(path);
+		if(!in)
+		{
+			std::cerr << "Can't open " << path << "\n";
+			return false;
+		}
+		skipped = graph.readFolded(in, baseline);
+	}
+
+	if(skipped != 0)
+		std::cerr << path << ": " << skipped << " lines skipped\n";
+	return true;
+}
+
+int main(int argc, char* argv[])
+{
+	std::ios::sync_with_stdio(false);
+
+	FlameGraphOptions options;
+	char const* baseline = NULL;
+	char const* profile  = NULL;
+	for(int i = 1; i < argc; ++i)
+	{
+		bool hasValue = i + 1 < argc;
+		if(strcmp(argv[i], "--title") == 0 && hasValue)
+			options.title = argv[++i];
+		else if(strcmp(argv[i], "--width") == 0 && hasValue)
+			options.width = atoi(argv[++i]);
+		else if(strcmp(argv[i], "--minwidth") == 0 && hasValue)
+			options.minWidth = atof(argv[++i]);
+		else if(strcmp(argv[i], "--diff") == 0 && hasValue)
+			baseline = argv[++i];
+		else if(profile == NULL && (argv[i][0] != '-' || argv[i][1] == '\0'))
+			profile = argv[i];
+		else
+		{
+			usage(argv[0]);
+			return EXIT_FAILURE;
+		}
+	}
+
+	if(profile == NULL || options.width <= 20)
+	{
+		usage(argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	FlameGraph graph;
+	if(!readProfile(graph, profile, false)
+	   || (baseline != NULL && !readProfile(graph, baseline, true)))
+		return EXIT_FAILURE;
+
+	graph.writeSvg(std::cout, options);
+	return std::cout ? EXIT_SUCCESS : EXIT_FAILURE;
+}
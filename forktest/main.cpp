@@ -0,0 +1,187 @@
+/*
+        Copyright (C) 2017 Florian Cabot
+
+        This program is free software; you can redistribute it and/or modify
+        it under the terms of the GNU General Public License as published by
+        the Free Software Foundation; either version 3 of the License, or
+        (at your option) any later version.
+
+        This program is distributed in the hope that it will be useful,
+        but WITHOUT ANY WARRANTY; without even the implied warranty of
+        MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+        GNU General Public License for more details.
+
+        You should have received a copy of the GNU General Public License along
+        with this program; if not, write to the Free Software Foundation, Inc.,
+        51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+// Forks while another thread symbolizes, tracks its stack and is profiled,
+// and checks that every child can do the same without deadlocking.
+// Exits with 0 if all children did.
+
+#include "../Cpp-stacktrace.hpp"
+#include "../stacktrace/ContinuousProfiler.hpp"
+#include "../stacktrace/StackUsage.hpp"
+#include <atomic>
+#include <cstdio>
+#include <cstring>
+#include <pthread.h>
+#include <string>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#define CHILDREN 20
+
+// seconds a child has before being considered deadlocked
+#define CHILD_TIMEOUT 10
+
+static std::atomic<bool> stopping(false);
+
+// a stack of the parent, and how it resolved it
+static void* stack[MAX_BACKTRACE_LINES];
+static int stackSize;
+static ResolvedFrame resolvedByParent[MAX_BACKTRACE_LINES];
+
+static int symbolize()
+{
+	void* buffer[MAX_BACKTRACE_LINES];
+	int nptrs = backtrace(buffer, MAX_BACKTRACE_LINES);
+	ResolvedFrame frames[MAX_BACKTRACE_LINES];
+	return resolve_frames(Exceptions::getProgramName(), buffer, nptrs,
+	                      frames);
+}
+
+// keeps the library's locks busy while the main thread forks
+static void* work(void*)
+{
+	StackUsage::registerThread("worker");
+	while(!stopping.load(std::memory_order_relaxed))
+		symbolize();
+	return NULL;
+}
+
+static void burnCpu()
+{
+	uint64_t end = SelfMetrics::now() + 50000000;
+	while(SelfMetrics::now() < end)
+		symbolize();
+}
+
+// resolves the parent's stack again, which has to give the same frames
+static bool resolveAgain()
+{
+	ResolvedFrame frames[MAX_BACKTRACE_LINES];
+	resolve_frames(Exceptions::getProgramName(), stack, stackSize, frames);
+	for(int i = 0; i < stackSize; ++i)
+	{
+		ResolvedFrame const& expected = resolvedByParent[i];
+		if(frames[i].resolved != expected.resolved
+		   || strcmp(frames[i].function, expected.function) != 0
+		   || strcmp(frames[i].location, expected.location) != 0)
+			return false;
+	}
+	return true;
+}
+
+static bool check(bool condition, char const* what)
+{
+	if(!condition)
+		fprintf(stderr, "child %d: %s\n", static_cast<int>(getpid()), what);
+	return condition;
+}
+
+static bool reportStack()
+{
+	int fds[2];
+	if(pipe(fds) != 0)
+		return false;
+
+	ReportBuilder report(fds[1]);
+	append_stacktrace(report, 0);
+	report.emit();
+	close(fds[1]);
+
+	std::string text;
+	char buffer[4096];
+	ssize_t length;
+	while((length = read(fds[0], buffer, sizeof(buffer))) > 0)
+		text.append(buffer, length);
+	close(fds[0]);
+	return text.find("runChild") != std::string::npos;
+}
+
+static bool runChild(char const* prefix)
+{
+	alarm(CHILD_TIMEOUT);
+	bool ok = true;
+
+	ok &= check(get_self_metrics().getCount(SELF_SYMBOLIZATION) == 0,
+	            "self metrics inherited from the parent");
+	ok &= check(resolveAgain(), "can't symbolize");
+	ok &= check(StackUsage::getUsage().size() == 1,
+	            "stack usage of the parent's threads");
+	ok &= check(reportStack(), "can't report");
+
+	burnCpu();
+	ContinuousProfiler::stop();
+	char path[4096];
+	snprintf(path, sizeof(path), "%s.%d.0.stks", prefix,
+	         static_cast<int>(getpid()));
+	ProfileSegment segment;
+	ok &= check(ContinuousProfiler::readSegment(path, &segment),
+	            "not profiled");
+	unlink(path);
+	return ok;
+}
+
+int main(int argc, char* argv[])
+{
+	(void) argc;
+	init_exceptions(argv[0]);
+	StackUsage::registerThread("main");
+
+	char prefix[] = "/tmp/forktest.XXXXXX";
+	int fd        = mkstemp(prefix);
+	if(fd < 0)
+		return 1;
+	close(fd);
+	ContinuousProfiler::setFollowForks(true);
+	if(!ContinuousProfiler::start(prefix, 1000, 60, 1))
+		return 1;
+
+	stackSize = backtrace(stack, MAX_BACKTRACE_LINES);
+	if(resolve_frames(argv[0], stack, stackSize, resolvedByParent) == 0)
+		return 1;
+
+	pthread_t worker;
+	pthread_create(&worker, NULL, work, NULL);
+
+	int failures = 0;
+	for(int i = 0; i < CHILDREN; ++i)
+	{
+		pid_t pid = fork();
+		if(pid == 0)
+			_exit(runChild(prefix) ? 0 : 1);
+
+		int status;
+		if(pid < 0 || waitpid(pid, &status, 0) != pid || !WIFEXITED(status)
+		   || WEXITSTATUS(status) != 0)
+		{
+			fprintf(stderr, "child %d failed\n", static_cast<int>(pid));
+			++failures;
+		}
+	}
+
+	stopping.store(true, std::memory_order_relaxed);
+	pthread_join(worker, NULL);
+	ContinuousProfiler::stop();
+
+	char path[4096];
+	snprintf(path, sizeof(path), "%s.0.stks", prefix);
+	unlink(path);
+	unlink(prefix);
+
+	printf("%d of %d children failed\n", failures, CHILDREN);
+	return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,665 @@
+/*
+    Copyright (C) 2017 Florian Cabot
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#ifndef STACKTRACE_CFIUNWINDER
+#define STACKTRACE_CFIUNWINDER
+
+#include <cstring>
+#include <stdint.h>
+#include <sys/uio.h>
+#include <ucontext.h>
+#include <unistd.h>
+
+#include "Dwarf.hpp"
+
+// registers followed through frames, enough for the general-purpose registers
+// and the stack pointer of x86-64 and ARM64
+#define UNWIND_REGISTERS 33
+
+/*! \ingroup exceptions
+ * Registers of a frame, see CfiUnwinder.
+ */
+struct UnwindRegisters
+{
+	// numbered as in DWARF for the architecture
+	uintptr_t values[UNWIND_REGISTERS];
+	// bit i set if values[i] is known
+	uint64_t known;
+	uintptr_t pc;
+	// pc is the instruction a signal interrupted, not a return address
+	bool interrupted;
+	// canonical frame address, the stack pointer before the call, known once
+	// the frame has been unwound
+	uintptr_t cfa;
+	bool hasCfa;
+
+	bool has(uint64_t reg) const
+	{
+		return reg < UNWIND_REGISTERS && (known >> reg & 1) != 0;
+	}
+
+	void set(int reg, uintptr_t value)
+	{
+		values[reg] = value;
+		known |= static_cast<uint64_t>(1) << reg;
+	}
+
+	// address the unwind and debug information of the frame are looked up
+	// at: the call itself for a return address
+	uintptr_t lookupPc() const { return interrupted ? pc : pc - 1; }
+};
+
+/*! \ingroup exceptions
+ * Unwinds frames from the registers of a context with the call frame
+ * information of the modules (.eh_frame), so that the registers of the callers
+ * are known too.
+ *
+ * The FDE of a frame is found through the binary search table of the loaded
+ * .eh_frame_hdr, then the rules of its CIE and its own are run up to the
+ * frame's instruction. Rules given by DWARF expressions aren't run: registers
+ * restored by one are unknown in the caller, and a CFA computed by one (PLT
+ * entries) stops unwinding.
+ *
+ * Only x86-64 and ARM64 are supported. Stack memory is read with
+ * process_vm_readv(), which fails instead of faulting on unmapped memory.
+ */
+class CfiUnwinder
+{
+  public:
+	/*! Reads the registers a signal interrupted, from the ucontext given to
+	 * its handler. Returns false on unsupported architectures.
+	 */
+	static bool getRegisters(void const* ucontext, UnwindRegisters* regs)
+	{
+		mcontext_t const& context
+		    = static_cast<ucontext_t const*>(ucontext)->uc_mcontext;
+		regs->known       = 0;
+		regs->interrupted = true;
+		regs->hasCfa      = false;
+#if defined(__x86_64__)
+		static int const gregs[]
+		    = {REG_RAX, REG_RDX, REG_RCX, REG_RBX, REG_RSI, REG_RDI,
+		       REG_RBP, REG_RSP, REG_R8,  REG_R9,  REG_R10, REG_R11,
+		       REG_R12, REG_R13, REG_R14, REG_R15};
+		for(int i = 0; i < 16; ++i)
+			regs->set(i, context.gregs[gregs[i]]);
+		regs->pc = context.gregs[REG_RIP];
+		return true;
+#elif defined(__aarch64__)
+		for(int i = 0; i < 31; ++i)
+			regs->set(i, context.regs[i]);
+		regs->set(SP_REGISTER, context.sp);
+		regs->pc = context.pc;
+		return true;
+#else
+		(void) context;
+		return false;
+#endif
+	}
+
+	/*! Computes the registers of the caller of frame, given the loaded
+	 * .eh_frame_hdr of the module of its instruction, and the CFA of frame.
+	 *
+	 * Returns false if the frame has no unwind information or no caller.
+	 */
+	static bool step(char const* ehFrameHdr, UnwindRegisters* frame,
+	                 UnwindRegisters* caller)
+	{
+		Fde parsed;
+		State state;
+		if(!findRules(ehFrameHdr, frame->lookupPc(), &parsed, &state))
+			return false;
+
+		if(!frame->has(state.cfaRegister))
+			return false;
+		frame->cfa    = frame->values[state.cfaRegister] + state.cfaOffset;
+		frame->hasCfa = true;
+
+		caller->known       = 0;
+		caller->interrupted = false;
+		caller->hasCfa      = false;
+		for(int reg = 0; reg < UNWIND_REGISTERS; ++reg)
+		{
+			Rule const& rule = state.rules[reg];
+			uintptr_t value;
+			switch(rule.type)
+			{
+				case RULE_SAME:
+					if(frame->has(reg))
+						caller->set(reg, frame->values[reg]);
+					break;
+				case RULE_OFFSET:
+					if(readMemory(frame->cfa + rule.value, &value,
+					              sizeof(value)))
+						caller->set(reg, value);
+					break;
+				case RULE_VAL_OFFSET:
+					caller->set(reg, frame->cfa + rule.value);
+					break;
+				case RULE_REGISTER:
+					if(frame->has(rule.value))
+						caller->set(reg, frame->values[rule.value]);
+					break;
+				case RULE_UNDEFINED:
+					break;
+			}
+		}
+
+		// an undefined return address marks the outermost frame
+		int ra = parsed.cie.raRegister;
+		if(ra >= UNWIND_REGISTERS || state.rules[ra].type == RULE_UNDEFINED
+		   || !caller->has(ra))
+			return false;
+		caller->pc = caller->values[ra];
+		caller->set(SP_REGISTER, frame->cfa);
+		return caller->pc != 0;
+	}
+
+	/*! Tells if the frame of a return address is the outermost one of its
+	 * stack, its unwind information leaving its own return address
+	 * undefined; the C runtime marks so the entry points of the program and
+	 * of threads.
+	 */
+	static bool isOutermost(char const* ehFrameHdr, uintptr_t returnAddress)
+	{
+		Fde parsed;
+		State state;
+		if(!findRules(ehFrameHdr, returnAddress - 1, &parsed, &state))
+			return false;
+		int ra = parsed.cie.raRegister;
+		return ra < UNWIND_REGISTERS
+		       && state.rules[ra].type == RULE_UNDEFINED;
+	}
+
+	/*! Returns the stack pointer of a frame, 0 if it is unknown.
+	 */
+	static uintptr_t getStackPointer(UnwindRegisters const& frame)
+	{
+		return frame.has(SP_REGISTER) ? frame.values[SP_REGISTER] : 0;
+	}
+
+	/*! Copies memory of the process that may not be mapped, returns false
+	 * if it isn't.
+	 */
+	static bool readMemory(uintptr_t addr, void* data, size_t size)
+	{
+		iovec local  = {data, size};
+		iovec remote = {reinterpret_cast<void*>(addr), size};
+		return process_vm_readv(getpid(), &local, 1, &remote, 1, 0)
+		       == static_cast<ssize_t>(size);
+	}
+
+  private:
+	// DWARF number of the stack pointer
+#if defined(__aarch64__)
+	enum
+	{
+		SP_REGISTER = 31
+	};
+#else
+	enum
+	{
+		SP_REGISTER = 7
+	};
+#endif
+
+	enum PointerEncoding
+	{
+		PE_ABSPTR  = 0x00,
+		PE_ULEB128 = 0x01,
+		PE_UDATA2  = 0x02,
+		PE_UDATA4  = 0x03,
+		PE_UDATA8  = 0x04,
+		PE_SLEB128 = 0x09,
+		PE_SDATA2  = 0x0a,
+		PE_SDATA4  = 0x0b,
+		PE_SDATA8  = 0x0c,
+		PE_PCREL   = 0x10,
+		PE_DATAREL = 0x30,
+		PE_OMIT    = 0xff
+	};
+
+	enum CfaOpcode
+	{
+		CFA_NOP                          = 0x00,
+		CFA_SET_LOC                      = 0x01,
+		CFA_ADVANCE_LOC1                 = 0x02,
+		CFA_ADVANCE_LOC2                 = 0x03,
+		CFA_ADVANCE_LOC4                 = 0x04,
+		CFA_OFFSET_EXTENDED              = 0x05,
+		CFA_RESTORE_EXTENDED             = 0x06,
+		CFA_UNDEFINED                    = 0x07,
+		CFA_SAME_VALUE                   = 0x08,
+		CFA_REGISTER                     = 0x09,
+		CFA_REMEMBER_STATE               = 0x0a,
+		CFA_RESTORE_STATE                = 0x0b,
+		CFA_DEF_CFA                      = 0x0c,
+		CFA_DEF_CFA_REGISTER             = 0x0d,
+		CFA_DEF_CFA_OFFSET               = 0x0e,
+		CFA_DEF_CFA_EXPRESSION           = 0x0f,
+		CFA_EXPRESSION                   = 0x10,
+		CFA_OFFSET_EXTENDED_SF           = 0x11,
+		CFA_DEF_CFA_SF                   = 0x12,
+		CFA_DEF_CFA_OFFSET_SF            = 0x13,
+		CFA_VAL_OFFSET                   = 0x14,
+		CFA_VAL_OFFSET_SF                = 0x15,
+		CFA_VAL_EXPRESSION               = 0x16,
+		CFA_GNU_WINDOW_SAVE              = 0x2d,
+		CFA_GNU_ARGS_SIZE                = 0x2e,
+		CFA_GNU_NEGATIVE_OFFSET_EXTENDED = 0x2f,
+		// the operand is in the low 6 bits of these
+		CFA_ADVANCE_LOC = 0x40,
+		CFA_OFFSET      = 0x80,
+		CFA_RESTORE     = 0xc0
+	};
+
+	enum RuleType
+	{
+		RULE_SAME,
+		RULE_UNDEFINED,
+		// saved at CFA + value
+		RULE_OFFSET,
+		// is CFA + value
+		RULE_VAL_OFFSET,
+		// saved in register value
+		RULE_REGISTER
+	};
+
+	struct Rule
+	{
+		RuleType type;
+		int64_t value;
+	};
+
+	struct State
+	{
+		int64_t cfaRegister;
+		int64_t cfaOffset;
+		Rule rules[UNWIND_REGISTERS];
+	};
+
+	struct Cie
+	{
+		uint64_t codeAlign;
+		int64_t dataAlign;
+		int raRegister;
+		int fdeEncoding;
+		bool hasAugmentationData;
+		char const* instructions;
+		char const* end;
+	};
+
+	struct Fde
+	{
+		Cie cie;
+		uintptr_t begin;
+		char const* instructions;
+		char const* end;
+	};
+
+	// runs the rules of the FDE covering target, those of its CIE first
+	static bool findRules(char const* ehFrameHdr, uintptr_t target,
+	                      Fde* parsed, State* state)
+	{
+		char const* fde;
+		if(ehFrameHdr == NULL || !findFde(ehFrameHdr, target, &fde)
+		   || !parseFde(fde, target, parsed))
+			return false;
+
+		State empty;
+		empty.cfaRegister = -1;
+		empty.cfaOffset   = 0;
+		for(int i = 0; i < UNWIND_REGISTERS; ++i)
+		{
+			empty.rules[i].type  = RULE_SAME;
+			empty.rules[i].value = 0;
+		}
+		State initial = empty;
+		if(!run(parsed->cie, parsed->cie.instructions, parsed->cie.end, 0,
+		        UINTPTR_MAX, empty, &initial))
+			return false;
+		*state = initial;
+		return run(parsed->cie, parsed->instructions, parsed->end,
+		           parsed->begin, target, initial, state);
+	}
+
+	// looks the FDE up in the table of .eh_frame_hdr, which compilers write
+	// with 32-bit offsets from its start
+	static bool findFde(char const* hdr, uintptr_t pc, char const** fde)
+	{
+		DwarfReader reader(hdr, hdr + 4 + 2 * sizeof(uint64_t));
+		int version       = reader.u8();
+		int pointerFormat = reader.u8();
+		int countFormat   = reader.u8();
+		int tableFormat   = reader.u8();
+		if(version != 1 || tableFormat != (PE_DATAREL | PE_SDATA4))
+			return false;
+
+		readPointer(reader, pointerFormat, hdr);
+		uint64_t count = readPointer(reader, countFormat, hdr);
+		if(!reader.ok() || count == 0)
+			return false;
+
+		// last entry starting at or before pc
+		char const* table = reader.position();
+		uint64_t low = 0, high = count;
+		while(high - low > 1)
+		{
+			uint64_t middle = low + (high - low) / 2;
+			int32_t start;
+			memcpy(&start, table + middle * 8, sizeof(start));
+			if(reinterpret_cast<uintptr_t>(hdr) + start <= pc)
+				low = middle;
+			else
+				high = middle;
+		}
+
+		int32_t offset;
+		memcpy(&offset, table + low * 8 + 4, sizeof(offset));
+		*fde = hdr + offset;
+		return true;
+	}
+
+	static bool parseFde(char const* fde, uintptr_t target, Fde* parsed)
+	{
+		DwarfReader header(fde, fde + sizeof(uint32_t));
+		uint32_t length = header.u32();
+		// the 64-bit format isn't used in .eh_frame
+		if(length == 0 || length == 0xffffffff)
+			return false;
+
+		DwarfReader reader(header.position(), header.position() + length);
+		char const* id = reader.position();
+		uint32_t cie   = reader.u32();
+		if(cie == 0 || !parseCie(id - cie, &parsed->cie))
+			return false;
+
+		int encoding   = parsed->cie.fdeEncoding;
+		parsed->begin  = readPointer(reader, encoding, NULL);
+		uintptr_t size = readPointer(reader, encoding & 0x0f, NULL);
+		if(!reader.ok() || target < parsed->begin
+		   || target - parsed->begin >= size)
+			return false;
+		if(parsed->cie.hasAugmentationData)
+			reader.skip(reader.uleb());
+
+		parsed->instructions = reader.position();
+		parsed->end          = header.position() + length;
+		return reader.ok();
+	}
+
+	static bool parseCie(char const* cie, Cie* parsed)
+	{
+		DwarfReader header(cie, cie + sizeof(uint32_t));
+		uint32_t length = header.u32();
+		if(length == 0 || length == 0xffffffff)
+			return false;
+
+		DwarfReader reader(header.position(), header.position() + length);
+		if(reader.u32() != 0)
+			return false;
+		int version              = reader.u8();
+		char const* augmentation = reader.cstr();
+		// pointer of an old GCC augmentation
+		if(strstr(augmentation, "eh") != NULL)
+			reader.skip(sizeof(void*));
+		parsed->codeAlign   = reader.uleb();
+		parsed->dataAlign   = reader.sleb();
+		parsed->raRegister  = version == 1 ? reader.u8() : reader.uleb();
+		parsed->fdeEncoding = PE_ABSPTR;
+
+		parsed->hasAugmentationData = augmentation[0] == 'z';
+		if(parsed->hasAugmentationData)
+		{
+			uint64_t size = reader.uleb();
+			DwarfReader data(reader.position(),
+			                 reader.position() + std::min<uint64_t>(
+			                                         size, reader.remaining()));
+			reader.skip(size);
+			for(char const* c = augmentation + 1; *c != '\0'; ++c)
+			{
+				if(*c == 'R')
+					parsed->fdeEncoding = data.u8();
+				else if(*c == 'L')
+					data.u8();
+				else if(*c == 'P')
+					readPointer(data, data.u8(), NULL);
+			}
+		}
+
+		parsed->instructions = reader.position();
+		parsed->end          = header.position() + length;
+		return reader.ok();
+	}
+
+	// reads a pointer in one of the encodings of .eh_frame; indirect ones
+	// aren't followed, none of those used here are
+	static uintptr_t readPointer(DwarfReader& reader, int encoding,
+	                             char const* dataBase)
+	{
+		if(encoding == PE_OMIT)
+			return 0;
+
+		uintptr_t base = 0;
+		switch(encoding & 0x70)
+		{
+			case PE_ABSPTR:
+				break;
+			case PE_PCREL:
+				base = reinterpret_cast<uintptr_t>(reader.position());
+				break;
+			case PE_DATAREL:
+				if(dataBase == NULL)
+					reader.fail();
+				base = reinterpret_cast<uintptr_t>(dataBase);
+				break;
+			default:
+				reader.fail();
+				return 0;
+		}
+
+		switch(encoding & 0x0f)
+		{
+			case PE_ABSPTR:
+				return base + reader.address(sizeof(uintptr_t));
+			case PE_ULEB128:
+				return base + reader.uleb();
+			case PE_UDATA2:
+				return base + reader.u16();
+			case PE_UDATA4:
+				return base + reader.u32();
+			case PE_UDATA8:
+				return base + reader.u64();
+			case PE_SLEB128:
+				return base + reader.sleb();
+			case PE_SDATA2:
+				return base + static_cast<int16_t>(reader.u16());
+			case PE_SDATA4:
+				return base + static_cast<int32_t>(reader.u32());
+			case PE_SDATA8:
+				return base + static_cast<int64_t>(reader.u64());
+			default:
+				reader.fail();
+				return 0;
+		}
+	}
+
+	// offsets of the rules are factored by the data alignment
+	static int64_t readOffset(DwarfReader& reader, Cie const& cie)
+	{
+		return static_cast<int64_t>(reader.uleb()) * cie.dataAlign;
+	}
+
+	static int64_t readSignedOffset(DwarfReader& reader, Cie const& cie)
+	{
+		return reader.sleb() * cie.dataAlign;
+	}
+
+	static void setRule(State* state, uint64_t reg, RuleType type,
+	                    int64_t value)
+	{
+		if(reg >= UNWIND_REGISTERS)
+			return;
+		state->rules[reg].type  = type;
+		state->rules[reg].value = value;
+	}
+
+	static void restoreRule(State* state, State const& initial, uint64_t reg)
+	{
+		if(reg < UNWIND_REGISTERS)
+			state->rules[reg] = initial.rules[reg];
+	}
+
+	// runs call frame instructions from the address loc until the one
+	// following target, initial holding the rules set by the CIE
+	static bool run(Cie const& cie, char const* begin, char const* end,
+	                uintptr_t loc, uintptr_t target, State const& initial,
+	                State* state)
+	{
+		State remembered[8];
+		int depth = 0;
+
+		DwarfReader reader(begin, end);
+		while(!reader.atEnd())
+		{
+			int opcode = reader.u8();
+			uint64_t reg;
+			uint64_t delta = 0;
+			switch(opcode & 0xc0)
+			{
+				case CFA_ADVANCE_LOC:
+					loc += (opcode & 0x3f) * cie.codeAlign;
+					if(loc > target)
+						return true;
+					continue;
+				case CFA_OFFSET:
+					setRule(state, opcode & 0x3f, RULE_OFFSET,
+					        readOffset(reader, cie));
+					continue;
+				case CFA_RESTORE:
+					restoreRule(state, initial, opcode & 0x3f);
+					continue;
+			}
+
+			switch(opcode)
+			{
+				case CFA_NOP:
+				case CFA_GNU_WINDOW_SAVE:
+					break;
+				case CFA_SET_LOC:
+					loc = readPointer(reader, cie.fdeEncoding, NULL);
+					if(loc > target)
+						return true;
+					break;
+				case CFA_ADVANCE_LOC1:
+					delta = reader.u8();
+					break;
+				case CFA_ADVANCE_LOC2:
+					delta = reader.u16();
+					break;
+				case CFA_ADVANCE_LOC4:
+					delta = reader.u32();
+					break;
+				case CFA_OFFSET_EXTENDED:
+					reg = reader.uleb();
+					setRule(state, reg, RULE_OFFSET, readOffset(reader, cie));
+					break;
+				case CFA_OFFSET_EXTENDED_SF:
+					reg = reader.uleb();
+					setRule(state, reg, RULE_OFFSET,
+					        readSignedOffset(reader, cie));
+					break;
+				case CFA_GNU_NEGATIVE_OFFSET_EXTENDED:
+					reg = reader.uleb();
+					setRule(state, reg, RULE_OFFSET, -readOffset(reader, cie));
+					break;
+				case CFA_VAL_OFFSET:
+					reg = reader.uleb();
+					setRule(state, reg, RULE_VAL_OFFSET,
+					        readOffset(reader, cie));
+					break;
+				case CFA_VAL_OFFSET_SF:
+					reg = reader.uleb();
+					setRule(state, reg, RULE_VAL_OFFSET,
+					        readSignedOffset(reader, cie));
+					break;
+				case CFA_RESTORE_EXTENDED:
+					restoreRule(state, initial, reader.uleb());
+					break;
+				case CFA_UNDEFINED:
+					setRule(state, reader.uleb(), RULE_UNDEFINED, 0);
+					break;
+				case CFA_SAME_VALUE:
+					setRule(state, reader.uleb(), RULE_SAME, 0);
+					break;
+				case CFA_REGISTER:
+					reg = reader.uleb();
+					setRule(state, reg, RULE_REGISTER, reader.uleb());
+					break;
+				case CFA_EXPRESSION:
+				case CFA_VAL_EXPRESSION:
+					reg = reader.uleb();
+					reader.skip(reader.uleb());
+					setRule(state, reg, RULE_UNDEFINED, 0);
+					break;
+				case CFA_REMEMBER_STATE:
+					if(depth == 8)
+						return false;
+					remembered[depth++] = *state;
+					break;
+				case CFA_RESTORE_STATE:
+					if(depth == 0)
+						return false;
+					*state = remembered[--depth];
+					break;
+				case CFA_DEF_CFA:
+					state->cfaRegister = reader.uleb();
+					state->cfaOffset   = reader.uleb();
+					break;
+				case CFA_DEF_CFA_SF:
+					state->cfaRegister = reader.uleb();
+					state->cfaOffset   = readSignedOffset(reader, cie);
+					break;
+				case CFA_DEF_CFA_REGISTER:
+					state->cfaRegister = reader.uleb();
+					break;
+				case CFA_DEF_CFA_OFFSET:
+					state->cfaOffset = reader.uleb();
+					break;
+				case CFA_DEF_CFA_OFFSET_SF:
+					state->cfaOffset = readSignedOffset(reader, cie);
+					break;
+				case CFA_GNU_ARGS_SIZE:
+					reader.uleb();
+					break;
+				default:
+					return false;
+			}
+
+			if(delta != 0)
+			{
+				loc += delta * cie.codeAlign;
+				if(loc > target)
+					return true;
+			}
+		}
+		return reader.ok();
+	}
+};
+
+#endif
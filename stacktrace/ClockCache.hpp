@@ -0,0 +1,177 @@
+/*
+    Copyright (C) 2017 Florian Cabot
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#ifndef STACKTRACE_CLOCKCACHE
+#define STACKTRACE_CLOCKCACHE
+
+#include <functional>
+#include <stddef.h>
+#include <stdint.h>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+/*! \ingroup exceptions
+ * Cache evicting with CLOCK, an approximation of LRU.
+ *
+ * Entries sit in a ring and a hit sets their reference bit. To evict, a hand
+ * sweeps the ring: it clears the bit of the referenced entries, giving them a
+ * second chance, and evicts the first entry without it.
+ *
+ * Each entry has a cost, in bytes. The cache doesn't enforce any capacity:
+ * its owner evicts until its budget is met, which may be shared by several
+ * caches.
+ */
+template <typename Key, typename Value, typename Hash = std::hash<Key> >
+class ClockCache
+{
+  public:
+	ClockCache()
+	    : hand(0)
+	    , cost(0)
+	    , hits(0)
+	    , misses(0)
+	    , evictions(0)
+	{
+	}
+
+	/*! Returns the value cached for key, NULL if there is none.
+	 */
+	Value* find(Key const& key)
+	{
+		typename std::unordered_map<Key, size_t, Hash>::iterator it
+		    = index.find(key);
+		if(it == index.end())
+		{
+			++misses;
+			return NULL;
+		}
+
+		++hits;
+		Slot& slot      = slots[it->second];
+		slot.referenced = true;
+		return &slot.value;
+	}
+
+	/*! Caches value for key, replacing the previous value if any.
+	 */
+	void insert(Key const& key, Value value, size_t entryCost)
+	{
+		typename std::unordered_map<Key, size_t, Hash>::iterator it
+		    = index.find(key);
+		if(it != index.end())
+			remove(it->second);
+
+		size_t position;
+		if(!freeSlots.empty())
+		{
+			position = freeSlots.back();
+			freeSlots.pop_back();
+		}
+		else
+		{
+			position = slots.size();
+			slots.push_back(Slot());
+		}
+
+		Slot& slot      = slots[position];
+		slot.key        = key;
+		slot.value      = std::move(value);
+		slot.cost       = entryCost;
+		slot.referenced = false;
+		slot.used       = true;
+		index[key]      = position;
+		cost += entryCost;
+	}
+
+	/*! Evicts one entry, returns false if the cache is empty.
+	 */
+	bool evict()
+	{
+		if(index.empty())
+			return false;
+
+		for(;;)
+		{
+			if(hand >= slots.size())
+				hand = 0;
+			Slot& slot = slots[hand++];
+			if(!slot.used)
+				continue;
+			if(slot.referenced)
+			{
+				slot.referenced = false;
+				continue;
+			}
+
+			remove(hand - 1);
+			++evictions;
+			return true;
+		}
+	}
+
+	void clear()
+	{
+		index.clear();
+		slots.clear();
+		freeSlots.clear();
+		hand = 0;
+		cost = 0;
+	}
+
+	size_t size() const { return index.size(); }
+
+	/*! Sum of the costs of the entries.
+	 */
+	size_t getCost() const { return cost; }
+
+	uint64_t getHits() const { return hits; }
+	uint64_t getMisses() const { return misses; }
+	uint64_t getEvictions() const { return evictions; }
+
+  private:
+	struct Slot
+	{
+		Key key;
+		Value value;
+		size_t cost;
+		bool referenced;
+		bool used;
+	};
+
+	std::vector<Slot> slots;
+	std::vector<size_t> freeSlots;
+	std::unordered_map<Key, size_t, Hash> index;
+	size_t hand;
+	size_t cost;
+	uint64_t hits;
+	uint64_t misses;
+	uint64_t evictions;
+
+	void remove(size_t position)
+	{
+		Slot& slot = slots[position];
+		index.erase(slot.key);
+		cost -= slot.cost;
+		slot.used  = false;
+		slot.value = Value();
+		freeSlots.push_back(position);
+	}
+};
+
+#endif
@@ -0,0 +1,594 @@
+/*
+    Copyright (C) 2017 Florian Cabot
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#ifndef STACKTRACE_CONTINUOUSPROFILER
+#define STACKTRACE_CONTINUOUSPROFILER
+
+#include "SamplingController.hpp"
+#include "SelfMetrics.hpp"
+#include "SignalFrames.hpp"
+#include "StackCodec.hpp"
+#include "StackTable.hpp"
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <execinfo.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdint.h>
+#include <string>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <unistd.h>
+#include <vector>
+
+#ifndef CONTINUOUS_MAX_STACKS
+#define CONTINUOUS_MAX_STACKS 4096
+#endif
+
+#ifndef CONTINUOUS_MAX_DEPTH
+#define CONTINUOUS_MAX_DEPTH 64
+#endif
+
+// size of each segment file, header included
+#ifndef CONTINUOUS_SEGMENT_BYTES
+#define CONTINUOUS_SEGMENT_BYTES (1 << 20)
+#endif
+
+/*! \ingroup exceptions
+ * A window of profile read back by ContinuousProfiler::readSegment().
+ */
+struct ProfileSegment
+{
+	// wall clock time the window started at, since the epoch
+	uint64_t startNs;
+	uint64_t durationNs;
+	// CPU time each sample stands for
+	uint64_t intervalUs;
+	// stacks left out because the segment was full
+	uint64_t droppedStacks;
+	// batch of StackEncoder, each stack has a single value: its samples
+	std::string batch;
+};
+
+/*! \ingroup exceptions
+ * Samples the CPU time of the process, and writes a profile of every window
+ * (a minute by default) to a rotating set of segment files.
+ *
+ * Stacks are captured from a SIGPROF timer and aggregated into the current
+ * window, without locks nor allocations. At the end of a window, a thread
+ * switches to the other window, encodes the closed one with StackEncoder and
+ * copies it to the oldest segment file. Segments are mapped in memory: the
+ * thread never writes to a file, the kernel writes the pages back, and what
+ * has been copied stays on disk even if the process crashes right after. With
+ * 60 segments of a minute, the last hour is always on disk, in segmentCount
+ * times CONTINUOUS_SEGMENT_BYTES. When a window doesn't fit in a segment, its
+ * stacks with the fewest samples are left out.
+ *
+ * The sampling rate is lowered by a SamplingController if the handler costs
+ * too much, each sample then counting for several intervals. The profiler uses
+ * SIGPROF, like StackUsage::startSampling(): only one of them can run.
+ *
+ * A child of fork() doesn't profile, the segments being its parent's: it may
+ * start() again with another prefix, or setFollowForks() makes every child of
+ * a running profiler start its own, with its pid appended to the prefix.
+ */
+class ContinuousProfiler
+{
+  public:
+	/*! Starts sampling every intervalUs microseconds of CPU time.
+	 *
+	 * Segments are the files prefix.0.stks to prefix.N.stks, with N
+	 * segmentCount - 1; existing ones are reused, starting with the oldest, so
+	 * that the profiles of a crashed run are kept as long as possible.
+	 * Returns false if the profiler is already running or a segment couldn't
+	 * be mapped.
+	 */
+	static bool start(char const* prefix, long intervalUs = 10000,
+	                  int windowSeconds = 60, int segmentCount = 60)
+	{
+		State& state = getState();
+		if(state.running || intervalUs <= 0 || windowSeconds <= 0
+		   || segmentCount <= 0)
+			return false;
+		guardFork();
+
+		for(int i = 0; i < segmentCount; ++i)
+		{
+			char path[4096];
+			snprintf(path, sizeof(path), "%s.%d.stks", prefix, i);
+			char* segment = mapSegment(path);
+			if(segment == NULL)
+			{
+				unmapSegments();
+				return false;
+			}
+			state.segments.push_back(segment);
+		}
+		state.prefix        = prefix;
+		state.segmentCount  = segmentCount;
+		state.nextSegment   = findOldestSegment();
+		state.intervalUs    = intervalUs;
+		state.windowSeconds = windowSeconds;
+
+		// the first backtrace() loads the unwinder, which can't be done from
+		// the signal handler
+		void* buffer[1];
+		backtrace(buffer, 1);
+
+		getWindows()[0].clear();
+		getWindows()[1].clear();
+		getCurrent().store(0, std::memory_order_release);
+		openWindow();
+
+		state.running = true;
+		if(pthread_create(&state.thread, NULL, run, NULL) != 0)
+		{
+			state.running = false;
+			unmapSegments();
+			return false;
+		}
+
+		struct sigaction action;
+		memset(&action, 0, sizeof(action));
+		action.sa_sigaction = sigprofHandler;
+		action.sa_flags     = SA_SIGINFO | SA_RESTART;
+		sigemptyset(&action.sa_mask);
+		sigaction(SIGPROF, &action, NULL);
+
+		getInterval().store(intervalUs, std::memory_order_relaxed);
+		armTimer(intervalUs * getController().getPeriod());
+		return true;
+	}
+
+	/*! Stops sampling and writes the current window, shorter than the others.
+	 */
+	static void stop()
+	{
+		State& state = getState();
+		if(!state.running)
+			return;
+
+		// keeps the handler from arming the timer again
+		getInterval().store(0, std::memory_order_relaxed);
+		armTimer(0);
+
+		pthread_mutex_lock(&state.mutex);
+		state.running = false;
+		pthread_cond_signal(&state.condition);
+		pthread_mutex_unlock(&state.mutex);
+		pthread_join(state.thread, NULL);
+
+		unmapSegments();
+	}
+
+	/*! Reads a segment file, returns false if it holds no window.
+	 */
+	static bool readSegment(char const* path, ProfileSegment* segment)
+	{
+		int fd = open(path, O_RDONLY | O_CLOEXEC);
+		if(fd < 0)
+			return false;
+
+		struct stat st;
+		void* data = MAP_FAILED;
+		if(fstat(fd, &st) == 0
+		   && static_cast<size_t>(st.st_size) >= sizeof(SegmentHeader))
+			data = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+		close(fd);
+		if(data == MAP_FAILED)
+			return false;
+
+		SegmentHeader const* header = static_cast<SegmentHeader const*>(data);
+		bool valid = isValid(*header)
+		             && header->size
+		                    <= st.st_size - sizeof(SegmentHeader);
+		if(valid)
+		{
+			segment->startNs       = header->startNs;
+			segment->durationNs    = header->durationNs;
+			segment->intervalUs    = header->intervalUs;
+			segment->droppedStacks = header->droppedStacks;
+			segment->batch.assign(static_cast<char const*>(data)
+			                          + sizeof(SegmentHeader),
+			                      header->size);
+		}
+		munmap(data, st.st_size);
+		return valid;
+	}
+
+	/*! Whether children of fork() profile themselves, to prefix.PID.0.stks to
+	 * prefix.PID.N.stks, prefix and N being the parent's. Off by default, as
+	 * children that exec() would create segments and a thread for nothing.
+	 */
+	static void setFollowForks(bool follow)
+	{
+		getFollowForks().store(follow, std::memory_order_relaxed);
+	}
+
+	/*! Controller of the cost of the SIGPROF handler, the timer fires every
+	 * interval times its period.
+	 */
+	static SamplingController& getController()
+	{
+		static SamplingController _controller;
+		return _controller;
+	}
+
+  private:
+	typedef StackTable<CONTINUOUS_MAX_STACKS, CONTINUOUS_MAX_STACKS * 16>
+	    Stacks;
+
+	struct Window
+	{
+		Stacks stacks;
+		std::atomic<uint64_t> samples[CONTINUOUS_MAX_STACKS];
+		// handlers writing to the window
+		std::atomic<int> writers;
+
+		void clear()
+		{
+			stacks.clear();
+			for(int i = 0; i < CONTINUOUS_MAX_STACKS; ++i)
+				samples[i].store(0, std::memory_order_relaxed);
+		}
+	};
+
+	// written last, a size of 0 meaning that the segment is being written
+	struct SegmentHeader
+	{
+		char magic[4];
+		uint32_t version;
+		uint64_t startNs;
+		uint64_t durationNs;
+		uint64_t intervalUs;
+		uint64_t droppedStacks;
+		uint64_t size;
+	};
+
+	struct State
+	{
+		State()
+		    : running(false)
+		    , segmentCount(0)
+		    , nextSegment(0)
+		    , intervalUs(0)
+		    , windowSeconds(0)
+		    , windowStart(0)
+		    , windowStartMonotonic(0)
+		{
+			pthread_mutex_init(&mutex, NULL);
+			pthread_cond_init(&condition, NULL);
+		}
+
+		bool running;
+		std::string prefix;
+		std::vector<char*> segments;
+		int segmentCount;
+		size_t nextSegment;
+		long intervalUs;
+		int windowSeconds;
+		uint64_t windowStart;
+		uint64_t windowStartMonotonic;
+		pthread_t thread;
+		// wakes the thread up when stopping
+		pthread_mutex_t mutex;
+		pthread_cond_t condition;
+	};
+
+	static State& getState()
+	{
+		static State _state;
+		return _state;
+	}
+
+	static Window* getWindows()
+	{
+		static Window _windows[2];
+		return _windows;
+	}
+
+	// index of the window the handler writes to
+	static std::atomic<int>& getCurrent()
+	{
+		static std::atomic<int> _current;
+		return _current;
+	}
+
+	// interval given to start(), in microseconds
+	static std::atomic<long>& getInterval()
+	{
+		static std::atomic<long> _interval;
+		return _interval;
+	}
+
+	static std::atomic<bool>& getFollowForks()
+	{
+		static std::atomic<bool> _followForks;
+		return _followForks;
+	}
+
+	static void armTimer(long intervalUs)
+	{
+		itimerval timer;
+		timer.it_interval.tv_sec  = intervalUs / 1000000;
+		timer.it_interval.tv_usec = intervalUs % 1000000;
+		timer.it_value            = timer.it_interval;
+		setitimer(ITIMER_PROF, &timer, NULL);
+	}
+
+	static uint64_t now(clockid_t clock)
+	{
+		timespec ts;
+		clock_gettime(clock, &ts);
+		return static_cast<uint64_t>(ts.tv_sec) * 1000000000ull + ts.tv_nsec;
+	}
+
+	static void sigprofHandler(int sig, siginfo_t* info, void* ucontext)
+	{
+		(void) info;
+		int savedErrno = errno;
+		SignalFrames::enter(sig, ucontext);
+
+		uint64_t begin = SamplingController::begin();
+		void* buffer[CONTINUOUS_MAX_DEPTH];
+		int nptrs = backtrace(buffer, CONTINUOUS_MAX_DEPTH);
+		SelfMetrics::time(SELF_CAPTURE, begin);
+
+		Window& window = enterWindow();
+		// skip the handler and the signal trampoline
+		uint32_t id = window.stacks.intern(buffer + 2, nptrs - 2);
+		if(id != 0)
+			window.samples[id - 1].fetch_add(getController().getPeriod(),
+			                                 std::memory_order_relaxed);
+		window.writers.fetch_sub(1, std::memory_order_release);
+
+		long interval = getInterval().load(std::memory_order_relaxed);
+		if(getController().end(begin) && interval != 0)
+			armTimer(interval * getController().getPeriod());
+
+		SignalFrames::leave();
+		errno = savedErrno;
+	}
+
+	// registers the handler as a writer of the current window, checking that
+	// the window didn't change meanwhile; each side stores then loads the
+	// other's variable, which only sequential consistency keeps in order
+	static Window& enterWindow()
+	{
+		for(;;)
+		{
+			int current    = getCurrent().load(std::memory_order_seq_cst);
+			Window& window = getWindows()[current];
+			window.writers.fetch_add(1, std::memory_order_seq_cst);
+			if(getCurrent().load(std::memory_order_seq_cst) == current)
+				return window;
+			window.writers.fetch_sub(1, std::memory_order_release);
+		}
+	}
+
+	static void guardFork()
+	{
+		static pthread_once_t _once = PTHREAD_ONCE_INIT;
+		pthread_once(&_once, registerForkHandlers);
+	}
+
+	static void registerForkHandlers()
+	{
+		pthread_atfork(lockForFork, unlockForFork, stopAfterFork);
+	}
+
+	static void lockForFork() { pthread_mutex_lock(&getState().mutex); }
+
+	static void unlockForFork() { pthread_mutex_unlock(&getState().mutex); }
+
+	// the segments are the parent's, and the child has neither its thread nor
+	// its timer
+	static void stopAfterFork()
+	{
+		State& state = getState();
+		bool running = state.running;
+		getInterval().store(0, std::memory_order_relaxed);
+		state.running = false;
+		unmapSegments();
+		for(int i = 0; i < 2; ++i)
+			getWindows()[i].writers.store(0, std::memory_order_relaxed);
+		pthread_cond_init(&state.condition, NULL);
+		pthread_mutex_unlock(&state.mutex);
+
+		if(running && getFollowForks().load(std::memory_order_relaxed))
+		{
+			char prefix[4096];
+			snprintf(prefix, sizeof(prefix), "%s.%d", state.prefix.c_str(),
+			         static_cast<int>(getpid()));
+			start(prefix, state.intervalUs, state.windowSeconds,
+			      state.segmentCount);
+		}
+	}
+
+	static void openWindow()
+	{
+		State& state               = getState();
+		state.windowStart          = now(CLOCK_REALTIME);
+		state.windowStartMonotonic = now(CLOCK_MONOTONIC);
+	}
+
+	static void* run(void*)
+	{
+		// the profile is about the program, not about its own writing
+		sigset_t signals;
+		sigemptyset(&signals);
+		sigaddset(&signals, SIGPROF);
+		pthread_sigmask(SIG_BLOCK, &signals, NULL);
+
+		State& state = getState();
+		pthread_mutex_lock(&state.mutex);
+		while(state.running)
+		{
+			timespec deadline;
+			uint64_t end = state.windowStart
+			               + state.windowSeconds * 1000000000ull;
+			deadline.tv_sec  = end / 1000000000;
+			deadline.tv_nsec = end % 1000000000;
+			pthread_cond_timedwait(&state.condition, &state.mutex, &deadline);
+
+			if(state.running && now(CLOCK_REALTIME) >= end)
+			{
+				pthread_mutex_unlock(&state.mutex);
+				closeWindow();
+				pthread_mutex_lock(&state.mutex);
+			}
+		}
+		pthread_mutex_unlock(&state.mutex);
+
+		closeWindow();
+		return NULL;
+	}
+
+	// switches to the other window, then writes the closed one to the next
+	// segment
+	static void closeWindow()
+	{
+		State& state    = getState();
+		int closed      = getCurrent().load(std::memory_order_relaxed);
+		Window& window  = getWindows()[closed];
+		uint64_t start  = state.windowStart;
+		uint64_t length = now(CLOCK_MONOTONIC) - state.windowStartMonotonic;
+		getCurrent().store(1 - closed, std::memory_order_seq_cst);
+		openWindow();
+
+		// handlers are short, and can't be waited for otherwise
+		while(window.writers.load(std::memory_order_seq_cst) != 0)
+			sched_yield();
+
+		std::vector<uint32_t> ids;
+		for(uint32_t id = 1; id <= window.stacks.size(); ++id)
+			if(window.samples[id - 1].load(std::memory_order_relaxed) != 0)
+				ids.push_back(id);
+
+		// leave the stacks with the fewest samples out until it fits
+		std::string batch;
+		size_t kept = ids.size();
+		for(;;)
+		{
+			StackEncoder encoder;
+			for(size_t i = 0; i < kept; ++i)
+			{
+				void* const* frames = NULL;
+				int nptrs = window.stacks.getFrames(ids[i], &frames);
+				uint64_t samples = window.samples[ids[i] - 1].load(
+				    std::memory_order_relaxed);
+				encoder.add(frames, nptrs, &samples, 1);
+			}
+			batch.clear();
+			encoder.writeBatch(&batch, true);
+			if(batch.size() <= CONTINUOUS_SEGMENT_BYTES - sizeof(SegmentHeader)
+			   || kept == 0)
+				break;
+
+			if(kept == ids.size())
+				std::sort(ids.begin(), ids.end(), BySamples(window));
+			kept /= 2;
+		}
+
+		char* segment = state.segments[state.nextSegment];
+		state.nextSegment = (state.nextSegment + 1) % state.segments.size();
+		SegmentHeader* header = reinterpret_cast<SegmentHeader*>(segment);
+
+		__atomic_store_n(&header->size, 0, __ATOMIC_RELEASE);
+		memcpy(segment + sizeof(SegmentHeader), batch.data(), batch.size());
+		memcpy(header->magic, "STKS", 4);
+		header->version       = 1;
+		header->startNs       = start;
+		header->durationNs    = length;
+		header->intervalUs    = state.intervalUs;
+		header->droppedStacks = ids.size() - kept;
+		__atomic_store_n(&header->size, batch.size(), __ATOMIC_RELEASE);
+
+		window.clear();
+	}
+
+	struct BySamples
+	{
+		explicit BySamples(Window const& window)
+		    : window(window)
+		{
+		}
+
+		bool operator()(uint32_t a, uint32_t b) const
+		{
+			return window.samples[a - 1].load(std::memory_order_relaxed)
+			       > window.samples[b - 1].load(std::memory_order_relaxed);
+		}
+
+		Window const& window;
+	};
+
+	static bool isValid(SegmentHeader const& header)
+	{
+		return memcmp(header.magic, "STKS", 4) == 0 && header.version == 1
+		       && header.size != 0;
+	}
+
+	static char* mapSegment(char const* path)
+	{
+		int fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+		if(fd < 0)
+			return NULL;
+
+		void* data = MAP_FAILED;
+		if(ftruncate(fd, CONTINUOUS_SEGMENT_BYTES) == 0)
+			data = mmap(NULL, CONTINUOUS_SEGMENT_BYTES, PROT_READ | PROT_WRITE,
+			            MAP_SHARED, fd, 0);
+		close(fd);
+		return data != MAP_FAILED ? static_cast<char*>(data) : NULL;
+	}
+
+	static void unmapSegments()
+	{
+		State& state = getState();
+		for(size_t i = 0; i < state.segments.size(); ++i)
+			munmap(state.segments[i], CONTINUOUS_SEGMENT_BYTES);
+		state.segments.clear();
+	}
+
+	// an empty segment, else the one holding the oldest window
+	static size_t findOldestSegment()
+	{
+		State const& state = getState();
+		size_t oldest      = 0;
+		for(size_t i = 0; i < state.segments.size(); ++i)
+		{
+			SegmentHeader const* header
+			    = reinterpret_cast<SegmentHeader const*>(state.segments[i]);
+			if(!isValid(*header))
+				return i;
+			if(header->startNs
+			   < reinterpret_cast<SegmentHeader const*>(state.segments[oldest])
+			         ->startNs)
+				oldest = i;
+		}
+		return oldest;
+	}
+};
+
+#endif
@@ -0,0 +1,2301 @@
+/*
+    Copyright (C) 2017 Florian Cabot
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#ifndef STACKTRACE_DWARF
+#define STACKTRACE_DWARF
+
+#include <algorithm>
+#include <atomic>
+#include <cstdlib>
+#include <cstring>
+#include <stdint.h>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "Elf.hpp"
+#include "Leb128.hpp"
+
+/*! \ingroup exceptions
+ * Bounds-checked cursor over DWARF data.
+ *
+ * Reading past the end fails the reader instead of reading outside of the
+ * section: the values read are then zeros and ok() returns false.
+ */
+class DwarfReader
+{
+  public:
+	DwarfReader(char const* begin, char const* end)
+	    : pos(begin)
+	    , end(end)
+	    , failed(false)
+	{
+	}
+
+	bool ok() const { return !failed; }
+	bool atEnd() const { return failed || pos >= end; }
+	char const* position() const { return pos; }
+	size_t remaining() const { return failed ? 0 : end - pos; }
+
+	void fail()
+	{
+		failed = true;
+		pos    = end;
+	}
+
+	void skip(uint64_t count)
+	{
+		if(count > remaining())
+			fail();
+		else
+			pos += count;
+	}
+
+	uint8_t u8() { return read<uint8_t>(); }
+	uint16_t u16() { return read<uint16_t>(); }
+	uint32_t u32() { return read<uint32_t>(); }
+	uint64_t u64() { return read<uint64_t>(); }
+
+	uint32_t u24()
+	{
+		uint32_t low = u16();
+		return low | static_cast<uint32_t>(u8()) << 16;
+	}
+
+	uint64_t uleb()
+	{
+		uint64_t value;
+		size_t length = Leb128::decodeUnsigned(pos, end, &value);
+		if(length == 0)
+		{
+			fail();
+			return 0;
+		}
+		pos += length;
+		return value;
+	}
+
+	int64_t sleb()
+	{
+		int64_t value;
+		size_t length = Leb128::decodeSigned(pos, end, &value);
+		if(length == 0)
+		{
+			fail();
+			return 0;
+		}
+		pos += length;
+		return value;
+	}
+
+	/*! Reads the length of a unit, and whether the unit is in the 64-bit
+	 * format.
+	 */
+	uint64_t unitLength(bool* is64)
+	{
+		uint32_t length = u32();
+		*is64           = length == 0xffffffff;
+		return *is64 ? u64() : length;
+	}
+
+	uint64_t offset(bool is64) { return is64 ? u64() : u32(); }
+
+	uint64_t address(int size)
+	{
+		switch(size)
+		{
+			case 1:
+				return u8();
+			case 2:
+				return u16();
+			case 4:
+				return u32();
+			case 8:
+				return u64();
+			default:
+				fail();
+				return 0;
+		}
+	}
+
+	// null-terminated string, empty if it isn't terminated within the data
+	char const* cstr()
+	{
+		char const* str = pos;
+		char const* nul = static_cast<char const*>(memchr(pos, '\0', remaining()));
+		if(nul == NULL)
+		{
+			fail();
+			return "";
+		}
+		pos = nul + 1;
+		return str;
+	}
+
+  private:
+	char const* pos;
+	char const* end;
+	bool failed;
+
+	template <typename T>
+	T read()
+	{
+		if(remaining() < sizeof(T))
+		{
+			fail();
+			return 0;
+		}
+		T value;
+		memcpy(&value, pos, sizeof(T));
+		pos += sizeof(T);
+		return value;
+	}
+};
+
+/*! \ingroup exceptions
+ * Rows of line programs, as parallel arrays so that scanning the addresses
+ * doesn't load the rest.
+ */
+struct DwarfLineRows
+{
+	std::vector<uint64_t> addresses;
+	// file indices, in the file table of the unit's line program
+	std::vector<uint32_t> files;
+	std::vector<uint32_t> lines;
+	// rows ending a sequence, their address is the one after the sequence
+	std::vector<uint8_t> ends;
+
+	size_t size() const { return addresses.size(); }
+
+	void clear()
+	{
+		addresses.clear();
+		files.clear();
+		lines.clear();
+		ends.clear();
+	}
+};
+
+/*! \ingroup exceptions
+ * Row of a line index built by DwarfModule::buildLineIndex().
+ */
+struct DwarfLineEntry
+{
+	uint64_t address;
+	// file name without its directory, NULL for the end of a sequence
+	char const* file;
+	uint32_t line;
+};
+
+/*! \ingroup exceptions
+ * DWARF expression, such as the location of a variable, pointing into the
+ * mapped debug information.
+ */
+struct DwarfExpression
+{
+	// NULL if there is none
+	char const* data;
+	size_t size;
+};
+
+/*! \ingroup exceptions
+ * How the value of a variable is printed, see DwarfVariable.
+ */
+enum DwarfValueKind
+{
+	VALUE_SIGNED,
+	VALUE_UNSIGNED,
+	VALUE_FLOAT,
+	VALUE_BOOL,
+	VALUE_CHAR,
+	VALUE_POINTER,
+	// aggregates and unknown types, only their address is printed
+	VALUE_OTHER
+};
+
+/*! \ingroup exceptions
+ * Parameter or local variable of a function in scope at an address, read by
+ * DwarfModule::findVariables().
+ */
+struct DwarfVariable
+{
+	// NULL if unnamed
+	char const* name;
+	bool parameter;
+	// such as "char const*", "?" if unknown
+	std::string type;
+	DwarfValueKind kind;
+	// size of the value in bytes, 0 if unknown
+	uint64_t size;
+	// location at the address, without data if the variable is optimized out
+	// there
+	DwarfExpression location;
+	// value of a variable the compiler replaced by a constant
+	bool hasConstant;
+	int64_t constant;
+};
+
+/*! \ingroup exceptions
+ * Source lines of a module, read from its DWARF debug information (versions 2
+ * to 5).
+ *
+ * Nothing is loaded up front but the address ranges of the compilation units,
+ * from .debug_aranges when the compiler wrote it, or else gathered once from
+ * the units themselves. A lookup then decodes the line program of the one unit
+ * covering the address, without storing it: memory stays at the size of the
+ * range index whatever the size of the debug information.
+ *
+ * For repeated lookups, the rows of all units can instead be decoded once into
+ * a sorted index with buildLineIndex(), which spreads the units over several
+ * threads.
+ *
+ * Debug information stripped into a separate file is found through the build
+ * ID or .gnu_debuglink, in the usual places under /usr/lib/debug.
+ *
+ * The parameters and local variables of a function are read from the DIEs of
+ * its unit only, when asked for, see findVariables().
+ */
+class DwarfModule
+{
+  public:
+	DwarfModule()
+	    : dwarf(NULL)
+	{
+	}
+
+	DwarfModule(DwarfModule const&) = delete;
+	DwarfModule& operator=(DwarfModule const&) = delete;
+
+	/*! Maps the module at path and indexes its compilation units.
+	 *
+	 * Returns false if it has no debug information that can be read.
+	 */
+	bool open(char const* path)
+	{
+		if(!binary.open(path))
+			return false;
+
+		dwarf = &binary;
+		if(!readSections())
+		{
+			dwarf = &separate;
+			if(!openSeparate(path) || !readSections())
+				return false;
+		}
+
+		if(!indexArangesSection())
+			indexUnits();
+		std::sort(ranges.begin(), ranges.end(), rangeBefore);
+		return true;
+	}
+
+	/*! Reads an ELF image mapped as is in memory, such as the vDSO, see
+	 * ElfFile::openImage().
+	 *
+	 * Returns false if it isn't a native ELF image; unlike open(), an image
+	 * without debug information is kept for its symbols.
+	 */
+	bool openImage(char const* image, size_t size)
+	{
+		if(!binary.openImage(image, size))
+			return false;
+
+		dwarf = &binary;
+		if(readSections())
+		{
+			if(!indexArangesSection())
+				indexUnits();
+			std::sort(ranges.begin(), ranges.end(), rangeBefore);
+		}
+		return true;
+	}
+
+	/*! Finds the source file (without its directory) and line of a file
+	 * address.
+	 *
+	 * Returns false if no compilation unit covers the address. file points
+	 * into the mapped debug information.
+	 */
+	bool findLine(uintptr_t addr, char const** file, int* line)
+	{
+		if(!lineIndex.empty())
+			return findLineInIndex(addr, file, line);
+
+		uint64_t units[16];
+		int count = findUnits(addr, units, 16);
+		for(int i = 0; i < count; ++i)
+		{
+			Unit unit;
+			if(readUnit(units[i], &unit) && findLineInUnit(unit, addr, file, line))
+				return true;
+		}
+		return false;
+	}
+
+	/*! Gives the offsets in .debug_info of up to max compilation units
+	 * covering a file address, returns their number.
+	 *
+	 * Ranges may overlap, so there may be more than one.
+	 */
+	int findUnits(uintptr_t addr, uint64_t* units, int max)
+	{
+		std::vector<Range>::const_iterator it
+		    = std::upper_bound(ranges.begin(), ranges.end(), addr, rangeAfter);
+
+		int count = 0;
+		for(int tries = 0; tries < 16 && it != ranges.begin() && count < max;
+		    ++tries)
+		{
+			--it;
+			if(addr < it->end)
+				units[count++] = it->unit;
+		}
+		return count;
+	}
+
+	/*! Finds the source file and line of a file address in the rows of a
+	 * compilation unit decoded by decodeLines(), as findLine() does.
+	 */
+	bool findLineInRows(DwarfLineRows const& rows, uint64_t unitOffset,
+	                    uintptr_t addr, char const** file, int* line)
+	{
+		// sequences aren't sorted, the first row whose range up to the next
+		// row covers addr is taken
+		size_t best = rows.size();
+		for(size_t i = 0; i + 1 < rows.size(); ++i)
+		{
+			if(!rows.ends[i] && rows.addresses[i] <= addr
+			   && addr < rows.addresses[i + 1])
+			{
+				best = i;
+				break;
+			}
+		}
+		if(best == rows.size())
+			return false;
+
+		*file = getFileName(unitOffset, rows.files[best]);
+		*line = static_cast<int>(rows.lines[best]);
+		return *file != NULL;
+	}
+
+	/*! Decodes the whole line program of a compilation unit, given by its
+	 * offset in .debug_info, and appends its rows to rows.
+	 *
+	 * Returns false if the unit has no line program, or if it has more than
+	 * maxRows rows (rows then holds the first ones).
+	 */
+	bool decodeLines(uint64_t unitOffset, DwarfLineRows* rows,
+	                 size_t maxRows = SIZE_MAX)
+	{
+		Unit unit;
+		LineProgram program;
+		if(!readUnit(unitOffset, &unit) || !readLineProgram(unit, &program))
+			return false;
+
+		// rows take about two bytes of program each
+		size_t expected = std::min<size_t>(
+		    (program.end - program.opcodes) / 2, maxRows);
+		expected += rows->size();
+		rows->addresses.reserve(expected);
+		rows->files.reserve(expected);
+		rows->lines.reserve(expected);
+		rows->ends.reserve(expected);
+
+		RowCollector collector(rows, maxRows);
+		runLineProgram(program, collector);
+		return collector.complete;
+	}
+
+	/*! Returns the name (without its directory) of a file of the line program
+	 * of a compilation unit, NULL if unknown.
+	 */
+	char const* getFileName(uint64_t unitOffset, uint32_t file)
+	{
+		Unit unit;
+		LineProgram program;
+		if(!readUnit(unitOffset, &unit) || !readLineProgram(unit, &program))
+			return NULL;
+		return fileName(DwarfReader(program.files, program.opcodes),
+		                program.header, file);
+	}
+
+	/*! Decodes the line programs of all compilation units into index, sorted
+	 * by address.
+	 *
+	 * The units are shared among threads workers, each sorting the rows it
+	 * decoded; the sorted runs are then merged pairwise, also in parallel.
+	 * Only the mapped debug information is read, so this can run while other
+	 * threads look addresses up; the index is used once given to
+	 * setLineIndex().
+	 */
+	void buildLineIndex(int threads, std::vector<DwarfLineEntry>* index)
+	{
+		std::vector<uint64_t> units;
+		for(size_t i = 0; i < ranges.size(); ++i)
+			units.push_back(ranges[i].unit);
+		std::sort(units.begin(), units.end());
+		units.erase(std::unique(units.begin(), units.end()), units.end());
+
+		size_t workerCount = std::max<size_t>(
+		    1, std::min<size_t>(threads, units.size()));
+		std::vector<std::vector<DwarfLineEntry> > runs(workerCount);
+		std::atomic<size_t> next(0);
+
+		std::vector<std::thread> workers;
+		for(size_t i = 0; i < workerCount; ++i)
+		{
+			std::vector<DwarfLineEntry>* run = &runs[i];
+			workers.push_back(std::thread([this, &units, &next, run]() {
+				indexLines(units, &next, run);
+			}));
+		}
+		for(size_t i = 0; i < workers.size(); ++i)
+			workers[i].join();
+
+		while(runs.size() > 1)
+		{
+			std::vector<std::vector<DwarfLineEntry> > merged(
+			    (runs.size() + 1) / 2);
+			workers.clear();
+			for(size_t i = 0; i + 1 < runs.size(); i += 2)
+			{
+				std::vector<DwarfLineEntry>* first  = &runs[i];
+				std::vector<DwarfLineEntry>* second = &runs[i + 1];
+				std::vector<DwarfLineEntry>* out    = &merged[i / 2];
+				workers.push_back(std::thread([first, second, out]() {
+					out->resize(first->size() + second->size());
+					std::merge(first->begin(), first->end(), second->begin(),
+					           second->end(), out->begin(), entryBefore);
+					std::vector<DwarfLineEntry>().swap(*first);
+					std::vector<DwarfLineEntry>().swap(*second);
+				}));
+			}
+			if(runs.size() % 2 != 0)
+				merged.back().swap(runs.back());
+			for(size_t i = 0; i < workers.size(); ++i)
+				workers[i].join();
+			runs.swap(merged);
+		}
+
+		index->swap(runs[0]);
+	}
+
+	/*! Makes findLine() search index, taking its contents.
+	 */
+	void setLineIndex(std::vector<DwarfLineEntry>* index)
+	{
+		lineIndex.swap(*index);
+	}
+
+	bool hasLineIndex() const { return !lineIndex.empty(); }
+
+	/*! Sorts the symbol tables, so that the first findFunction() doesn't.
+	 */
+	void loadSymbols()
+	{
+		binary.loadSymbols();
+		if(dwarf == &separate)
+			separate.loadSymbols();
+	}
+
+	/*! Returns the (mangled) name of the function containing the file address
+	 * addr, NULL if unknown.
+	 */
+	char const* findFunction(uintptr_t addr)
+	{
+		char const* name = binary.findFunction(addr);
+		if(name == NULL && dwarf == &separate)
+			name = separate.findFunction(addr);
+		return name;
+	}
+
+	/*! Finds the parameters and local variables in scope at a file address,
+	 * in the function containing it, and the location of the frame base their
+	 * locations may be relative to (DW_AT_frame_base).
+	 *
+	 * Only the compilation unit covering the address is read; the variables
+	 * of functions inlined there aren't. Returns false if no function of the
+	 * debug information contains the address.
+	 */
+	bool findVariables(uintptr_t addr, std::vector<DwarfVariable>* variables,
+	                   DwarfExpression* frameBase)
+	{
+		uint64_t units[16];
+		int count = findUnits(addr, units, 16);
+		for(int i = 0; i < count; ++i)
+		{
+			Unit unit;
+			std::vector<Abbrev> abbrevs;
+			if(readUnit(units[i], &unit)
+			   && readAbbrevs(unit.abbrevOffset, &abbrevs)
+			   && findVariablesInUnit(unit, abbrevs, addr, variables,
+			                          frameBase))
+				return true;
+		}
+		return false;
+	}
+
+  private:
+	enum Form
+	{
+		FORM_ADDR           = 0x01,
+		FORM_BLOCK2         = 0x03,
+		FORM_BLOCK4         = 0x04,
+		FORM_DATA2          = 0x05,
+		FORM_DATA4          = 0x06,
+		FORM_DATA8          = 0x07,
+		FORM_STRING         = 0x08,
+		FORM_BLOCK          = 0x09,
+		FORM_BLOCK1         = 0x0a,
+		FORM_DATA1          = 0x0b,
+		FORM_FLAG           = 0x0c,
+		FORM_SDATA          = 0x0d,
+		FORM_STRP           = 0x0e,
+		FORM_UDATA          = 0x0f,
+		FORM_REF_ADDR       = 0x10,
+		FORM_REF1           = 0x11,
+		FORM_REF2           = 0x12,
+		FORM_REF4           = 0x13,
+		FORM_REF8           = 0x14,
+		FORM_REF_UDATA      = 0x15,
+		FORM_INDIRECT       = 0x16,
+		FORM_SEC_OFFSET     = 0x17,
+		FORM_EXPRLOC        = 0x18,
+		FORM_FLAG_PRESENT   = 0x19,
+		FORM_STRX           = 0x1a,
+		FORM_ADDRX          = 0x1b,
+		FORM_REF_SUP4       = 0x1c,
+		FORM_STRP_SUP       = 0x1d,
+		FORM_DATA16         = 0x1e,
+		FORM_LINE_STRP      = 0x1f,
+		FORM_REF_SIG8       = 0x20,
+		FORM_IMPLICIT_CONST = 0x21,
+		FORM_LOCLISTX       = 0x22,
+		FORM_RNGLISTX       = 0x23,
+		FORM_REF_SUP8       = 0x24,
+		FORM_STRX1          = 0x25,
+		FORM_STRX2          = 0x26,
+		FORM_STRX3          = 0x27,
+		FORM_STRX4          = 0x28,
+		FORM_ADDRX1         = 0x29,
+		FORM_ADDRX2         = 0x2a,
+		FORM_ADDRX3         = 0x2b,
+		FORM_ADDRX4         = 0x2c,
+		FORM_GNU_ADDR_INDEX = 0x1f01,
+		FORM_GNU_STR_INDEX  = 0x1f02,
+		FORM_GNU_REF_ALT    = 0x1f20,
+		FORM_GNU_STRP_ALT   = 0x1f21
+	};
+
+	enum Attribute
+	{
+		AT_LOCATION         = 0x02,
+		AT_NAME             = 0x03,
+		AT_BYTE_SIZE        = 0x0b,
+		AT_STMT_LIST        = 0x10,
+		AT_LOW_PC           = 0x11,
+		AT_HIGH_PC          = 0x12,
+		AT_CONST_VALUE      = 0x1c,
+		AT_ABSTRACT_ORIGIN  = 0x31,
+		AT_DECLARATION      = 0x3c,
+		AT_ENCODING         = 0x3e,
+		AT_FRAME_BASE       = 0x40,
+		AT_TYPE             = 0x49,
+		AT_RANGES           = 0x55,
+		AT_STR_OFFSETS_BASE = 0x72,
+		AT_ADDR_BASE        = 0x73,
+		AT_RNGLISTS_BASE    = 0x74,
+		AT_LOCLISTS_BASE    = 0x8c,
+		AT_GNU_ADDR_BASE    = 0x2133
+	};
+
+	enum Tag
+	{
+		TAG_ARRAY_TYPE            = 0x01,
+		TAG_CLASS_TYPE            = 0x02,
+		TAG_ENUMERATION_TYPE      = 0x04,
+		TAG_FORMAL_PARAMETER      = 0x05,
+		TAG_LEXICAL_BLOCK         = 0x0b,
+		TAG_POINTER_TYPE          = 0x0f,
+		TAG_REFERENCE_TYPE        = 0x10,
+		TAG_COMPILE_UNIT          = 0x11,
+		TAG_STRUCTURE_TYPE        = 0x13,
+		TAG_SUBROUTINE_TYPE       = 0x15,
+		TAG_TYPEDEF               = 0x16,
+		TAG_UNION_TYPE            = 0x17,
+		TAG_BASE_TYPE             = 0x24,
+		TAG_CONST_TYPE            = 0x26,
+		TAG_SUBPROGRAM            = 0x2e,
+		TAG_VARIABLE              = 0x34,
+		TAG_VOLATILE_TYPE         = 0x35,
+		TAG_RESTRICT_TYPE         = 0x37,
+		TAG_NAMESPACE             = 0x39,
+		TAG_UNSPECIFIED_TYPE      = 0x3b,
+		TAG_RVALUE_REFERENCE_TYPE = 0x42,
+		TAG_ATOMIC_TYPE           = 0x47
+	};
+
+	enum Encoding
+	{
+		ATE_ADDRESS       = 0x1,
+		ATE_BOOLEAN       = 0x2,
+		ATE_FLOAT         = 0x4,
+		ATE_SIGNED        = 0x5,
+		ATE_SIGNED_CHAR   = 0x6,
+		ATE_UNSIGNED      = 0x7,
+		ATE_UNSIGNED_CHAR = 0x8,
+		ATE_UTF           = 0x10
+	};
+
+	enum LineOpcode
+	{
+		LNS_COPY             = 1,
+		LNS_ADVANCE_PC       = 2,
+		LNS_ADVANCE_LINE     = 3,
+		LNS_SET_FILE         = 4,
+		LNS_CONST_ADD_PC     = 8,
+		LNS_FIXED_ADVANCE_PC = 9,
+		LNE_END_SEQUENCE     = 1,
+		LNE_SET_ADDRESS      = 2,
+		LNCT_PATH            = 1
+	};
+
+	enum RangeListEntry
+	{
+		RLE_END_OF_LIST   = 0,
+		RLE_BASE_ADDRESSX = 1,
+		RLE_STARTX_ENDX   = 2,
+		RLE_STARTX_LENGTH = 3,
+		RLE_OFFSET_PAIR   = 4,
+		RLE_BASE_ADDRESS  = 5,
+		RLE_START_END     = 6,
+		RLE_START_LENGTH  = 7
+	};
+
+	enum LocationListEntry
+	{
+		LLE_END_OF_LIST      = 0,
+		LLE_BASE_ADDRESSX    = 1,
+		LLE_STARTX_ENDX      = 2,
+		LLE_STARTX_LENGTH    = 3,
+		LLE_OFFSET_PAIR      = 4,
+		LLE_DEFAULT_LOCATION = 5,
+		LLE_BASE_ADDRESS     = 6,
+		LLE_START_END        = 7,
+		LLE_START_LENGTH     = 8,
+		LLE_GNU_VIEW_PAIR    = 9
+	};
+
+	// address range of a compilation unit
+	struct Range
+	{
+		uintptr_t begin;
+		uintptr_t end;
+		// offset of the unit in .debug_info
+		uint64_t unit;
+	};
+
+	// header and root DIE attributes of a compilation unit
+	struct Unit
+	{
+		uint64_t offset;
+		char const* end;
+		int version;
+		int addrSize;
+		bool is64;
+
+		bool hasStmtList;
+		uint64_t stmtList;
+		bool hasLowPc;
+		uint64_t lowPc;
+		bool hasHighPc;
+		uint64_t highPc;
+		bool highPcIsOffset;
+		bool hasRanges;
+		uint64_t rangesOffset;
+		bool rangesIsIndex;
+		uint64_t strOffsetsBase;
+		uint64_t addrBase;
+		uint64_t rnglistsBase;
+		uint64_t loclistsBase;
+
+		uint64_t abbrevOffset;
+		// first DIE, the root one
+		char const* dies;
+	};
+
+	ElfFile binary;
+	// debug information stripped from the binary
+	ElfFile separate;
+	// file holding the debug information, binary or separate
+	ElfFile* dwarf;
+
+	ElfSection info;
+	ElfSection abbrev;
+	ElfSection line;
+	ElfSection aranges;
+	ElfSection str;
+	ElfSection lineStr;
+	ElfSection strOffsets;
+	ElfSection addr;
+	ElfSection rangesV4;
+	ElfSection rnglists;
+	ElfSection locV4;
+	ElfSection loclists;
+
+	std::vector<Range> ranges;
+	std::vector<DwarfLineEntry> lineIndex;
+
+	bool readSections()
+	{
+		if(!dwarf->getSection(".debug_info", &info)
+		   || !dwarf->getSection(".debug_abbrev", &abbrev)
+		   || !dwarf->getSection(".debug_line", &line))
+			return false;
+
+		ElfSection* optional[]
+		    = {&aranges,  &str,      &lineStr, &strOffsets, &addr,
+		       &rangesV4, &rnglists, &locV4,   &loclists};
+		char const* names[]
+		    = {".debug_aranges",  ".debug_str",      ".debug_line_str",
+		       ".debug_str_offsets", ".debug_addr",  ".debug_ranges",
+		       ".debug_rnglists", ".debug_loc",      ".debug_loclists"};
+		for(size_t i = 0; i < sizeof(names) / sizeof(names[0]); ++i)
+		{
+			if(!dwarf->getSection(names[i], optional[i]))
+			{
+				optional[i]->data = NULL;
+				optional[i]->size = 0;
+			}
+		}
+		return true;
+	}
+
+	bool openSeparate(char const* path)
+	{
+		std::string id = binary.getBuildId();
+		if(id.size() > 2
+		   && separate.open(("/usr/lib/debug/.build-id/" + id.substr(0, 2) + "/"
+		                     + id.substr(2) + ".debug")
+		                        .c_str()))
+			return true;
+
+		std::string link = binary.getDebugLink();
+		if(link.empty())
+			return false;
+
+		// the link is relative to the directory of the binary itself, not
+		// of a symbolic link to it (such as /proc/self/exe)
+		char* real = realpath(path, NULL);
+		if(real == NULL)
+			return false;
+		std::string dir = real;
+		free(real);
+		dir.erase(dir.rfind('/') + 1);
+
+		std::string paths[] = {dir + link, dir + ".debug/" + link,
+		                       "/usr/lib/debug" + dir + link};
+		for(size_t i = 0; i < 3; ++i)
+		{
+			if(separate.open(paths[i].c_str()))
+				return true;
+		}
+		return false;
+	}
+
+	void addRange(uint64_t begin, uint64_t end, uint64_t unit)
+	{
+		if(begin >= end)
+			return;
+
+		Range range;
+		range.begin = begin;
+		range.end   = end;
+		range.unit  = unit;
+		ranges.push_back(range);
+	}
+
+	static bool rangeBefore(Range const& a, Range const& b)
+	{
+		return a.begin < b.begin;
+	}
+
+	static bool rangeAfter(uintptr_t addr, Range const& range)
+	{
+		return addr < range.begin;
+	}
+
+	// reads the ranges of .debug_aranges, returns false if there are none
+	bool indexArangesSection()
+	{
+		DwarfReader reader(aranges.data, aranges.data + aranges.size);
+		while(!reader.atEnd())
+		{
+			char const* setStart = reader.position();
+			bool is64;
+			uint64_t length = reader.unitLength(&is64);
+			if(length > reader.remaining())
+				break;
+
+			DwarfReader set(reader.position(), reader.position() + length);
+			reader.skip(length);
+
+			set.u16(); // version
+			uint64_t unit   = set.offset(is64);
+			int addrSize    = set.u8();
+			int segmentSize = set.u8();
+			if(!set.ok() || (addrSize != 4 && addrSize != 8) || segmentSize != 0)
+				continue;
+
+			// tuples are aligned on their size from the start of the set
+			size_t tupleSize  = 2 * addrSize;
+			size_t headerSize = set.position() - setStart;
+			set.skip((tupleSize - headerSize % tupleSize) % tupleSize);
+
+			while(set.remaining() >= tupleSize)
+			{
+				uint64_t begin = set.address(addrSize);
+				uint64_t size  = set.address(addrSize);
+				if(begin == 0 && size == 0)
+					break;
+				addRange(begin, begin + size, unit);
+			}
+		}
+		return !ranges.empty();
+	}
+
+	// gathers the ranges from the root DIE of every compilation unit
+	void indexUnits()
+	{
+		uint64_t offset = 0;
+		while(offset < info.size)
+		{
+			Unit unit;
+			if(!readUnitHeader(offset, &unit))
+				break;
+			if(readRootDie(offset, &unit))
+				addUnitRanges(unit);
+			offset = unit.end - info.data;
+		}
+	}
+
+	void addUnitRanges(Unit const& unit)
+	{
+		if(unit.hasRanges)
+		{
+			uint64_t offset = unit.offset;
+			readRanges(unit, unit.rangesOffset, unit.rangesIsIndex,
+			           [this, offset](uint64_t begin, uint64_t end) {
+				           addRange(begin, end, offset);
+			           });
+		}
+		else if(unit.hasLowPc && unit.hasHighPc)
+		{
+			addRange(unit.lowPc,
+			         unit.highPcIsOffset ? unit.lowPc + unit.highPc : unit.highPc,
+			         unit.offset);
+		}
+	}
+
+	// calls add(begin, end) for each range of a range list of the unit, given
+	// by its offset or, in DWARF 5, its index
+	template <typename Add>
+	void readRanges(Unit const& unit, uint64_t offset, bool isIndex,
+	                Add const& add)
+	{
+		if(unit.version >= 5)
+			readRangeList(unit, offset, isIndex, add);
+		else
+			readRangesV4(unit, offset, add);
+	}
+
+	// .debug_ranges, before DWARF 5
+	template <typename Add>
+	void readRangesV4(Unit const& unit, uint64_t offset, Add const& add)
+	{
+		if(offset >= rangesV4.size)
+			return;
+
+		DwarfReader reader(rangesV4.data + offset,
+		                   rangesV4.data + rangesV4.size);
+		uint64_t maxAddress
+		    = unit.addrSize == 8 ? ~static_cast<uint64_t>(0) : 0xffffffffu;
+		uint64_t base = unit.hasLowPc ? unit.lowPc : 0;
+		while(reader.ok())
+		{
+			uint64_t begin = reader.address(unit.addrSize);
+			uint64_t end   = reader.address(unit.addrSize);
+			if(!reader.ok() || (begin == 0 && end == 0))
+				break;
+			if(begin == maxAddress)
+				base = end;
+			else
+				add(base + begin, base + end);
+		}
+	}
+
+	// .debug_rnglists, DWARF 5
+	template <typename Add>
+	void readRangeList(Unit const& unit, uint64_t offset, bool isIndex,
+	                   Add const& add)
+	{
+		if(isIndex)
+		{
+			int offsetSize = unit.is64 ? 8 : 4;
+			uint64_t entry = unit.rnglistsBase + offset * offsetSize;
+			if(entry >= rnglists.size)
+				return;
+			DwarfReader table(rnglists.data + entry,
+			                  rnglists.data + rnglists.size);
+			offset = unit.rnglistsBase + table.offset(unit.is64);
+		}
+		if(offset >= rnglists.size)
+			return;
+
+		DwarfReader reader(rnglists.data + offset, rnglists.data + rnglists.size);
+		uint64_t base = unit.hasLowPc ? unit.lowPc : 0;
+		while(reader.ok())
+		{
+			uint64_t begin, end;
+			switch(reader.u8())
+			{
+				case RLE_END_OF_LIST:
+					return;
+				case RLE_BASE_ADDRESSX:
+					base = readAddrx(unit, reader.uleb());
+					continue;
+				case RLE_STARTX_ENDX:
+					begin = readAddrx(unit, reader.uleb());
+					end   = readAddrx(unit, reader.uleb());
+					break;
+				case RLE_STARTX_LENGTH:
+					begin = readAddrx(unit, reader.uleb());
+					end   = begin + reader.uleb();
+					break;
+				case RLE_OFFSET_PAIR:
+					begin = base + reader.uleb();
+					end   = base + reader.uleb();
+					break;
+				case RLE_BASE_ADDRESS:
+					base = reader.address(unit.addrSize);
+					continue;
+				case RLE_START_END:
+					begin = reader.address(unit.addrSize);
+					end   = reader.address(unit.addrSize);
+					break;
+				case RLE_START_LENGTH:
+					begin = reader.address(unit.addrSize);
+					end   = begin + reader.uleb();
+					break;
+				default:
+					return;
+			}
+			if(reader.ok())
+				add(begin, end);
+		}
+	}
+
+	uint64_t readAddrx(Unit const& unit, uint64_t index)
+	{
+		uint64_t offset = unit.addrBase + index * unit.addrSize;
+		if(offset >= addr.size)
+			return 0;
+		DwarfReader reader(addr.data + offset, addr.data + addr.size);
+		return reader.address(unit.addrSize);
+	}
+
+	bool readUnit(uint64_t offset, Unit* unit)
+	{
+		return readUnitHeader(offset, unit) && readRootDie(offset, unit);
+	}
+
+	bool readUnitHeader(uint64_t offset, Unit* unit)
+	{
+		if(offset >= info.size)
+			return false;
+
+		DwarfReader reader(info.data + offset, info.data + info.size);
+		uint64_t length = reader.unitLength(&unit->is64);
+		if(!reader.ok() || length > reader.remaining())
+			return false;
+
+		unit->offset  = offset;
+		unit->end     = reader.position() + length;
+		unit->version = reader.u16();
+		return reader.ok() && unit->version >= 2 && unit->version <= 5;
+	}
+
+	// reads the attributes of the first DIE of the unit that are needed to
+	// find its ranges and its line program
+	bool readRootDie(uint64_t offset, Unit* unit)
+	{
+		unit->hasStmtList    = false;
+		unit->hasLowPc       = false;
+		unit->hasHighPc      = false;
+		unit->highPcIsOffset = false;
+		unit->hasRanges      = false;
+		unit->rangesIsIndex  = false;
+		unit->strOffsetsBase = 0;
+		unit->addrBase       = 0;
+		unit->rnglistsBase   = 0;
+		unit->loclistsBase   = 0;
+
+		DwarfReader reader(info.data + offset, unit->end);
+		reader.unitLength(&unit->is64);
+		reader.u16(); // version
+
+		uint64_t abbrevOffset;
+		if(unit->version >= 5)
+		{
+			int unitType   = reader.u8();
+			unit->addrSize = reader.u8();
+			abbrevOffset   = reader.offset(unit->is64);
+			// only compile units have line programs, skeletons point to
+			// split DWARF which isn't read
+			if(unitType != 1)
+				return false;
+		}
+		else
+		{
+			abbrevOffset   = reader.offset(unit->is64);
+			unit->addrSize = reader.u8();
+		}
+		unit->abbrevOffset = abbrevOffset;
+		unit->dies         = reader.position();
+
+		uint64_t code = reader.uleb();
+		if(!reader.ok() || code == 0)
+			return false;
+
+		DwarfReader specs(NULL, NULL);
+		if(!findAbbrev(abbrevOffset, code, &specs))
+			return false;
+
+		bool lowPcIsIndex = false;
+		bool highPcIsIndex = false;
+		while(reader.ok())
+		{
+			uint64_t attribute = specs.uleb();
+			uint64_t form      = specs.uleb();
+			int64_t implicit   = form == FORM_IMPLICIT_CONST ? specs.sleb() : 0;
+			if(!specs.ok() || (attribute == 0 && form == 0))
+				break;
+
+			uint64_t value = readForm(reader, form, *unit, implicit);
+			bool isIndex   = form == FORM_ADDRX || form == FORM_GNU_ADDR_INDEX
+			               || (form >= FORM_ADDRX1 && form <= FORM_ADDRX4);
+			switch(attribute)
+			{
+				case AT_STMT_LIST:
+					unit->hasStmtList = true;
+					unit->stmtList    = value;
+					break;
+				case AT_LOW_PC:
+					unit->hasLowPc = true;
+					unit->lowPc    = value;
+					lowPcIsIndex   = isIndex;
+					break;
+				case AT_HIGH_PC:
+					unit->hasHighPc      = true;
+					unit->highPc         = value;
+					highPcIsIndex        = isIndex;
+					unit->highPcIsOffset = form != FORM_ADDR && !isIndex;
+					break;
+				case AT_RANGES:
+					unit->hasRanges     = true;
+					unit->rangesOffset  = value;
+					unit->rangesIsIndex = form == FORM_RNGLISTX;
+					break;
+				case AT_STR_OFFSETS_BASE:
+					unit->strOffsetsBase = value;
+					break;
+				case AT_ADDR_BASE:
+				case AT_GNU_ADDR_BASE:
+					unit->addrBase = value;
+					break;
+				case AT_RNGLISTS_BASE:
+					unit->rnglistsBase = value;
+					break;
+				case AT_LOCLISTS_BASE:
+					unit->loclistsBase = value;
+					break;
+			}
+		}
+
+		// indices can only be resolved once the bases are known
+		if(lowPcIsIndex)
+			unit->lowPc = readAddrx(*unit, unit->lowPc);
+		if(highPcIsIndex)
+			unit->highPc = readAddrx(*unit, unit->highPc);
+		return reader.ok();
+	}
+
+	// positions specs on the attribute specifications of an abbreviation
+	bool findAbbrev(uint64_t offset, uint64_t code, DwarfReader* specs)
+	{
+		if(offset >= abbrev.size)
+			return false;
+
+		DwarfReader reader(abbrev.data + offset, abbrev.data + abbrev.size);
+		while(reader.ok())
+		{
+			uint64_t current = reader.uleb();
+			if(current == 0)
+				return false;
+			reader.uleb(); // tag
+			reader.u8();   // children
+			if(current == code)
+			{
+				*specs = reader;
+				return reader.ok();
+			}
+
+			for(;;)
+			{
+				uint64_t attribute = reader.uleb();
+				uint64_t form      = reader.uleb();
+				if(form == FORM_IMPLICIT_CONST)
+					reader.sleb();
+				if(!reader.ok() || (attribute == 0 && form == 0))
+					break;
+			}
+		}
+		return false;
+	}
+
+	// reads an attribute value: constants, addresses, offsets and indices are
+	// returned, strings and blocks are skipped
+	static uint64_t readForm(DwarfReader& reader, uint64_t form, Unit const& unit,
+	                         int64_t implicit)
+	{
+		switch(form)
+		{
+			case FORM_ADDR:
+				return reader.address(unit.addrSize);
+			case FORM_DATA1:
+			case FORM_REF1:
+			case FORM_FLAG:
+			case FORM_STRX1:
+			case FORM_ADDRX1:
+				return reader.u8();
+			case FORM_DATA2:
+			case FORM_REF2:
+			case FORM_STRX2:
+			case FORM_ADDRX2:
+				return reader.u16();
+			case FORM_STRX3:
+			case FORM_ADDRX3:
+				return reader.u24();
+			case FORM_DATA4:
+			case FORM_REF4:
+			case FORM_REF_SUP4:
+			case FORM_STRX4:
+			case FORM_ADDRX4:
+				return reader.u32();
+			case FORM_DATA8:
+			case FORM_REF8:
+			case FORM_REF_SIG8:
+			case FORM_REF_SUP8:
+				return reader.u64();
+			case FORM_DATA16:
+				reader.skip(16);
+				return 0;
+			case FORM_SDATA:
+				return reader.sleb();
+			case FORM_UDATA:
+			case FORM_REF_UDATA:
+			case FORM_STRX:
+			case FORM_ADDRX:
+			case FORM_LOCLISTX:
+			case FORM_RNGLISTX:
+			case FORM_GNU_ADDR_INDEX:
+			case FORM_GNU_STR_INDEX:
+				return reader.uleb();
+			case FORM_STRP:
+			case FORM_LINE_STRP:
+			case FORM_SEC_OFFSET:
+			case FORM_STRP_SUP:
+			case FORM_GNU_REF_ALT:
+			case FORM_GNU_STRP_ALT:
+				return reader.offset(unit.is64);
+			case FORM_REF_ADDR:
+				return unit.version <= 2 ? reader.address(unit.addrSize)
+				                         : reader.offset(unit.is64);
+			case FORM_STRING:
+				reader.cstr();
+				return 0;
+			case FORM_BLOCK1:
+				reader.skip(reader.u8());
+				return 0;
+			case FORM_BLOCK2:
+				reader.skip(reader.u16());
+				return 0;
+			case FORM_BLOCK4:
+				reader.skip(reader.u32());
+				return 0;
+			case FORM_BLOCK:
+			case FORM_EXPRLOC:
+				reader.skip(reader.uleb());
+				return 0;
+			case FORM_FLAG_PRESENT:
+				return 1;
+			case FORM_IMPLICIT_CONST:
+				return implicit;
+			case FORM_INDIRECT:
+				return readForm(reader, reader.uleb(), unit, 0);
+			default:
+				reader.fail();
+				return 0;
+		}
+	}
+
+	// reads a string attribute of the line program header, NULL if the form
+	// isn't a string
+	char const* readString(DwarfReader& reader, uint64_t form, Unit const& unit)
+	{
+		if(form == FORM_STRING)
+			return reader.cstr();
+
+		uint64_t value = readForm(reader, form, unit, 0);
+		switch(form)
+		{
+			case FORM_STRP:
+				return sectionString(str, value);
+			case FORM_LINE_STRP:
+				return sectionString(lineStr, value);
+			case FORM_STRX:
+			case FORM_STRX1:
+			case FORM_STRX2:
+			case FORM_STRX3:
+			case FORM_STRX4:
+			{
+				int offsetSize  = unit.is64 ? 8 : 4;
+				uint64_t offset = unit.strOffsetsBase + value * offsetSize;
+				if(offset >= strOffsets.size)
+					return NULL;
+				DwarfReader entry(strOffsets.data + offset,
+				                  strOffsets.data + strOffsets.size);
+				return sectionString(str, entry.offset(unit.is64));
+			}
+			default:
+				return NULL;
+		}
+	}
+
+	static char const* sectionString(ElfSection const& section, uint64_t offset)
+	{
+		if(offset >= section.size
+		   || memchr(section.data + offset, '\0', section.size - offset) == NULL)
+			return NULL;
+		return section.data + offset;
+	}
+
+	// header of a line program
+	struct LineProgram
+	{
+		// unit with the offset size, version and address size of the program
+		Unit header;
+		// directory and file tables
+		char const* files;
+		char const* opcodes;
+		char const* end;
+		int minInstLength;
+		int lineBase;
+		int lineRange;
+		int opcodeBase;
+		char const* opcodeLengths;
+	};
+
+	bool readLineProgram(Unit const& unit, LineProgram* program)
+	{
+		if(!unit.hasStmtList || unit.stmtList >= line.size)
+			return false;
+
+		DwarfReader reader(line.data + unit.stmtList, line.data + line.size);
+		Unit& header    = program->header;
+		header          = unit;
+		uint64_t length = reader.unitLength(&header.is64);
+		if(!reader.ok() || length > reader.remaining())
+			return false;
+		program->end = reader.position() + length;
+
+		header.version = reader.u16();
+		if(header.version < 2 || header.version > 5)
+			return false;
+		if(header.version >= 5)
+		{
+			header.addrSize = reader.u8();
+			reader.u8(); // segment selector size
+		}
+
+		uint64_t headerLength = reader.offset(header.is64);
+		if(headerLength > reader.remaining())
+			return false;
+		program->opcodes = reader.position() + headerLength;
+
+		program->minInstLength = reader.u8();
+		if(header.version >= 4)
+			reader.u8(); // maximum operations per instruction
+		reader.u8();     // default is_stmt
+		program->lineBase      = static_cast<int8_t>(reader.u8());
+		program->lineRange     = reader.u8();
+		program->opcodeBase    = reader.u8();
+		program->opcodeLengths = reader.position();
+		reader.skip(program->opcodeBase > 0 ? program->opcodeBase - 1 : 0);
+		program->files = reader.position();
+		return reader.ok() && program->lineRange != 0
+		       && program->opcodeBase != 0;
+	}
+
+	// runs a line program, calling visitor.row(address, file, line,
+	// endSequence) for each row until it returns false
+	template <typename Visitor>
+	static void runLineProgram(LineProgram const& program, Visitor& visitor)
+	{
+		// address and line advances of the special opcodes
+		int addressAdvance[256];
+		int lineAdvance[256];
+		for(int opcode = program.opcodeBase; opcode < 256; ++opcode)
+		{
+			int adjusted           = opcode - program.opcodeBase;
+			addressAdvance[opcode] = (adjusted / program.lineRange)
+			                         * program.minInstLength;
+			lineAdvance[opcode]
+			    = program.lineBase + adjusted % program.lineRange;
+		}
+
+		uint64_t address   = 0;
+		uint64_t fileIndex = 1;
+		int64_t lineNo     = 1;
+
+		DwarfReader ops(program.opcodes, program.end);
+		while(!ops.atEnd())
+		{
+			uint8_t opcode   = ops.u8();
+			bool endSequence = false;
+
+			if(opcode >= program.opcodeBase)
+			{
+				address += addressAdvance[opcode];
+				lineNo += lineAdvance[opcode];
+			}
+			else if(opcode == 0)
+			{
+				uint64_t size = ops.uleb();
+				if(size == 0 || size > ops.remaining())
+					break;
+				DwarfReader extended(ops.position(), ops.position() + size);
+				ops.skip(size);
+
+				uint8_t subOpcode = extended.u8();
+				if(subOpcode == LNE_SET_ADDRESS)
+					address = extended.address(size - 1);
+				if(subOpcode != LNE_END_SEQUENCE)
+					continue;
+				endSequence = true;
+			}
+			else
+			{
+				switch(opcode)
+				{
+					case LNS_COPY:
+						break;
+					case LNS_ADVANCE_PC:
+						address += ops.uleb() * program.minInstLength;
+						continue;
+					case LNS_ADVANCE_LINE:
+						lineNo += ops.sleb();
+						continue;
+					case LNS_SET_FILE:
+						fileIndex = ops.uleb();
+						continue;
+					case LNS_CONST_ADD_PC:
+						address += addressAdvance[255];
+						continue;
+					case LNS_FIXED_ADVANCE_PC:
+						address += ops.u16();
+						continue;
+					default:
+						// other standard opcodes only change state that isn't
+						// needed, skip their arguments
+						for(int i = 0; i < program.opcodeLengths[opcode - 1]; ++i)
+							ops.uleb();
+						continue;
+				}
+			}
+
+			if(!visitor.row(address, fileIndex, lineNo, endSequence))
+				return;
+
+			if(endSequence)
+			{
+				address   = 0;
+				fileIndex = 1;
+				lineNo    = 1;
+			}
+		}
+	}
+
+	// finds the row covering an address, the previous row covering addresses
+	// up to the current one
+	struct CoveringRow
+	{
+		explicit CoveringRow(uintptr_t addr)
+		    : addr(addr)
+		    , havePrevious(false)
+		    , found(false)
+		    , prevAddress(0)
+		    , prevFile(0)
+		    , prevLine(0)
+		{
+		}
+
+		bool row(uint64_t address, uint64_t file, int64_t lineNo,
+		         bool endSequence)
+		{
+			if(havePrevious && prevAddress <= addr && addr < address)
+			{
+				found = true;
+				return false;
+			}
+
+			havePrevious = !endSequence;
+			prevAddress  = address;
+			prevFile     = file;
+			prevLine     = lineNo;
+			return true;
+		}
+
+		uintptr_t addr;
+		bool havePrevious;
+		bool found;
+		uint64_t prevAddress;
+		uint64_t prevFile;
+		int64_t prevLine;
+	};
+
+	struct RowCollector
+	{
+		RowCollector(DwarfLineRows* rows, size_t maxRows)
+		    : rows(rows)
+		    , left(maxRows)
+		    , complete(true)
+		{
+		}
+
+		bool row(uint64_t address, uint64_t file, int64_t lineNo,
+		         bool endSequence)
+		{
+			if(left == 0)
+			{
+				complete = false;
+				return false;
+			}
+			--left;
+			rows->addresses.push_back(address);
+			rows->files.push_back(static_cast<uint32_t>(file));
+			rows->lines.push_back(static_cast<uint32_t>(lineNo));
+			rows->ends.push_back(endSequence);
+			return true;
+		}
+
+		DwarfLineRows* rows;
+		// rows that may still be added
+		size_t left;
+		bool complete;
+	};
+
+	// ends of sequences come first, so that the last entry at an address is
+	// the start of the next sequence
+	static bool entryBefore(DwarfLineEntry const& a, DwarfLineEntry const& b)
+	{
+		if(a.address != b.address)
+			return a.address < b.address;
+		return a.file == NULL && b.file != NULL;
+	}
+
+	static bool entryAfter(uintptr_t addr, DwarfLineEntry const& entry)
+	{
+		return addr < entry.address;
+	}
+
+	// worker of buildLineIndex(), takes units until there are none left
+	void indexLines(std::vector<uint64_t> const& units,
+	                std::atomic<size_t>* next, std::vector<DwarfLineEntry>* run)
+	{
+		DwarfLineRows rows;
+		std::vector<char const*> names;
+		for(size_t i = (*next)++; i < units.size(); i = (*next)++)
+		{
+			rows.clear();
+			names.clear();
+			if(!decodeLines(units[i], &rows))
+				continue;
+
+			bool inSequence = false;
+			for(size_t row = 0; row < rows.size(); ++row)
+			{
+				DwarfLineEntry entry;
+				entry.address = rows.addresses[row];
+				entry.line    = rows.lines[row];
+				entry.file    = NULL;
+				if(!rows.ends[row])
+				{
+					uint32_t file = rows.files[row];
+					if(file >= names.size())
+						names.resize(file + 1, NULL);
+					if(names[file] == NULL)
+						names[file] = getFileName(units[i], file);
+					entry.file = names[file];
+				}
+
+				// a row with the same line as the previous one adds nothing
+				if(inSequence && entry.file != NULL
+				   && entry.file == run->back().file
+				   && entry.line == run->back().line)
+					continue;
+
+				run->push_back(entry);
+				inSequence = entry.file != NULL;
+			}
+		}
+		std::stable_sort(run->begin(), run->end(), entryBefore);
+	}
+
+	bool findLineInIndex(uintptr_t addr, char const** file, int* line)
+	{
+		std::vector<DwarfLineEntry>::const_iterator it = std::upper_bound(
+		    lineIndex.begin(), lineIndex.end(), addr, entryAfter);
+		if(it == lineIndex.begin() || (it - 1)->file == NULL)
+			return false;
+
+		--it;
+		*file = it->file;
+		*line = static_cast<int>(it->line);
+		return true;
+	}
+
+	// runs the line program of unit until the row covering addr, without
+	// storing the rows
+	bool findLineInUnit(Unit const& unit, uintptr_t addr, char const** file,
+	                    int* lineNumber)
+	{
+		LineProgram program;
+		if(!readLineProgram(unit, &program))
+			return false;
+
+		CoveringRow covering(addr);
+		runLineProgram(program, covering);
+		if(!covering.found)
+			return false;
+
+		*file = fileName(DwarfReader(program.files, program.opcodes),
+		                 program.header, covering.prevFile);
+		*lineNumber = static_cast<int>(covering.prevLine);
+		return *file != NULL;
+	}
+
+	// name of a file of a line program header, without its directory
+	char const* fileName(DwarfReader files, Unit const& header, uint64_t index)
+	{
+		char const* name = NULL;
+		if(header.version >= 5)
+			name = fileNameV5(files, header, index);
+		else
+		{
+			// skip the include directories
+			while(files.ok() && *files.cstr() != '\0')
+			{
+			}
+			// files are numbered from 1
+			for(uint64_t i = 1; files.ok() && name == NULL; ++i)
+			{
+				char const* current = files.cstr();
+				if(*current == '\0')
+					break;
+				files.uleb(); // directory
+				files.uleb(); // modification time
+				files.uleb(); // size
+				if(i == index)
+					name = current;
+			}
+		}
+
+		if(name == NULL || !files.ok())
+			return NULL;
+		char const* lastSlash = strrchr(name, '/');
+		return lastSlash != NULL ? lastSlash + 1 : name;
+	}
+
+	char const* fileNameV5(DwarfReader& files, Unit const& header,
+	                       uint64_t index)
+	{
+		// directories and files are tables described by (content, form) pairs
+		for(int table = 0; table < 2; ++table)
+		{
+			int formatCount = files.u8();
+			DwarfReader formats = files;
+			for(int i = 0; i < formatCount; ++i)
+			{
+				files.uleb();
+				files.uleb();
+			}
+
+			uint64_t count = files.uleb();
+			for(uint64_t entry = 0; entry < count && files.ok(); ++entry)
+			{
+				DwarfReader format = formats;
+				char const* path   = NULL;
+				for(int i = 0; i < formatCount; ++i)
+				{
+					uint64_t content = format.uleb();
+					uint64_t form    = format.uleb();
+					if(content == LNCT_PATH)
+						path = readString(files, form, header);
+					else
+						readForm(files, form, header, 0);
+				}
+
+				// files are numbered from 0
+				if(table == 1 && entry == index)
+					return path;
+			}
+		}
+		return NULL;
+	}
+
+	// abbreviation of DIEs: their tag, whether they have children, and where
+	// their attribute specifications are in .debug_abbrev
+	struct Abbrev
+	{
+		uint64_t tag;
+		bool children;
+		char const* specs;
+	};
+
+	// location attribute: an expression, or a location list given by its
+	// offset or, in DWARF 5, its index
+	struct LocationAttribute
+	{
+		bool present;
+		DwarfExpression expression;
+		bool isList;
+		uint64_t list;
+		bool listIsIndex;
+	};
+
+	// attributes of a DIE needed to find variables and describe their types
+	struct Die
+	{
+		// 0 for the null entry ending a list of children
+		uint64_t tag;
+		bool children;
+		char const* name;
+		// offsets in .debug_info of the DIEs referred to, 0 if none
+		uint64_t type;
+		uint64_t origin;
+		uint64_t byteSize;
+		uint64_t encoding;
+		bool declaration;
+		bool hasLowPc;
+		uint64_t lowPc;
+		bool hasHighPc;
+		uint64_t highPc;
+		bool highPcIsOffset;
+		bool hasRanges;
+		uint64_t rangesOffset;
+		bool rangesIsIndex;
+		LocationAttribute location;
+		LocationAttribute frameBase;
+		bool hasConstant;
+		int64_t constant;
+	};
+
+	// reads the abbreviations of a unit, indexed by their code
+	bool readAbbrevs(uint64_t offset, std::vector<Abbrev>* abbrevs)
+	{
+		if(offset >= abbrev.size)
+			return false;
+
+		DwarfReader reader(abbrev.data + offset, abbrev.data + abbrev.size);
+		while(reader.ok())
+		{
+			uint64_t code = reader.uleb();
+			if(code == 0)
+				return reader.ok();
+			// compilers number them from 1
+			if(code > 65536)
+				return false;
+
+			Abbrev entry;
+			entry.tag      = reader.uleb();
+			entry.children = reader.u8() != 0;
+			entry.specs    = reader.position();
+			if(abbrevs->size() <= code)
+			{
+				Abbrev none = {0, false, NULL};
+				abbrevs->resize(code + 1, none);
+			}
+			(*abbrevs)[code] = entry;
+
+			for(;;)
+			{
+				uint64_t attribute = reader.uleb();
+				uint64_t form      = reader.uleb();
+				if(form == FORM_IMPLICIT_CONST)
+					reader.sleb();
+				if(!reader.ok() || (attribute == 0 && form == 0))
+					break;
+			}
+		}
+		return false;
+	}
+
+	bool readDieAt(Unit const& unit, std::vector<Abbrev> const& abbrevs,
+	               uint64_t offset, Die* die)
+	{
+		// references to other units aren't followed
+		if(offset <= unit.offset
+		   || offset >= static_cast<uint64_t>(unit.end - info.data))
+			return false;
+
+		DwarfReader reader(info.data + offset, unit.end);
+		return readDie(reader, unit, abbrevs, die) && die->tag != 0;
+	}
+
+	bool readDie(DwarfReader& reader, Unit const& unit,
+	             std::vector<Abbrev> const& abbrevs, Die* die)
+	{
+		*die          = Die();
+		uint64_t code = reader.uleb();
+		if(!reader.ok())
+			return false;
+		if(code == 0)
+			return true;
+		if(code >= abbrevs.size() || abbrevs[code].specs == NULL)
+			return false;
+
+		die->tag      = abbrevs[code].tag;
+		die->children = abbrevs[code].children;
+
+		DwarfReader specs(abbrevs[code].specs, abbrev.data + abbrev.size);
+		bool lowPcIsIndex  = false;
+		bool highPcIsIndex = false;
+		while(reader.ok())
+		{
+			uint64_t attribute = specs.uleb();
+			uint64_t form      = specs.uleb();
+			int64_t implicit   = form == FORM_IMPLICIT_CONST ? specs.sleb() : 0;
+			if(!specs.ok() || (attribute == 0 && form == 0))
+				break;
+
+			// attributes that aren't numbers
+			if(attribute == AT_NAME)
+			{
+				die->name = readString(reader, form, unit);
+				continue;
+			}
+			if(attribute == AT_LOCATION || attribute == AT_FRAME_BASE)
+			{
+				readLocation(reader, form, unit,
+				             attribute == AT_LOCATION ? &die->location
+				                                      : &die->frameBase);
+				continue;
+			}
+
+			uint64_t value = readForm(reader, form, unit, implicit);
+			bool isIndex   = form == FORM_ADDRX || form == FORM_GNU_ADDR_INDEX
+			               || (form >= FORM_ADDRX1 && form <= FORM_ADDRX4);
+			switch(attribute)
+			{
+				case AT_TYPE:
+					die->type = readReference(form, value, unit);
+					break;
+				case AT_ABSTRACT_ORIGIN:
+					die->origin = readReference(form, value, unit);
+					break;
+				case AT_BYTE_SIZE:
+					die->byteSize = value;
+					break;
+				case AT_ENCODING:
+					die->encoding = value;
+					break;
+				case AT_DECLARATION:
+					die->declaration = value != 0;
+					break;
+				case AT_LOW_PC:
+					die->hasLowPc = true;
+					die->lowPc    = value;
+					lowPcIsIndex  = isIndex;
+					break;
+				case AT_HIGH_PC:
+					die->hasHighPc      = true;
+					die->highPc         = value;
+					highPcIsIndex       = isIndex;
+					die->highPcIsOffset = form != FORM_ADDR && !isIndex;
+					break;
+				case AT_RANGES:
+					die->hasRanges     = true;
+					die->rangesOffset  = value;
+					die->rangesIsIndex = form == FORM_RNGLISTX;
+					break;
+				case AT_CONST_VALUE:
+					// constants in blocks, such as those of structures,
+					// aren't read
+					die->hasConstant
+					    = (form >= FORM_DATA2 && form <= FORM_DATA8)
+					      || form == FORM_DATA1 || form == FORM_SDATA
+					      || form == FORM_UDATA || form == FORM_IMPLICIT_CONST;
+					die->constant = static_cast<int64_t>(value);
+					break;
+			}
+		}
+
+		if(lowPcIsIndex)
+			die->lowPc = readAddrx(unit, die->lowPc);
+		if(highPcIsIndex)
+			die->highPc = readAddrx(unit, die->highPc);
+		return reader.ok();
+	}
+
+	// offset in .debug_info of the DIE a reference attribute points to, 0 if
+	// it is in another section
+	static uint64_t readReference(uint64_t form, uint64_t value,
+	                              Unit const& unit)
+	{
+		switch(form)
+		{
+			case FORM_REF1:
+			case FORM_REF2:
+			case FORM_REF4:
+			case FORM_REF8:
+			case FORM_REF_UDATA:
+				return unit.offset + value;
+			case FORM_REF_ADDR:
+				return value;
+			default:
+				return 0;
+		}
+	}
+
+	static void readLocation(DwarfReader& reader, uint64_t form,
+	                         Unit const& unit, LocationAttribute* location)
+	{
+		uint64_t size;
+		switch(form)
+		{
+			case FORM_EXPRLOC:
+			case FORM_BLOCK:
+				size = reader.uleb();
+				break;
+			case FORM_BLOCK1:
+				size = reader.u8();
+				break;
+			case FORM_BLOCK2:
+				size = reader.u16();
+				break;
+			case FORM_BLOCK4:
+				size = reader.u32();
+				break;
+			// offsets of location lists, data forms before DWARF 4
+			case FORM_SEC_OFFSET:
+			case FORM_DATA4:
+			case FORM_DATA8:
+			case FORM_LOCLISTX:
+				location->present     = true;
+				location->isList      = true;
+				location->listIsIndex = form == FORM_LOCLISTX;
+				location->list        = readForm(reader, form, unit, 0);
+				return;
+			default:
+				readForm(reader, form, unit, 0);
+				return;
+		}
+
+		location->present         = true;
+		location->isList          = false;
+		location->expression.data = reader.position();
+		location->expression.size = size;
+		reader.skip(size);
+	}
+
+	bool dieCovers(Unit const& unit, Die const& die, uint64_t addr)
+	{
+		if(die.hasRanges)
+		{
+			bool covered = false;
+			readRanges(unit, die.rangesOffset, die.rangesIsIndex,
+			           [addr, &covered](uint64_t begin, uint64_t end) {
+				           covered = covered || (addr >= begin && addr < end);
+			           });
+			return covered;
+		}
+		return die.hasLowPc && die.hasHighPc && addr >= die.lowPc
+		       && addr < (die.highPcIsOffset ? die.lowPc + die.highPc
+		                                     : die.highPc);
+	}
+
+	// walks the DIEs of a unit down to the function containing addr, and
+	// through its lexical blocks containing addr; the others are skipped
+	bool findVariablesInUnit(Unit const& unit,
+	                         std::vector<Abbrev> const& abbrevs, uintptr_t addr,
+	                         std::vector<DwarfVariable>* variables,
+	                         DwarfExpression* frameBase)
+	{
+		DwarfReader reader(unit.dies, unit.end);
+		// depth of the next DIE, of the DIEs looked at (those of the DIEs
+		// entered), and of the function once found
+		int depth    = 0;
+		int examined = 0;
+		int function = -1;
+		while(!reader.atEnd())
+		{
+			Die die;
+			if(!readDie(reader, unit, abbrevs, &die))
+				return false;
+			if(die.tag == 0)
+			{
+				--depth;
+				examined = std::min(examined, depth);
+				if(function >= 0 && depth <= function)
+					return true;
+				continue;
+			}
+
+			// DIEs entered: the unit, namespaces, then the function and its
+			// blocks containing addr
+			bool enter = false;
+			if(depth == examined && function < 0)
+			{
+				enter = die.tag == TAG_COMPILE_UNIT || die.tag == TAG_NAMESPACE;
+				if(die.tag == TAG_SUBPROGRAM && !die.declaration
+				   && dieCovers(unit, die, addr))
+				{
+					enter           = true;
+					function        = depth;
+					frameBase->data = NULL;
+					frameBase->size = 0;
+					if(die.frameBase.present)
+						findLocation(unit, die.frameBase, addr, frameBase);
+					if(!die.children)
+						return true;
+				}
+			}
+			else if(depth == examined && die.tag == TAG_LEXICAL_BLOCK)
+				enter = dieCovers(unit, die, addr);
+			else if(depth == examined
+			        && (die.tag == TAG_FORMAL_PARAMETER
+			            || die.tag == TAG_VARIABLE)
+			        && !die.declaration)
+				addVariable(unit, abbrevs, die, addr, variables);
+
+			if(die.children)
+			{
+				++depth;
+				if(enter)
+					examined = depth;
+			}
+		}
+		return function >= 0;
+	}
+
+	void addVariable(Unit const& unit, std::vector<Abbrev> const& abbrevs,
+	                 Die const& die, uintptr_t addr,
+	                 std::vector<DwarfVariable>* variables)
+	{
+		DwarfVariable variable;
+		variable.name      = die.name;
+		variable.parameter = die.tag == TAG_FORMAL_PARAMETER;
+
+		// the instances of inlined or cloned functions take the names and
+		// types of their abstract instance
+		uint64_t type = die.type;
+		Die origin;
+		if(die.origin != 0 && readDieAt(unit, abbrevs, die.origin, &origin))
+		{
+			if(variable.name == NULL)
+				variable.name = origin.name;
+			if(type == 0)
+				type = origin.type;
+		}
+		describeType(unit, abbrevs, type, 0, &variable);
+
+		variable.location.data = NULL;
+		variable.location.size = 0;
+		if(die.location.present)
+			findLocation(unit, die.location, addr, &variable.location);
+		variable.hasConstant = die.hasConstant;
+		variable.constant    = die.constant;
+		variables->push_back(variable);
+	}
+
+	// names a type the way it is written in C++, and tells how to print its
+	// values
+	void describeType(Unit const& unit, std::vector<Abbrev> const& abbrevs,
+	                  uint64_t offset, int depth, DwarfVariable* variable)
+	{
+		variable->type = "?";
+		variable->kind = VALUE_OTHER;
+		variable->size = 0;
+
+		Die die;
+		if(offset == 0)
+		{
+			variable->type = "void";
+			return;
+		}
+		if(depth >= 16 || !readDieAt(unit, abbrevs, offset, &die))
+			return;
+
+		switch(die.tag)
+		{
+			case TAG_BASE_TYPE:
+				if(die.name != NULL)
+					variable->type = die.name;
+				variable->kind = getValueKind(die.encoding);
+				variable->size = die.byteSize;
+				return;
+			case TAG_POINTER_TYPE:
+			case TAG_REFERENCE_TYPE:
+			case TAG_RVALUE_REFERENCE_TYPE:
+				describeType(unit, abbrevs, die.type, depth + 1, variable);
+				variable->type += die.tag == TAG_POINTER_TYPE     ? "*"
+				                  : die.tag == TAG_REFERENCE_TYPE ? "&"
+				                                                  : "&&";
+				variable->kind = VALUE_POINTER;
+				variable->size
+				    = die.byteSize != 0 ? die.byteSize : unit.addrSize;
+				return;
+			case TAG_CONST_TYPE:
+			case TAG_VOLATILE_TYPE:
+				describeType(unit, abbrevs, die.type, depth + 1, variable);
+				variable->type
+				    += die.tag == TAG_CONST_TYPE ? " const" : " volatile";
+				return;
+			case TAG_RESTRICT_TYPE:
+			case TAG_ATOMIC_TYPE:
+				describeType(unit, abbrevs, die.type, depth + 1, variable);
+				return;
+			case TAG_TYPEDEF:
+				describeType(unit, abbrevs, die.type, depth + 1, variable);
+				if(die.name != NULL)
+					variable->type = die.name;
+				return;
+			case TAG_ENUMERATION_TYPE:
+				// printed as their underlying type
+				if(die.type != 0)
+					describeType(unit, abbrevs, die.type, depth + 1, variable);
+				else
+					variable->kind = VALUE_SIGNED;
+				variable->type = die.name != NULL ? die.name : "enum";
+				if(die.byteSize != 0)
+					variable->size = die.byteSize;
+				return;
+			case TAG_ARRAY_TYPE:
+				describeType(unit, abbrevs, die.type, depth + 1, variable);
+				variable->type += "[]";
+				variable->kind = VALUE_OTHER;
+				variable->size = 0;
+				return;
+			case TAG_SUBROUTINE_TYPE:
+				variable->type = "function";
+				return;
+			case TAG_UNSPECIFIED_TYPE:
+				// decltype(nullptr)
+				if(die.name != NULL)
+					variable->type = die.name;
+				variable->kind = VALUE_POINTER;
+				variable->size = unit.addrSize;
+				return;
+			default:
+				if(die.name != NULL)
+					variable->type = die.name;
+				else if(die.tag == TAG_STRUCTURE_TYPE)
+					variable->type = "struct";
+				else if(die.tag == TAG_CLASS_TYPE)
+					variable->type = "class";
+				else if(die.tag == TAG_UNION_TYPE)
+					variable->type = "union";
+				variable->size = die.byteSize;
+				return;
+		}
+	}
+
+	static DwarfValueKind getValueKind(uint64_t encoding)
+	{
+		switch(encoding)
+		{
+			case ATE_ADDRESS:
+				return VALUE_POINTER;
+			case ATE_BOOLEAN:
+				return VALUE_BOOL;
+			case ATE_FLOAT:
+				return VALUE_FLOAT;
+			case ATE_SIGNED:
+				return VALUE_SIGNED;
+			case ATE_SIGNED_CHAR:
+			case ATE_UNSIGNED_CHAR:
+				return VALUE_CHAR;
+			case ATE_UNSIGNED:
+			case ATE_UTF:
+				return VALUE_UNSIGNED;
+			default:
+				return VALUE_OTHER;
+		}
+	}
+
+	// finds the expression of a location attribute that applies at addr,
+	// returns false if there is none
+	bool findLocation(Unit const& unit, LocationAttribute const& location,
+	                  uint64_t addr, DwarfExpression* expression)
+	{
+		if(!location.isList)
+		{
+			*expression = location.expression;
+			return true;
+		}
+		if(unit.version >= 5)
+			return findInLocationList(unit, location.list,
+			                          location.listIsIndex, addr, expression);
+		return findInLocationsV4(unit, location.list, addr, expression);
+	}
+
+	// .debug_loc, before DWARF 5
+	bool findInLocationsV4(Unit const& unit, uint64_t offset, uint64_t addr,
+	                       DwarfExpression* expression)
+	{
+		if(offset >= locV4.size)
+			return false;
+
+		DwarfReader reader(locV4.data + offset, locV4.data + locV4.size);
+		uint64_t maxAddress
+		    = unit.addrSize == 8 ? ~static_cast<uint64_t>(0) : 0xffffffffu;
+		uint64_t base = unit.hasLowPc ? unit.lowPc : 0;
+		while(reader.ok())
+		{
+			uint64_t begin = reader.address(unit.addrSize);
+			uint64_t end   = reader.address(unit.addrSize);
+			if(!reader.ok() || (begin == 0 && end == 0))
+				return false;
+			if(begin == maxAddress)
+			{
+				base = end;
+				continue;
+			}
+
+			uint16_t size    = reader.u16();
+			char const* data = reader.position();
+			reader.skip(size);
+			if(reader.ok() && addr >= base + begin && addr < base + end)
+			{
+				expression->data = data;
+				expression->size = size;
+				return true;
+			}
+		}
+		return false;
+	}
+
+	// .debug_loclists, DWARF 5
+	bool findInLocationList(Unit const& unit, uint64_t offset, bool isIndex,
+	                        uint64_t addr, DwarfExpression* expression)
+	{
+		if(isIndex)
+		{
+			int offsetSize = unit.is64 ? 8 : 4;
+			uint64_t entry = unit.loclistsBase + offset * offsetSize;
+			if(entry >= loclists.size)
+				return false;
+			DwarfReader table(loclists.data + entry,
+			                  loclists.data + loclists.size);
+			offset = unit.loclistsBase + table.offset(unit.is64);
+		}
+		if(offset >= loclists.size)
+			return false;
+
+		DwarfReader reader(loclists.data + offset,
+		                   loclists.data + loclists.size);
+		uint64_t base = unit.hasLowPc ? unit.lowPc : 0;
+		// applies where no other entry does
+		DwarfExpression fallback = {NULL, 0};
+		while(reader.ok())
+		{
+			uint64_t begin = 0, end = 0;
+			bool bounded = true;
+			switch(reader.u8())
+			{
+				case LLE_END_OF_LIST:
+					*expression = fallback;
+					return fallback.data != NULL;
+				case LLE_BASE_ADDRESSX:
+					base = readAddrx(unit, reader.uleb());
+					continue;
+				case LLE_STARTX_ENDX:
+					begin = readAddrx(unit, reader.uleb());
+					end   = readAddrx(unit, reader.uleb());
+					break;
+				case LLE_STARTX_LENGTH:
+					begin = readAddrx(unit, reader.uleb());
+					end   = begin + reader.uleb();
+					break;
+				case LLE_OFFSET_PAIR:
+					begin = base + reader.uleb();
+					end   = base + reader.uleb();
+					break;
+				case LLE_DEFAULT_LOCATION:
+					bounded = false;
+					break;
+				case LLE_BASE_ADDRESS:
+					base = reader.address(unit.addrSize);
+					continue;
+				case LLE_START_END:
+					begin = reader.address(unit.addrSize);
+					end   = reader.address(unit.addrSize);
+					break;
+				case LLE_START_LENGTH:
+					begin = reader.address(unit.addrSize);
+					end   = begin + reader.uleb();
+					break;
+				case LLE_GNU_VIEW_PAIR:
+					reader.uleb();
+					reader.uleb();
+					continue;
+				default:
+					return false;
+			}
+
+			DwarfExpression entry;
+			entry.size = reader.uleb();
+			entry.data = reader.position();
+			reader.skip(entry.size);
+			if(!reader.ok())
+				return false;
+			if(!bounded)
+				fallback = entry;
+			else if(addr >= begin && addr < end)
+			{
+				*expression = entry;
+				return true;
+			}
+		}
+		return false;
+	}
+};
+
+#endif
@@ -0,0 +1,329 @@
+/*
+    Copyright (C) 2017 Florian Cabot
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#ifndef STACKTRACE_ELF
+#define STACKTRACE_ELF
+
+#include <algorithm>
+#include <cstring>
+#include <elf.h>
+#include <fcntl.h>
+#include <link.h>
+#include <stdint.h>
+#include <string>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <vector>
+
+/*! \ingroup exceptions
+ * Contents of a section of an ElfFile, pointing into the mapped file.
+ */
+struct ElfSection
+{
+	char const* data;
+	size_t size;
+};
+
+/*! \ingroup exceptions
+ * Read-only view of an ELF file of the native class and byte order.
+ *
+ * The file is mapped rather than read: only the pages that are looked at are
+ * loaded, so a lookup in a binary with gigabytes of debug information costs a
+ * few pages of memory.
+ */
+class ElfFile
+{
+  public:
+	ElfFile()
+	    : data(NULL)
+	    , size(0)
+	    , owned(false)
+	    , sections(NULL)
+	    , sectionCount(0)
+	    , sectionNames(NULL)
+	    , sectionNamesSize(0)
+	    , symbolsLoaded(false)
+	{
+	}
+
+	~ElfFile() { release(); }
+
+	ElfFile(ElfFile const&) = delete;
+	ElfFile& operator=(ElfFile const&) = delete;
+
+	/*! Maps the file at path, returns false if it isn't a native ELF file.
+	 */
+	bool open(char const* path)
+	{
+		release();
+
+		int fd = ::open(path, O_RDONLY | O_CLOEXEC);
+		if(fd < 0)
+			return false;
+
+		struct stat st;
+		void* mapped = MAP_FAILED;
+		if(fstat(fd, &st) == 0
+		   && static_cast<size_t>(st.st_size) >= sizeof(ElfW(Ehdr)))
+			mapped = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		::close(fd);
+
+		if(mapped == MAP_FAILED)
+			return false;
+
+		data  = static_cast<char const*>(mapped);
+		size  = st.st_size;
+		owned = true;
+		if(!readHeaders())
+		{
+			release();
+			return false;
+		}
+		return true;
+	}
+
+	/*! Reads an ELF file already in memory, such as the vDSO, which has to
+	 * stay there while it is used.
+	 */
+	bool openImage(char const* image, size_t imageSize)
+	{
+		release();
+		if(imageSize < sizeof(ElfW(Ehdr)))
+			return false;
+
+		data = image;
+		size = imageSize;
+		if(!readHeaders())
+		{
+			release();
+			return false;
+		}
+		return true;
+	}
+
+	bool isOpen() const { return data != NULL; }
+
+	/*! Finds a section by name.
+	 *
+	 * Returns false if there is no such section, if it has no contents in the
+	 * file (in a stripped binary for example) or if it is compressed.
+	 */
+	bool getSection(char const* name, ElfSection* section) const
+	{
+		for(size_t i = 0; i < sectionCount; ++i)
+		{
+			ElfW(Shdr) const& shdr = sections[i];
+			if(shdr.sh_name >= sectionNamesSize
+			   || strcmp(sectionNames + shdr.sh_name, name) != 0)
+				continue;
+
+			if(shdr.sh_type == SHT_NOBITS || (shdr.sh_flags & SHF_COMPRESSED)
+			   || shdr.sh_offset > size || shdr.sh_size > size - shdr.sh_offset)
+				return false;
+
+			section->data = data + shdr.sh_offset;
+			section->size = shdr.sh_size;
+			return true;
+		}
+		return false;
+	}
+
+	/*! Returns the GNU build ID in hexadecimal, empty if there is none.
+	 */
+	std::string getBuildId() const
+	{
+		ElfSection note;
+		if(!getSection(".note.gnu.build-id", &note)
+		   || note.size < sizeof(ElfW(Nhdr)))
+			return std::string();
+
+		ElfW(Nhdr) nhdr;
+		memcpy(&nhdr, note.data, sizeof(nhdr));
+		size_t descOffset = sizeof(nhdr) + ((nhdr.n_namesz + 3) & ~3u);
+		if(nhdr.n_type != NT_GNU_BUILD_ID || descOffset > note.size
+		   || nhdr.n_descsz > note.size - descOffset)
+			return std::string();
+
+		std::string id;
+		for(size_t i = 0; i < nhdr.n_descsz; ++i)
+		{
+			unsigned char byte = note.data[descOffset + i];
+			id += "0123456789abcdef"[byte >> 4];
+			id += "0123456789abcdef"[byte & 0xf];
+		}
+		return id;
+	}
+
+	/*! Returns the file name stored in .gnu_debuglink, empty if there is none.
+	 */
+	std::string getDebugLink() const
+	{
+		ElfSection link;
+		if(!getSection(".gnu_debuglink", &link)
+		   || memchr(link.data, '\0', link.size) == NULL)
+			return std::string();
+		return link.data;
+	}
+
+	/*! Returns the (mangled) name of the function containing the file address
+	 * addr according to the symbol table, NULL if unknown.
+	 *
+	 * The symbol table is sorted on the first call, or by loadSymbols().
+	 */
+	char const* findFunction(uintptr_t addr)
+	{
+		loadSymbols();
+
+		std::vector<Symbol>::const_iterator it = std::upper_bound(
+		    symbols.begin(), symbols.end(), addr, symbolAfter);
+		if(it == symbols.begin())
+			return NULL;
+		--it;
+		return addr - it->addr < it->size ? it->name : NULL;
+	}
+
+	/*! Sorts the functions of .symtab, or of .dynsym if the file has been
+	 * stripped, for findFunction().
+	 */
+	void loadSymbols()
+	{
+		if(symbolsLoaded)
+			return;
+
+		ElfW(Word) types[] = {SHT_SYMTAB, SHT_DYNSYM};
+		for(size_t t = 0; t < 2 && symbols.empty(); ++t)
+		{
+			for(size_t i = 0; i < sectionCount; ++i)
+			{
+				if(sections[i].sh_type == types[t])
+					addSymbols(sections[i]);
+			}
+		}
+		std::sort(symbols.begin(), symbols.end(), symbolBefore);
+		symbolsLoaded = true;
+	}
+
+  private:
+	struct Symbol
+	{
+		uintptr_t addr;
+		uintptr_t size;
+		char const* name;
+	};
+
+	char const* data;
+	size_t size;
+	// whether data has been mapped by open()
+	bool owned;
+	ElfW(Shdr) const* sections;
+	size_t sectionCount;
+	char const* sectionNames;
+	size_t sectionNamesSize;
+	std::vector<Symbol> symbols;
+	bool symbolsLoaded;
+
+	void release()
+	{
+		if(data != NULL && owned)
+			munmap(const_cast<char*>(data), size);
+		data         = NULL;
+		owned        = false;
+		size         = 0;
+		sectionCount = 0;
+		symbols.clear();
+		symbolsLoaded = false;
+	}
+
+	bool readHeaders()
+	{
+		ElfW(Ehdr) const* ehdr = reinterpret_cast<ElfW(Ehdr) const*>(data);
+		if(memcmp(ehdr->e_ident, ELFMAG, SELFMAG) != 0
+		   || ehdr->e_ident[EI_CLASS]
+		          != (sizeof(void*) == 8 ? ELFCLASS64 : ELFCLASS32)
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+		   || ehdr->e_ident[EI_DATA] != ELFDATA2LSB
+#else
+		   || ehdr->e_ident[EI_DATA] != ELFDATA2MSB
+#endif
+		   || ehdr->e_shentsize != sizeof(ElfW(Shdr)) || ehdr->e_shoff == 0
+		   || ehdr->e_shoff > size
+		   || size - ehdr->e_shoff < sizeof(ElfW(Shdr)))
+			return false;
+
+		sections = reinterpret_cast<ElfW(Shdr) const*>(data + ehdr->e_shoff);
+
+		// with many sections, their number and the index of their names are
+		// stored in the first section header
+		sectionCount = ehdr->e_shnum != 0 ? ehdr->e_shnum : sections[0].sh_size;
+		size_t namesIndex = ehdr->e_shstrndx != SHN_XINDEX
+		                        ? ehdr->e_shstrndx
+		                        : sections[0].sh_link;
+		if(sectionCount > (size - ehdr->e_shoff) / sizeof(ElfW(Shdr))
+		   || namesIndex >= sectionCount)
+			return false;
+
+		ElfW(Shdr) const& names = sections[namesIndex];
+		if(names.sh_offset > size || names.sh_size > size - names.sh_offset)
+			return false;
+		sectionNames     = data + names.sh_offset;
+		sectionNamesSize = names.sh_size;
+		return true;
+	}
+
+	void addSymbols(ElfW(Shdr) const& table)
+	{
+		if(table.sh_link >= sectionCount || table.sh_offset > size
+		   || table.sh_size > size - table.sh_offset)
+			return;
+
+		ElfW(Shdr) const& strings = sections[table.sh_link];
+		if(strings.sh_offset > size || strings.sh_size > size - strings.sh_offset)
+			return;
+
+		ElfW(Sym) const* syms
+		    = reinterpret_cast<ElfW(Sym) const*>(data + table.sh_offset);
+		size_t count = table.sh_size / sizeof(ElfW(Sym));
+		for(size_t i = 0; i < count; ++i)
+		{
+			int type = ELF64_ST_TYPE(syms[i].st_info);
+			if((type != STT_FUNC && type != STT_GNU_IFUNC)
+			   || syms[i].st_shndx == SHN_UNDEF || syms[i].st_value == 0
+			   || syms[i].st_name >= strings.sh_size)
+				continue;
+
+			Symbol symbol;
+			symbol.addr = syms[i].st_value;
+			symbol.size = syms[i].st_size;
+			symbol.name = data + strings.sh_offset + syms[i].st_name;
+			symbols.push_back(symbol);
+		}
+	}
+
+	static bool symbolBefore(Symbol const& a, Symbol const& b)
+	{
+		return a.addr < b.addr;
+	}
+
+	static bool symbolAfter(uintptr_t addr, Symbol const& symbol)
+	{
+		return addr < symbol.addr;
+	}
+};
+
+#endif
@@ -0,0 +1,373 @@
+/*
+    Copyright (C) 2017 Florian Cabot
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#ifndef STACKTRACE_EXCEPTIONPROFILER
+#define STACKTRACE_EXCEPTIONPROFILER
+
+#include "../Cpp-stacktrace.hpp"
+#include "Folded.hpp"
+#include "SamplingController.hpp"
+#include "SelfMetrics.hpp"
+#include "StackTable.hpp"
+#include <algorithm>
+#include <atomic>
+#include <cxxabi.h>
+#include <ctime>
+#include <execinfo.h>
+#include <ostream>
+#include <typeinfo>
+#include <vector>
+
+#ifndef EXCEPTIONPROFILER_MAX_STACKS
+#define EXCEPTIONPROFILER_MAX_STACKS 1024
+#endif
+
+// exceptions thrown while others are in flight, in destructors run by the
+// unwinder for example
+#ifndef EXCEPTIONPROFILER_MAX_NESTING
+#define EXCEPTIONPROFILER_MAX_NESTING 8
+#endif
+
+/*! \ingroup exceptions
+ * Throw site aggregated by the ExceptionProfiler.
+ */
+struct ThrowSite
+{
+	uint32_t stack;
+	std::type_info const* type;
+	// exceptions caught, and the CPU time from their throw to their catch
+	uint64_t count;
+	uint64_t totalNs;
+	uint64_t maxNs;
+};
+
+/*! \ingroup exceptions
+ * Measures what exceptions cost, per throw site and exception type.
+ *
+ * __cxa_throw() and __cxa_begin_catch() are interposed: the stack of each
+ * throw is captured, then the CPU time of the thread is read at the throw and
+ * at the catch, so that the time measured is the unwinding (personality
+ * routines, landing pads, destructors) and not the capture. Throw sites are
+ * interned with their exception type, the type being stored as an extra frame.
+ * A rethrown exception is measured from its throw to its first catch, and an
+ * exception never caught isn't counted.
+ *
+ * Throws are sampled by a SamplingController when capturing costs too much, a
+ * captured throw then counting for several.
+ *
+ * The interposed functions are defined in the translation unit that defines
+ * EXCEPTIONPROFILER_IMPLEMENTATION before including this header; exactly one
+ * translation unit of the program must do so, and the program has to be
+ * linked with -rdynamic for the throws of shared libraries to be seen.
+ */
+class ExceptionProfiler
+{
+  public:
+	typedef StackTable<EXCEPTIONPROFILER_MAX_STACKS,
+	                   EXCEPTIONPROFILER_MAX_STACKS * 16>
+	    Stacks;
+
+	static void enable()
+	{
+		// the first backtrace() loads the unwinder
+		void* buffer[1];
+		backtrace(buffer, 1);
+		getEnabled().store(true, std::memory_order_release);
+	}
+
+	static void disable()
+	{
+		getEnabled().store(false, std::memory_order_release);
+	}
+
+	// called by the interposer, the skipped frames are this function and the
+	// interposer itself
+	__attribute__((noinline)) static void onThrow(void const* thrown,
+	                                              std::type_info const* type)
+	{
+		if(!getEnabled().load(std::memory_order_relaxed))
+			return;
+
+		Thread& thread = getThread();
+		if(thread.depth == EXCEPTIONPROFILER_MAX_NESTING)
+			return;
+		InFlight& inFlight = thread.inFlight[thread.depth++];
+		inFlight.thrown    = thrown;
+		inFlight.stack     = 0;
+		inFlight.weight    = getController().sample();
+		if(inFlight.weight == 0)
+			return;
+
+		uint64_t begin = SamplingController::begin();
+		void* buffer[MAX_BACKTRACE_LINES];
+		int nptrs = backtrace(buffer, MAX_BACKTRACE_LINES);
+		SelfMetrics::time(SELF_CAPTURE, begin);
+
+		// the type is interned as the innermost frame
+		buffer[1]      = const_cast<std::type_info*>(type);
+		inFlight.stack = getStacks().intern(buffer + 1, nptrs - 1);
+		getController().end(begin);
+
+		inFlight.start = threadTime();
+	}
+
+	/*! Called by the interposer with the object being caught, which ends the
+	 * measure of its throw. Rethrown exceptions, and those thrown while the
+	 * profiler was disabled or past the nesting limit, were never pushed and
+	 * are ignored.
+	 */
+	static void onCatch(void const* caught, uint64_t end)
+	{
+		if(!getEnabled().load(std::memory_order_relaxed))
+			return;
+
+		Thread& thread = getThread();
+		int depth      = thread.depth;
+		while(depth > 0 && thread.inFlight[depth - 1].thrown != caught)
+			--depth;
+		if(depth == 0)
+			return;
+		// exceptions above it were never caught here, std::terminate() is
+		// about to be called for them or they were lost by foreign code
+		thread.depth = depth - 1;
+
+		InFlight const& inFlight = thread.inFlight[depth - 1];
+		if(inFlight.stack == 0)
+			return;
+
+		uint64_t elapsed = end - inFlight.start;
+		Stats& stats     = getStats()[inFlight.stack - 1];
+		stats.count.fetch_add(inFlight.weight, std::memory_order_relaxed);
+		stats.ns.fetch_add(elapsed * inFlight.weight,
+		                   std::memory_order_relaxed);
+		uint64_t max = stats.maxNs.load(std::memory_order_relaxed);
+		while(elapsed > max
+		      && !stats.maxNs.compare_exchange_weak(max, elapsed))
+		{
+		}
+	}
+
+	// CPU time of the calling thread, in nanoseconds
+	static uint64_t threadTime()
+	{
+		timespec ts;
+		clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+		return static_cast<uint64_t>(ts.tv_sec) * 1000000000ull + ts.tv_nsec;
+	}
+
+	/*! Returns the throw sites, the costliest in total first.
+	 */
+	static std::vector<ThrowSite> getSites()
+	{
+		std::vector<ThrowSite> sites;
+		Stacks& stacks = getStacks();
+
+		for(uint32_t id = 1; id <= stacks.size(); ++id)
+		{
+			void* const* frames = NULL;
+			Stats const& stats = getStats()[id - 1];
+			if(stacks.getFrames(id, &frames) == 0
+			   || stats.count.load(std::memory_order_relaxed) == 0)
+				continue;
+
+			ThrowSite site;
+			site.stack   = id;
+			site.type    = static_cast<std::type_info const*>(frames[0]);
+			site.count   = stats.count.load(std::memory_order_relaxed);
+			site.totalNs = stats.ns.load(std::memory_order_relaxed);
+			site.maxNs   = stats.maxNs.load(std::memory_order_relaxed);
+			sites.push_back(site);
+		}
+
+		std::sort(sites.begin(), sites.end(), costlier);
+		return sites;
+	}
+
+	/*! Returns the frames of a throw site, innermost first, without its type.
+	 */
+	static int getFrames(ThrowSite const& site, void* const** frames)
+	{
+		int nptrs = getStacks().getFrames(site.stack, frames);
+		++*frames;
+		return nptrs - 1;
+	}
+
+	/*! Returns the demangled name of an exception type.
+	 */
+	static std::string getTypeName(std::type_info const* type)
+	{
+		int status;
+		char* demangled
+		    = abi::__cxa_demangle(type->name(), NULL, NULL, &status);
+		std::string name(status == 0 ? demangled : type->name());
+		free(demangled);
+		return name;
+	}
+
+	/*! Writes the throw sites as a folded profile weighted by the nanoseconds
+	 * spent unwinding, the innermost frame being the exception type.
+	 */
+	static void writeFolded(std::ostream& out)
+	{
+		FoldedWriter writer(out);
+		std::vector<ThrowSite> sites = getSites();
+
+		for(size_t i = 0; i < sites.size(); ++i)
+		{
+			void* const* frames = NULL;
+			int nptrs           = getFrames(sites[i], &frames);
+			writer.write(frames, nptrs, getTypeName(sites[i].type).c_str(),
+			             sites[i].totalNs);
+		}
+	}
+
+	static Stacks& getStacks()
+	{
+		static Stacks _stacks;
+		return _stacks;
+	}
+
+	static SamplingController& getController()
+	{
+		static SamplingController _controller;
+		return _controller;
+	}
+
+  private:
+	struct Stats
+	{
+		std::atomic<uint64_t> count;
+		std::atomic<uint64_t> ns;
+		std::atomic<uint64_t> maxNs;
+	};
+
+	struct InFlight
+	{
+		// thrown object, as given to __cxa_throw()
+		void const* thrown;
+		uint32_t stack;
+		uint32_t weight;
+		uint64_t start;
+	};
+
+	struct Thread
+	{
+		InFlight inFlight[EXCEPTIONPROFILER_MAX_NESTING];
+		int depth;
+	};
+
+	static Stats* getStats()
+	{
+		static Stats _stats[EXCEPTIONPROFILER_MAX_STACKS];
+		return _stats;
+	}
+
+	static std::atomic<bool>& getEnabled()
+	{
+		static std::atomic<bool> _enabled;
+		return _enabled;
+	}
+
+	static Thread& getThread()
+	{
+		static __thread Thread _thread;
+		return _thread;
+	}
+
+	static bool costlier(ThrowSite const& a, ThrowSite const& b)
+	{
+		return a.totalNs > b.totalNs;
+	}
+};
+
+/*! \ingroup exceptions
+ * Prints the top throw sites by CPU time spent unwinding, with their stacks.
+ */
+inline void print_exception_report(size_t top = 10)
+{
+	std::vector<ThrowSite> sites = ExceptionProfiler::getSites();
+
+	uint64_t count = 0, totalNs = 0;
+	for(size_t i = 0; i < sites.size(); ++i)
+	{
+		count += sites[i].count;
+		totalNs += sites[i].totalNs;
+	}
+
+	ReportBuilder report;
+	report << count << " exceptions caught from " << sites.size()
+	       << " throw sites, " << totalNs / 1000 << "us unwinding, "
+	       << ExceptionProfiler::getStacks().dropped() << " stacks dropped\n";
+
+	for(size_t i = 0; i < sites.size() && i < top; ++i)
+	{
+		report << sites[i].count << " "
+		       << ExceptionProfiler::getTypeName(sites[i].type) << " thrown, "
+		       << sites[i].totalNs / 1000 << "us unwinding (average "
+		       << sites[i].totalNs / sites[i].count << "ns, max "
+		       << sites[i].maxNs << "ns) at:\n";
+
+		void* const* frames = NULL;
+		int nptrs = ExceptionProfiler::getFrames(sites[i], &frames);
+		append_frames(report, frames, nptrs);
+	}
+	report.emit();
+}
+
+#ifdef EXCEPTIONPROFILER_IMPLEMENTATION
+
+#include <dlfcn.h>
+#include <unwind.h>
+
+// the interposers are given their C++ runtime name through an asm label so
+// that they don't clash with the declarations of <cxxabi.h>
+extern "C" void exceptionprofiler_throw(void* thrown, std::type_info* type,
+                                        void (*destructor)(void*))
+    __asm__("__cxa_throw") __attribute__((noreturn));
+extern "C" void* exceptionprofiler_begin_catch(void* exception) throw()
+    __asm__("__cxa_begin_catch");
+
+void exceptionprofiler_throw(void* thrown, std::type_info* type,
+                             void (*destructor)(void*))
+{
+	typedef void (*Throw)(void*, std::type_info*, void (*)(void*));
+	static Throw real_throw
+	    = reinterpret_cast<Throw>(dlsym(RTLD_NEXT, "__cxa_throw"));
+
+	ExceptionProfiler::onThrow(thrown, type);
+	real_throw(thrown, type, destructor);
+	__builtin_unreachable();
+}
+
+void* exceptionprofiler_begin_catch(void* exception) throw()
+{
+	typedef void* (*BeginCatch)(void*);
+	static BeginCatch real_begin_catch = reinterpret_cast<BeginCatch>(
+	    dlsym(RTLD_NEXT, "__cxa_begin_catch"));
+
+	// the thrown object follows the unwinder's header of the exception
+	uint64_t end = ExceptionProfiler::threadTime();
+	void* caught = real_begin_catch(exception);
+	ExceptionProfiler::onCatch(static_cast<_Unwind_Exception*>(exception) + 1,
+	                           end);
+	return caught;
+}
+
+#endif
+
+#endif
@@ -0,0 +1,456 @@
+/*
+    Copyright (C) 2017 Florian Cabot
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#ifndef STACKTRACE_FDTRACKER
+#define STACKTRACE_FDTRACKER
+
+#include "../Cpp-stacktrace.hpp"
+#include "StackTable.hpp"
+#include <algorithm>
+#include <map>
+#include <vector>
+
+#ifndef FDTRACKER_MAX_FDS
+#define FDTRACKER_MAX_FDS 65536
+#endif
+
+/*! \ingroup exceptions
+ * File descriptors opened at the same place, see FdTracker::getGroups().
+ */
+struct FdGroup
+{
+	uint32_t stack;
+	std::vector<int> fds;
+};
+
+/*! \ingroup exceptions
+ * Records the stack that opened each file descriptor, to find fd leaks.
+ *
+ * The tracker keeps one interned stack id per file descriptor in a flat array
+ * indexed by the descriptor itself, so recording an open costs one stack
+ * capture and one store, and recording a close a single store.
+ *
+ * Recording only happens through the interposed open(), openat(), creat(),
+ * socket(), socketpair(), accept(), accept4(), pipe(), pipe2(), dup(), dup2(),
+ * dup3() and close() functions. They are defined in the translation unit that
+ * defines FDTRACKER_IMPLEMENTATION before including this header; exactly one
+ * translation unit of the program must do so. Descriptors created inside libc
+ * (fopen() for example) or through fcntl(F_DUPFD) are not seen.
+ *
+ * Descriptors above FDTRACKER_MAX_FDS are counted but not attributed.
+ */
+class FdTracker
+{
+  public:
+	typedef StackTable<4096, 4096 * 16> Stacks;
+
+	/*! Starts recording.
+	 *
+	 * Descriptors opened before this call are not attributed.
+	 */
+	static void enable()
+	{
+		// the first backtrace() loads the unwinder, which opens files
+		void* buffer[1];
+		backtrace(buffer, 1);
+		getEnabled().store(true, std::memory_order_release);
+	}
+
+	static void disable()
+	{
+		getEnabled().store(false, std::memory_order_release);
+	}
+
+	// called by the interposers, the skipped frames are this function and the
+	// interposer itself
+	__attribute__((noinline)) static void onOpen(int fd)
+	{
+		if(fd < 0 || !getEnabled().load(std::memory_order_relaxed))
+			return;
+
+		if(fd >= FDTRACKER_MAX_FDS)
+		{
+			getUntracked().fetch_add(1, std::memory_order_relaxed);
+			return;
+		}
+
+		// backtrace() may open files itself
+		int& guard = getReentrancyGuard();
+		if(guard != 0)
+			return;
+		guard = 1;
+
+		void* buffer[MAX_BACKTRACE_LINES];
+		uint64_t start = SelfMetrics::now();
+		int nptrs      = backtrace(buffer, MAX_BACKTRACE_LINES);
+		SelfMetrics::time(SELF_CAPTURE, start);
+
+		guard = 0;
+
+		uint32_t id = getStacks().intern(buffer + 2, nptrs - 2);
+		__atomic_store_n(getFdStacks() + fd, id, __ATOMIC_RELAXED);
+	}
+
+	static void onClose(int fd)
+	{
+		if(fd >= 0 && fd < FDTRACKER_MAX_FDS)
+			__atomic_store_n(getFdStacks() + fd, 0, __ATOMIC_RELAXED);
+	}
+
+	/*! Returns the id of the stack that opened fd, 0 if unknown.
+	 */
+	static uint32_t getOpenStack(int fd)
+	{
+		if(fd < 0 || fd >= FDTRACKER_MAX_FDS)
+			return 0;
+		return __atomic_load_n(getFdStacks() + fd, __ATOMIC_RELAXED);
+	}
+
+	/*! Returns the currently open descriptors grouped by opening stack, the
+	 * largest groups first.
+	 */
+	static std::vector<FdGroup> getGroups()
+	{
+		std::map<uint32_t, size_t> indices;
+		std::vector<FdGroup> groups;
+
+		for(int fd = 0; fd < FDTRACKER_MAX_FDS; ++fd)
+		{
+			uint32_t id = getOpenStack(fd);
+			if(id == 0)
+				continue;
+
+			std::map<uint32_t, size_t>::iterator it = indices.find(id);
+			if(it == indices.end())
+			{
+				it = indices.insert(std::make_pair(id, groups.size())).first;
+				groups.push_back(FdGroup());
+				groups.back().stack = id;
+			}
+			groups[it->second].fds.push_back(fd);
+		}
+
+		std::stable_sort(groups.begin(), groups.end(), biggerGroup);
+		return groups;
+	}
+
+	static Stacks& getStacks()
+	{
+		static Stacks _stacks;
+		return _stacks;
+	}
+
+	/*! Number of opens that could not be attributed to a stack because the
+	 * descriptor was above FDTRACKER_MAX_FDS.
+	 */
+	static uint32_t getUntrackedCount()
+	{
+		return getUntracked().load(std::memory_order_relaxed);
+	}
+
+  private:
+	static std::atomic<bool>& getEnabled()
+	{
+		static std::atomic<bool> _enabled;
+		return _enabled;
+	}
+
+	static std::atomic<uint32_t>& getUntracked()
+	{
+		static std::atomic<uint32_t> _untracked;
+		return _untracked;
+	}
+
+	static uint32_t* getFdStacks()
+	{
+		static uint32_t _fdStacks[FDTRACKER_MAX_FDS];
+		return _fdStacks;
+	}
+
+	static int& getReentrancyGuard()
+	{
+		static __thread int _guard;
+		return _guard;
+	}
+
+	static bool biggerGroup(FdGroup const& a, FdGroup const& b)
+	{
+		return a.fds.size() > b.fds.size();
+	}
+};
+
+/*! \ingroup exceptions
+ * Prints the open file descriptors grouped by the stack that opened them.
+ */
+inline void print_fd_report()
+{
+	std::vector<FdGroup> groups = FdTracker::getGroups();
+
+	size_t total = 0;
+	for(size_t i = 0; i < groups.size(); ++i)
+		total += groups[i].fds.size();
+
+	ReportBuilder report;
+	report << total << " tracked file descriptors open, "
+	       << FdTracker::getStacks().dropped() << " stacks dropped, "
+	       << FdTracker::getUntrackedCount() << " untracked\n";
+
+	for(size_t i = 0; i < groups.size(); ++i)
+	{
+		report << groups[i].fds.size() << " opened at (fd";
+		for(size_t j = 0; j < groups[i].fds.size() && j < 8; ++j)
+			report << " " << groups[i].fds[j];
+		if(groups[i].fds.size() > 8)
+			report << " ...";
+		report << "):\n";
+
+		void* const* frames;
+		int nptrs = FdTracker::getStacks().getFrames(groups[i].stack, &frames);
+		append_frames(report, frames, nptrs);
+	}
+	report.emit();
+}
+
+#ifdef FDTRACKER_IMPLEMENTATION
+
+#include <dlfcn.h>
+#include <fcntl.h>
+#include <stdarg.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+// the interposers are given their libc name through an asm label so that they
+// don't clash with the declarations (and fortified inline wrappers) of libc
+#define FDTRACKER_REAL(name)               \
+	static decltype(&::name) real_##name = \
+	    reinterpret_cast<decltype(&::name)>(dlsym(RTLD_NEXT, #name))
+
+static inline bool fdtracker_has_mode(int flags)
+{
+#ifdef O_TMPFILE
+	if((flags & O_TMPFILE) == O_TMPFILE)
+		return true;
+#endif
+	return (flags & O_CREAT) != 0;
+}
+
+extern "C" int fdtracker_open(char const* path, int flags, ...)
+    __asm__("open");
+extern "C" int fdtracker_open64(char const* path, int flags, ...)
+    __asm__("open64");
+extern "C" int fdtracker_openat(int dirfd, char const* path, int flags, ...)
+    __asm__("openat");
+extern "C" int fdtracker_openat64(int dirfd, char const* path, int flags, ...)
+    __asm__("openat64");
+extern "C" int fdtracker_creat(char const* path, mode_t mode)
+    __asm__("creat");
+extern "C" int fdtracker_creat64(char const* path, mode_t mode)
+    __asm__("creat64");
+extern "C" int fdtracker_socket(int domain, int type, int protocol)
+    __asm__("socket");
+extern "C" int fdtracker_socketpair(int domain, int type, int protocol,
+                                    int sv[2]) __asm__("socketpair");
+extern "C" int fdtracker_accept(int sockfd, sockaddr* addr, socklen_t* len)
+    __asm__("accept");
+extern "C" int fdtracker_accept4(int sockfd, sockaddr* addr, socklen_t* len,
+                                 int flags) __asm__("accept4");
+extern "C" int fdtracker_pipe(int fds[2]) __asm__("pipe");
+extern "C" int fdtracker_pipe2(int fds[2], int flags) __asm__("pipe2");
+extern "C" int fdtracker_dup(int oldfd) __asm__("dup");
+extern "C" int fdtracker_dup2(int oldfd, int newfd) __asm__("dup2");
+extern "C" int fdtracker_dup3(int oldfd, int newfd, int flags)
+    __asm__("dup3");
+extern "C" int fdtracker_close(int fd) __asm__("close");
+
+int fdtracker_open(char const* path, int flags, ...)
+{
+	FDTRACKER_REAL(open);
+	mode_t mode = 0;
+	if(fdtracker_has_mode(flags))
+	{
+		va_list args;
+		va_start(args, flags);
+		mode = va_arg(args, mode_t);
+		va_end(args);
+	}
+	int fd = real_open(path, flags, mode);
+	FdTracker::onOpen(fd);
+	return fd;
+}
+
+int fdtracker_open64(char const* path, int flags, ...)
+{
+	FDTRACKER_REAL(open64);
+	mode_t mode = 0;
+	if(fdtracker_has_mode(flags))
+	{
+		va_list args;
+		va_start(args, flags);
+		mode = va_arg(args, mode_t);
+		va_end(args);
+	}
+	int fd = real_open64(path, flags, mode);
+	FdTracker::onOpen(fd);
+	return fd;
+}
+
+int fdtracker_openat(int dirfd, char const* path, int flags, ...)
+{
+	FDTRACKER_REAL(openat);
+	mode_t mode = 0;
+	if(fdtracker_has_mode(flags))
+	{
+		va_list args;
+		va_start(args, flags);
+		mode = va_arg(args, mode_t);
+		va_end(args);
+	}
+	int fd = real_openat(dirfd, path, flags, mode);
+	FdTracker::onOpen(fd);
+	return fd;
+}
+
+int fdtracker_openat64(int dirfd, char const* path, int flags, ...)
+{
+	FDTRACKER_REAL(openat64);
+	mode_t mode = 0;
+	if(fdtracker_has_mode(flags))
+	{
+		va_list args;
+		va_start(args, flags);
+		mode = va_arg(args, mode_t);
+		va_end(args);
+	}
+	int fd = real_openat64(dirfd, path, flags, mode);
+	FdTracker::onOpen(fd);
+	return fd;
+}
+
+int fdtracker_creat(char const* path, mode_t mode)
+{
+	FDTRACKER_REAL(creat);
+	int fd = real_creat(path, mode);
+	FdTracker::onOpen(fd);
+	return fd;
+}
+
+int fdtracker_creat64(char const* path, mode_t mode)
+{
+	FDTRACKER_REAL(creat64);
+	int fd = real_creat64(path, mode);
+	FdTracker::onOpen(fd);
+	return fd;
+}
+
+int fdtracker_socket(int domain, int type, int protocol)
+{
+	FDTRACKER_REAL(socket);
+	int fd = real_socket(domain, type, protocol);
+	FdTracker::onOpen(fd);
+	return fd;
+}
+
+int fdtracker_socketpair(int domain, int type, int protocol, int sv[2])
+{
+	FDTRACKER_REAL(socketpair);
+	int result = real_socketpair(domain, type, protocol, sv);
+	if(result == 0)
+	{
+		FdTracker::onOpen(sv[0]);
+		FdTracker::onOpen(sv[1]);
+	}
+	return result;
+}
+
+int fdtracker_accept(int sockfd, sockaddr* addr, socklen_t* len)
+{
+	FDTRACKER_REAL(accept);
+	int fd = real_accept(sockfd, addr, len);
+	FdTracker::onOpen(fd);
+	return fd;
+}
+
+int fdtracker_accept4(int sockfd, sockaddr* addr, socklen_t* len, int flags)
+{
+	FDTRACKER_REAL(accept4);
+	int fd = real_accept4(sockfd, addr, len, flags);
+	FdTracker::onOpen(fd);
+	return fd;
+}
+
+int fdtracker_pipe(int fds[2])
+{
+	FDTRACKER_REAL(pipe);
+	int result = real_pipe(fds);
+	if(result == 0)
+	{
+		FdTracker::onOpen(fds[0]);
+		FdTracker::onOpen(fds[1]);
+	}
+	return result;
+}
+
+int fdtracker_pipe2(int fds[2], int flags)
+{
+	FDTRACKER_REAL(pipe2);
+	int result = real_pipe2(fds, flags);
+	if(result == 0)
+	{
+		FdTracker::onOpen(fds[0]);
+		FdTracker::onOpen(fds[1]);
+	}
+	return result;
+}
+
+int fdtracker_dup(int oldfd)
+{
+	FDTRACKER_REAL(dup);
+	int fd = real_dup(oldfd);
+	FdTracker::onOpen(fd);
+	return fd;
+}
+
+int fdtracker_dup2(int oldfd, int newfd)
+{
+	FDTRACKER_REAL(dup2);
+	int fd = real_dup2(oldfd, newfd);
+	if(fd != oldfd)
+		FdTracker::onOpen(fd);
+	return fd;
+}
+
+int fdtracker_dup3(int oldfd, int newfd, int flags)
+{
+	FDTRACKER_REAL(dup3);
+	int fd = real_dup3(oldfd, newfd, flags);
+	FdTracker::onOpen(fd);
+	return fd;
+}
+
+int fdtracker_close(int fd)
+{
+	FDTRACKER_REAL(close);
+	// forget the stack first: once closed, another thread may get the same
+	// descriptor back from an open
+	FdTracker::onClose(fd);
+	return real_close(fd);
+}
+
+#endif
+
+#endif
@@ -0,0 +1,535 @@
+/*
+    Copyright (C) 2017 Florian Cabot
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#ifndef STACKTRACE_FLAMEGRAPH
+#define STACKTRACE_FLAMEGRAPH
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <istream>
+#include <ostream>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+#include "StringPool.hpp"
+
+/*! \ingroup exceptions
+ * Appearance of a FlameGraph.
+ */
+struct FlameGraphOptions
+{
+	FlameGraphOptions()
+	    : title("Flame Graph")
+	    , width(1200)
+	    , frameHeight(16)
+	    , fontSize(12)
+	    , minWidth(0.1)
+	{
+	}
+
+	char const* title;
+	// in pixels
+	int width;
+	int frameHeight;
+	int fontSize;
+	// frames narrower than this many pixels are left out
+	double minWidth;
+};
+
+/*! \ingroup exceptions
+ * Renders folded stacks (see FoldedWriter) as an SVG flame graph.
+ *
+ * Stacks are merged into a tree of frames as they are read, so memory depends
+ * on the number of distinct paths, not on the number of lines or samples. The
+ * SVG is written while walking the tree, one element per frame, with frames too
+ * narrow to be seen left out. Clicking a frame zooms on it, and a search
+ * highlights the frames matching a regular expression.
+ *
+ * Stacks added as the baseline make it a differential flame graph: widths are
+ * those of the other profile, and frames are colored red when they take a
+ * larger share of it than of the baseline, blue when smaller.
+ */
+class FlameGraph
+{
+  public:
+	FlameGraph()
+	    : edgeCount(0)
+	    , differential(false)
+	{
+		Node root = {names.intern("all"), 0, 0, 0, 0};
+		nodes.push_back(root);
+	}
+
+	/*! Adds a line of folded stacks, "frame;frame;frame value".
+	 *
+	 * Returns false if the line isn't made of frames and a value.
+	 */
+	bool addFolded(char const* line, size_t length, bool baseline = false)
+	{
+		while(length > 0
+		      && (line[length - 1] == '\n' || line[length - 1] == '\r'))
+			--length;
+
+		char const* space = NULL;
+		for(size_t i = length; i > 0; --i)
+		{
+			if(line[i - 1] == ' ')
+			{
+				space = line + i - 1;
+				break;
+			}
+		}
+		if(space == NULL || space == line || space + 1 == line + length)
+			return false;
+
+		// fractions are dropped
+		uint64_t value = 0;
+		for(char const* c = space + 1; c < line + length && *c != '.'; ++c)
+		{
+			if(*c < '0' || *c > '9')
+				return false;
+			value = value * 10 + (*c - '0');
+		}
+
+		add(line, space, value, baseline);
+		return true;
+	}
+
+	/*! Adds the folded stacks of a stream, returns the number of lines that
+	 * couldn't be read.
+	 */
+	size_t readFolded(std::istream& in, bool baseline = false)
+	{
+		size_t skipped = 0;
+		std::string line;
+		while(std::getline(in, line))
+		{
+			if(!line.empty() && !addFolded(line.data(), line.size(), baseline))
+				++skipped;
+		}
+		return skipped;
+	}
+
+	uint64_t getTotal() const { return nodes[0].value; }
+
+	/*! Writes the flame graph as a standalone SVG document.
+	 */
+	void writeSvg(std::ostream& out,
+	              FlameGraphOptions const& options = FlameGraphOptions()) const
+	{
+		int depth       = getDepth(0, 0, options);
+		double frames   = options.width - 2 * PADDING;
+		int top         = 3 * options.fontSize + 2 * PADDING;
+		int height      = top + (depth + 1) * options.frameHeight + PADDING;
+		double maxDelta = differential ? getMaxDelta() : 0;
+
+		char buffer[512];
+		snprintf(buffer, sizeof(buffer),
+		         "<?xml version=\"1.0\" standalone=\"no\"?>\n"
+		         "<svg version=\"1.1\" width=\"%d\" height=\"%d\" "
+		         "onload=\"init(evt)\" viewBox=\"0 0 %d %d\" "
+		         "xmlns=\"http://www.w3.org/2000/svg\">\n",
+		         options.width, height, options.width, height);
+		out << buffer;
+		writeScript(out, options, frames);
+
+		snprintf(buffer, sizeof(buffer),
+		         "<rect width=\"100%%\" height=\"100%%\" fill=\"#eeeeee\"/>\n"
+		         "<text x=\"%d\" y=\"%d\" text-anchor=\"middle\" "
+		         "font-size=\"%d\">",
+		         options.width / 2, options.fontSize + PADDING,
+		         options.fontSize + 5);
+		out << buffer;
+		writeEscaped(out, options.title);
+		snprintf(buffer, sizeof(buffer),
+		         "</text>\n"
+		         "<text id=\"reset\" x=\"%d\" y=\"%d\" onclick=\"zoom(null)\" "
+		         "style=\"cursor:pointer\">Reset Zoom</text>\n"
+		         "<text x=\"%d\" y=\"%d\" text-anchor=\"end\" "
+		         "onclick=\"search()\" style=\"cursor:pointer\">Search</text>\n"
+		         "<text id=\"details\" x=\"%d\" y=\"%d\"> </text>\n",
+		         PADDING, 2 * options.fontSize + PADDING,
+		         options.width - PADDING, 2 * options.fontSize + PADDING,
+		         PADDING, height - PADDING / 2);
+		out << buffer;
+
+		// the root is at the bottom, children above their parent
+		if(getTotal() > 0)
+		{
+			out << "<g id=\"frames\">\n";
+			writeFrame(out, options, 0, PADDING, frames / getTotal(),
+			           height - PADDING - options.frameHeight, maxDelta);
+			out << "</g>\n";
+		}
+		out << "</svg>\n";
+	}
+
+  private:
+	static const int PADDING = 10;
+
+	// nodes are linked to their first child and their next sibling, 0 for
+	// none (the root is no one's child)
+	struct Node
+	{
+		uint32_t name;
+		uint32_t firstChild;
+		uint32_t nextSibling;
+		// in the profile and in the baseline
+		uint64_t value;
+		uint64_t baseValue;
+	};
+
+	struct Edge
+	{
+		// parent and name, 0 for a free slot
+		uint64_t key;
+		uint32_t child;
+	};
+
+	std::vector<Node> nodes;
+	StringPool names;
+	// open addressing hash table of the children by parent and name
+	std::vector<Edge> edges;
+	size_t edgeCount;
+	bool differential;
+
+	void add(char const* stack, char const* end, uint64_t value, bool baseline)
+	{
+		differential = differential || baseline;
+		uint32_t node = 0;
+		addValue(node, value, baseline);
+
+		for(char const* frame = stack; frame < end;)
+		{
+			char const* next = std::find(frame, end, ';');
+			if(next != frame)
+			{
+				node = getChild(node, names.intern(frame, next - frame));
+				addValue(node, value, baseline);
+			}
+			frame = next + 1;
+		}
+	}
+
+	void addValue(uint32_t node, uint64_t value, bool baseline)
+	{
+		if(baseline)
+			nodes[node].baseValue += value;
+		else
+			nodes[node].value += value;
+	}
+
+	uint32_t getChild(uint32_t parent, uint32_t name)
+	{
+		if(2 * (edgeCount + 1) > edges.size())
+			growEdges();
+
+		// names are never 0, the empty string
+		uint64_t key = (static_cast<uint64_t>(parent) << 32) | name;
+		size_t mask  = edges.size() - 1;
+		for(size_t slot = hashOf(key) & mask;; slot = (slot + 1) & mask)
+		{
+			if(edges[slot].key == key)
+				return edges[slot].child;
+			if(edges[slot].key != 0)
+				continue;
+
+			uint32_t id = static_cast<uint32_t>(nodes.size());
+			Node node   = {name, 0, nodes[parent].firstChild, 0, 0};
+			nodes.push_back(node);
+			nodes[parent].firstChild = id;
+			edges[slot].key          = key;
+			edges[slot].child        = id;
+			++edgeCount;
+			return id;
+		}
+	}
+
+	void growEdges()
+	{
+		std::vector<Edge> old;
+		old.swap(edges);
+		Edge free = {0, 0};
+		edges.resize(old.empty() ? 1024 : 2 * old.size(), free);
+
+		size_t mask = edges.size() - 1;
+		for(size_t i = 0; i < old.size(); ++i)
+		{
+			if(old[i].key == 0)
+				continue;
+			size_t slot = hashOf(old[i].key) & mask;
+			while(edges[slot].key != 0)
+				slot = (slot + 1) & mask;
+			edges[slot] = old[i];
+		}
+	}
+
+	static size_t hashOf(uint64_t key)
+	{
+		key ^= key >> 33;
+		key *= 0xff51afd7ed558ccdULL;
+		key ^= key >> 33;
+		return static_cast<size_t>(key);
+	}
+
+	bool visible(uint32_t node, FlameGraphOptions const& options) const
+	{
+		return getTotal() > 0
+		       && static_cast<double>(nodes[node].value) / getTotal()
+		                  * (options.width - 2 * PADDING)
+		              >= options.minWidth;
+	}
+
+	int getDepth(uint32_t node, int depth,
+	             FlameGraphOptions const& options) const
+	{
+		int deepest = depth;
+		for(uint32_t child = nodes[node].firstChild; child != 0;
+		    child = nodes[child].nextSibling)
+		{
+			if(visible(child, options))
+			{
+				deepest
+				    = std::max(deepest, getDepth(child, depth + 1, options));
+			}
+		}
+		return deepest;
+	}
+
+	// change of the share of a node between the baseline and the profile
+	double getDelta(uint32_t node) const
+	{
+		double share = getTotal() > 0
+		                   ? static_cast<double>(nodes[node].value) / getTotal()
+		                   : 0;
+		uint64_t baseTotal = nodes[0].baseValue;
+		double baseShare
+		    = baseTotal > 0
+		          ? static_cast<double>(nodes[node].baseValue) / baseTotal
+		          : 0;
+		return share - baseShare;
+	}
+
+	double getMaxDelta() const
+	{
+		double maxDelta = 0;
+		for(uint32_t i = 0; i < nodes.size(); ++i)
+			maxDelta = std::max(maxDelta, std::fabs(getDelta(i)));
+		return maxDelta;
+	}
+
+	bool nameBefore(uint32_t a, uint32_t b) const
+	{
+		return strcmp(names.get(nodes[a].name), names.get(nodes[b].name)) < 0;
+	}
+
+	struct NameOrder
+	{
+		FlameGraph const* graph;
+		bool operator()(uint32_t a, uint32_t b) const
+		{
+			return graph->nameBefore(a, b);
+		}
+	};
+
+	void writeFrame(std::ostream& out, FlameGraphOptions const& options,
+	                uint32_t node, double x, double scale, int y,
+	                double maxDelta) const
+	{
+		Node const& frame = nodes[node];
+		std::string name  = names.get(frame.name);
+		double width            = frame.value * scale;
+
+		char buffer[256];
+		out << "<g><title>";
+		writeEscaped(out, name);
+		snprintf(buffer, sizeof(buffer), " (%llu samples, %.2f%%",
+		         static_cast<unsigned long long>(frame.value),
+		         100.0 * frame.value / getTotal());
+		out << buffer;
+		if(differential)
+		{
+			snprintf(buffer, sizeof(buffer), ", %+.2f%%", 100 * getDelta(node));
+			out << buffer;
+		}
+		out << ")</title>";
+
+		snprintf(buffer, sizeof(buffer),
+		         "<rect x=\"%.1f\" y=\"%d\" width=\"%.1f\" height=\"%d\" "
+		         "fill=\"%s\" rx=\"2\"/>",
+		         x, y, width, options.frameHeight - 1,
+		         getColor(node, maxDelta).c_str());
+		out << buffer;
+
+		// about 0.6 font size per character
+		size_t fits = static_cast<size_t>(width / (0.6 * options.fontSize));
+		snprintf(buffer, sizeof(buffer), "<text x=\"%.1f\" y=\"%d\">", x + 3,
+		         y + options.frameHeight - 4);
+		out << buffer;
+		if(fits >= 3)
+		{
+			if(name.size() <= fits)
+				writeEscaped(out, name);
+			else
+			{
+				writeEscaped(out, name.substr(0, fits - 2));
+				out << "..";
+			}
+		}
+		out << "</text></g>\n";
+
+		std::vector<uint32_t> children;
+		for(uint32_t child = frame.firstChild; child != 0;
+		    child = nodes[child].nextSibling)
+			children.push_back(child);
+		NameOrder order = {this};
+		std::sort(children.begin(), children.end(), order);
+		for(size_t i = 0; i < children.size(); ++i)
+		{
+			if(visible(children[i], options))
+				writeFrame(out, options, children[i], x, scale,
+				           y - options.frameHeight, maxDelta);
+			x += nodes[children[i]].value * scale;
+		}
+	}
+
+	std::string getColor(uint32_t node, double maxDelta) const
+	{
+		int red, green, blue;
+		if(differential)
+		{
+			// white when unchanged, saturating at the largest change
+			double delta  = maxDelta > 0 ? getDelta(node) / maxDelta : 0;
+			int intensity = static_cast<int>(255 * (1 - std::fabs(delta)));
+			red           = delta < 0 ? intensity : 255;
+			blue          = delta > 0 ? intensity : 255;
+			green         = intensity;
+		}
+		else
+		{
+			// the same name always gets the same warm color
+			uint32_t hash = 2166136261u;
+			for(char const* c = names.get(nodes[node].name); *c != '\0'; ++c)
+				hash = (hash ^ static_cast<unsigned char>(*c)) * 16777619u;
+			red   = 205 + static_cast<int>(hash % 51);
+			green = static_cast<int>((hash >> 8) % 231);
+			blue  = static_cast<int>((hash >> 16) % 56);
+		}
+
+		char color[32];
+		snprintf(color, sizeof(color), "rgb(%d,%d,%d)", red, green, blue);
+		return color;
+	}
+
+	static void writeEscaped(std::ostream& out, std::string const& text)
+	{
+		for(size_t i = 0; i < text.size(); ++i)
+		{
+			switch(text[i])
+			{
+				case '<':
+					out << "&lt;";
+					break;
+				case '>':
+					out << "&gt;";
+					break;
+				case '&':
+					out << "&amp;";
+					break;
+				case '"':
+					out << "&quot;";
+					break;
+				default:
+					out << text[i];
+			}
+		}
+	}
+
+	// zooming rescales the frames above the clicked one to the whole width,
+	// and fades the others; the search colors the matching frames
+	static void writeScript(std::ostream& out, FlameGraphOptions const& options,
+	                        double frames)
+	{
+		char buffer[128];
+		snprintf(buffer, sizeof(buffer),
+		         "<script type=\"text/ecmascript\"><![CDATA[\n"
+		         "var pad = %d, width = %.1f, font = %d;\n",
+		         PADDING, frames, options.fontSize);
+		out << buffer;
+		out << "var details, groups;\n"
+		       "function init(evt) {\n"
+		       "  details = document.getElementById('details').firstChild;\n"
+		       "  groups = document.querySelectorAll('#frames g');\n"
+		       "  for(var i = 0; i < groups.length; ++i) {\n"
+		       "    var g = groups[i], r = g.querySelector('rect'),\n"
+		       "        t = g.querySelector('text');\n"
+		       "    g.x = +r.getAttribute('x');\n"
+		       "    g.w = +r.getAttribute('width');\n"
+		       "    g.y = +r.getAttribute('y'); g.name = t.textContent;\n"
+		       "    g.full = g.querySelector('title').textContent;\n"
+		       "    g.fill = r.getAttribute('fill');\n"
+		       "    g.onclick = function() { zoom(this); };\n"
+		       "    g.onmouseover = function() {\n"
+		       "      details.nodeValue = this.full;\n"
+		       "    };\n"
+		       "    g.onmouseout = function() { details.nodeValue = ' '; };\n"
+		       "  }\n"
+		       "}\n"
+		       "function label(g, w) {\n"
+		       "  var name = g.full.replace(/ \\([^(]*\\)$/, ''),\n"
+		       "      fits = Math.floor(w / (0.6 * font));\n"
+		       "  return fits < 3 ? '' : name.length <= fits ? name\n"
+		       "         : name.substring(0, fits - 2) + '..';\n"
+		       "}\n"
+		       "function zoom(target) {\n"
+		       "  var x = target ? target.x : pad, w = target ? target.w : "
+		       "width;\n"
+		       "  var scale = width / w;\n"
+		       "  for(var i = 0; i < groups.length; ++i) {\n"
+		       "    var g = groups[i], r = g.querySelector('rect'),\n"
+		       "        t = g.querySelector('text');\n"
+		       "    var inside = g.x + g.w > x + 0.01 && g.x < x + w - 0.01;\n"
+		       "    var below = target && g.y > target.y;\n"
+		       "    if(!inside) { g.style.display = 'none'; continue; }\n"
+		       "    g.style.display = '';\n"
+		       "    var nx = below ? pad : pad + (g.x - x) * scale,\n"
+		       "        nw = below ? width : g.w * scale;\n"
+		       "    g.style.opacity = below ? 0.5 : 1;\n"
+		       "    r.setAttribute('x', nx); r.setAttribute('width', nw);\n"
+		       "    t.setAttribute('x', nx + 3);\n"
+		       "    t.textContent = label(g, nw);\n"
+		       "  }\n"
+		       "}\n"
+		       "function search() {\n"
+		       "  var term = prompt('Search (regular expression)', '');\n"
+		       "  var re = term ? new RegExp(term) : null;\n"
+		       "  for(var i = 0; i < groups.length; ++i) {\n"
+		       "    var g = groups[i], hit = re && re.test(g.full);\n"
+		       "    g.querySelector('rect').setAttribute('fill',\n"
+		       "        hit ? 'rgb(230,0,230)' : g.fill);\n"
+		       "  }\n"
+		       "}\n"
+		       "]]></script>\n";
+	}
+};
+
+#endif
@@ -0,0 +1,133 @@
+/*
+    Copyright (C) 2017 Florian Cabot
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#ifndef STACKTRACE_FOLDED
+#define STACKTRACE_FOLDED
+
+#include <cstdlib>
+#include <cstring>
+#include <cxxabi.h>
+#include <dlfcn.h>
+#include <map>
+#include <ostream>
+#include <sstream>
+#include <stdint.h>
+#include <string>
+
+/*! \ingroup exceptions
+ * Writes stacks in the folded format used by flame graph tools.
+ *
+ * Each stack is written on its own line as its frames from the outermost to the
+ * innermost separated by semicolons, followed by a space and the stack's value:
+ *
+ *     main;Server::run;Connection::read;read 1250
+ *
+ * Frames are named with dladdr(), so the program has to be linked with
+ * -rdynamic for its own functions to be named. Names are cached, so a writer
+ * should be reused for a whole profile.
+ */
+class FoldedWriter
+{
+  public:
+	explicit FoldedWriter(std::ostream& out)
+	    : out(out)
+	{
+	}
+
+	/*! Writes one stack.
+	 *
+	 * \param frames The frames, innermost first as returned by backtrace().
+	 * \param count Number of frames.
+	 * \param leaf Optional extra innermost frame name (a syscall name for
+	 * example), can be NULL.
+	 * \param value The value of the stack (samples, time...).
+	 */
+	void write(void* const* frames, int count, char const* leaf,
+	           uint64_t value)
+	{
+		bool first = true;
+		for(int i = count - 1; i >= 0; --i)
+		{
+			if(!first)
+				out << ';';
+			out << getName(frames[i]);
+			first = false;
+		}
+		if(leaf != NULL)
+			out << (first ? "" : ";") << leaf;
+		out << ' ' << value << '\n';
+	}
+
+	/*! Returns the name of the function containing addr, "module+0xoffset" if
+	 * it has no symbol.
+	 */
+	std::string const& getName(void const* addr)
+	{
+		std::map<void const*, std::string>::iterator it = names.find(addr);
+		if(it != names.end())
+			return it->second;
+
+		std::string name = frameName(addr);
+		return names.insert(std::make_pair(addr, name)).first->second;
+	}
+
+	static std::string frameName(void const* addr)
+	{
+		Dl_info info;
+		std::ostringstream oss;
+
+		if(dladdr(addr, &info) == 0 || info.dli_fname == NULL)
+		{
+			oss << addr;
+			return oss.str();
+		}
+
+		std::string name;
+		if(info.dli_sname != NULL)
+		{
+			int status;
+			char* demangled
+			    = abi::__cxa_demangle(info.dli_sname, NULL, NULL, &status);
+			name = status == 0 ? demangled : info.dli_sname;
+			free(demangled);
+		}
+		else
+		{
+			char const* module = strrchr(info.dli_fname, '/');
+			module             = module != NULL ? module + 1 : info.dli_fname;
+			oss << module << "+0x" << std::hex
+			    << (static_cast<char const*>(addr)
+			        - static_cast<char const*>(info.dli_fbase));
+			name = oss.str();
+		}
+
+		// ';' separates frames, it can't appear within a name
+		for(size_t i = 0; i < name.size(); ++i)
+		{
+			if(name[i] == ';')
+				name[i] = ',';
+		}
+		return name;
+	}
+
+  private:
+	std::ostream& out;
+	std::map<void const*, std::string> names;
+};
+
+#endif
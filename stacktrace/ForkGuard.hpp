@@ -0,0 +1,53 @@
+/*
+    Copyright (C) 2017 Florian Cabot
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#ifndef STACKTRACE_FORKGUARD
+#define STACKTRACE_FORKGUARD
+
+#include <pthread.h>
+
+/*! \ingroup exceptions
+ * Takes the mutex returned by getMutex around fork(), so that the child
+ * doesn't inherit it locked by a thread that doesn't exist there.
+ *
+ * What the mutex protects is then consistent in the child, and shared with
+ * the parent copy-on-write. Handlers are registered once per mutex, by
+ * install(), which must not be called from a signal handler.
+ */
+template <pthread_mutex_t& (*getMutex)()>
+class ForkGuard
+{
+  public:
+	static void install()
+	{
+		static pthread_once_t _once = PTHREAD_ONCE_INIT;
+		pthread_once(&_once, registerHandlers);
+	}
+
+  private:
+	static void registerHandlers()
+	{
+		pthread_atfork(lock, unlock, unlock);
+	}
+
+	static void lock() { pthread_mutex_lock(&getMutex()); }
+
+	static void unlock() { pthread_mutex_unlock(&getMutex()); }
+};
+
+#endif
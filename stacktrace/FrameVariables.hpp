@@ -0,0 +1,572 @@
+/*
+    Copyright (C) 2017 Florian Cabot
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#ifndef STACKTRACE_FRAMEVARIABLES
+#define STACKTRACE_FRAMEVARIABLES
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <pthread.h>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+#include "CfiUnwinder.hpp"
+#include "ForkGuard.hpp"
+#include "ModuleMap.hpp"
+#include "SelfMetrics.hpp"
+
+// frames unwound at most from a signal's context, looking for those with
+// debug information
+#ifndef FRAMEVARIABLES_MAX_UNWIND
+#define FRAMEVARIABLES_MAX_UNWIND 16
+#endif
+
+/*! \ingroup exceptions
+ * Parameters and local variables of the frames a signal interrupted, see
+ * set_frame_variables().
+ *
+ * The registers of the interrupted frame are those of the signal's context,
+ * the ones of its callers are unwound from them by CfiUnwinder. The variables
+ * in scope at the instruction of a frame are read from the compilation unit
+ * covering it (see DwarfModule::findVariables()), then their locations are
+ * evaluated against the frame's registers and memory. Scalars are printed
+ * with their value, pointers with the address they hold, and the other types
+ * with their own address.
+ *
+ * Unwinding only restores the registers a function saves: variables a caller
+ * keeps in other registers across a call are unavailable, which their
+ * location lists usually tell already.
+ *
+ * The module table is locked with a try, a crash while it is being updated
+ * prints no variables. Both functions stop at a deadline, the time
+ * (SelfMetrics::now()) left to the report, between frames and variables.
+ */
+class FrameVariables
+{
+  public:
+	/*! Unwinds up to max frames from a ucontext given to a signal handler,
+	 * the interrupted one first, returns their number.
+	 */
+	static int unwind(void const* ucontext, UnwindRegisters* frames, int max,
+	                  int64_t deadline)
+	{
+		if(max <= 0 || !CfiUnwinder::getRegisters(ucontext, &frames[0]))
+			return 0;
+		if(pthread_mutex_trylock(&getMutex()) != 0)
+			return 0;
+		ModuleMap& modules = getModules();
+		modules.update();
+
+		// the CFA of each frame is computed with its caller, the last one's
+		// is needed too
+		int count = 1;
+		for(int i = 0; i < count && !isPast(deadline); ++i)
+		{
+			UnwindRegisters caller;
+			ModuleMap::Module* module = modules.find(frames[i].lookupPc());
+			if(module != NULL
+			   && CfiUnwinder::step(module->ehFrameHdr, &frames[i], &caller)
+			   && count < max)
+				frames[count++] = caller;
+		}
+
+		pthread_mutex_unlock(&getMutex());
+		return count;
+	}
+
+	/*! Describes the variables of an unwound frame, one line each, such as
+	 * "int count = 3". Returns false if its function has no debug
+	 * information or the deadline has passed.
+	 */
+	static bool describe(UnwindRegisters const& frame,
+	                     std::vector<std::string>* lines, int64_t deadline)
+	{
+		if(isPast(deadline) || pthread_mutex_trylock(&getMutex()) != 0)
+			return false;
+
+		uintptr_t pc              = frame.lookupPc();
+		ModuleMap::Module* module = getModules().find(pc);
+		DwarfModule* dwarf
+		    = module != NULL ? getModules().getDwarf(*module) : NULL;
+		std::vector<DwarfVariable> variables;
+		DwarfExpression frameBase;
+		bool found = dwarf != NULL
+		             && dwarf->findVariables(pc - module->base, &variables,
+		                                     &frameBase);
+
+		for(size_t i = 0; i < variables.size() && !isPast(deadline); ++i)
+		{
+			// unnamed parameters can't be used by the function
+			if(variables[i].name == NULL)
+				continue;
+			lines->push_back(variables[i].type + " " + variables[i].name
+			                 + " = "
+			                 + describeValue(variables[i], frame, module->base,
+			                                 frameBase));
+		}
+
+		pthread_mutex_unlock(&getMutex());
+		return found;
+	}
+
+	/*! Keeps the module table usable in children of fork(), see ForkGuard.
+	 */
+	static void guardFork() { ForkGuard<getMutex>::install(); }
+
+  private:
+	static bool isPast(int64_t deadline)
+	{
+		return static_cast<int64_t>(SelfMetrics::now()) >= deadline;
+	}
+
+	enum Operation
+	{
+		OP_ADDR           = 0x03,
+		OP_DEREF          = 0x06,
+		OP_CONST1U        = 0x08,
+		OP_CONST1S        = 0x09,
+		OP_CONST2U        = 0x0a,
+		OP_CONST2S        = 0x0b,
+		OP_CONST4U        = 0x0c,
+		OP_CONST4S        = 0x0d,
+		OP_CONST8U        = 0x0e,
+		OP_CONST8S        = 0x0f,
+		OP_CONSTU         = 0x10,
+		OP_CONSTS         = 0x11,
+		OP_DUP            = 0x12,
+		OP_DROP           = 0x13,
+		OP_OVER           = 0x14,
+		OP_SWAP           = 0x16,
+		OP_AND            = 0x1a,
+		OP_MINUS          = 0x1c,
+		OP_MUL            = 0x1e,
+		OP_NEG            = 0x1f,
+		OP_NOT            = 0x20,
+		OP_OR             = 0x21,
+		OP_PLUS           = 0x22,
+		OP_PLUS_UCONST    = 0x23,
+		OP_SHL            = 0x24,
+		OP_SHR            = 0x25,
+		OP_SHRA           = 0x26,
+		OP_XOR            = 0x27,
+		OP_LIT0           = 0x30,
+		OP_LIT31          = 0x4f,
+		OP_REG0           = 0x50,
+		OP_REG31          = 0x6f,
+		OP_BREG0          = 0x70,
+		OP_BREG31         = 0x8f,
+		OP_REGX           = 0x90,
+		OP_FBREG          = 0x91,
+		OP_BREGX          = 0x92,
+		OP_PIECE          = 0x93,
+		OP_NOP            = 0x96,
+		OP_CALL_FRAME_CFA = 0x9c,
+		OP_IMPLICIT_VALUE = 0x9e,
+		OP_STACK_VALUE    = 0x9f
+	};
+
+	// result of a location expression
+	struct Location
+	{
+		enum
+		{
+			IN_MEMORY,
+			IN_REGISTER,
+			// the value itself, computed by the expression
+			VALUE
+		} kind;
+		// address, register number or value
+		uintptr_t value;
+	};
+
+	// evaluates a location expression, returns false if it uses what isn't
+	// supported or known (entry values, implicit pointers, composite
+	// locations, unknown registers)
+	static bool evaluate(DwarfExpression const& expression,
+	                     UnwindRegisters const& frame, uintptr_t base,
+	                     uintptr_t const* frameBase, uint64_t size,
+	                     Location* location)
+	{
+		uintptr_t stack[64];
+		int depth = 0;
+		// a register or a value ends the expression, but for a piece
+		bool complete = false;
+
+		DwarfReader reader(expression.data, expression.data + expression.size);
+		while(!reader.atEnd())
+		{
+			int op = reader.u8();
+			if(complete && op != OP_PIECE)
+				return false;
+			if(depth >= 62)
+				return false;
+
+			uint64_t reg;
+			uintptr_t value;
+			if(op >= OP_LIT0 && op <= OP_LIT31)
+			{
+				stack[depth++] = op - OP_LIT0;
+				continue;
+			}
+			if(op >= OP_REG0 && op <= OP_REG31)
+			{
+				location->kind  = Location::IN_REGISTER;
+				location->value = op - OP_REG0;
+				complete        = true;
+				continue;
+			}
+			if(op >= OP_BREG0 && op <= OP_BREG31)
+			{
+				reg = op - OP_BREG0;
+				if(!frame.has(reg))
+					return false;
+				stack[depth++] = frame.values[reg] + reader.sleb();
+				continue;
+			}
+
+			switch(op)
+			{
+				case OP_ADDR:
+					// file addresses, relative to the load bias
+					stack[depth++] = base + reader.address(sizeof(uintptr_t));
+					break;
+				case OP_DEREF:
+					if(depth < 1
+					   || !CfiUnwinder::readMemory(stack[depth - 1], &value,
+					                               sizeof(value)))
+						return false;
+					stack[depth - 1] = value;
+					break;
+				case OP_CONST1U:
+					stack[depth++] = reader.u8();
+					break;
+				case OP_CONST1S:
+					stack[depth++] = static_cast<int8_t>(reader.u8());
+					break;
+				case OP_CONST2U:
+					stack[depth++] = reader.u16();
+					break;
+				case OP_CONST2S:
+					stack[depth++] = static_cast<int16_t>(reader.u16());
+					break;
+				case OP_CONST4U:
+					stack[depth++] = reader.u32();
+					break;
+				case OP_CONST4S:
+					stack[depth++] = static_cast<int32_t>(reader.u32());
+					break;
+				case OP_CONST8U:
+				case OP_CONST8S:
+					stack[depth++] = reader.u64();
+					break;
+				case OP_CONSTU:
+					stack[depth++] = reader.uleb();
+					break;
+				case OP_CONSTS:
+					stack[depth++] = reader.sleb();
+					break;
+				case OP_DUP:
+					if(depth < 1)
+						return false;
+					stack[depth] = stack[depth - 1];
+					++depth;
+					break;
+				case OP_DROP:
+					if(depth < 1)
+						return false;
+					--depth;
+					break;
+				case OP_OVER:
+					if(depth < 2)
+						return false;
+					stack[depth] = stack[depth - 2];
+					++depth;
+					break;
+				case OP_SWAP:
+					if(depth < 2)
+						return false;
+					std::swap(stack[depth - 1], stack[depth - 2]);
+					break;
+				case OP_NEG:
+				case OP_NOT:
+					if(depth < 1)
+						return false;
+					stack[depth - 1] = op == OP_NEG ? -stack[depth - 1]
+					                                : ~stack[depth - 1];
+					break;
+				case OP_PLUS_UCONST:
+					if(depth < 1)
+						return false;
+					stack[depth - 1] += reader.uleb();
+					break;
+				case OP_AND:
+				case OP_MINUS:
+				case OP_MUL:
+				case OP_OR:
+				case OP_PLUS:
+				case OP_SHL:
+				case OP_SHR:
+				case OP_SHRA:
+				case OP_XOR:
+					if(depth < 2)
+						return false;
+					--depth;
+					stack[depth - 1]
+					    = applyBinary(op, stack[depth - 1], stack[depth]);
+					break;
+				case OP_REGX:
+					location->kind  = Location::IN_REGISTER;
+					location->value = reader.uleb();
+					complete        = true;
+					break;
+				case OP_FBREG:
+					if(frameBase == NULL)
+						return false;
+					stack[depth++] = *frameBase + reader.sleb();
+					break;
+				case OP_BREGX:
+					reg = reader.uleb();
+					if(!frame.has(reg))
+						return false;
+					stack[depth++] = frame.values[reg] + reader.sleb();
+					break;
+				case OP_PIECE:
+					// only a first piece holding the whole value is read
+					if(reader.uleb() < size)
+						return false;
+					reader.skip(reader.remaining());
+					break;
+				case OP_NOP:
+					break;
+				case OP_CALL_FRAME_CFA:
+					if(!frame.hasCfa)
+						return false;
+					stack[depth++] = frame.cfa;
+					break;
+				case OP_IMPLICIT_VALUE:
+				{
+					uint64_t length = reader.uleb();
+					if(length > sizeof(value) || length > reader.remaining())
+						return false;
+					value = 0;
+					memcpy(&value, reader.position(), length);
+					reader.skip(length);
+					location->kind  = Location::VALUE;
+					location->value = value;
+					complete        = true;
+					break;
+				}
+				case OP_STACK_VALUE:
+					if(depth < 1)
+						return false;
+					location->kind  = Location::VALUE;
+					location->value = stack[depth - 1];
+					complete        = true;
+					break;
+				default:
+					return false;
+			}
+		}
+
+		if(!reader.ok())
+			return false;
+		if(!complete)
+		{
+			if(depth < 1)
+				return false;
+			location->kind  = Location::IN_MEMORY;
+			location->value = stack[depth - 1];
+		}
+		return true;
+	}
+
+	static uintptr_t applyBinary(int op, uintptr_t a, uintptr_t b)
+	{
+		switch(op)
+		{
+			case OP_AND:
+				return a & b;
+			case OP_MINUS:
+				return a - b;
+			case OP_MUL:
+				return a * b;
+			case OP_OR:
+				return a | b;
+			case OP_PLUS:
+				return a + b;
+			case OP_SHL:
+				return b < 64 ? a << b : 0;
+			case OP_SHR:
+				return b < 64 ? a >> b : 0;
+			case OP_SHRA:
+				return static_cast<intptr_t>(a) >> (b < 63 ? b : 63);
+			default:
+				return a ^ b;
+		}
+	}
+
+	static std::string describeValue(DwarfVariable const& variable,
+	                                 UnwindRegisters const& frame,
+	                                 uintptr_t base,
+	                                 DwarfExpression const& frameBaseExpression)
+	{
+		if(variable.location.data == NULL || variable.location.size == 0)
+		{
+			if(variable.hasConstant)
+				return format(variable, variable.constant);
+			return "<optimized out>";
+		}
+
+		// the frame base is the value of a register, or an address
+		uintptr_t frameBase;
+		bool hasFrameBase = false;
+		Location location;
+		if(frameBaseExpression.data != NULL
+		   && evaluate(frameBaseExpression, frame, base, NULL, 0, &location))
+		{
+			if(location.kind != Location::IN_REGISTER)
+			{
+				frameBase    = location.value;
+				hasFrameBase = true;
+			}
+			else if(frame.has(location.value))
+			{
+				frameBase    = frame.values[location.value];
+				hasFrameBase = true;
+			}
+		}
+
+		if(!evaluate(variable.location, frame, base,
+		             hasFrameBase ? &frameBase : NULL, variable.size,
+		             &location))
+			return "<unavailable>";
+
+		char text[64];
+		if(variable.kind == VALUE_OTHER || variable.size == 0
+		   || variable.size > sizeof(uint64_t))
+		{
+			if(location.kind != Location::IN_MEMORY)
+				return "<unavailable>";
+			if(variable.size != 0)
+				snprintf(text, sizeof(text), "<%llu bytes at 0x%llx>",
+				         static_cast<unsigned long long>(variable.size),
+				         static_cast<unsigned long long>(location.value));
+			else
+				snprintf(text, sizeof(text), "<at 0x%llx>",
+				         static_cast<unsigned long long>(location.value));
+			return text;
+		}
+
+		uint64_t bits = 0;
+		switch(location.kind)
+		{
+			case Location::IN_MEMORY:
+				if(!CfiUnwinder::readMemory(location.value, &bits,
+				                            variable.size))
+				{
+					snprintf(text, sizeof(text), "<unreadable at 0x%llx>",
+					         static_cast<unsigned long long>(location.value));
+					return text;
+				}
+				break;
+			case Location::IN_REGISTER:
+				if(!frame.has(location.value))
+					return "<unavailable>";
+				bits = frame.values[location.value];
+				break;
+			case Location::VALUE:
+				bits = location.value;
+				break;
+		}
+		return format(variable, bits);
+	}
+
+	// formats a scalar from the bytes of its value, little-endian
+	static std::string format(DwarfVariable const& variable, uint64_t bits)
+	{
+		int shift = 64 - 8 * static_cast<int>(variable.size);
+		if(shift > 0 && shift < 64)
+			bits &= ~static_cast<uint64_t>(0) >> shift;
+		int64_t sign = shift > 0 && shift < 64
+		                   ? static_cast<int64_t>(bits << shift) >> shift
+		                   : static_cast<int64_t>(bits);
+
+		char text[64];
+		switch(variable.kind)
+		{
+			case VALUE_SIGNED:
+				snprintf(text, sizeof(text), "%lld",
+				         static_cast<long long>(sign));
+				break;
+			case VALUE_BOOL:
+				return bits != 0 ? "true" : "false";
+			case VALUE_CHAR:
+				if(bits >= 0x20 && bits < 0x7f)
+					snprintf(text, sizeof(text), "%lld '%c'",
+					         static_cast<long long>(sign),
+					         static_cast<char>(bits));
+				else
+					snprintf(text, sizeof(text), "%lld",
+					         static_cast<long long>(sign));
+				break;
+			case VALUE_FLOAT:
+				if(variable.size == sizeof(float))
+				{
+					float value;
+					uint32_t low = static_cast<uint32_t>(bits);
+					memcpy(&value, &low, sizeof(value));
+					snprintf(text, sizeof(text), "%g", value);
+				}
+				else if(variable.size == sizeof(double))
+				{
+					double value;
+					memcpy(&value, &bits, sizeof(value));
+					snprintf(text, sizeof(text), "%g", value);
+				}
+				else
+					return "<unavailable>";
+				break;
+			case VALUE_POINTER:
+				snprintf(text, sizeof(text), "0x%llx",
+				         static_cast<unsigned long long>(bits));
+				break;
+			default:
+				snprintf(text, sizeof(text), "%llu",
+				         static_cast<unsigned long long>(bits));
+				break;
+		}
+		return text;
+	}
+
+	// never destroyed, like the symbolizer's, for reports printed at exit
+	static ModuleMap& getModules()
+	{
+		static ModuleMap* _modules = new ModuleMap;
+		return *_modules;
+	}
+
+	static pthread_mutex_t& getMutex()
+	{
+		static pthread_mutex_t _mutex = PTHREAD_MUTEX_INITIALIZER;
+		return _mutex;
+	}
+};
+
+#endif
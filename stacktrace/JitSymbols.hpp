@@ -0,0 +1,303 @@
+/*
+    Copyright (C) 2017 Florian Cabot
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#ifndef STACKTRACE_JITSYMBOLS
+#define STACKTRACE_JITSYMBOLS
+
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <map>
+#include <stdint.h>
+#include <string>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// code ranges kept by JitRegistry, the oldest being overwritten
+#ifndef JIT_MAX_RANGES
+#define JIT_MAX_RANGES 4096
+#endif
+
+// longest name of a registered range, with its terminating null character
+#define JIT_NAME_SIZE 128
+
+/*! \ingroup exceptions
+ * Names of the code generated at run time, registered by the JIT compilers
+ * embedded in the program.
+ *
+ * Ranges are written in a ring of JIT_MAX_RANGES entries without locking, so
+ * that a JIT can register each piece of code as it generates it, even from a
+ * signal handler. Each entry has a sequence number, odd while it is written,
+ * which readers check before and after copying it. Lookups go from the newest
+ * range to the oldest one: code generated over freed code hides it.
+ */
+class JitRegistry
+{
+  public:
+	static void add(void const* code, size_t size, char const* name)
+	{
+		uint64_t index = getNext().fetch_add(1, std::memory_order_relaxed);
+		Range& range   = getRanges()[index % JIT_MAX_RANGES];
+
+		range.sequence.fetch_add(1, std::memory_order_relaxed);
+		std::atomic_thread_fence(std::memory_order_release);
+		range.begin.store(reinterpret_cast<uintptr_t>(code),
+		                  std::memory_order_relaxed);
+		range.end.store(reinterpret_cast<uintptr_t>(code) + size,
+		                std::memory_order_relaxed);
+		size_t length = strnlen(name, JIT_NAME_SIZE - 1);
+		for(size_t i = 0; i < length; ++i)
+			range.name[i].store(name[i], std::memory_order_relaxed);
+		range.name[length].store('\0', std::memory_order_relaxed);
+		range.sequence.fetch_add(1, std::memory_order_release);
+	}
+
+	/*! Forgets the ranges starting at code, once it is freed.
+	 */
+	static void remove(void const* code)
+	{
+		uintptr_t begin = reinterpret_cast<uintptr_t>(code);
+		for(int i = 0; i < JIT_MAX_RANGES; ++i)
+		{
+			Range& range = getRanges()[i];
+			if(range.begin.load(std::memory_order_relaxed) != begin)
+				continue;
+			range.sequence.fetch_add(1, std::memory_order_relaxed);
+			std::atomic_thread_fence(std::memory_order_release);
+			range.end.store(begin, std::memory_order_relaxed);
+			range.sequence.fetch_add(1, std::memory_order_release);
+		}
+	}
+
+	/*! Finds the newest range containing addr, copying its name and giving
+	 * its start. Returns false if there is none.
+	 */
+	static bool find(uintptr_t addr, char* name, uintptr_t* start)
+	{
+		uint64_t next  = getNext().load(std::memory_order_acquire);
+		uint64_t count = next < JIT_MAX_RANGES ? next : JIT_MAX_RANGES;
+		for(uint64_t i = 1; i <= count; ++i)
+		{
+			Range const& range = getRanges()[(next - i) % JIT_MAX_RANGES];
+			uint32_t sequence  = range.sequence.load(std::memory_order_acquire);
+			uintptr_t begin    = range.begin.load(std::memory_order_relaxed);
+			uintptr_t end      = range.end.load(std::memory_order_relaxed);
+			if((sequence & 1) != 0 || addr < begin || addr >= end)
+				continue;
+
+			for(int c = 0; c < JIT_NAME_SIZE; ++c)
+				name[c] = range.name[c].load(std::memory_order_relaxed);
+			name[JIT_NAME_SIZE - 1] = '\0';
+
+			// the range has been rewritten meanwhile
+			std::atomic_thread_fence(std::memory_order_acquire);
+			if(range.sequence.load(std::memory_order_relaxed) != sequence)
+				continue;
+			*start = begin;
+			return true;
+		}
+		return false;
+	}
+
+  private:
+	struct Range
+	{
+		std::atomic<uint32_t> sequence;
+		std::atomic<uintptr_t> begin;
+		std::atomic<uintptr_t> end;
+		std::atomic<char> name[JIT_NAME_SIZE];
+	};
+
+	// zero-initialized, so that ranges can be added before main()
+	static Range* getRanges()
+	{
+		static Range _ranges[JIT_MAX_RANGES];
+		return _ranges;
+	}
+
+	static std::atomic<uint64_t>& getNext()
+	{
+		static std::atomic<uint64_t> _next;
+		return _next;
+	}
+};
+
+/*! \ingroup exceptions
+ * Symbols of the perf map file of the process, /tmp/perf-<pid>.map, which
+ * JITs such as LuaJIT, V8 or the JVM write for perf.
+ *
+ * Each line is "START SIZE name", in hexadecimal; a line overrides the ranges
+ * it overlaps. The file is only appended to, so update() reads the lines added
+ * since its last call, and starts over if the file has been replaced (or if
+ * the process forked). The ranges are indexed by their start.
+ *
+ * It isn't thread-safe, its users lock it.
+ */
+class PerfMap
+{
+  public:
+	PerfMap()
+	    : pid(0)
+	    , device(0)
+	    , inode(0)
+	    , offset(0)
+	{
+	}
+
+	/*! Reads the lines appended to the file since the last update.
+	 */
+	void update()
+	{
+		char path[64];
+		snprintf(path, sizeof(path), "/tmp/perf-%d.map",
+		         static_cast<int>(getpid()));
+
+		struct stat st;
+		if(stat(path, &st) != 0)
+		{
+			symbols.clear();
+			offset = 0;
+			return;
+		}
+		if(getpid() != pid || st.st_dev != device || st.st_ino != inode
+		   || st.st_size < offset)
+		{
+			symbols.clear();
+			offset = 0;
+			pid    = getpid();
+			device = st.st_dev;
+			inode  = st.st_ino;
+		}
+		if(st.st_size == offset)
+			return;
+
+		int fd = open(path, O_RDONLY | O_CLOEXEC);
+		if(fd < 0)
+			return;
+
+		// lines still being written are read at the next update
+		char buffer[65536];
+		std::string pending;
+		ssize_t count;
+		while((count = pread(fd, buffer, sizeof(buffer),
+		                     offset + pending.size()))
+		      > 0)
+		{
+			pending.append(buffer, count);
+			size_t last = pending.rfind('\n');
+			if(last == std::string::npos)
+				continue;
+
+			parse(pending.c_str(), last + 1);
+			offset += last + 1;
+			pending.erase(0, last + 1);
+		}
+		close(fd);
+	}
+
+	/*! Returns the name of the symbol containing addr and gives its start,
+	 * NULL if there is none.
+	 */
+	char const* find(uintptr_t addr, uintptr_t* start) const
+	{
+		std::map<uintptr_t, Symbol>::const_iterator it
+		    = symbols.upper_bound(addr);
+		if(it == symbols.begin())
+			return NULL;
+		--it;
+		if(addr >= it->second.end)
+			return NULL;
+		*start = it->first;
+		return it->second.name.c_str();
+	}
+
+	size_t size() const { return symbols.size(); }
+
+  private:
+	struct Symbol
+	{
+		uintptr_t end;
+		std::string name;
+	};
+
+	// symbols by start, not overlapping
+	std::map<uintptr_t, Symbol> symbols;
+	pid_t pid;
+	dev_t device;
+	ino_t inode;
+	// bytes of the file read, up to the end of a line
+	off_t offset;
+
+	void parse(char const* text, size_t length)
+	{
+		char const* end = text + length;
+		while(text < end)
+		{
+			char const* eol = static_cast<char const*>(
+			    memchr(text, '\n', end - text));
+			char* next;
+			uintptr_t start = strtoull(text, &next, 16);
+			uintptr_t size  = strtoull(next, &next, 16);
+			if(next < eol && *next == ' ' && size != 0)
+				insert(start, start + size,
+				       std::string(next + 1, eol - next - 1));
+			text = eol + 1;
+		}
+	}
+
+	// adds a range, removing or trimming the older ones it overlaps
+	void insert(uintptr_t begin, uintptr_t end, std::string const& name)
+	{
+		std::map<uintptr_t, Symbol>::iterator it = symbols.lower_bound(begin);
+		if(it != symbols.begin())
+		{
+			std::map<uintptr_t, Symbol>::iterator previous = it;
+			--previous;
+			if(previous->second.end > begin)
+			{
+				// an older range around the new one keeps its tail
+				if(previous->second.end > end)
+				{
+					Symbol tail  = previous->second;
+					symbols[end] = tail;
+				}
+				previous->second.end = begin;
+			}
+		}
+		while(it != symbols.end() && it->first < end)
+		{
+			if(it->second.end > end)
+			{
+				Symbol tail = it->second;
+				symbols.erase(it);
+				symbols[end] = tail;
+				break;
+			}
+			symbols.erase(it++);
+		}
+
+		Symbol symbol;
+		symbol.end     = end;
+		symbol.name    = name;
+		symbols[begin] = symbol;
+	}
+};
+
+#endif
@@ -0,0 +1,161 @@
+/*
+    Copyright (C) 2017 Florian Cabot
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#ifndef STACKTRACE_LEB128
+#define STACKTRACE_LEB128
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+/*! \ingroup exceptions
+ * Decoding and encoding of LEB128, the variable length integers of DWARF.
+ *
+ * Values of one byte, by far the most common ones, are decoded inline. Where
+ * SSE2 is available, which x86-64 always has, the length of longer ones is
+ * found from the continuation bits of 16 bytes at once; near the end of the
+ * data, and elsewhere, they are decoded a byte at a time. bench/ compares the
+ * two on the line programs of a binary.
+ */
+class Leb128
+{
+  public:
+	/*! Decodes an unsigned value.
+	 *
+	 * Returns the number of bytes read, 0 if the value runs past end.
+	 */
+	static size_t decodeUnsigned(char const* pos, char const* end,
+	                             uint64_t* value)
+	{
+		if(pos < end && (*pos & 0x80) == 0)
+		{
+			*value = static_cast<uint8_t>(*pos);
+			return 1;
+		}
+#ifdef __SSE2__
+		if(end - pos >= 16)
+		{
+			size_t length = decodeSse2(pos, value);
+			if(length != 0)
+				return length;
+		}
+#endif
+		return decodeScalar(pos, end, value);
+	}
+
+	/*! Decodes a signed value.
+	 *
+	 * Returns the number of bytes read, 0 if the value runs past end.
+	 */
+	static size_t decodeSigned(char const* pos, char const* end, int64_t* value)
+	{
+		uint64_t raw;
+		size_t length = decodeUnsigned(pos, end, &raw);
+		if(length == 0)
+			return 0;
+
+		// the sign is the highest bit of the last group
+		size_t bits = 7 * length;
+		if(bits < 64 && ((raw >> (bits - 1)) & 1))
+			raw |= ~static_cast<uint64_t>(0) << bits;
+		*value = static_cast<int64_t>(raw);
+		return length;
+	}
+
+	/*! Encodes an unsigned value into out, which must have room for 10
+	 * bytes, returns the number of bytes written.
+	 */
+	static size_t encodeUnsigned(uint64_t value, char* out)
+	{
+		size_t length = 0;
+		while(value >= 0x80)
+		{
+			out[length++] = static_cast<char>((value & 0x7f) | 0x80);
+			value >>= 7;
+		}
+		out[length++] = static_cast<char>(value);
+		return length;
+	}
+
+	/*! Encodes a signed value into out, which must have room for 10 bytes,
+	 * returns the number of bytes written.
+	 */
+	static size_t encodeSigned(int64_t value, char* out)
+	{
+		size_t length = 0;
+		for(;;)
+		{
+			uint8_t byte = value & 0x7f;
+			// arithmetic shift, the sign is kept
+			value >>= 7;
+			if((value == 0 && (byte & 0x40) == 0)
+			   || (value == -1 && (byte & 0x40) != 0))
+			{
+				out[length++] = static_cast<char>(byte);
+				return length;
+			}
+			out[length++] = static_cast<char>(byte | 0x80);
+		}
+	}
+
+  private:
+	static size_t decodeScalar(char const* pos, char const* end,
+	                           uint64_t* value)
+	{
+		uint64_t result = 0;
+		unsigned shift  = 0;
+		for(char const* p = pos; p < end; ++p)
+		{
+			uint8_t byte = *p;
+			if(shift < 64)
+				result |= static_cast<uint64_t>(byte & 0x7f) << shift;
+			shift += 7;
+			if((byte & 0x80) == 0)
+			{
+				*value = result;
+				return p - pos + 1;
+			}
+		}
+		return 0;
+	}
+
+#ifdef __SSE2__
+	// decodes a value from 16 readable bytes, returns 0 if it's longer than
+	// 10 bytes (padded values, left to the scalar decoder)
+	static size_t decodeSse2(char const* pos, uint64_t* value)
+	{
+		__m128i bytes = _mm_loadu_si128(reinterpret_cast<__m128i const*>(pos));
+		unsigned more = _mm_movemask_epi8(bytes);
+		// the first byte without continuation bit ends the value
+		size_t length = __builtin_ctz(~more) + 1;
+		if(length > 10)
+			return 0;
+
+		uint64_t result = 0;
+		for(size_t i = 0; i < length; ++i)
+			result |= static_cast<uint64_t>(pos[i] & 0x7f) << (7 * i);
+		*value = result;
+		return length;
+	}
+#endif
+};
+
+#endif
@@ -0,0 +1,360 @@
+/*
+    Copyright (C) 2017 Florian Cabot
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#ifndef STACKTRACE_MODULEMAP
+#define STACKTRACE_MODULEMAP
+
+#include <algorithm>
+#include <cstddef>
+#include <cstring>
+#include <link.h>
+#include <stdint.h>
+#include <string>
+#include <sys/auxv.h>
+#include <vector>
+
+#include "Dwarf.hpp"
+
+/*! \ingroup exceptions
+ * Table of the loaded modules, kept current across dlopen() and dlclose().
+ *
+ * dl_iterate_phdr() counts the modules ever loaded and unloaded. update()
+ * compares these counters with the ones of its last run and does nothing if
+ * they didn't change; if modules were only loaded, only the new ones are
+ * added. Known modules keep their debug information, which is opened the
+ * first time one of their addresses is looked up.
+ *
+ * The vDSO is listed too, its symbols being read from its image in memory.
+ *
+ * Each change increments the generation, so that what was derived from the
+ * previous table can be told apart.
+ *
+ * The table isn't thread-safe, its users lock it.
+ */
+class ModuleMap
+{
+  public:
+	/*! Debug information of a module, counted so that it can be used without
+	 * the table's lock (see acquire()).
+	 *
+	 * It isn't a std::shared_ptr: its deleter would be code of the module
+	 * that created it, which may be a plugin unloaded since.
+	 */
+	struct Debug
+	{
+		DwarfModule dwarf;
+		// the table's reference and the acquired ones
+		int references;
+	};
+
+	struct Module
+	{
+		// path to open, /proc/self/exe for the program
+		std::string path;
+		// load bias, subtracted from addresses to get file addresses
+		uintptr_t base;
+		// addresses of the loaded segments
+		uintptr_t begin;
+		uintptr_t end;
+		// addresses of the largest readable and executable segment, empty if
+		// there is none
+		uintptr_t codeBegin;
+		uintptr_t codeEnd;
+		// ELF image of a module that isn't a file (the vDSO), NULL otherwise
+		char const* image;
+		size_t imageSize;
+		// loaded .eh_frame_hdr, NULL if there is none
+		char const* ehFrameHdr;
+		// GNU build ID in hexadecimal, read from the loaded notes
+		std::string buildId;
+		// debug information, NULL if not opened yet or unreadable
+		Debug* debug;
+		bool opened;
+	};
+
+	ModuleMap()
+	    : adds(0)
+	    , subs(0)
+	    , listed(0)
+	    , generation(0)
+	{
+	}
+
+	~ModuleMap()
+	{
+		for(size_t i = 0; i < modules.size(); ++i)
+			release(modules[i].debug);
+	}
+
+	ModuleMap(ModuleMap const&) = delete;
+	ModuleMap& operator=(ModuleMap const&) = delete;
+
+	/*! Updates the table if modules have been loaded or unloaded since the
+	 * last update, returns the generation.
+	 */
+	uint64_t update()
+	{
+		Counters counters = {0, 0, false};
+		dl_iterate_phdr(readCounters, &counters);
+		if(generation != 0 && counters.known && counters.adds == adds
+		   && counters.subs == subs)
+			return generation;
+
+		// modules are listed in load order, if none has been unloaded the new
+		// ones are the last ones
+		Scan scan;
+		scan.skip = generation != 0 && counters.known && counters.subs == subs
+		                ? listed
+		                : 0;
+		scan.count = 0;
+		dl_iterate_phdr(addModule, &scan);
+
+		if(scan.skip == 0)
+		{
+			// modules that are still there keep their debug information
+			for(size_t i = 0; i < scan.modules.size(); ++i)
+			{
+				Module* known = findSame(scan.modules[i]);
+				if(known != NULL)
+				{
+					scan.modules[i].debug  = known->debug;
+					scan.modules[i].opened = known->opened;
+					known->debug           = NULL;
+				}
+			}
+			for(size_t i = 0; i < modules.size(); ++i)
+				release(modules[i].debug);
+			modules.clear();
+		}
+
+		modules.insert(modules.end(), scan.modules.begin(), scan.modules.end());
+		std::sort(modules.begin(), modules.end(), moduleBefore);
+		listed = scan.count;
+		adds   = counters.adds;
+		subs   = counters.subs;
+		return ++generation;
+	}
+
+	uint64_t getGeneration() const { return generation; }
+
+	size_t size() const { return modules.size(); }
+
+	Module& operator[](size_t index) { return modules[index]; }
+
+	/*! Returns the module containing addr, NULL if there is none.
+	 */
+	Module* find(uintptr_t addr)
+	{
+		std::vector<Module>::iterator it = std::upper_bound(
+		    modules.begin(), modules.end(), addr, moduleAfter);
+		if(it == modules.begin() || addr >= (it - 1)->end)
+			return NULL;
+		return &*(it - 1);
+	}
+
+	/*! Returns the debug information of module, opening it the first time.
+	 *
+	 * It stays valid as long as the table isn't updated.
+	 */
+	DwarfModule* getDwarf(Module& module)
+	{
+		if(!module.opened)
+		{
+			module.opened     = true;
+			Debug* debug      = new Debug;
+			debug->references = 1;
+			if(module.image != NULL
+			       ? debug->dwarf.openImage(module.image, module.imageSize)
+			       : debug->dwarf.open(module.path.c_str()))
+				module.debug = debug;
+			else
+				delete debug;
+		}
+		return module.debug != NULL ? &module.debug->dwarf : NULL;
+	}
+
+	/*! Returns the debug information of module, which stays valid after the
+	 * table is updated, until it is given to release().
+	 */
+	Debug* acquire(Module& module)
+	{
+		if(getDwarf(module) != NULL)
+			++module.debug->references;
+		return module.debug;
+	}
+
+	/*! Releases debug information, with the table's lock held.
+	 */
+	static void release(Debug* debug)
+	{
+		if(debug != NULL && --debug->references == 0)
+			delete debug;
+	}
+
+  private:
+	struct Counters
+	{
+		unsigned long long adds;
+		unsigned long long subs;
+		bool known;
+	};
+
+	struct Scan
+	{
+		size_t skip;
+		size_t count;
+		std::vector<Module> modules;
+	};
+
+	std::vector<Module> modules;
+	unsigned long long adds;
+	unsigned long long subs;
+	// number of modules dl_iterate_phdr() listed at the last update
+	size_t listed;
+	uint64_t generation;
+
+	static int readCounters(dl_phdr_info* info, size_t size, void* data)
+	{
+		Counters* counters = static_cast<Counters*>(data);
+		counters->known    = size >= offsetof(dl_phdr_info, dlpi_subs)
+		                              + sizeof(info->dlpi_subs);
+		if(counters->known)
+		{
+			counters->adds = info->dlpi_adds;
+			counters->subs = info->dlpi_subs;
+		}
+		// the counters are the same for all modules
+		return 1;
+	}
+
+	static int addModule(dl_phdr_info* info, size_t, void* data)
+	{
+		Scan* scan = static_cast<Scan*>(data);
+		if(scan->count++ < scan->skip)
+			return 0;
+
+		Module module;
+		module.path       = info->dlpi_name[0] != '\0' ? info->dlpi_name
+		                                               : "/proc/self/exe";
+		module.base       = info->dlpi_addr;
+		module.begin      = UINTPTR_MAX;
+		module.end        = 0;
+		module.codeBegin  = 0;
+		module.codeEnd    = 0;
+		module.image      = NULL;
+		module.imageSize  = 0;
+		module.ehFrameHdr = NULL;
+		module.debug      = NULL;
+		module.opened     = false;
+
+		for(int i = 0; i < info->dlpi_phnum; ++i)
+		{
+			ElfW(Phdr) const& phdr = info->dlpi_phdr[i];
+			uintptr_t start        = info->dlpi_addr + phdr.p_vaddr;
+			if(phdr.p_type == PT_LOAD)
+			{
+				module.begin = std::min(module.begin, start);
+				module.end   = std::max(module.end, start + phdr.p_memsz);
+				if((phdr.p_flags & (PF_R | PF_X)) == (PF_R | PF_X)
+				   && phdr.p_memsz > module.codeEnd - module.codeBegin)
+				{
+					module.codeBegin = start;
+					module.codeEnd   = start + phdr.p_memsz;
+				}
+			}
+			else if(phdr.p_type == PT_GNU_EH_FRAME)
+				module.ehFrameHdr = reinterpret_cast<char const*>(start);
+			else if(phdr.p_type == PT_NOTE && module.buildId.empty())
+			{
+				module.buildId = readBuildId(
+				    reinterpret_cast<char const*>(start), phdr.p_memsz,
+				    phdr.p_align == 8 ? 8 : 4);
+			}
+		}
+
+		// the vDSO is mapped whole from its ELF header, its section headers
+		// being past its loaded segment
+		if(module.begin == getauxval(AT_SYSINFO_EHDR) && module.begin != 0)
+		{
+			ElfW(Ehdr) const* ehdr
+			    = reinterpret_cast<ElfW(Ehdr) const*>(module.begin);
+			module.image     = reinterpret_cast<char const*>(ehdr);
+			module.imageSize = std::max<size_t>(
+			    module.end - module.begin,
+			    ehdr->e_shoff + ehdr->e_shnum * sizeof(ElfW(Shdr)));
+		}
+
+		if(module.begin < module.end)
+			scan->modules.push_back(module);
+		return 0;
+	}
+
+	static std::string readBuildId(char const* notes, size_t size,
+	                               size_t align)
+	{
+		size_t offset = 0;
+		while(offset < size && size - offset >= sizeof(ElfW(Nhdr)))
+		{
+			ElfW(Nhdr) const* nhdr
+			    = reinterpret_cast<ElfW(Nhdr) const*>(notes + offset);
+			size_t desc = offset + sizeof(ElfW(Nhdr))
+			              + ((nhdr->n_namesz + align - 1) & ~(align - 1));
+			if(desc > size || nhdr->n_descsz > size - desc)
+				break;
+
+			if(nhdr->n_type == NT_GNU_BUILD_ID && nhdr->n_namesz == 4
+			   && memcmp(notes + offset + sizeof(ElfW(Nhdr)), "GNU", 4) == 0)
+			{
+				std::string id;
+				for(size_t i = 0; i < nhdr->n_descsz; ++i)
+				{
+					unsigned char byte = notes[desc + i];
+					id += "0123456789abcdef"[byte >> 4];
+					id += "0123456789abcdef"[byte & 0xf];
+				}
+				return id;
+			}
+			offset = desc + ((nhdr->n_descsz + align - 1) & ~(align - 1));
+		}
+		return std::string();
+	}
+
+	// the same file loaded at the same place
+	Module* findSame(Module const& module)
+	{
+		for(size_t i = 0; i < modules.size(); ++i)
+		{
+			if(modules[i].base == module.base && modules[i].path == module.path
+			   && modules[i].buildId == module.buildId)
+				return &modules[i];
+		}
+		return NULL;
+	}
+
+	static bool moduleBefore(Module const& a, Module const& b)
+	{
+		return a.begin < b.begin;
+	}
+
+	static bool moduleAfter(uintptr_t addr, Module const& module)
+	{
+		return addr < module.begin;
+	}
+};
+
+#endif
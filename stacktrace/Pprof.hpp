@@ -0,0 +1,388 @@
+/*
+    Copyright (C) 2017 Florian Cabot
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#ifndef STACKTRACE_PPROF
+#define STACKTRACE_PPROF
+
+#include <cstdlib>
+#include <cstring>
+#include <cxxabi.h>
+#include <dlfcn.h>
+#include <ostream>
+#include <stdint.h>
+#include <string>
+#include <unistd.h>
+#include <unordered_map>
+#include <vector>
+
+#include "Leb128.hpp"
+#include "ModuleMap.hpp"
+
+// define STACKTRACE_ZLIB (and link with -lz) to gzip profiles
+#ifdef STACKTRACE_ZLIB
+#include <zlib.h>
+#endif
+
+/*! \ingroup exceptions
+ * Label of a pprof sample, either a string (str not NULL) or a number.
+ */
+struct PprofLabel
+{
+	char const* key;
+	char const* str;
+	int64_t num;
+	// unit of num, can be NULL
+	char const* unit;
+};
+
+/*! \ingroup exceptions
+ * Writes stacks as a profile.proto message, the format of pprof.
+ *
+ * The message is streamed: each sample is written as it is added, and so are
+ * the locations, functions, mappings and strings it is the first to use,
+ * since protobuf allows the fields of a message in any order. The writer only
+ * keeps the ids of what it has written, so its memory depends on the number of
+ * distinct addresses and names, not on the number of samples.
+ *
+ * Frames are named with dladdr() like FoldedWriter does; mappings come from
+ * the loaded modules with their build ID, so that pprof can also symbolize
+ * them from the binaries. With STACKTRACE_ZLIB defined, the profile can be
+ * gzipped as pprof expects from files.
+ */
+class PprofWriter
+{
+  public:
+	explicit PprofWriter(std::ostream& out, bool compress = false)
+	    : out(out)
+	    , compress(false)
+	    , finished(false)
+	{
+#ifdef STACKTRACE_ZLIB
+		if(compress)
+		{
+			memset(&zstream, 0, sizeof(zstream));
+			// 16 + window bits asks for a gzip header
+			this->compress = deflateInit2(&zstream, Z_DEFAULT_COMPRESSION,
+			                              Z_DEFLATED, 16 + 15, 8,
+			                              Z_DEFAULT_STRATEGY)
+			                 == Z_OK;
+		}
+#else
+		(void) compress;
+#endif
+
+		// string_table[0] must be the empty string
+		strings[""] = 0;
+		putString("");
+		modules.update();
+		mappingIds.resize(modules.size(), 0);
+	}
+
+	~PprofWriter() { finish(); }
+
+	PprofWriter(PprofWriter const&) = delete;
+	PprofWriter& operator=(PprofWriter const&) = delete;
+
+	/*! Declares the meaning of the next value of the samples, in order.
+	 */
+	void addSampleType(char const* type, char const* unit)
+	{
+		message.clear();
+		putVarintField(&message, 1, getString(type));
+		putVarintField(&message, 2, getString(unit));
+		writeField(PROFILE_SAMPLE_TYPE, message);
+	}
+
+	/*! Adds a sample.
+	 *
+	 * \param frames The frames, innermost first as returned by backtrace().
+	 * \param values One value per sample type.
+	 */
+	void addSample(void* const* frames, int count, int64_t const* values,
+	               int valueCount, PprofLabel const* labels = NULL,
+	               int labelCount = 0)
+	{
+		// the locations first, they may write their own fields
+		locationIds.clear();
+		for(int i = 0; i < count; ++i)
+			locationIds.push_back(getLocation(frames[i]));
+
+		labelFields.clear();
+		for(int i = 0; i < labelCount; ++i)
+		{
+			field.clear();
+			putVarintField(&field, 1, getString(labels[i].key));
+			if(labels[i].str != NULL)
+				putVarintField(&field, 2, getString(labels[i].str));
+			else
+			{
+				putVarintField(&field, 3, labels[i].num);
+				if(labels[i].unit != NULL)
+					putVarintField(&field, 4, getString(labels[i].unit));
+			}
+			putBytesField(&labelFields, 3, field);
+		}
+
+		message.clear();
+		field.clear();
+		for(size_t i = 0; i < locationIds.size(); ++i)
+			putVarint(&field, locationIds[i]);
+		putBytesField(&message, 1, field);
+		field.clear();
+		for(int i = 0; i < valueCount; ++i)
+			putVarint(&field, values[i]);
+		putBytesField(&message, 2, field);
+		message += labelFields;
+		writeField(PROFILE_SAMPLE, message);
+	}
+
+	/*! Sets when the profile was taken and how long it lasted.
+	 */
+	void setTime(int64_t timeNanos, int64_t durationNanos)
+	{
+		message.clear();
+		putVarintField(&message, PROFILE_TIME_NANOS, timeNanos);
+		putVarintField(&message, PROFILE_DURATION_NANOS, durationNanos);
+		write(message.data(), message.size());
+	}
+
+	/*! Ends the profile, called by the destructor.
+	 */
+	void finish()
+	{
+		if(finished)
+			return;
+		finished = true;
+
+#ifdef STACKTRACE_ZLIB
+		if(compress)
+		{
+			deflateChunk(NULL, 0, Z_FINISH);
+			deflateEnd(&zstream);
+		}
+#endif
+		out.flush();
+	}
+
+  private:
+	enum
+	{
+		PROFILE_SAMPLE_TYPE    = 1,
+		PROFILE_SAMPLE         = 2,
+		PROFILE_MAPPING        = 3,
+		PROFILE_LOCATION       = 4,
+		PROFILE_FUNCTION       = 5,
+		PROFILE_STRING_TABLE   = 6,
+		PROFILE_TIME_NANOS     = 9,
+		PROFILE_DURATION_NANOS = 10
+	};
+
+	std::ostream& out;
+	bool compress;
+	bool finished;
+#ifdef STACKTRACE_ZLIB
+	z_stream zstream;
+#endif
+	ModuleMap modules;
+	// ids of what has been written, 0 for not yet
+	std::vector<uint64_t> mappingIds;
+	std::unordered_map<void const*, uint64_t> locations;
+	std::unordered_map<std::string, uint64_t> functions;
+	std::unordered_map<std::string, uint64_t> strings;
+	// buffers reused for each message
+	std::string message;
+	std::string field;
+	std::string labelFields;
+	std::vector<uint64_t> locationIds;
+
+	uint64_t getString(char const* str)
+	{
+		std::unordered_map<std::string, uint64_t>::iterator it
+		    = strings.find(str);
+		if(it != strings.end())
+			return it->second;
+
+		uint64_t index = strings.size();
+		strings.insert(std::make_pair(std::string(str), index));
+		putString(str);
+		return index;
+	}
+
+	void putString(char const* str)
+	{
+		std::string entry;
+		putBytesField(&entry, PROFILE_STRING_TABLE, std::string(str));
+		write(entry.data(), entry.size());
+	}
+
+	uint64_t getLocation(void const* addr)
+	{
+		std::unordered_map<void const*, uint64_t>::iterator it
+		    = locations.find(addr);
+		if(it != locations.end())
+			return it->second;
+
+		uint64_t id = locations.size() + 1;
+		locations.insert(std::make_pair(addr, id));
+
+		uint64_t mapping = getMapping(reinterpret_cast<uintptr_t>(addr));
+		uint64_t function = getFunction(addr);
+
+		std::string location;
+		putVarintField(&location, 1, id);
+		if(mapping != 0)
+			putVarintField(&location, 2, mapping);
+		putVarintField(&location, 3, reinterpret_cast<uintptr_t>(addr));
+		if(function != 0)
+		{
+			std::string line;
+			putVarintField(&line, 1, function);
+			putBytesField(&location, 4, line);
+		}
+		writeField(PROFILE_LOCATION, location);
+		return id;
+	}
+
+	uint64_t getMapping(uintptr_t addr)
+	{
+		ModuleMap::Module* module = modules.find(addr);
+		if(module == NULL)
+			return 0;
+
+		size_t index = module - &modules[0];
+		if(mappingIds[index] != 0)
+			return mappingIds[index];
+
+		uint64_t id       = index + 1;
+		mappingIds[index] = id;
+
+		std::string mapping;
+		putVarintField(&mapping, 1, id);
+		putVarintField(&mapping, 2, module->begin);
+		putVarintField(&mapping, 3, module->end);
+		// file_offset is left to 0, the offset of the first segment in
+		// nearly all binaries
+		putVarintField(&mapping, 5, getString(getPath(*module).c_str()));
+		putVarintField(&mapping, 6, getString(module->buildId.c_str()));
+		// has_functions is left false, pprof can then add the lines from the
+		// binaries
+		writeField(PROFILE_MAPPING, mapping);
+		return id;
+	}
+
+	// the path of the program, which the profile outlives
+	static std::string getPath(ModuleMap::Module const& module)
+	{
+		if(module.path != "/proc/self/exe")
+			return module.path;
+
+		char path[4096];
+		ssize_t length = readlink("/proc/self/exe", path, sizeof(path));
+		if(length <= 0 || length == sizeof(path))
+			return module.path;
+		return std::string(path, length);
+	}
+
+	uint64_t getFunction(void const* addr)
+	{
+		Dl_info info;
+		if(dladdr(addr, &info) == 0 || info.dli_sname == NULL)
+			return 0;
+
+		std::unordered_map<std::string, uint64_t>::iterator it
+		    = functions.find(info.dli_sname);
+		if(it != functions.end())
+			return it->second;
+
+		uint64_t id = functions.size() + 1;
+		functions.insert(std::make_pair(std::string(info.dli_sname), id));
+
+		int status;
+		char* demangled
+		    = abi::__cxa_demangle(info.dli_sname, NULL, NULL, &status);
+
+		std::string function;
+		putVarintField(&function, 1, id);
+		putVarintField(&function, 2,
+		               getString(status == 0 ? demangled : info.dli_sname));
+		putVarintField(&function, 3, getString(info.dli_sname));
+		writeField(PROFILE_FUNCTION, function);
+		free(demangled);
+		return id;
+	}
+
+	// wire types of protobuf
+	static void putVarint(std::string* buffer, uint64_t value)
+	{
+		char bytes[10];
+		buffer->append(bytes, Leb128::encodeUnsigned(value, bytes));
+	}
+
+	static void putVarintField(std::string* buffer, int number, uint64_t value)
+	{
+		putVarint(buffer, number << 3);
+		putVarint(buffer, value);
+	}
+
+	static void putBytesField(std::string* buffer, int number,
+	                          std::string const& bytes)
+	{
+		putVarint(buffer, (number << 3) | 2);
+		putVarint(buffer, bytes.size());
+		*buffer += bytes;
+	}
+
+	void writeField(int number, std::string const& bytes)
+	{
+		char header[2 * 10];
+		size_t length = Leb128::encodeUnsigned((number << 3) | 2, header);
+		length += Leb128::encodeUnsigned(bytes.size(), header + length);
+		write(header, length);
+		write(bytes.data(), bytes.size());
+	}
+
+	void write(char const* data, size_t size)
+	{
+#ifdef STACKTRACE_ZLIB
+		if(compress)
+		{
+			deflateChunk(data, size, Z_NO_FLUSH);
+			return;
+		}
+#endif
+		out.write(data, size);
+	}
+
+#ifdef STACKTRACE_ZLIB
+	void deflateChunk(char const* data, size_t size, int flush)
+	{
+		zstream.next_in  = reinterpret_cast<Bytef*>(const_cast<char*>(data));
+		zstream.avail_in = static_cast<uInt>(size);
+		do
+		{
+			char chunk[16384];
+			zstream.next_out  = reinterpret_cast<Bytef*>(chunk);
+			zstream.avail_out = sizeof(chunk);
+			deflate(&zstream, flush);
+			out.write(chunk, sizeof(chunk) - zstream.avail_out);
+		} while(zstream.avail_out == 0);
+	}
+#endif
+};
+
+#endif
@@ -0,0 +1,266 @@
+/*
+    Copyright (C) 2017 Florian Cabot
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#ifndef STACKTRACE_REPORTBUILDER
+#define STACKTRACE_REPORTBUILDER
+
+#include "SelfMetrics.hpp"
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <stdint.h>
+#include <string>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#ifndef REPORT_BUFFER_SIZE
+#define REPORT_BUFFER_SIZE 16384
+#endif
+
+#ifndef REPORT_MAX_SEGMENTS
+#define REPORT_MAX_SEGMENTS 64
+#endif
+
+/*! \ingroup exceptions
+ * Formats a report in a fixed buffer and writes it with a single writev().
+ *
+ * Nothing is allocated and nothing is written before emit(), so a report
+ * shorter than PIPE_BUF reaches a pipe atomically, without being interleaved
+ * with other threads' output. Long strings that outlive the report can be
+ * referenced with appendExternal() instead of being copied.
+ *
+ * When the buffer is full, what has been formatted so far is written and the
+ * buffer is reused, so long reports are never truncated but lose atomicity.
+ */
+class ReportBuilder
+{
+  public:
+	explicit ReportBuilder(int fd = STDERR_FILENO)
+	    : fd(fd)
+	    , used(0)
+	    , segmentCount(0)
+	    , deadline(0)
+	{
+	}
+
+	/*! Appends a copy of length bytes of data.
+	 */
+	void append(char const* data, size_t length)
+	{
+		while(length > 0)
+		{
+			if(used == sizeof(buffer))
+				emit();
+
+			size_t chunk = std::min(length, sizeof(buffer) - used);
+			memcpy(buffer + used, data, chunk);
+			addSegment(buffer + used, chunk, true);
+			used += chunk;
+			data += chunk;
+			length -= chunk;
+		}
+	}
+
+	/*! Appends data without copying it; data has to stay valid until emit().
+	 */
+	void appendExternal(char const* data, size_t length)
+	{
+		if(segmentCount == REPORT_MAX_SEGMENTS)
+			append(data, length);
+		else
+			addSegment(data, length, false);
+	}
+
+	ReportBuilder& operator<<(char const* str)
+	{
+		append(str, strlen(str));
+		return *this;
+	}
+
+	ReportBuilder& operator<<(std::string const& str)
+	{
+		append(str.c_str(), str.size());
+		return *this;
+	}
+
+	ReportBuilder& operator<<(char c)
+	{
+		append(&c, 1);
+		return *this;
+	}
+
+	ReportBuilder& operator<<(long long value)
+	{
+		if(value < 0)
+			return *this << '-' << -static_cast<unsigned long long>(value);
+		return *this << static_cast<unsigned long long>(value);
+	}
+
+	ReportBuilder& operator<<(unsigned long long value)
+	{
+		char digits[20];
+		int count = 0;
+		do
+		{
+			digits[sizeof(digits) - ++count] = '0' + value % 10;
+			value /= 10;
+		} while(value != 0);
+		append(digits + sizeof(digits) - count, count);
+		return *this;
+	}
+
+	ReportBuilder& operator<<(int value)
+	{
+		return *this << static_cast<long long>(value);
+	}
+
+	ReportBuilder& operator<<(long value)
+	{
+		return *this << static_cast<long long>(value);
+	}
+
+	ReportBuilder& operator<<(unsigned int value)
+	{
+		return *this << static_cast<unsigned long long>(value);
+	}
+
+	ReportBuilder& operator<<(unsigned long value)
+	{
+		return *this << static_cast<unsigned long long>(value);
+	}
+
+	// pointers are printed in hexadecimal as iostreams do
+	ReportBuilder& operator<<(void const* pointer)
+	{
+		uintptr_t value = reinterpret_cast<uintptr_t>(pointer);
+		char digits[2 + 2 * sizeof(uintptr_t)];
+		int count = 0;
+		do
+		{
+			digits[sizeof(digits) - ++count] = "0123456789abcdef"[value & 0xf];
+			value >>= 4;
+		} while(value != 0);
+		digits[sizeof(digits) - ++count] = 'x';
+		digits[sizeof(digits) - ++count] = '0';
+		append(digits + sizeof(digits) - count, count);
+		return *this;
+	}
+
+	/*! Writes the report and empties the builder.
+	 *
+	 * Returns false if the report couldn't be entirely written.
+	 */
+	bool emit()
+	{
+		iovec* iov     = segments;
+		int count      = segmentCount;
+		bool ok        = true;
+		uint64_t start = SelfMetrics::now();
+
+		while(count > 0)
+		{
+			ssize_t written = writev(fd, iov, count);
+			if(written < 0)
+			{
+				if(errno == EINTR)
+					continue;
+				ok = false;
+				break;
+			}
+			SelfMetrics::add(SELF_BYTES_WRITTEN, written);
+
+			// partial write, skip what has been written
+			while(count > 0 && static_cast<size_t>(written) >= iov->iov_len)
+			{
+				written -= iov->iov_len;
+				++iov;
+				--count;
+			}
+			if(count > 0)
+			{
+				iov->iov_base = static_cast<char*>(iov->iov_base) + written;
+				iov->iov_len -= written;
+			}
+		}
+
+		if(segmentCount > 0)
+			SelfMetrics::time(SELF_EMIT, start);
+		used         = 0;
+		segmentCount = 0;
+		return ok;
+	}
+
+	/*! Time (CLOCK_MONOTONIC, in nanoseconds) by which the frames of the
+	 * report have to be symbolized, shared by all of them; 0 until it is
+	 * set. It is kept by emit().
+	 */
+	int64_t getDeadline() const { return deadline; }
+
+	void setDeadline(int64_t time) { deadline = time; }
+
+	/*! Number of bytes waiting to be emitted.
+	 */
+	size_t size() const
+	{
+		size_t total = 0;
+		for(int i = 0; i < segmentCount; ++i)
+			total += segments[i].iov_len;
+		return total;
+	}
+
+  private:
+	int fd;
+	char buffer[REPORT_BUFFER_SIZE];
+	size_t used;
+	iovec segments[REPORT_MAX_SEGMENTS];
+	int segmentCount;
+	int64_t deadline;
+
+	void addSegment(char const* data, size_t length, bool internal)
+	{
+		// contiguous internal data extends the last segment
+		if(internal && segmentCount > 0)
+		{
+			iovec& last = segments[segmentCount - 1];
+			if(static_cast<char*>(last.iov_base) + last.iov_len == data)
+			{
+				last.iov_len += length;
+				return;
+			}
+		}
+
+		if(segmentCount == REPORT_MAX_SEGMENTS)
+		{
+			// out of segments, the data being added moves to the start of
+			// the emptied buffer
+			emit();
+			if(internal)
+			{
+				memmove(buffer, data, length);
+				data = buffer;
+				used = 0;
+			}
+		}
+
+		segments[segmentCount].iov_base = const_cast<char*>(data);
+		segments[segmentCount].iov_len  = length;
+		++segmentCount;
+	}
+};
+
+#endif
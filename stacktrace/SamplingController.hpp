@@ -0,0 +1,206 @@
+/*
+    Copyright (C) 2017 Florian Cabot
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#ifndef STACKTRACE_SAMPLINGCONTROLLER
+#define STACKTRACE_SAMPLINGCONTROLLER
+
+#include <algorithm>
+#include <atomic>
+#include <stdint.h>
+#include <time.h>
+
+// default overhead budget of all the sampling features together, in millionths
+// of the process's CPU time
+#ifndef SAMPLING_OVERHEAD_PPM
+#define SAMPLING_OVERHEAD_PPM 10000
+#endif
+
+// time over which the overhead is measured before the period is adjusted
+#ifndef SAMPLING_WINDOW_NS
+#define SAMPLING_WINDOW_NS 200000000
+#endif
+
+// largest period, in events
+#ifndef SAMPLING_MAX_PERIOD
+#define SAMPLING_MAX_PERIOD 65536
+#endif
+
+/*! \ingroup exceptions
+ * Keeps the cost of the sampling features under a share of the CPU time of the
+ * process.
+ *
+ * Each feature has a controller, and times its own work with begin() and
+ * end(). Every SAMPLING_WINDOW_NS, a controller compares the time all the
+ * features spent with the CPU time the process used meanwhile: over the
+ * budget, its period (one event sampled out of period) grows in proportion;
+ * under half the budget, it is halved. The features thus share one budget,
+ * each slowing down as much as the total exceeds it. Features ask sample()
+ * whether to handle an event, and weigh what they record by the period it
+ * returns so that counts stay unbiased.
+ *
+ * Everything is lock-free and async-signal-safe. Instances are meant to be
+ * static: all members are zero-initialized and no constructor has to run
+ * before the first call.
+ */
+class SamplingController
+{
+  public:
+	/*! Returns 0 if the event is to be skipped, else the number of events it
+	 * stands for.
+	 */
+	uint32_t sample()
+	{
+		uint32_t period = getPeriod();
+		if(period == 1)
+			return 1;
+		return events.fetch_add(1, std::memory_order_relaxed) % period == 0
+		           ? period
+		           : 0;
+	}
+
+	/*! Starts timing the handling of an event.
+	 */
+	static uint64_t begin() { return now(CLOCK_MONOTONIC); }
+
+	/*! Ends timing the handling of an event, adjusting the period at the end
+	 * of a window.
+	 *
+	 * Returns true if the period changed.
+	 */
+	bool end(uint64_t start)
+	{
+		uint64_t stop = now(CLOCK_MONOTONIC);
+		spent.fetch_add(stop - start, std::memory_order_relaxed);
+		getTotalSpent().fetch_add(stop - start, std::memory_order_relaxed);
+
+		uint64_t opened = windowStart.load(std::memory_order_relaxed);
+		if(opened != 0 && stop - opened < SAMPLING_WINDOW_NS)
+			return false;
+		// a single thread closes the window
+		if(!windowStart.compare_exchange_strong(opened, stop))
+			return false;
+		return adjust(opened == 0);
+	}
+
+	/*! One event out of getPeriod() is sampled.
+	 */
+	uint32_t getPeriod() const
+	{
+		uint32_t period = periodValue.load(std::memory_order_relaxed);
+		return period != 0 ? period : 1;
+	}
+
+	/*! Share of the process's CPU time spent in the feature during the last
+	 * window, in millionths.
+	 */
+	uint32_t getOverheadPpm() const
+	{
+		return overheadPpm.load(std::memory_order_relaxed);
+	}
+
+	/*! Total time spent in the feature, in nanoseconds.
+	 */
+	uint64_t getSpentNs() const
+	{
+		return spent.load(std::memory_order_relaxed);
+	}
+
+	/*! Sets the budget shared by all the sampling features, as a percentage
+	 * of the process's CPU time (1 for 1%).
+	 */
+	static void setBudget(double percent)
+	{
+		getBudgetPpm().store(static_cast<uint32_t>(percent * 10000),
+		                     std::memory_order_relaxed);
+	}
+
+	static uint32_t getBudget()
+	{
+		return getBudgetPpm().load(std::memory_order_relaxed);
+	}
+
+  private:
+	std::atomic<uint32_t> periodValue;
+	std::atomic<uint32_t> events;
+	std::atomic<uint32_t> overheadPpm;
+	std::atomic<uint64_t> spent;
+	std::atomic<uint64_t> windowStart;
+	// spent, spent by all the features and CPU time at the start of the
+	// window
+	std::atomic<uint64_t> windowSpent;
+	std::atomic<uint64_t> windowTotal;
+	std::atomic<uint64_t> windowCpu;
+
+	static std::atomic<uint32_t>& getBudgetPpm()
+	{
+		static std::atomic<uint32_t> _budgetPpm(SAMPLING_OVERHEAD_PPM);
+		return _budgetPpm;
+	}
+
+	// time spent by all the features, in nanoseconds
+	static std::atomic<uint64_t>& getTotalSpent()
+	{
+		static std::atomic<uint64_t> _totalSpent;
+		return _totalSpent;
+	}
+
+	static uint64_t now(clockid_t clock)
+	{
+		timespec ts;
+		clock_gettime(clock, &ts);
+		return static_cast<uint64_t>(ts.tv_sec) * 1000000000ull + ts.tv_nsec;
+	}
+
+	bool adjust(bool first)
+	{
+		uint64_t cpu      = now(CLOCK_PROCESS_CPUTIME_ID);
+		uint64_t total    = spent.load(std::memory_order_relaxed);
+		uint64_t all      = getTotalSpent().load(std::memory_order_relaxed);
+		uint64_t cpuDelta = cpu - windowCpu.exchange(cpu);
+		uint64_t used     = total - windowSpent.exchange(total);
+		uint64_t allUsed  = all - windowTotal.exchange(all);
+		if(first || cpuDelta == 0)
+			return false;
+
+		uint64_t own = std::min<uint64_t>(used * 1000000 / cpuDelta,
+		                                  UINT32_MAX);
+		overheadPpm.store(static_cast<uint32_t>(own),
+		                  std::memory_order_relaxed);
+
+		// the budget is for all the features together
+		uint64_t ppm = allUsed * 1000000 / cpuDelta;
+		uint64_t budget = getBudget() != 0 ? getBudget() : 1;
+		uint64_t period = getPeriod();
+		uint64_t next   = period;
+		if(ppm > budget)
+		{
+			// the cost is about proportional to the sampled events
+			next = (period * ppm + budget - 1) / budget;
+			if(next > SAMPLING_MAX_PERIOD)
+				next = SAMPLING_MAX_PERIOD;
+		}
+		else if(2 * ppm < budget && period > 1)
+			next = period / 2;
+
+		periodValue.store(static_cast<uint32_t>(next),
+		                  std::memory_order_relaxed);
+		return next != period;
+	}
+};
+
+#endif
@@ -0,0 +1,243 @@
+/*
+    Copyright (C) 2017 Florian Cabot
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#ifndef STACKTRACE_SELFMETRICS
+#define STACKTRACE_SELFMETRICS
+
+#include <atomic>
+#include <cstring>
+#include <pthread.h>
+#include <stdint.h>
+#include <time.h>
+
+// threads with their own counters, the others share a single set
+#ifndef SELFMETRICS_MAX_THREADS
+#define SELFMETRICS_MAX_THREADS 256
+#endif
+
+// histogram buckets, bucket i counts durations in [2^i, 2^(i+1)) ns
+#define SELFMETRICS_BUCKETS 32
+
+/*! \ingroup exceptions
+ * Events counted by SelfMetrics.
+ */
+enum SelfCounter
+{
+	SELF_SYMBOLIZED_FRAMES,
+	SELF_CACHE_HITS,
+	SELF_CACHE_MISSES,
+	SELF_BYTES_WRITTEN,
+	SELF_DROPPED_SAMPLES,
+	SELF_COUNTER_COUNT
+};
+
+/*! \ingroup exceptions
+ * Work timed by SelfMetrics.
+ */
+enum SelfTimer
+{
+	// one backtrace()
+	SELF_CAPTURE,
+	// the symbolization of one stack
+	SELF_SYMBOLIZATION,
+	// one write of a report
+	SELF_EMIT,
+	SELF_TIMER_COUNT
+};
+
+/*! \ingroup exceptions
+ * Sum of the metrics of all threads, see SelfMetrics::get().
+ */
+struct SelfMetricsSnapshot
+{
+	uint64_t counters[SELF_COUNTER_COUNT];
+	// total time and histogram of each timer
+	uint64_t totalNs[SELF_TIMER_COUNT];
+	uint64_t buckets[SELF_TIMER_COUNT][SELFMETRICS_BUCKETS];
+
+	uint64_t getCount(SelfTimer timer) const
+	{
+		uint64_t count = 0;
+		for(int i = 0; i < SELFMETRICS_BUCKETS; ++i)
+			count += buckets[timer][i];
+		return count;
+	}
+
+	/*! Upper bound of the given percentile (0 to 100) of a timer, in ns.
+	 */
+	uint64_t getPercentileNs(SelfTimer timer, int percentile) const
+	{
+		uint64_t rank = (getCount(timer) * percentile + 99) / 100;
+		uint64_t seen = 0;
+		for(int i = 0; i < SELFMETRICS_BUCKETS; ++i)
+		{
+			seen += buckets[timer][i];
+			if(seen >= rank && seen != 0)
+				return (2ull << i) - 1;
+		}
+		return 0;
+	}
+};
+
+/*! \ingroup exceptions
+ * Counts what the library itself costs: stack captures, symbolization, cache
+ * hits and misses, bytes written and dropped samples.
+ *
+ * Each thread writes its own counters, without atomic read-modify-write, so
+ * counting costs a few instructions and can be done from signal handlers;
+ * get() sums them. Past SELFMETRICS_MAX_THREADS threads, the others share a
+ * set of counters updated atomically. The counters of exited threads are kept.
+ * A child of fork() starts from zero, with a block for each of its threads.
+ */
+class SelfMetrics
+{
+  public:
+	static void add(SelfCounter counter, uint64_t value)
+	{
+		Block& block = getBlock();
+		increase(block, block.counters[counter], value);
+	}
+
+	/*! Records the time elapsed since start, a value of now().
+	 */
+	static void time(SelfTimer timer, uint64_t start)
+	{
+		uint64_t elapsed = now() - start;
+		int bucket       = 0;
+		for(uint64_t rest = elapsed >> 1; rest != 0; rest >>= 1)
+			++bucket;
+		if(bucket >= SELFMETRICS_BUCKETS)
+			bucket = SELFMETRICS_BUCKETS - 1;
+
+		Block& block = getBlock();
+		increase(block, block.totalNs[timer], elapsed);
+		increase(block, block.buckets[timer][bucket], 1);
+	}
+
+	static uint64_t now()
+	{
+		timespec ts;
+		clock_gettime(CLOCK_MONOTONIC, &ts);
+		return static_cast<uint64_t>(ts.tv_sec) * 1000000000ull + ts.tv_nsec;
+	}
+
+	/*! Sums the metrics of all threads, async-signal-safe.
+	 */
+	static SelfMetricsSnapshot get()
+	{
+		SelfMetricsSnapshot snapshot;
+		memset(&snapshot, 0, sizeof(snapshot));
+
+		int used = getNextBlock().load(std::memory_order_relaxed);
+		if(used > SELFMETRICS_MAX_THREADS)
+			used = SELFMETRICS_MAX_THREADS;
+		for(int i = 0; i <= used; ++i)
+		{
+			// the shared block is the last one
+			Block const& block
+			    = getBlocks()[i < used ? i : SELFMETRICS_MAX_THREADS];
+			for(int c = 0; c < SELF_COUNTER_COUNT; ++c)
+				snapshot.counters[c]
+				    += block.counters[c].load(std::memory_order_relaxed);
+			for(int t = 0; t < SELF_TIMER_COUNT; ++t)
+			{
+				snapshot.totalNs[t]
+				    += block.totalNs[t].load(std::memory_order_relaxed);
+				for(int b = 0; b < SELFMETRICS_BUCKETS; ++b)
+					snapshot.buckets[t][b]
+					    += block.buckets[t][b].load(std::memory_order_relaxed);
+			}
+		}
+		return snapshot;
+	}
+
+	/*! Makes children of fork() count their own cost from zero.
+	 */
+	static void guardFork()
+	{
+		static pthread_once_t _once = PTHREAD_ONCE_INIT;
+		pthread_once(&_once, registerForkHandlers);
+	}
+
+  private:
+	struct Block
+	{
+		std::atomic<uint64_t> counters[SELF_COUNTER_COUNT];
+		std::atomic<uint64_t> totalNs[SELF_TIMER_COUNT];
+		std::atomic<uint64_t> buckets[SELF_TIMER_COUNT][SELFMETRICS_BUCKETS];
+	};
+
+	static void increase(Block const& block, std::atomic<uint64_t>& value,
+	                     uint64_t delta)
+	{
+		if(&block == getBlocks() + SELFMETRICS_MAX_THREADS)
+			value.fetch_add(delta, std::memory_order_relaxed);
+		// only this thread writes it
+		else
+			value.store(value.load(std::memory_order_relaxed) + delta,
+			            std::memory_order_relaxed);
+	}
+
+	static Block& getBlock()
+	{
+		Block*& self = getSelf();
+		if(self == NULL)
+		{
+			int index = getNextBlock().fetch_add(1, std::memory_order_relaxed);
+			if(index > SELFMETRICS_MAX_THREADS)
+				index = SELFMETRICS_MAX_THREADS;
+			self = getBlocks() + index;
+		}
+		return *self;
+	}
+
+	static Block*& getSelf()
+	{
+		static __thread Block* _self;
+		return _self;
+	}
+
+	static void registerForkHandlers()
+	{
+		pthread_atfork(NULL, NULL, resetAfterFork);
+	}
+
+	// the blocks of the parent's threads would be summed with the child's
+	static void resetAfterFork()
+	{
+		memset(static_cast<void*>(getBlocks()), 0,
+		       sizeof(Block) * (SELFMETRICS_MAX_THREADS + 1));
+		getNextBlock().store(0, std::memory_order_relaxed);
+		getSelf() = NULL;
+	}
+
+	// one block per thread, then the shared one
+	static Block* getBlocks()
+	{
+		static Block _blocks[SELFMETRICS_MAX_THREADS + 1];
+		return _blocks;
+	}
+
+	static std::atomic<int>& getNextBlock()
+	{
+		static std::atomic<int> _nextBlock;
+		return _nextBlock;
+	}
+};
+
+#endif
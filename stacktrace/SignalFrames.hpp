@@ -0,0 +1,212 @@
+/*
+    Copyright (C) 2017 Florian Cabot
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#ifndef STACKTRACE_SIGNALFRAMES
+#define STACKTRACE_SIGNALFRAMES
+
+#include <algorithm>
+#include <atomic>
+#include <cstring>
+#include <signal.h>
+#include <stdint.h>
+#include <ucontext.h>
+
+#include "StackScanner.hpp"
+
+// signal handlers of a thread running within each other
+#ifndef SIGNALFRAMES_MAX_NESTING
+#define SIGNALFRAMES_MAX_NESTING 8
+#endif
+
+/*! \ingroup exceptions
+ * Context interrupted by a signal, see SignalFrames.
+ */
+struct SignalFrame
+{
+	int sig;
+	// instruction and stack pointers when the signal was delivered
+	uintptr_t pc;
+	uintptr_t sp;
+	// ucontext given to the handler, valid until it returns
+	void const* context;
+};
+
+/*! \ingroup exceptions
+ * Keeps track of the signal handlers the calling thread is running, so that
+ * stack traces taken within them can be followed through the signal frames.
+ *
+ * A signal handler returns into the sigreturn trampoline (__restore_rt on
+ * x86-64), which backtrace() reports as a frame followed by the interrupted
+ * instruction. The trampoline is recognised from its code, and the signal it
+ * returns from is found among the contexts registered by the handlers of the
+ * library through enter() and leave(). When unwinding stops at a trampoline,
+ * the registered context tells where to resume.
+ *
+ * Everything is per thread and async-signal-safe.
+ */
+class SignalFrames
+{
+  public:
+	/*! Registers the context a signal handler interrupted, ucontext being its
+	 * third parameter (SA_SIGINFO).
+	 */
+	static void enter(int sig, void* ucontext)
+	{
+		Thread& thread = getThread();
+		if(thread.depth < SIGNALFRAMES_MAX_NESTING)
+		{
+			SignalFrame& frame = thread.frames[thread.depth];
+			frame.sig          = sig;
+			frame.context      = ucontext;
+			getContext(ucontext, &frame.pc, &frame.sp);
+		}
+		thread.modulesUpdated = false;
+		// a nested handler has to see the frame once it is complete
+		std::atomic_signal_fence(std::memory_order_seq_cst);
+		++thread.depth;
+	}
+
+	static void leave()
+	{
+		std::atomic_signal_fence(std::memory_order_seq_cst);
+		--getThread().depth;
+	}
+
+	/*! Tells if addr is a sigreturn trampoline, the code a signal handler
+	 * returns into. Its bytes are only compared within the code of a loaded
+	 * module, a frame may point anywhere.
+	 *
+	 * Always false outside registered handlers, where there is no signal
+	 * frame to follow. Modules are read on the first call of each handler.
+	 */
+	static bool isTrampoline(void const* addr)
+	{
+		if(getDepth() == 0)
+			return false;
+		Thread& thread = getThread();
+		if(!thread.modulesUpdated)
+			thread.modulesUpdated = StackScanner::updateModules();
+#if defined(__x86_64__)
+		// mov $15, %rax (rt_sigreturn); syscall
+		static unsigned char const code[]
+		    = {0x48, 0xC7, 0xC0, 0x0F, 0x00, 0x00, 0x00, 0x0F, 0x05};
+		return StackScanner::isLoadedCode(addr, sizeof(code))
+		       && memcmp(addr, code, sizeof(code)) == 0;
+#elif defined(__i386__)
+		// mov $173, %eax (rt_sigreturn); int $0x80
+		static unsigned char const code[]
+		    = {0xB8, 0xAD, 0x00, 0x00, 0x00, 0xCD, 0x80};
+		return StackScanner::isLoadedCode(addr, sizeof(code))
+		       && memcmp(addr, code, sizeof(code)) == 0;
+#elif defined(__aarch64__)
+		// mov x8, #139 (rt_sigreturn); svc #0
+		static uint32_t const code[] = {0xD2801168, 0xD4000001};
+		return StackScanner::isLoadedCode(addr, sizeof(code))
+		       && memcmp(addr, code, sizeof(code)) == 0;
+#else
+		(void) addr;
+		return false;
+#endif
+	}
+
+	/*! Returns the registered signal that interrupted the instruction at pc,
+	 * the frame following a trampoline, or NULL if there is none.
+	 */
+	static SignalFrame const* find(void const* pc)
+	{
+		Thread const& thread = getThread();
+		for(int i = getDepth() - 1; i >= 0; --i)
+			if(thread.frames[i].pc == reinterpret_cast<uintptr_t>(pc))
+				return &thread.frames[i];
+		return NULL;
+	}
+
+	/*! Returns the innermost registered signal whose interrupted instruction
+	 * isn't among the frames, NULL if there is none: the context to resume
+	 * from when unwinding stopped at a trampoline.
+	 */
+	static SignalFrame const* findNotUnwound(void* const* frames, int nptrs)
+	{
+		Thread const& thread = getThread();
+		for(int i = getDepth() - 1; i >= 0; --i)
+		{
+			void* pc = reinterpret_cast<void*>(thread.frames[i].pc);
+			if(std::find(frames, frames + nptrs, pc) == frames + nptrs)
+				return &thread.frames[i];
+		}
+		return NULL;
+	}
+
+	/*! Returns the index of the innermost trampoline among frames, -1 if
+	 * there is none.
+	 */
+	static int findTrampoline(void* const* frames, int nptrs)
+	{
+		for(int i = 0; i < nptrs; ++i)
+			if(isTrampoline(frames[i]))
+				return i;
+		return -1;
+	}
+
+	/*! Reads the instruction and stack pointers of a ucontext, 0 on
+	 * unsupported architectures.
+	 */
+	static void getContext(void const* ucontext, uintptr_t* pc, uintptr_t* sp)
+	{
+		mcontext_t const& context
+		    = static_cast<ucontext_t const*>(ucontext)->uc_mcontext;
+#if defined(__x86_64__)
+		*pc = context.gregs[REG_RIP];
+		*sp = context.gregs[REG_RSP];
+#elif defined(__i386__)
+		*pc = context.gregs[REG_EIP];
+		*sp = context.gregs[REG_ESP];
+#elif defined(__aarch64__)
+		*pc = context.pc;
+		*sp = context.sp;
+#else
+		(void) context;
+		*pc = 0;
+		*sp = 0;
+#endif
+	}
+
+  private:
+	struct Thread
+	{
+		SignalFrame frames[SIGNALFRAMES_MAX_NESTING];
+		int depth;
+		// the module table was updated since the innermost handler started
+		bool modulesUpdated;
+	};
+
+	static int getDepth()
+	{
+		int depth = getThread().depth;
+		return depth < SIGNALFRAMES_MAX_NESTING ? depth
+		                                        : SIGNALFRAMES_MAX_NESTING;
+	}
+
+	static Thread& getThread()
+	{
+		static __thread Thread _thread;
+		return _thread;
+	}
+};
+
+#endif
@@ -0,0 +1,542 @@
+/*
+    Copyright (C) 2017 Florian Cabot
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#ifndef STACKTRACE_SLOWSYSCALLS
+#define STACKTRACE_SLOWSYSCALLS
+
+#include "Folded.hpp"
+#include "Pprof.hpp"
+#include "SamplingController.hpp"
+#include "StackCodec.hpp"
+#include "StackTable.hpp"
+#include <cerrno>
+#include <ctime>
+#include <execinfo.h>
+#include <ostream>
+
+#if defined(SLOWSYSCALLS_RDTSC) && (defined(__x86_64__) || defined(__i386__))
+#include <x86intrin.h>
+#define SLOWSYSCALLS_USE_RDTSC
+#endif
+
+#ifndef SLOWSYSCALLS_MAX_STACKS
+#define SLOWSYSCALLS_MAX_STACKS 4096
+#endif
+
+#ifndef SLOWSYSCALLS_MAX_DEPTH
+#define SLOWSYSCALLS_MAX_DEPTH 64
+#endif
+
+/*! \ingroup exceptions
+ * Blocking calls watched by the SlowSyscallTracer.
+ */
+enum SlowSyscall
+{
+	SLOW_READ,
+	SLOW_WRITE,
+	SLOW_PREAD,
+	SLOW_PWRITE,
+	SLOW_READV,
+	SLOW_WRITEV,
+	SLOW_RECV,
+	SLOW_RECVFROM,
+	SLOW_RECVMSG,
+	SLOW_SEND,
+	SLOW_SENDTO,
+	SLOW_SENDMSG,
+	SLOW_CONNECT,
+	SLOW_FSYNC,
+	SLOW_FDATASYNC,
+	SLOW_POLL,
+	SLOW_SELECT,
+	SLOW_EPOLL_WAIT,
+	SLOW_SYSCALL_COUNT
+};
+
+/*! \ingroup exceptions
+ * Records the stacks of blocking calls that take longer than a threshold.
+ *
+ * Every watched call is timed; its stack is only captured and interned when it
+ * took longer than the threshold, so fast calls cost two clock reads. Per stack,
+ * the tracer keeps the number of slow calls, their total and maximum duration.
+ *
+ * When capturing takes more than the budget of the SamplingController, only
+ * one slow call out of its period is captured, and counts for period calls:
+ * counts and totals become estimates, maximums are those of the captured calls.
+ *
+ * Time is read from CLOCK_MONOTONIC_COARSE, whose resolution is the kernel tick
+ * (a few milliseconds), which is enough for thresholds in the milliseconds.
+ * Define SLOWSYSCALLS_RDTSC to read the time stamp counter on x86 instead; it is
+ * then calibrated in enable().
+ *
+ * The interposed functions are defined in the translation unit that defines
+ * SLOWSYSCALLS_IMPLEMENTATION before including this header; exactly one
+ * translation unit of the program must do so.
+ */
+class SlowSyscallTracer
+{
+  public:
+	typedef StackTable<SLOWSYSCALLS_MAX_STACKS, SLOWSYSCALLS_MAX_STACKS * 16>
+	    Stacks;
+
+	/*! Starts recording calls that take at least thresholdUs microseconds.
+	 */
+	static void enable(uint64_t thresholdUs)
+	{
+		// the first backtrace() loads the unwinder
+		void* buffer[1];
+		backtrace(buffer, 1);
+
+		getTicksPerUs() = calibrate();
+		getThreshold().store(thresholdUs * getTicksPerUs(),
+		                     std::memory_order_relaxed);
+		getEnabled().store(true, std::memory_order_release);
+	}
+
+	static void disable()
+	{
+		getEnabled().store(false, std::memory_order_release);
+	}
+
+	// returns 0 when disabled so that the call isn't timed
+	static uint64_t start()
+	{
+		if(!getEnabled().load(std::memory_order_relaxed))
+			return 0;
+		return now();
+	}
+
+	// called by the interposers, the skipped frames are this function and the
+	// interposer itself
+	__attribute__((noinline)) static void onReturn(SlowSyscall call,
+	                                               uint64_t startTicks)
+	{
+		if(startTicks == 0)
+			return;
+
+		uint64_t elapsed = now() - startTicks;
+		if(elapsed < getThreshold().load(std::memory_order_relaxed))
+			return;
+
+		int& guard = getReentrancyGuard();
+		if(guard != 0)
+			return;
+
+		uint32_t weight = getController().sample();
+		if(weight == 0)
+			return;
+		guard = 1;
+
+		uint64_t begin = SamplingController::begin();
+		int savedErrno = errno;
+		void* buffer[SLOWSYSCALLS_MAX_DEPTH];
+		int nptrs = backtrace(buffer, SLOWSYSCALLS_MAX_DEPTH);
+		errno     = savedErrno;
+		SelfMetrics::time(SELF_CAPTURE, begin);
+
+		guard = 0;
+
+		uint32_t id = getStacks().intern(buffer + 2, nptrs - 2);
+		if(id != 0)
+		{
+			Stats& stats = getStats()[id - 1];
+			stats.call.store(call, std::memory_order_relaxed);
+			stats.count.fetch_add(weight, std::memory_order_relaxed);
+			stats.ticks.fetch_add(elapsed * weight, std::memory_order_relaxed);
+			uint64_t max = stats.maxTicks.load(std::memory_order_relaxed);
+			while(elapsed > max
+			      && !stats.maxTicks.compare_exchange_weak(max, elapsed))
+			{
+			}
+		}
+		getController().end(begin);
+	}
+
+	/*! Controller of the cost of capturing, whose period tells how many slow
+	 * calls each captured one stands for.
+	 */
+	static SamplingController& getController()
+	{
+		static SamplingController _controller;
+		return _controller;
+	}
+
+	static uint64_t getCount(uint32_t id)
+	{
+		return getStats()[id - 1].count.load(std::memory_order_relaxed);
+	}
+
+	static uint64_t getTotalUs(uint32_t id)
+	{
+		return getStats()[id - 1].ticks.load(std::memory_order_relaxed)
+		       / getTicksPerUs();
+	}
+
+	static uint64_t getMaxUs(uint32_t id)
+	{
+		return getStats()[id - 1].maxTicks.load(std::memory_order_relaxed)
+		       / getTicksPerUs();
+	}
+
+	static SlowSyscall getCall(uint32_t id)
+	{
+		return static_cast<SlowSyscall>(
+		    getStats()[id - 1].call.load(std::memory_order_relaxed));
+	}
+
+	static char const* getCallName(SlowSyscall call)
+	{
+		static char const* const names[SLOW_SYSCALL_COUNT]
+		    = {"read",    "write",     "pread",      "pwrite",  "readv",
+		       "writev",  "recv",      "recvfrom",   "recvmsg", "send",
+		       "sendto",  "sendmsg",   "connect",    "fsync",   "fdatasync",
+		       "poll",    "select",    "epoll_wait"};
+		return names[call];
+	}
+
+	/*! Writes the recorded stacks as a folded profile.
+	 *
+	 * The innermost frame of each stack is the name of the blocking call.
+	 * \param byCount If true, stacks are weighted by their number of slow
+	 * calls, else by their total blocking time in microseconds.
+	 */
+	static void writeFolded(std::ostream& out, bool byCount = false)
+	{
+		FoldedWriter writer(out);
+		Stacks& stacks = getStacks();
+
+		for(uint32_t id = 1; id <= stacks.size(); ++id)
+		{
+			void* const* frames;
+			int nptrs = stacks.getFrames(id, &frames);
+			if(nptrs == 0 || getCount(id) == 0)
+				continue;
+
+			writer.write(frames, nptrs, getCallName(getCall(id)),
+			             byCount ? getCount(id) : getTotalUs(id));
+		}
+	}
+
+	/*! Appends the recorded stacks to out as a batch of StackEncoder, to be
+	 * read offline with StackBatchReader.
+	 *
+	 * The values of each stack are its SlowSyscall, its number of slow calls,
+	 * their total and their maximum duration in microseconds.
+	 */
+	static void writeEncoded(std::string* out, bool compress = false)
+	{
+		StackEncoder encoder;
+		Stacks& stacks = getStacks();
+
+		for(uint32_t id = 1; id <= stacks.size(); ++id)
+		{
+			void* const* frames;
+			int nptrs = stacks.getFrames(id, &frames);
+			if(nptrs == 0 || getCount(id) == 0)
+				continue;
+
+			uint64_t values[] = {static_cast<uint64_t>(getCall(id)),
+			                     getCount(id), getTotalUs(id), getMaxUs(id)};
+			encoder.add(frames, nptrs, values, 4);
+		}
+		encoder.writeBatch(out, compress);
+	}
+
+	/*! Writes the recorded stacks as a pprof profile, gzipped if asked and if
+	 * STACKTRACE_ZLIB is defined.
+	 *
+	 * Samples have the number of slow calls and the time blocked in
+	 * microseconds, and are labelled with the blocking call.
+	 */
+	static void writePprof(std::ostream& out, bool compress = false)
+	{
+		PprofWriter writer(out, compress);
+		writer.addSampleType("calls", "count");
+		writer.addSampleType("blocked", "microseconds");
+		Stacks& stacks = getStacks();
+
+		for(uint32_t id = 1; id <= stacks.size(); ++id)
+		{
+			void* const* frames;
+			int nptrs = stacks.getFrames(id, &frames);
+			if(nptrs == 0 || getCount(id) == 0)
+				continue;
+
+			int64_t values[] = {static_cast<int64_t>(getCount(id)),
+			                    static_cast<int64_t>(getTotalUs(id))};
+			PprofLabel call  = {"call", getCallName(getCall(id)), 0, NULL};
+			writer.addSample(frames, nptrs, values, 2, &call, 1);
+		}
+	}
+
+	static Stacks& getStacks()
+	{
+		static Stacks _stacks;
+		return _stacks;
+	}
+
+	static uint64_t now()
+	{
+#ifdef SLOWSYSCALLS_USE_RDTSC
+		return __rdtsc();
+#else
+		timespec ts;
+		clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+		return static_cast<uint64_t>(ts.tv_sec) * 1000000000ull + ts.tv_nsec;
+#endif
+	}
+
+  private:
+	struct Stats
+	{
+		std::atomic<int> call;
+		std::atomic<uint64_t> count;
+		std::atomic<uint64_t> ticks;
+		std::atomic<uint64_t> maxTicks;
+	};
+
+	static Stats* getStats()
+	{
+		static Stats _stats[SLOWSYSCALLS_MAX_STACKS];
+		return _stats;
+	}
+
+	static std::atomic<bool>& getEnabled()
+	{
+		static std::atomic<bool> _enabled;
+		return _enabled;
+	}
+
+	static std::atomic<uint64_t>& getThreshold()
+	{
+		static std::atomic<uint64_t> _threshold;
+		return _threshold;
+	}
+
+	static uint64_t& getTicksPerUs()
+	{
+		static uint64_t _ticksPerUs = 1000;
+		return _ticksPerUs;
+	}
+
+	static int& getReentrancyGuard()
+	{
+		static __thread int _guard;
+		return _guard;
+	}
+
+	static uint64_t calibrate()
+	{
+#ifdef SLOWSYSCALLS_USE_RDTSC
+		timespec begin, end, pause = {0, 10000000};
+		clock_gettime(CLOCK_MONOTONIC, &begin);
+		uint64_t ticks = __rdtsc();
+		nanosleep(&pause, NULL);
+		ticks = __rdtsc() - ticks;
+		clock_gettime(CLOCK_MONOTONIC, &end);
+
+		uint64_t us = (end.tv_sec - begin.tv_sec) * 1000000ull
+		              + (end.tv_nsec - begin.tv_nsec) / 1000;
+		return us != 0 && ticks >= us ? ticks / us : 1;
+#else
+		return 1000;
+#endif
+	}
+};
+
+#ifdef SLOWSYSCALLS_IMPLEMENTATION
+
+#include <dlfcn.h>
+#include <poll.h>
+#include <sys/epoll.h>
+#include <sys/select.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+// the interposers are given their libc name through an asm label so that they
+// don't clash with the declarations (and fortified inline wrappers) of libc
+#define SLOWSYSCALLS_REAL(name)            \
+	static decltype(&::name) real_##name = \
+	    reinterpret_cast<decltype(&::name)>(dlsym(RTLD_NEXT, #name))
+
+#define SLOWSYSCALLS_TIMED(call, name, ...)           \
+	SLOWSYSCALLS_REAL(name);                          \
+	uint64_t startTicks = SlowSyscallTracer::start(); \
+	decltype(real_##name(__VA_ARGS__)) result         \
+	    = real_##name(__VA_ARGS__);                   \
+	SlowSyscallTracer::onReturn(call, startTicks);    \
+	return result
+
+extern "C" ssize_t slowsyscalls_read(int fd, void* buf, size_t count)
+    __asm__("read");
+extern "C" ssize_t slowsyscalls_write(int fd, void const* buf, size_t count)
+    __asm__("write");
+extern "C" ssize_t slowsyscalls_pread(int fd, void* buf, size_t count,
+                                      off_t offset) __asm__("pread");
+extern "C" ssize_t slowsyscalls_pwrite(int fd, void const* buf, size_t count,
+                                       off_t offset) __asm__("pwrite");
+extern "C" ssize_t slowsyscalls_pread64(int fd, void* buf, size_t count,
+                                        off64_t offset) __asm__("pread64");
+extern "C" ssize_t slowsyscalls_pwrite64(int fd, void const* buf, size_t count,
+                                         off64_t offset) __asm__("pwrite64");
+extern "C" ssize_t slowsyscalls_readv(int fd, iovec const* iov, int iovcnt)
+    __asm__("readv");
+extern "C" ssize_t slowsyscalls_writev(int fd, iovec const* iov, int iovcnt)
+    __asm__("writev");
+extern "C" ssize_t slowsyscalls_recv(int fd, void* buf, size_t len, int flags)
+    __asm__("recv");
+extern "C" ssize_t slowsyscalls_recvfrom(int fd, void* buf, size_t len,
+                                         int flags, sockaddr* addr,
+                                         socklen_t* addrlen)
+    __asm__("recvfrom");
+extern "C" ssize_t slowsyscalls_recvmsg(int fd, msghdr* msg, int flags)
+    __asm__("recvmsg");
+extern "C" ssize_t slowsyscalls_send(int fd, void const* buf, size_t len,
+                                     int flags) __asm__("send");
+extern "C" ssize_t slowsyscalls_sendto(int fd, void const* buf, size_t len,
+                                       int flags, sockaddr const* addr,
+                                       socklen_t addrlen) __asm__("sendto");
+extern "C" ssize_t slowsyscalls_sendmsg(int fd, msghdr const* msg, int flags)
+    __asm__("sendmsg");
+extern "C" int slowsyscalls_connect(int fd, sockaddr const* addr,
+                                    socklen_t addrlen) __asm__("connect");
+extern "C" int slowsyscalls_fsync(int fd) __asm__("fsync");
+extern "C" int slowsyscalls_fdatasync(int fd) __asm__("fdatasync");
+extern "C" int slowsyscalls_poll(pollfd* fds, nfds_t nfds, int timeout)
+    __asm__("poll");
+extern "C" int slowsyscalls_select(int nfds, fd_set* readfds, fd_set* writefds,
+                                   fd_set* exceptfds, timeval* timeout)
+    __asm__("select");
+extern "C" int slowsyscalls_epoll_wait(int epfd, epoll_event* events,
+                                       int maxevents, int timeout)
+    __asm__("epoll_wait");
+
+ssize_t slowsyscalls_read(int fd, void* buf, size_t count)
+{
+	SLOWSYSCALLS_TIMED(SLOW_READ, read, fd, buf, count);
+}
+
+ssize_t slowsyscalls_write(int fd, void const* buf, size_t count)
+{
+	SLOWSYSCALLS_TIMED(SLOW_WRITE, write, fd, buf, count);
+}
+
+ssize_t slowsyscalls_pread(int fd, void* buf, size_t count, off_t offset)
+{
+	SLOWSYSCALLS_TIMED(SLOW_PREAD, pread, fd, buf, count, offset);
+}
+
+ssize_t slowsyscalls_pwrite(int fd, void const* buf, size_t count,
+                            off_t offset)
+{
+	SLOWSYSCALLS_TIMED(SLOW_PWRITE, pwrite, fd, buf, count, offset);
+}
+
+ssize_t slowsyscalls_pread64(int fd, void* buf, size_t count, off64_t offset)
+{
+	SLOWSYSCALLS_TIMED(SLOW_PREAD, pread64, fd, buf, count, offset);
+}
+
+ssize_t slowsyscalls_pwrite64(int fd, void const* buf, size_t count,
+                              off64_t offset)
+{
+	SLOWSYSCALLS_TIMED(SLOW_PWRITE, pwrite64, fd, buf, count, offset);
+}
+
+ssize_t slowsyscalls_readv(int fd, iovec const* iov, int iovcnt)
+{
+	SLOWSYSCALLS_TIMED(SLOW_READV, readv, fd, iov, iovcnt);
+}
+
+ssize_t slowsyscalls_writev(int fd, iovec const* iov, int iovcnt)
+{
+	SLOWSYSCALLS_TIMED(SLOW_WRITEV, writev, fd, iov, iovcnt);
+}
+
+ssize_t slowsyscalls_recv(int fd, void* buf, size_t len, int flags)
+{
+	SLOWSYSCALLS_TIMED(SLOW_RECV, recv, fd, buf, len, flags);
+}
+
+ssize_t slowsyscalls_recvfrom(int fd, void* buf, size_t len, int flags,
+                              sockaddr* addr, socklen_t* addrlen)
+{
+	SLOWSYSCALLS_TIMED(SLOW_RECVFROM, recvfrom, fd, buf, len, flags, addr,
+	                   addrlen);
+}
+
+ssize_t slowsyscalls_recvmsg(int fd, msghdr* msg, int flags)
+{
+	SLOWSYSCALLS_TIMED(SLOW_RECVMSG, recvmsg, fd, msg, flags);
+}
+
+ssize_t slowsyscalls_send(int fd, void const* buf, size_t len, int flags)
+{
+	SLOWSYSCALLS_TIMED(SLOW_SEND, send, fd, buf, len, flags);
+}
+
+ssize_t slowsyscalls_sendto(int fd, void const* buf, size_t len, int flags,
+                            sockaddr const* addr, socklen_t addrlen)
+{
+	SLOWSYSCALLS_TIMED(SLOW_SENDTO, sendto, fd, buf, len, flags, addr,
+	                   addrlen);
+}
+
+ssize_t slowsyscalls_sendmsg(int fd, msghdr const* msg, int flags)
+{
+	SLOWSYSCALLS_TIMED(SLOW_SENDMSG, sendmsg, fd, msg, flags);
+}
+
+int slowsyscalls_connect(int fd, sockaddr const* addr, socklen_t addrlen)
+{
+	SLOWSYSCALLS_TIMED(SLOW_CONNECT, connect, fd, addr, addrlen);
+}
+
+int slowsyscalls_fsync(int fd)
+{
+	SLOWSYSCALLS_TIMED(SLOW_FSYNC, fsync, fd);
+}
+
+int slowsyscalls_fdatasync(int fd)
+{
+	SLOWSYSCALLS_TIMED(SLOW_FDATASYNC, fdatasync, fd);
+}
+
+int slowsyscalls_poll(pollfd* fds, nfds_t nfds, int timeout)
+{
+	SLOWSYSCALLS_TIMED(SLOW_POLL, poll, fds, nfds, timeout);
+}
+
+int slowsyscalls_select(int nfds, fd_set* readfds, fd_set* writefds,
+                        fd_set* exceptfds, timeval* timeout)
+{
+	SLOWSYSCALLS_TIMED(SLOW_SELECT, select, nfds, readfds, writefds, exceptfds,
+	                   timeout);
+}
+
+int slowsyscalls_epoll_wait(int epfd, epoll_event* events, int maxevents,
+                            int timeout)
+{
+	SLOWSYSCALLS_TIMED(SLOW_EPOLL_WAIT, epoll_wait, epfd, events, maxevents,
+	                   timeout);
+}
+
+#endif
+
+#endif
@@ -0,0 +1,258 @@
+/*
+    Copyright (C) 2017 Florian Cabot
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#ifndef STACKTRACE_SOURCECACHE
+#define STACKTRACE_SOURCECACHE
+
+#include <algorithm>
+#include <cstring>
+#include <dirent.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <string>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <unordered_map>
+#include <vector>
+
+#include "ForkGuard.hpp"
+#include "ReportBuilder.hpp"
+
+// source files kept mapped, all of them being unmapped past it
+#ifndef SOURCECACHE_MAX_FILES
+#define SOURCECACHE_MAX_FILES 64
+#endif
+
+// files and directories listed when indexing the source roots
+#ifndef SOURCECACHE_MAX_ENTRIES
+#define SOURCECACHE_MAX_ENTRIES 100000
+#endif
+
+// longest part of a source line printed
+#define SOURCECACHE_LINE_LENGTH 160
+
+/*! \ingroup exceptions
+ * Source lines printed under the frames of stack traces, see
+ * set_source_snippets().
+ *
+ * Symbolized locations only hold a file name, so the source roots are listed
+ * once, recursively, indexing their files by name (the first one found wins
+ * when several have the same name). A file is mapped the first time one of
+ * its lines is asked for, and the offsets of its lines are indexed at once;
+ * files that can't be found are remembered too, so absent sources cost a
+ * lookup in a table.
+ *
+ * The cache is locked with a try: a stack trace printed while another thread
+ * uses it, or from a signal handler that interrupted it, has no snippets.
+ */
+class SourceCache
+{
+  public:
+	/*! Adds a directory searched for source files, with its subdirectories.
+	 */
+	static void addRoot(char const* root)
+	{
+		pthread_mutex_lock(&getMutex());
+		State& state = getState();
+		state.roots.push_back(root);
+		state.indexed = false;
+		clearFiles(state);
+		pthread_mutex_unlock(&getMutex());
+	}
+
+	/*! Appends the lines of file from line - context to line + context,
+	 * marking line. Returns false if the file isn't found or doesn't have
+	 * this line.
+	 */
+	static bool appendSnippet(ReportBuilder& report, char const* file,
+	                          int line, int context)
+	{
+		if(pthread_mutex_trylock(&getMutex()) != 0)
+			return false;
+
+		File const* source = find(file);
+
+		int count  = source != NULL ? source->lines.size() - 2 : 0;
+		bool found = line >= 1 && line <= count;
+		for(int i = std::max(1, line - context);
+		    found && i <= std::min(count, line + context); ++i)
+			appendLine(report, *source, i, i == line);
+
+		pthread_mutex_unlock(&getMutex());
+		return found;
+	}
+
+	/*! Keeps the cache usable in children of fork(), see ForkGuard.
+	 */
+	static void guardFork() { ForkGuard<getMutex>::install(); }
+
+  private:
+	struct File
+	{
+		char const* data;
+		size_t size;
+		// offset of the start of each line, lines[0] being unused, then the
+		// size of the file: a file of n lines has n + 2 offsets
+		std::vector<uint32_t> lines;
+	};
+
+	struct State
+	{
+		std::vector<std::string> roots;
+		bool indexed;
+		// path of the files of the roots by name
+		std::unordered_map<std::string, std::string> paths;
+		// mapped files by name, with a NULL data if unreadable
+		std::unordered_map<std::string, File> files;
+	};
+
+	static File const* find(char const* name)
+	{
+		State& state = getState();
+		std::unordered_map<std::string, File>::iterator it
+		    = state.files.find(name);
+		if(it != state.files.end())
+			return it->second.data != NULL ? &it->second : NULL;
+
+		if(!state.indexed)
+		{
+			state.paths.clear();
+			size_t entries = 0;
+			for(size_t i = 0; i < state.roots.size(); ++i)
+				indexDirectory(state, state.roots[i], &entries);
+			state.indexed = true;
+		}
+
+		if(state.files.size() >= SOURCECACHE_MAX_FILES)
+			clearFiles(state);
+		File& file = state.files[name];
+		file.data  = NULL;
+		file.size  = 0;
+
+		std::unordered_map<std::string, std::string>::const_iterator path
+		    = state.paths.find(name);
+		if(path == state.paths.end() || !map(path->second.c_str(), &file))
+			return NULL;
+		return &file;
+	}
+
+	static void indexDirectory(State& state, std::string const& directory,
+	                           size_t* entries)
+	{
+		DIR* dir = opendir(directory.c_str());
+		if(dir == NULL)
+			return;
+
+		dirent* entry;
+		while((entry = readdir(dir)) != NULL
+		      && ++*entries <= SOURCECACHE_MAX_ENTRIES)
+		{
+			// hidden directories are version control or build caches
+			if(entry->d_name[0] == '.')
+				continue;
+
+			std::string path = directory + "/" + entry->d_name;
+			struct stat st;
+			if(stat(path.c_str(), &st) != 0)
+				continue;
+			if(S_ISDIR(st.st_mode))
+				indexDirectory(state, path, entries);
+			else if(S_ISREG(st.st_mode))
+				state.paths.insert(std::make_pair(entry->d_name, path));
+		}
+		closedir(dir);
+	}
+
+	// maps a file and indexes its lines
+	static bool map(char const* path, File* file)
+	{
+		int fd = open(path, O_RDONLY | O_CLOEXEC);
+		if(fd < 0)
+			return false;
+
+		struct stat st;
+		void* mapped = MAP_FAILED;
+		if(fstat(fd, &st) == 0 && st.st_size > 0 && st.st_size < UINT32_MAX)
+			mapped = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		close(fd);
+		if(mapped == MAP_FAILED)
+			return false;
+
+		file->data = static_cast<char const*>(mapped);
+		file->size = st.st_size;
+		file->lines.push_back(0);
+		file->lines.push_back(0);
+		for(char const* c = file->data;
+		    (c = static_cast<char const*>(
+		         memchr(c, '\n', file->data + file->size - c)))
+		    != NULL;)
+			file->lines.push_back(++c - file->data);
+		if(file->lines.back() != file->size)
+			file->lines.push_back(file->size);
+		return true;
+	}
+
+	static void clearFiles(State& state)
+	{
+		std::unordered_map<std::string, File>::iterator it;
+		for(it = state.files.begin(); it != state.files.end(); ++it)
+		{
+			if(it->second.data != NULL)
+				munmap(const_cast<char*>(it->second.data), it->second.size);
+		}
+		state.files.clear();
+	}
+
+	static void appendLine(ReportBuilder& report, File const& file, int line,
+	                       bool marked)
+	{
+		char const* begin = file.data + file.lines[line];
+		char const* end   = file.data + file.lines[line + 1];
+		while(end > begin && (end[-1] == '\n' || end[-1] == '\r'))
+			--end;
+		size_t length = std::min<size_t>(end - begin, SOURCECACHE_LINE_LENGTH);
+
+		// line numbers right-aligned on 5 columns
+		int digits = 1;
+		for(int rest = line / 10; rest > 0; rest /= 10)
+			++digits;
+		report << (marked ? "  > " : "    ");
+		for(int i = digits; i < 5; ++i)
+			report << ' ';
+		report << line << " | ";
+		report.append(begin, length);
+		report << '\n';
+	}
+
+	// never destroyed, reports may be printed at exit
+	static State& getState()
+	{
+		static State* _state = new State();
+		return *_state;
+	}
+
+	static pthread_mutex_t& getMutex()
+	{
+		static pthread_mutex_t _mutex = PTHREAD_MUTEX_INITIALIZER;
+		return _mutex;
+	}
+};
+
+#endif
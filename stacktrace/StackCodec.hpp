@@ -0,0 +1,379 @@
+/*
+    Copyright (C) 2017 Florian Cabot
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#ifndef STACKTRACE_STACKCODEC
+#define STACKTRACE_STACKCODEC
+
+#include <cstring>
+#include <dlfcn.h>
+#include <map>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+#include "Leb128.hpp"
+
+// define STACKTRACE_ZSTD (and link with -lzstd) to compress batches
+#ifdef STACKTRACE_ZSTD
+#include <zstd.h>
+#endif
+
+#ifndef STACKCODEC_ZSTD_LEVEL
+#define STACKCODEC_ZSTD_LEVEL 3
+#endif
+
+/*! \ingroup exceptions
+ * Frame of an encoded stack: a module and an offset from the address it was
+ * loaded at (dli_fbase).
+ *
+ * Module 0 stands for addresses outside of any module, whose offset is then
+ * the address itself.
+ */
+struct EncodedFrame
+{
+	uint32_t module;
+	uintptr_t offset;
+};
+
+/*! \ingroup exceptions
+ * Encodes stacks into a compact batch, which can be stored or sent and read
+ * back in another process with StackBatchReader.
+ *
+ * Frames are written as their module and their offset in it, so that they
+ * still mean something once the process is gone. A frame in the same module
+ * as the previous one (most of them) only takes a zero byte and the
+ * difference between both offsets as a signed LEB128, which is usually two or
+ * three bytes: a 64-frame stack takes about 130 bytes instead of 512.
+ *
+ * Each stack is stored with values (a count, a duration...), whose meaning is
+ * left to the writer. Batches start with "STKB", a version and a flags byte;
+ * with STACKTRACE_ZSTD defined, the rest can be compressed with zstd.
+ *
+ * Modules are found with dladdr(), which isn't async-signal-safe: stacks are
+ * meant to be captured raw, then encoded outside of signal handlers.
+ */
+class StackEncoder
+{
+  public:
+	StackEncoder()
+	    : records(0)
+	{
+	}
+
+	/*! Adds a stack and its values to the batch.
+	 *
+	 * \param frames The frames, innermost first as returned by backtrace().
+	 */
+	void add(void* const* frames, int count, uint64_t const* values,
+	         int valueCount)
+	{
+		putUnsigned(valueCount);
+		for(int i = 0; i < valueCount; ++i)
+			putUnsigned(values[i]);
+
+		putUnsigned(count);
+		uint32_t previousModule = UINT32_MAX;
+		uintptr_t previousOffset = 0;
+		for(int i = 0; i < count; ++i)
+		{
+			EncodedFrame frame = locate(frames[i]);
+			if(frame.module == previousModule)
+			{
+				putUnsigned(0);
+				putSigned(static_cast<int64_t>(frame.offset - previousOffset));
+			}
+			else
+			{
+				putUnsigned(frame.module + 1);
+				putUnsigned(frame.offset);
+			}
+			previousModule = frame.module;
+			previousOffset = frame.offset;
+		}
+		++records;
+	}
+
+	/*! Number of stacks added.
+	 */
+	size_t size() const { return records; }
+
+	/*! Appends the batch to out, compressed if asked and if zstd is available.
+	 */
+	void writeBatch(std::string* out, bool compress = false) const
+	{
+		std::string payload;
+		putUnsigned(&payload, modules.size());
+		for(size_t i = 0; i < modules.size(); ++i)
+		{
+			putUnsigned(&payload, modules[i].size());
+			payload += modules[i];
+		}
+		putUnsigned(&payload, records);
+		payload += data;
+
+		out->append("STKB\1", 5);
+#ifdef STACKTRACE_ZSTD
+		if(compress)
+		{
+			std::string compressed(ZSTD_compressBound(payload.size()), '\0');
+			size_t size = ZSTD_compress(&compressed[0], compressed.size(),
+			                            payload.data(), payload.size(),
+			                            STACKCODEC_ZSTD_LEVEL);
+			if(!ZSTD_isError(size))
+			{
+				*out += static_cast<char>(FLAG_ZSTD);
+				out->append(compressed.data(), size);
+				return;
+			}
+		}
+#else
+		(void) compress;
+#endif
+		*out += '\0';
+		*out += payload;
+	}
+
+	/*! Removes the stacks and the modules.
+	 */
+	void clear()
+	{
+		modules.clear();
+		moduleIds.clear();
+		frames.clear();
+		data.clear();
+		records = 0;
+	}
+
+	static const int FLAG_ZSTD = 1;
+
+  private:
+	// paths of the modules, module i + 1 is modules[i]
+	std::vector<std::string> modules;
+	std::map<void const*, uint32_t> moduleIds;
+	// frames already located, dladdr() being slow
+	std::map<void const*, EncodedFrame> frames;
+	std::string data;
+	size_t records;
+
+	EncodedFrame locate(void const* addr)
+	{
+		std::map<void const*, EncodedFrame>::iterator it = frames.find(addr);
+		if(it != frames.end())
+			return it->second;
+
+		EncodedFrame frame;
+		frame.module = 0;
+		frame.offset = reinterpret_cast<uintptr_t>(addr);
+
+		Dl_info info;
+		if(dladdr(addr, &info) != 0 && info.dli_fname != NULL)
+		{
+			std::map<void const*, uint32_t>::iterator known
+			    = moduleIds.find(info.dli_fbase);
+			if(known == moduleIds.end())
+			{
+				modules.push_back(info.dli_fname);
+				known = moduleIds
+				            .insert(std::make_pair(
+				                info.dli_fbase,
+				                static_cast<uint32_t>(modules.size())))
+				            .first;
+			}
+			frame.module = known->second;
+			frame.offset = static_cast<char const*>(addr)
+			               - static_cast<char const*>(info.dli_fbase);
+		}
+
+		frames.insert(std::make_pair(addr, frame));
+		return frame;
+	}
+
+	void putUnsigned(uint64_t value) { putUnsigned(&data, value); }
+
+	void putSigned(int64_t value)
+	{
+		char bytes[10];
+		data.append(bytes, Leb128::encodeSigned(value, bytes));
+	}
+
+	static void putUnsigned(std::string* out, uint64_t value)
+	{
+		char bytes[10];
+		out->append(bytes, Leb128::encodeUnsigned(value, bytes));
+	}
+};
+
+/*! \ingroup exceptions
+ * Reads a batch written by StackEncoder.
+ */
+class StackBatchReader
+{
+  public:
+	StackBatchReader()
+	    : pos(NULL)
+	    , end(NULL)
+	    , records(0)
+	    , recordsRead(0)
+	{
+	}
+
+	/*! Reads the header and the modules of a batch, returns false if it
+	 * isn't one, or if it is compressed and zstd isn't available.
+	 *
+	 * The data must outlive the reader unless it was compressed.
+	 */
+	bool open(char const* batch, size_t size)
+	{
+		modules.clear();
+		records     = 0;
+		recordsRead = 0;
+		if(size < 6 || memcmp(batch, "STKB\1", 5) != 0)
+			return false;
+
+		int flags = batch[5];
+		pos       = batch + 6;
+		end       = batch + size;
+		if(flags & StackEncoder::FLAG_ZSTD)
+		{
+#ifdef STACKTRACE_ZSTD
+			unsigned long long expanded
+			    = ZSTD_getFrameContentSize(pos, end - pos);
+			if(expanded == ZSTD_CONTENTSIZE_UNKNOWN
+			   || expanded == ZSTD_CONTENTSIZE_ERROR)
+				return false;
+			payload.resize(expanded);
+			size_t result = ZSTD_decompress(&payload[0], payload.size(), pos,
+			                                end - pos);
+			if(ZSTD_isError(result) || result != expanded)
+				return false;
+			pos = payload.data();
+			end = pos + payload.size();
+#else
+			return false;
+#endif
+		}
+
+		uint64_t count;
+		if(!getUnsigned(&count) || count > static_cast<size_t>(end - pos))
+			return false;
+		for(uint64_t i = 0; i < count; ++i)
+		{
+			uint64_t length;
+			if(!getUnsigned(&length)
+			   || length > static_cast<size_t>(end - pos))
+				return false;
+			modules.push_back(std::string(pos, length));
+			pos += length;
+		}
+
+		uint64_t stacks;
+		if(!getUnsigned(&stacks))
+			return false;
+		records = stacks;
+		return true;
+	}
+
+	/*! Number of stacks in the batch.
+	 */
+	size_t size() const { return records; }
+
+	size_t getModuleCount() const { return modules.size(); }
+
+	/*! Returns the path of a module as given by dladdr(), NULL for module 0
+	 * or an unknown one.
+	 */
+	char const* getModulePath(uint32_t module) const
+	{
+		if(module == 0 || module > modules.size())
+			return NULL;
+		return modules[module - 1].c_str();
+	}
+
+	/*! Reads the next stack and its values, returns false at the end of the
+	 * batch or if it is corrupted.
+	 */
+	bool next(std::vector<uint64_t>* values, std::vector<EncodedFrame>* frames)
+	{
+		values->clear();
+		frames->clear();
+		if(recordsRead == records)
+			return false;
+
+		uint64_t count;
+		if(!getUnsigned(&count) || count > static_cast<size_t>(end - pos))
+			return false;
+		for(uint64_t i = 0; i < count; ++i)
+		{
+			uint64_t value;
+			if(!getUnsigned(&value))
+				return false;
+			values->push_back(value);
+		}
+
+		if(!getUnsigned(&count) || count > static_cast<size_t>(end - pos))
+			return false;
+		EncodedFrame frame = {0, 0};
+		for(uint64_t i = 0; i < count; ++i)
+		{
+			uint64_t tag;
+			if(!getUnsigned(&tag) || (tag == 0 && i == 0)
+			   || tag > modules.size() + 1)
+				return false;
+
+			if(tag == 0)
+			{
+				int64_t delta;
+				size_t length = Leb128::decodeSigned(pos, end, &delta);
+				if(length == 0)
+					return false;
+				pos += length;
+				frame.offset += delta;
+			}
+			else
+			{
+				uint64_t offset;
+				if(!getUnsigned(&offset))
+					return false;
+				frame.module = static_cast<uint32_t>(tag - 1);
+				frame.offset = static_cast<uintptr_t>(offset);
+			}
+			frames->push_back(frame);
+		}
+
+		++recordsRead;
+		return true;
+	}
+
+  private:
+	// decompressed batch
+	std::string payload;
+	char const* pos;
+	char const* end;
+	std::vector<std::string> modules;
+	size_t records;
+	size_t recordsRead;
+
+	bool getUnsigned(uint64_t* value)
+	{
+		size_t length = Leb128::decodeUnsigned(pos, end, value);
+		pos += length;
+		return length != 0;
+	}
+};
+
+#endif
@@ -0,0 +1,321 @@
+/*
+    Copyright (C) 2017 Florian Cabot
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#ifndef STACKTRACE_STACKSCANNER
+#define STACKTRACE_STACKSCANNER
+
+#include <cstring>
+#include <pthread.h>
+#include <stdint.h>
+
+#include "CfiUnwinder.hpp"
+#include "ForkGuard.hpp"
+#include "ModuleMap.hpp"
+
+// stack memory scanned at most, in bytes
+#ifndef STACKSCAN_MAX_BYTES
+#define STACKSCAN_MAX_BYTES 65536
+#endif
+
+/*! \ingroup exceptions
+ * How likely a scanned frame is a real return address.
+ */
+enum ScanConfidence
+{
+	// points into code, the preceding instruction isn't checked (unknown
+	// architecture)
+	SCAN_LOW,
+	// follows an indirect call
+	SCAN_MEDIUM,
+	// follows a direct call to code
+	SCAN_HIGH
+};
+
+/*! \ingroup exceptions
+ * Frame found by StackScanner.
+ */
+struct ScannedFrame
+{
+	void* addr;
+	ScanConfidence confidence;
+};
+
+/*! \ingroup exceptions
+ * Finds return addresses by scanning the raw memory of a stack, when unwinding
+ * stops early (smashed stack, code without unwind information).
+ *
+ * Each word between a stack pointer and the top of the thread's stack is
+ * looked up in the module table, with a binary search; a word pointing into
+ * the code of a module is kept if the instruction before it is a call, on
+ * x86 and ARM64. The scan is bounded by STACKSCAN_MAX_BYTES.
+ *
+ * Old return addresses left in the stack and other code pointers can show up
+ * too: scanned frames are hints, marked with their confidence.
+ */
+class StackScanner
+{
+  public:
+	/*! Scans the calling thread's stack from sp, returns the number of frames
+	 * found, at most max.
+	 *
+	 * Returns 0 if sp isn't within the thread's stack or the module table is
+	 * being used by another thread.
+	 */
+	static int scan(uintptr_t sp, ScannedFrame* frames, int max)
+	{
+		uintptr_t top;
+		if(!getStackTop(sp, &top))
+			return 0;
+		if(top - sp > STACKSCAN_MAX_BYTES)
+			top = sp + STACKSCAN_MAX_BYTES;
+
+		// a crash may happen while the table is updated, don't wait for it
+		if(pthread_mutex_trylock(&getMutex()) != 0)
+			return 0;
+		ModuleMap& modules = getModules();
+		modules.update();
+
+		int count = 0;
+		sp        = (sp + sizeof(uintptr_t) - 1) & ~(sizeof(uintptr_t) - 1);
+		for(uintptr_t p = sp; p + sizeof(uintptr_t) <= top && count < max;
+		    p += sizeof(uintptr_t))
+		{
+			uintptr_t value = *reinterpret_cast<uintptr_t const*>(p);
+			int confidence  = checkReturnAddress(modules, value);
+			if(confidence < 0)
+				continue;
+
+			frames[count].addr       = reinterpret_cast<void*>(value);
+			frames[count].confidence = static_cast<ScanConfidence>(confidence);
+			++count;
+		}
+
+		pthread_mutex_unlock(&getMutex());
+		return count;
+	}
+
+	/*! Tells if unwinding a stack that stopped at returnAddress reached its
+	 * end, the entry point of the program or of a thread, see
+	 * CfiUnwinder::isOutermost(). Returns false too if the module table is
+	 * being used by another thread.
+	 */
+	static bool isStackEnd(void const* returnAddress)
+	{
+		if(pthread_mutex_trylock(&getMutex()) != 0)
+			return false;
+		ModuleMap& modules = getModules();
+		modules.update();
+		uintptr_t pc              = reinterpret_cast<uintptr_t>(returnAddress);
+		ModuleMap::Module* module = modules.find(pc - 1);
+		bool end = module != NULL
+		           && CfiUnwinder::isOutermost(module->ehFrameHdr, pc);
+		pthread_mutex_unlock(&getMutex());
+		return end;
+	}
+
+	/*! Unwinds the stack a signal interrupted with the call frame
+	 * information of its modules (see CfiUnwinder), from the registers of
+	 * the ucontext given to the handler. Stores the interrupted instruction
+	 * then the return addresses in frames, and the stack pointer of the
+	 * outermost frame in sp, from which the rest of the stack can be scanned.
+	 *
+	 * Returns the number of frames, at most max, 0 if the architecture isn't
+	 * supported or the module table is being used by another thread.
+	 */
+	static int unwind(void const* ucontext, void** frames, int max,
+	                  uintptr_t* sp)
+	{
+		UnwindRegisters frame;
+		if(max <= 0 || !CfiUnwinder::getRegisters(ucontext, &frame))
+			return 0;
+		if(pthread_mutex_trylock(&getMutex()) != 0)
+			return 0;
+		ModuleMap& modules = getModules();
+		modules.update();
+
+		// a smashed stack gives return addresses out of the code, the stack
+		// is scanned from the last frame that made sense instead
+		int count = 0;
+		UnwindRegisters caller;
+		do
+		{
+			frames[count++] = reinterpret_cast<void*>(frame.pc);
+			*sp             = CfiUnwinder::getStackPointer(frame);
+
+			ModuleMap::Module* module = modules.find(frame.lookupPc());
+			if(count == max || module == NULL
+			   || !CfiUnwinder::step(module->ehFrameHdr, &frame, &caller))
+				break;
+			frame = caller;
+		} while(isCode(modules, frame.lookupPc(), 1));
+
+		pthread_mutex_unlock(&getMutex());
+		return count;
+	}
+
+	/*! Reads the modules loaded since the last update of the module table,
+	 * which isLoadedCode() answers from. Returns false if the table is being
+	 * used by another thread.
+	 */
+	static bool updateModules()
+	{
+		if(pthread_mutex_trylock(&getMutex()) != 0)
+			return false;
+		getModules().update();
+		pthread_mutex_unlock(&getMutex());
+		return true;
+	}
+
+	/*! Tells if the size bytes at addr are in the code of a module loaded at
+	 * the last update of the module table, see updateModules(), so that they
+	 * can be read. Returns false too if the table is being used by another
+	 * thread.
+	 */
+	static bool isLoadedCode(void const* addr, size_t size)
+	{
+		if(pthread_mutex_trylock(&getMutex()) != 0)
+			return false;
+		bool code
+		    = isCode(getModules(), reinterpret_cast<uintptr_t>(addr), size);
+		pthread_mutex_unlock(&getMutex());
+		return code;
+	}
+
+	static char const* getConfidenceName(ScanConfidence confidence)
+	{
+		static char const* const names[] = {"low", "medium", "high"};
+		return names[confidence];
+	}
+
+	/*! Keeps the module table usable in children of fork(), see ForkGuard.
+	 */
+	static void guardFork() { ForkGuard<getMutex>::install(); }
+
+  private:
+	// never destroyed, like the symbolizer's, for reports printed at exit
+	static ModuleMap& getModules()
+	{
+		static ModuleMap* _modules = new ModuleMap;
+		return *_modules;
+	}
+
+	static pthread_mutex_t& getMutex()
+	{
+		static pthread_mutex_t _mutex = PTHREAD_MUTEX_INITIALIZER;
+		return _mutex;
+	}
+
+	static bool getStackTop(uintptr_t sp, uintptr_t* top)
+	{
+		pthread_attr_t attr;
+		void* stackAddr;
+		size_t stackSize;
+		if(pthread_getattr_np(pthread_self(), &attr) != 0)
+			return false;
+		int result = pthread_attr_getstack(&attr, &stackAddr, &stackSize);
+		pthread_attr_destroy(&attr);
+		if(result != 0)
+			return false;
+
+		uintptr_t low = reinterpret_cast<uintptr_t>(stackAddr);
+		*top          = low + stackSize;
+		return sp >= low && sp < *top;
+	}
+
+	static bool isCode(ModuleMap& modules, uintptr_t addr, size_t size)
+	{
+		ModuleMap::Module* module = modules.find(addr);
+		return module != NULL && addr >= module->codeBegin
+		       && addr + size <= module->codeEnd;
+	}
+
+	// returns the confidence of a return address, -1 if it isn't one
+	static int checkReturnAddress(ModuleMap& modules, uintptr_t value)
+	{
+#if defined(__x86_64__) || defined(__i386__)
+		// the longest call is 7 bytes: FF /2 with a SIB byte and a disp32,
+		// and the byte at value may be read as a SIB byte
+		if(!isCode(modules, value - 7, 8))
+			return -1;
+		unsigned char const* code
+		    = reinterpret_cast<unsigned char const*>(value);
+
+		if(code[-5] == 0xE8)
+		{
+			int32_t offset;
+			memcpy(&offset, code - 4, sizeof(offset));
+			return isCode(modules, value + offset, 1) ? SCAN_HIGH : -1;
+		}
+
+		// FF /2, indirect call through a register or memory
+		static int const lengths[] = {2, 3, 4, 6, 7};
+		for(size_t i = 0; i < sizeof(lengths) / sizeof(lengths[0]); ++i)
+		{
+			unsigned char const* call = code - lengths[i];
+			if(call[0] == 0xFF && ((call[1] >> 3) & 7) == 2
+			   && getModRmLength(call[1], call[2]) == lengths[i])
+				return SCAN_MEDIUM;
+		}
+		return -1;
+#elif defined(__aarch64__)
+		if((value & 3) != 0 || !isCode(modules, value - 4, 4))
+			return -1;
+		uint32_t insn;
+		memcpy(&insn, reinterpret_cast<void const*>(value - 4), sizeof(insn));
+
+		// BL, whose signed 26-bit offset counts instructions
+		if((insn & 0xFC000000) == 0x94000000)
+		{
+			int32_t offset = static_cast<int32_t>(insn << 6) >> 4;
+			return isCode(modules, value - 4 + offset, 1) ? SCAN_HIGH : -1;
+		}
+		// BLR
+		if((insn & 0xFFFFFC1F) == 0xD63F0000)
+			return SCAN_MEDIUM;
+		return -1;
+#else
+		return isCode(modules, value, 1) ? SCAN_LOW : -1;
+#endif
+	}
+
+#if defined(__x86_64__) || defined(__i386__)
+	// length of an FF instruction given its ModR/M and SIB bytes
+	static int getModRmLength(unsigned char modRm, unsigned char sib)
+	{
+		int mod = modRm >> 6;
+		int rm  = modRm & 7;
+		switch(mod)
+		{
+			case 3:
+				return 2;
+			case 0:
+				if(rm == 5)
+					return 6;
+				if(rm == 4)
+					return (sib & 7) == 5 ? 7 : 3;
+				return 2;
+			case 1:
+				return rm == 4 ? 4 : 3;
+			default:
+				return rm == 4 ? 7 : 6;
+		}
+	}
+#endif
+};
+
+#endif
@@ -0,0 +1,213 @@
+/*
+    Copyright (C) 2017 Florian Cabot
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#ifndef STACKTRACE_STACKTABLE
+#define STACKTRACE_STACKTABLE
+
+#include "SelfMetrics.hpp"
+#include <atomic>
+#include <stdint.h>
+
+/*! \ingroup exceptions
+ * Fixed-size table of interned stack traces.
+ *
+ * Each distinct sequence of frames is stored once and identified by a 32-bit
+ * id (starting at 1, 0 meaning "no stack"). Interning never allocates and never
+ * locks, so it can be used from interposed libc functions and from signal
+ * handlers. When the table or its frame pool is full, intern() returns 0 and
+ * the caller is expected to account the event as dropped.
+ *
+ * Instances are meant to be static: all members are zero-initialized and no
+ * constructor has to run before the first call.
+ *
+ * \param Capacity Maximum number of distinct stacks, must be a power of two.
+ * \param FramesCapacity Total number of frames shared by all stored stacks.
+ */
+template <uint32_t Capacity, uint32_t FramesCapacity>
+class StackTable
+{
+  public:
+	/*! Returns the id of the given stack, inserting it if needed.
+	 *
+	 * Returns 0 if the stack could not be stored.
+	 */
+	uint32_t intern(void* const* frames, int count)
+	{
+		if(count <= 0)
+			return 0;
+
+		uint32_t hash = hashFrames(frames, count);
+
+		for(uint32_t probe = 0; probe < Capacity; ++probe)
+		{
+			Slot& slot = slots[(hash + probe) & (Capacity - 1)];
+			uint32_t slotHash = slot.hash.load(std::memory_order_acquire);
+
+			if(slotHash == 0)
+			{
+				uint32_t expected = 0;
+				if(slot.hash.compare_exchange_strong(expected, hash))
+					return publish(slot, frames, count);
+				slotHash = expected;
+			}
+
+			if(slotHash != hash)
+				continue;
+
+			uint32_t id = waitForId(slot);
+			if(id == 0)
+				return 0;
+			if(id != deadId && equals(id, frames, count))
+				return id;
+		}
+
+		return 0;
+	}
+
+	/*! Retrieves the frames of a stack.
+	 *
+	 * Returns the number of frames, or 0 if the id is unknown.
+	 */
+	int getFrames(uint32_t id, void* const** frames) const
+	{
+		if(id == 0 || id > Capacity)
+			return 0;
+
+		int count = counts[id - 1].load(std::memory_order_acquire);
+		if(count != 0)
+			*frames = pool + offsets[id - 1];
+		return count;
+	}
+
+	/*! Number of ids handed out so far.
+	 *
+	 * Valid ids are within [1, size()]; an id whose stack is still being
+	 * written reports 0 frames in getFrames().
+	 */
+	uint32_t size() const
+	{
+		uint32_t n = nextId.load(std::memory_order_acquire);
+		return n < Capacity ? n : Capacity;
+	}
+
+	/*! Forgets all stacks, ids start again from 1.
+	 *
+	 * No intern() nor getFrames() may run meanwhile.
+	 */
+	void clear()
+	{
+		for(uint32_t i = 0; i < Capacity; ++i)
+		{
+			slots[i].hash.store(0, std::memory_order_relaxed);
+			slots[i].id.store(0, std::memory_order_relaxed);
+			counts[i].store(0, std::memory_order_relaxed);
+		}
+		poolTop.store(0, std::memory_order_relaxed);
+		nextId.store(0, std::memory_order_release);
+	}
+
+	/*! Number of intern() calls that could not store their stack.
+	 */
+	uint32_t dropped() const
+	{
+		return droppedCount.load(std::memory_order_relaxed);
+	}
+
+  private:
+	static const uint32_t deadId = 0xFFFFFFFFu;
+
+	struct Slot
+	{
+		std::atomic<uint32_t> hash;
+		std::atomic<uint32_t> id;
+	};
+
+	Slot slots[Capacity];
+	uint32_t offsets[Capacity];
+	std::atomic<int> counts[Capacity];
+	void* pool[FramesCapacity];
+	std::atomic<uint32_t> poolTop;
+	std::atomic<uint32_t> nextId;
+	std::atomic<uint32_t> droppedCount;
+
+	static uint32_t hashFrames(void* const* frames, int count)
+	{
+		// FNV-1a over the frame addresses, never returns 0 (empty slot)
+		uint64_t h = 14695981039346656037ull;
+		for(int i = 0; i < count; ++i)
+		{
+			h ^= reinterpret_cast<uintptr_t>(frames[i]);
+			h *= 1099511628211ull;
+		}
+		uint32_t result = static_cast<uint32_t>(h ^ (h >> 32));
+		return result != 0 ? result : 1;
+	}
+
+	uint32_t publish(Slot& slot, void* const* frames, int count)
+	{
+		uint32_t offset = poolTop.fetch_add(count, std::memory_order_relaxed);
+		uint32_t id     = nextId.fetch_add(1, std::memory_order_relaxed) + 1;
+
+		if(offset + count > FramesCapacity || offset + count < offset
+		   || id > Capacity)
+		{
+			slot.id.store(deadId, std::memory_order_release);
+			droppedCount.fetch_add(1, std::memory_order_relaxed);
+			SelfMetrics::add(SELF_DROPPED_SAMPLES, 1);
+			return 0;
+		}
+
+		for(int i = 0; i < count; ++i)
+			pool[offset + i] = frames[i];
+		offsets[id - 1] = offset;
+		counts[id - 1].store(count, std::memory_order_release);
+		slot.id.store(id, std::memory_order_release);
+		return id;
+	}
+
+	// the slot may have been claimed by a writer that has not published yet;
+	// don't wait forever since this writer may be the thread we interrupted
+	uint32_t waitForId(Slot& slot)
+	{
+		for(int spin = 0; spin < 1024; ++spin)
+		{
+			uint32_t id = slot.id.load(std::memory_order_acquire);
+			if(id != 0)
+				return id;
+		}
+		droppedCount.fetch_add(1, std::memory_order_relaxed);
+		SelfMetrics::add(SELF_DROPPED_SAMPLES, 1);
+		return 0;
+	}
+
+	bool equals(uint32_t id, void* const* frames, int count) const
+	{
+		if(counts[id - 1].load(std::memory_order_acquire) != count)
+			return false;
+
+		void* const* stored = pool + offsets[id - 1];
+		for(int i = 0; i < count; ++i)
+		{
+			if(stored[i] != frames[i])
+				return false;
+		}
+		return true;
+	}
+};
+
+#endif
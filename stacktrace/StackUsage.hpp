@@ -0,0 +1,493 @@
+/*
+    Copyright (C) 2017 Florian Cabot
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#ifndef STACKTRACE_STACKUSAGE
+#define STACKTRACE_STACKUSAGE
+
+#include "../Cpp-stacktrace.hpp"
+#include "SamplingController.hpp"
+#include "SignalFrames.hpp"
+#include <atomic>
+#include <cstring>
+#include <pthread.h>
+#include <signal.h>
+#include <string>
+#include <sys/syscall.h>
+#include <sys/time.h>
+#include <ucontext.h>
+#include <unistd.h>
+#include <vector>
+
+#ifndef STACKUSAGE_MAX_THREADS
+#define STACKUSAGE_MAX_THREADS 4096
+#endif
+
+/*! \ingroup exceptions
+ * Stack usage of one registered thread, see StackUsage::getUsage().
+ */
+struct ThreadStackUsage
+{
+	pid_t tid;
+	std::string name;
+	bool exited;
+	// size of the usable stack
+	size_t size;
+	// deepest point ever written to the stack
+	size_t highWater;
+	// depth of the deepest sampled stack and its frames
+	size_t deepestSampled;
+	std::vector<void*> deepestStack;
+};
+
+/*! \ingroup exceptions
+ * Measures how much of their stack the registered threads really use.
+ *
+ * When a thread registers, the unused part of its stack is painted with a known
+ * pattern; the high water mark is then found by looking for the deepest word
+ * that doesn't hold the pattern anymore. Threads are measured on demand with
+ * getUsage() or print_stack_usage(), and when they exit.
+ *
+ * Painting touches every page of the stack, so a registered thread's stack is
+ * entirely resident.
+ *
+ * The deepest stack is only known through sampling: sample() records the
+ * current stack of the calling thread if it is deeper than any previously
+ * sampled one, and startSampling() calls it periodically from a SIGPROF timer.
+ * The timer is slowed down when the handler takes more than the budget of its
+ * SamplingController.
+ *
+ * In a child of fork(), the registry only holds the thread that forked, and
+ * sampling goes on with a timer of its own.
+ */
+class StackUsage
+{
+  public:
+	/*! Paints the calling thread's stack and starts tracking it.
+	 *
+	 * Returns false if the thread couldn't be registered (registry full or
+	 * stack bounds unknown).
+	 */
+	static bool registerThread(char const* name = NULL)
+	{
+		if(getSelf() != NULL)
+			return true;
+		guardFork();
+
+		pthread_attr_t attr;
+		void* stackAddr;
+		size_t stackSize;
+		if(pthread_getattr_np(pthread_self(), &attr) != 0)
+			return false;
+		int result = pthread_attr_getstack(&attr, &stackAddr, &stackSize);
+		pthread_attr_destroy(&attr);
+		if(result != 0)
+			return false;
+
+		Entry* entry = allocate();
+		if(entry == NULL)
+			return false;
+
+		entry->tid       = static_cast<pid_t>(syscall(SYS_gettid));
+		entry->low       = static_cast<char*>(stackAddr);
+		entry->high      = entry->low + stackSize;
+		entry->highWater = 0;
+		entry->depth     = 0;
+		entry->deepestSp.store(0, std::memory_order_relaxed);
+		strncpy(entry->name, name != NULL ? name : "", sizeof(entry->name) - 1);
+		entry->name[sizeof(entry->name) - 1] = '\0';
+
+		paint(entry);
+
+		getSelf() = entry;
+		pthread_setspecific(getKey(), entry);
+		entry->state.store(LIVE, std::memory_order_release);
+		return true;
+	}
+
+	/*! Records the calling thread's stack if it is the deepest seen so far.
+	 *
+	 * Cheap when the stack isn't deeper: one comparison.
+	 */
+	__attribute__((noinline)) static void sample()
+	{
+		// skip record() and this function
+		record(reinterpret_cast<uintptr_t>(__builtin_frame_address(0)), 2);
+	}
+
+	/*! Samples the running threads every intervalUs microseconds of CPU time.
+	 */
+	static void startSampling(long intervalUs)
+	{
+		// the first backtrace() loads the unwinder, which can't be done from
+		// the signal handler
+		void* buffer[1];
+		backtrace(buffer, 1);
+		guardFork();
+
+		struct sigaction action;
+		memset(&action, 0, sizeof(action));
+		action.sa_sigaction = sigprofHandler;
+		action.sa_flags     = SA_SIGINFO | SA_RESTART;
+		sigemptyset(&action.sa_mask);
+		sigaction(SIGPROF, &action, NULL);
+
+		getInterval().store(intervalUs, std::memory_order_relaxed);
+		armTimer(intervalUs * getController().getPeriod());
+	}
+
+	static void stopSampling()
+	{
+		// keeps the handler from arming the timer again
+		getInterval().store(0, std::memory_order_relaxed);
+
+		itimerval timer;
+		memset(&timer, 0, sizeof(timer));
+		setitimer(ITIMER_PROF, &timer, NULL);
+	}
+
+	/*! Controller of the cost of the SIGPROF handler, the timer fires every
+	 * interval times its period.
+	 */
+	static SamplingController& getController()
+	{
+		static SamplingController _controller;
+		return _controller;
+	}
+
+	/*! Measures all registered threads, the live ones first.
+	 */
+	static std::vector<ThreadStackUsage> getUsage()
+	{
+		std::vector<ThreadStackUsage> result;
+
+		// an exiting thread waits for the lock before its stack is released
+		pthread_mutex_lock(&getMutex());
+		for(int pass = 0; pass < 2; ++pass)
+		{
+			for(int i = 0; i < STACKUSAGE_MAX_THREADS; ++i)
+			{
+				Entry& entry = getEntries()[i];
+				int state    = entry.state.load(std::memory_order_acquire);
+				if(state != (pass == 0 ? LIVE : EXITED))
+					continue;
+
+				ThreadStackUsage usage;
+				usage.tid       = entry.tid;
+				usage.name      = entry.name;
+				usage.exited    = state == EXITED;
+				usage.size      = entry.high - entry.low;
+				usage.highWater = state == LIVE ? measure(&entry)
+				                                : entry.highWater;
+				copyDeepest(&entry, &usage);
+				result.push_back(usage);
+			}
+		}
+		pthread_mutex_unlock(&getMutex());
+
+		return result;
+	}
+
+	/*! Prints the stack usage of the registered threads when the program
+	 * exits normally.
+	 */
+	static void reportAtExit() { atexit(printAtExit); }
+
+  private:
+	enum State
+	{
+		FREE,
+		RESERVED,
+		LIVE,
+		EXITED
+	};
+
+	static const uint64_t pattern = 0x5354414B55534147ull;
+
+	struct Entry
+	{
+		std::atomic<int> state;
+		pid_t tid;
+		char name[32];
+		char* low;
+		char* high;
+		size_t highWater;
+		// seqlock protecting the deepest stack, written by its own thread
+		std::atomic<unsigned int> sequence;
+		std::atomic<uintptr_t> deepestSp;
+		int depth;
+		void* frames[MAX_BACKTRACE_LINES];
+	};
+
+	static Entry* getEntries()
+	{
+		static Entry _entries[STACKUSAGE_MAX_THREADS];
+		return _entries;
+	}
+
+	static Entry*& getSelf()
+	{
+		static __thread Entry* _self;
+		return _self;
+	}
+
+	static pthread_mutex_t& getMutex()
+	{
+		static pthread_mutex_t _mutex = PTHREAD_MUTEX_INITIALIZER;
+		return _mutex;
+	}
+
+	// interval given to startSampling(), in microseconds
+	static std::atomic<long>& getInterval()
+	{
+		static std::atomic<long> _interval;
+		return _interval;
+	}
+
+	static void armTimer(long intervalUs)
+	{
+		itimerval timer;
+		timer.it_interval.tv_sec  = intervalUs / 1000000;
+		timer.it_interval.tv_usec = intervalUs % 1000000;
+		timer.it_value            = timer.it_interval;
+		setitimer(ITIMER_PROF, &timer, NULL);
+	}
+
+	static pthread_key_t getKey()
+	{
+		static pthread_once_t _once = PTHREAD_ONCE_INIT;
+		pthread_once(&_once, createKey);
+		return getKeyStorage();
+	}
+
+	static void createKey()
+	{
+		pthread_key_create(&getKeyStorage(), onThreadExit);
+	}
+
+	static pthread_key_t& getKeyStorage()
+	{
+		static pthread_key_t _key;
+		return _key;
+	}
+
+	static void guardFork()
+	{
+		static pthread_once_t _once = PTHREAD_ONCE_INIT;
+		pthread_once(&_once, registerForkHandlers);
+	}
+
+	static void registerForkHandlers()
+	{
+		pthread_atfork(lockForFork, unlockForFork, resetAfterFork);
+	}
+
+	static void lockForFork() { pthread_mutex_lock(&getMutex()); }
+
+	static void unlockForFork() { pthread_mutex_unlock(&getMutex()); }
+
+	// the child only has the thread that forked, and no interval timer
+	static void resetAfterFork()
+	{
+		Entry* self = getSelf();
+		for(int i = 0; i < STACKUSAGE_MAX_THREADS; ++i)
+			if(getEntries() + i != self)
+				getEntries()[i].state.store(FREE, std::memory_order_relaxed);
+		if(self != NULL)
+			self->tid = static_cast<pid_t>(syscall(SYS_gettid));
+		pthread_mutex_unlock(&getMutex());
+
+		long interval = getInterval().load(std::memory_order_relaxed);
+		if(interval != 0)
+			armTimer(interval * getController().getPeriod());
+	}
+
+	static Entry* allocate()
+	{
+		Entry* exited = NULL;
+
+		pthread_mutex_lock(&getMutex());
+		for(int i = 0; i < STACKUSAGE_MAX_THREADS; ++i)
+		{
+			Entry& entry = getEntries()[i];
+			int state    = entry.state.load(std::memory_order_relaxed);
+			if(state == FREE)
+			{
+				entry.state.store(RESERVED, std::memory_order_relaxed);
+				pthread_mutex_unlock(&getMutex());
+				return &entry;
+			}
+			if(state == EXITED && exited == NULL)
+				exited = &entry;
+		}
+		// registry full, forget about an exited thread
+		if(exited != NULL)
+			exited->state.store(RESERVED, std::memory_order_relaxed);
+		pthread_mutex_unlock(&getMutex());
+
+		return exited;
+	}
+
+	__attribute__((noinline)) static void paint(Entry* entry)
+	{
+		long pageSize = sysconf(_SC_PAGESIZE);
+
+		// keep away from this function's own frame and from the guard page
+		char* top = static_cast<char*>(__builtin_frame_address(0)) - pageSize;
+		uint64_t* begin = reinterpret_cast<uint64_t*>(
+		    (reinterpret_cast<uintptr_t>(entry->low) + pageSize + 7) & ~7ul);
+		uint64_t* end = reinterpret_cast<uint64_t*>(
+		    reinterpret_cast<uintptr_t>(top) & ~7ul);
+
+		for(volatile uint64_t* p = begin; p < end; ++p)
+			*p = pattern;
+	}
+
+	static size_t measure(Entry const* entry)
+	{
+		long pageSize = sysconf(_SC_PAGESIZE);
+		uint64_t const* p = reinterpret_cast<uint64_t const*>(
+		    (reinterpret_cast<uintptr_t>(entry->low) + pageSize + 7) & ~7ul);
+		uint64_t const* end = reinterpret_cast<uint64_t const*>(entry->high);
+
+		while(p < end && *p == pattern)
+			++p;
+		return entry->high - reinterpret_cast<char const*>(p);
+	}
+
+	// never inlined, so that the frames its callers skip are always there
+	__attribute__((noinline)) static void record(uintptr_t sp, int skip)
+	{
+		Entry* entry = getSelf();
+		if(entry == NULL)
+			return;
+
+		uintptr_t deepest = entry->deepestSp.load(std::memory_order_relaxed);
+		if(deepest != 0 && sp >= deepest)
+			return;
+
+		entry->sequence.fetch_add(1, std::memory_order_acq_rel);
+		entry->deepestSp.store(sp, std::memory_order_relaxed);
+		uint64_t start = SelfMetrics::now();
+		int nptrs      = backtrace(entry->frames, MAX_BACKTRACE_LINES);
+		SelfMetrics::time(SELF_CAPTURE, start);
+		if(nptrs > skip)
+		{
+			memmove(entry->frames, entry->frames + skip,
+			        (nptrs - skip) * sizeof(void*));
+			entry->depth = nptrs - skip;
+		}
+		else
+			entry->depth = 0;
+		entry->sequence.fetch_add(1, std::memory_order_acq_rel);
+	}
+
+	static void copyDeepest(Entry const* entry, ThreadStackUsage* usage)
+	{
+		// retry while the thread is writing its deepest stack
+		for(int attempt = 0; attempt < 100; ++attempt)
+		{
+			unsigned int before
+			    = entry->sequence.load(std::memory_order_acquire);
+			if((before & 1) != 0)
+				continue;
+
+			uintptr_t sp = entry->deepestSp.load(std::memory_order_relaxed);
+			usage->deepestSampled
+			    = sp != 0 ? reinterpret_cast<uintptr_t>(entry->high) - sp : 0;
+			usage->deepestStack.assign(entry->frames,
+			                           entry->frames + entry->depth);
+
+			if(entry->sequence.load(std::memory_order_acquire) == before)
+				return;
+		}
+		usage->deepestSampled = 0;
+		usage->deepestStack.clear();
+	}
+
+	static void sigprofHandler(int sig, siginfo_t* info, void* ucontext)
+	{
+		(void) info;
+		int savedErrno = errno;
+		SignalFrames::enter(sig, ucontext);
+
+		uintptr_t sp = reinterpret_cast<uintptr_t>(__builtin_frame_address(0));
+#if defined(__x86_64__)
+		sp = static_cast<ucontext_t*>(ucontext)->uc_mcontext.gregs[REG_RSP];
+#else
+		(void) ucontext;
+#endif
+		uint64_t begin = SamplingController::begin();
+		// skip record(), the handler and the signal trampoline
+		record(sp, 3);
+		long interval = getInterval().load(std::memory_order_relaxed);
+		if(getController().end(begin) && interval != 0)
+			armTimer(interval * getController().getPeriod());
+
+		SignalFrames::leave();
+		errno = savedErrno;
+	}
+
+	static void onThreadExit(void* data)
+	{
+		Entry* entry = static_cast<Entry*>(data);
+
+		pthread_mutex_lock(&getMutex());
+		entry->highWater = measure(entry);
+		entry->state.store(EXITED, std::memory_order_release);
+		pthread_mutex_unlock(&getMutex());
+	}
+
+	static void printAtExit();
+};
+
+/*! \ingroup exceptions
+ * Prints the stack usage and deepest sampled stack of the registered threads.
+ */
+inline void print_stack_usage()
+{
+	std::vector<ThreadStackUsage> usages = StackUsage::getUsage();
+
+	ReportBuilder report;
+	report << "Stack usage of " << usages.size() << " threads:\n";
+	for(size_t i = 0; i < usages.size(); ++i)
+	{
+		ThreadStackUsage const& usage = usages[i];
+		report << "tid " << usage.tid << " \"" << usage.name << "\""
+		       << (usage.exited ? " (exited)" : "") << ": " << usage.highWater
+		       << " / " << usage.size << " bytes ("
+		       << (usage.size != 0 ? usage.highWater * 100 / usage.size : 0)
+		       << "%)";
+		if(usage.deepestStack.empty())
+		{
+			report << "\n";
+			continue;
+		}
+		report << ", deepest sampled stack (" << usage.deepestSampled
+		       << " bytes):\n";
+		append_frames(report, &usage.deepestStack[0],
+		              usage.deepestStack.size());
+	}
+	report.emit();
+}
+
+inline void StackUsage::printAtExit()
+{
+	print_stack_usage();
+}
+
+#endif
@@ -0,0 +1,154 @@
+/*
+    Copyright (C) 2017 Florian Cabot
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#ifndef STACKTRACE_STRINGPOOL
+#define STACKTRACE_STRINGPOOL
+
+#include <cstring>
+#include <stddef.h>
+#include <stdint.h>
+#include <vector>
+
+/*! \ingroup exceptions
+ * Append-only table of distinct strings, each known by a 32-bit id.
+ *
+ * The strings are stored one after the other, null-terminated, and their id
+ * is their offset: equal ids mean equal strings. Id 0 is the empty string.
+ * Strings can't be removed one by one, only all at once with clear().
+ */
+class StringPool
+{
+  public:
+	StringPool()
+	    : count(0)
+	    , hits(0)
+	    , misses(0)
+	{
+		chars.push_back('\0');
+	}
+
+	/*! Returns the id of a string, adding it if it isn't in the pool yet.
+	 *
+	 * Returns 0 (the empty string) if the pool is full.
+	 */
+	uint32_t intern(char const* str, size_t length)
+	{
+		if(length == 0)
+			return 0;
+
+		uint32_t hash = hashOf(str, length);
+		if(2 * (count + 1) > table.size())
+			grow();
+
+		size_t mask = table.size() - 1;
+		for(size_t slot = hash & mask;; slot = (slot + 1) & mask)
+		{
+			uint32_t id = table[slot];
+			if(id == 0)
+			{
+				if(chars.size() + length + 1 > UINT32_MAX)
+					return 0;
+
+				id = static_cast<uint32_t>(chars.size());
+				chars.insert(chars.end(), str, str + length);
+				chars.push_back('\0');
+				table[slot] = id;
+				++count;
+				++misses;
+				return id;
+			}
+			if(strncmp(&chars[id], str, length) == 0
+			   && chars[id + length] == '\0')
+			{
+				++hits;
+				return id;
+			}
+		}
+	}
+
+	uint32_t intern(char const* str) { return intern(str, strlen(str)); }
+
+	/*! Returns the string of an id, valid until the next call to intern().
+	 */
+	char const* get(uint32_t id) const { return &chars[id]; }
+
+	/*! Removes all the strings and frees their memory.
+	 */
+	void clear()
+	{
+		std::vector<char>(1, '\0').swap(chars);
+		std::vector<uint32_t>().swap(table);
+		count = 0;
+	}
+
+	/*! Number of strings, without the empty one.
+	 */
+	size_t size() const { return count; }
+
+	/*! Memory used by the strings and their index.
+	 */
+	size_t getBytes() const
+	{
+		return chars.capacity() + table.capacity() * sizeof(uint32_t);
+	}
+
+	// interned strings that were already there, and that were added
+	uint64_t getHits() const { return hits; }
+	uint64_t getMisses() const { return misses; }
+
+  private:
+	std::vector<char> chars;
+	// open addressing hash table of the ids, 0 for free slots
+	std::vector<uint32_t> table;
+	size_t count;
+	uint64_t hits;
+	uint64_t misses;
+
+	// FNV-1a
+	static uint32_t hashOf(char const* str, size_t length)
+	{
+		uint32_t hash = 2166136261u;
+		for(size_t i = 0; i < length; ++i)
+		{
+			hash ^= static_cast<unsigned char>(str[i]);
+			hash *= 16777619u;
+		}
+		return hash;
+	}
+
+	void grow()
+	{
+		std::vector<uint32_t> old;
+		old.swap(table);
+		table.resize(old.empty() ? 64 : 2 * old.size(), 0);
+
+		size_t mask = table.size() - 1;
+		for(size_t i = 0; i < old.size(); ++i)
+		{
+			if(old[i] == 0)
+				continue;
+			char const* str = &chars[old[i]];
+			size_t slot     = hashOf(str, strlen(str)) & mask;
+			while(table[slot] != 0)
+				slot = (slot + 1) & mask;
+			table[slot] = old[i];
+		}
+	}
+};
+
+#endif
@@ -0,0 +1,926 @@
+/*
+    Copyright (C) 2017 Florian Cabot
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#ifndef STACKTRACE_SYMBOLIZER
+#define STACKTRACE_SYMBOLIZER
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <cxxabi.h>
+#include <dlfcn.h>
+#include <fcntl.h>
+#include <link.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <spawn.h>
+#include <stdint.h>
+#include <string>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <unordered_map>
+#include <vector>
+
+#include "ClockCache.hpp"
+#include "ForkGuard.hpp"
+#include "JitSymbols.hpp"
+#include "SelfMetrics.hpp"
+#include "StringPool.hpp"
+#include "ModuleMap.hpp"
+
+// memory given to the caches of the symbolizer, in bytes
+#ifndef SYMBOLIZER_CACHE_BYTES
+#define SYMBOLIZER_CACHE_BYTES (8 << 20)
+#endif
+
+extern char** environ;
+
+/*! \ingroup exceptions
+ * Symbolized frame, filled by resolve_frames().
+ */
+struct ResolvedFrame
+{
+	// true if function and location come from the debug information
+	bool resolved;
+	// demangled function name, empty if unknown
+	char function[512];
+	// file name and line, without the directory
+	char location[256];
+	// file name of the module containing the address, empty if unknown
+	char module[128];
+	// offset of the address within the module
+	uintptr_t offset;
+};
+
+/*! \ingroup exceptions
+ * Counters of one of the caches of the Symbolizer.
+ */
+struct SymbolizerCacheStats
+{
+	uint64_t hits;
+	uint64_t misses;
+	uint64_t evictions;
+	size_t entries;
+	// estimated memory used by the entries
+	size_t bytes;
+};
+
+/*! \ingroup exceptions
+ * Counters of the caches of the Symbolizer, see get_symbolizer_stats().
+ */
+struct SymbolizerStats
+{
+	// resolved addresses
+	SymbolizerCacheStats frames;
+	// decoded line programs of compilation units
+	SymbolizerCacheStats units;
+	// demangled function names
+	SymbolizerCacheStats names;
+	// strings interned for the resolved addresses, evicted all at once
+	SymbolizerCacheStats strings;
+};
+
+/*! \ingroup exceptions
+ * Resolves addresses from the cheapest source to the most expensive one.
+ *
+ * Each address is first looked up in a process-wide cache, then in the dynamic
+ * symbol table with dladdr() (which gives the function name and module), and
+ * finally in the debug information. The debug information is read in the
+ * process with DwarfModule; addr2line, run once per module, is only used for
+ * the modules it can't read (compressed debug sections for example). The last
+ * steps stop at the deadline: addresses that haven't been resolved by then
+ * keep what the symbol table gave, or their module and offset.
+ *
+ * Addresses outside of any module are looked up in the code registered by
+ * JITs (JitRegistry), then in the perf map of the process (PerfMap), which is
+ * re-read as it grows. Their frames aren't cached, as code generated at run
+ * time may be replaced.
+ *
+ * Resolved addresses, decoded line programs and demangled names are cached
+ * within a memory budget shared by the three caches (SYMBOLIZER_CACHE_BYTES,
+ * or setCacheCapacity()). Past it, entries are evicted with CLOCK from the
+ * cache using the most memory. Cached addresses only hold ids of their
+ * function, file and module names, interned in a StringPool per module.
+ */
+class Symbolizer
+{
+  public:
+	/*! Monotonic time in nanoseconds, to compute deadlines.
+	 */
+	static int64_t now()
+	{
+		timespec ts;
+		clock_gettime(CLOCK_MONOTONIC, &ts);
+		return static_cast<int64_t>(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+	}
+
+	/*! Resolves count addresses.
+	 *
+	 * Returns the number of addresses resolved down to the source line.
+	 * \param programName Path of the program, used for addresses dladdr()
+	 * doesn't know about.
+	 * \param deadline Time (from now()) after which addr2line isn't waited for.
+	 */
+	static int resolve(char const* programName, void* const* addrs, int count,
+	                   ResolvedFrame* frames, int64_t deadline)
+	{
+		std::vector<Pending> pending;
+		int resolvedCount = 0;
+		uint64_t start    = SelfMetrics::now();
+		SelfMetrics::add(SELF_SYMBOLIZED_FRAMES, count);
+
+		// without the lock, the caches and the debug information are skipped
+		bool locked = lock(deadline);
+		if(locked)
+			refreshModules();
+		bool perfMapRead = false;
+
+		for(int i = 0; i < count; ++i)
+		{
+			if(locked && lookupCache(addrs[i], frames + i))
+			{
+				SelfMetrics::add(SELF_CACHE_HITS, 1);
+				if(frames[i].resolved)
+					++resolvedCount;
+				continue;
+			}
+			SelfMetrics::add(SELF_CACHE_MISSES, 1);
+
+			Pending p;
+			p.frame = frames + i;
+			p.addr  = addrs[i];
+			resolveSymbol(addrs[i], frames + i, &p.path, &p.fileAddr, locked);
+			if(p.path.empty()
+			   && resolveJit(addrs[i], frames + i, locked, &perfMapRead))
+				continue;
+			if(p.path.empty() && programName != NULL)
+				p.path = programName;
+			if(!p.path.empty())
+				pending.push_back(p);
+		}
+
+		if(locked)
+			resolveDwarf(&pending, deadline);
+		if(locked)
+			pthread_mutex_unlock(&getMutex());
+
+		// one addr2line run per module and per 64 addresses
+		std::stable_sort(pending.begin(), pending.end(), byPath);
+		for(size_t begin = 0; begin < pending.size();)
+		{
+			if(pending[begin].answered)
+			{
+				++begin;
+				continue;
+			}
+
+			size_t end = begin + 1;
+			while(end < pending.size() && end - begin < 64
+			      && pending[end].path == pending[begin].path
+			      && !pending[end].answered)
+				++end;
+
+			if(now() < deadline)
+				runAddr2line(&pending[begin], end - begin, deadline);
+			begin = end;
+		}
+
+		// results cut by the deadline aren't cached, a later report may have
+		// more time
+		locked = lock(deadline);
+		for(size_t i = 0; i < pending.size(); ++i)
+		{
+			if(pending[i].frame->resolved)
+				++resolvedCount;
+			if(locked && (pending[i].frame->resolved || pending[i].answered))
+				storeCache(pending[i].addr, pending[i].path,
+				           *pending[i].frame);
+		}
+		if(locked)
+			pthread_mutex_unlock(&getMutex());
+
+		SelfMetrics::time(SELF_SYMBOLIZATION, start);
+		return resolvedCount;
+	}
+
+	/*! Sets the memory given to the caches, in bytes, evicting entries if
+	 * they use more.
+	 */
+	static void setCacheCapacity(size_t bytes)
+	{
+		pthread_mutex_lock(&getMutex());
+		getCaches().capacity = bytes;
+		makeRoom(0);
+		pthread_mutex_unlock(&getMutex());
+	}
+
+	static SymbolizerStats getStats()
+	{
+		SymbolizerStats stats;
+		memset(&stats, 0, sizeof(stats));
+
+		pthread_mutex_lock(&getMutex());
+		Caches& caches = getCaches();
+		getCacheStats(caches.frames, &stats.frames);
+		getCacheStats(caches.units, &stats.units);
+		getCacheStats(caches.names, &stats.names);
+		for(size_t i = 0; i < caches.pools.size(); ++i)
+		{
+			stats.strings.hits += caches.pools[i].getHits();
+			stats.strings.misses += caches.pools[i].getMisses();
+			stats.strings.entries += caches.pools[i].size();
+		}
+		stats.strings.hits += caches.poolHits;
+		stats.strings.misses += caches.poolMisses;
+		stats.strings.evictions = caches.poolEvictions;
+		stats.strings.bytes     = getPoolBytes();
+		pthread_mutex_unlock(&getMutex());
+		return stats;
+	}
+
+	/*! Indexes the debug information of every loaded module, see
+	 * DwarfModule::buildLineIndex().
+	 */
+	static void prewarm(int threads)
+	{
+		pthread_mutex_lock(&getMutex());
+		refreshModules();
+		std::vector<ModuleMap::Debug*> pending;
+		ModuleMap& modules = getModules();
+		for(size_t i = 0; i < modules.size(); ++i)
+		{
+			// modules loaded since the last call are the only ones left
+			DwarfModule* dwarf = modules.getDwarf(modules[i]);
+			if(dwarf != NULL && !dwarf->hasLineIndex())
+			{
+				dwarf->loadSymbols();
+				pending.push_back(modules.acquire(modules[i]));
+			}
+		}
+		pthread_mutex_unlock(&getMutex());
+
+		for(size_t i = 0; i < pending.size(); ++i)
+		{
+			// lookups go on meanwhile, the module only changes once the
+			// index is complete
+			std::vector<DwarfLineEntry> index;
+			pending[i]->dwarf.buildLineIndex(threads, &index);
+
+			pthread_mutex_lock(&getMutex());
+			pending[i]->dwarf.setLineIndex(&index);
+			ModuleMap::release(pending[i]);
+			pthread_mutex_unlock(&getMutex());
+		}
+	}
+
+	/*! Keeps the caches usable in children of fork(), see ForkGuard: the
+	 * indexes built by the parent are shared, not rebuilt. fork() waits for
+	 * the symbolization in progress, if any.
+	 */
+	static void guardFork() { ForkGuard<getMutex>::install(); }
+
+  private:
+	struct Pending
+	{
+		Pending()
+		    : answered(false)
+		{
+		}
+
+		ResolvedFrame* frame;
+		void* addr;
+		std::string path;
+		uintptr_t fileAddr;
+		// the debug information has been read, even if it didn't know the
+		// address
+		bool answered;
+	};
+
+	// frame as cached, its strings are ids in the pool of its module
+	struct FrameEntry
+	{
+		// generation of the modules the frame was resolved with
+		uint64_t generation;
+		uintptr_t offset;
+		uint32_t pool;
+		uint32_t function;
+		uint32_t file;
+		// NO_LINE if the location isn't made of a file and a line
+		uint32_t line;
+		uint32_t module;
+		bool resolved;
+	};
+
+	static uint32_t const NO_LINE = UINT32_MAX;
+
+	struct UnitKey
+	{
+		DwarfModule const* module;
+		uint64_t unit;
+
+		bool operator==(UnitKey const& other) const
+		{
+			return module == other.module && unit == other.unit;
+		}
+	};
+
+	struct UnitKeyHash
+	{
+		size_t operator()(UnitKey const& key) const
+		{
+			return std::hash<void const*>()(key.module)
+			       ^ std::hash<uint64_t>()(key.unit) * 31;
+		}
+	};
+
+	struct Caches
+	{
+		Caches()
+		    : poolHits(0)
+		    , poolMisses(0)
+		    , poolEvictions(0)
+		    , capacity(SYMBOLIZER_CACHE_BYTES)
+		{
+		}
+
+		ClockCache<void*, FrameEntry> frames;
+		ClockCache<UnitKey, DwarfLineRows, UnitKeyHash> units;
+		ClockCache<std::string, std::string> names;
+		// strings of the cached frames, one pool per module path
+		std::vector<StringPool> pools;
+		std::unordered_map<std::string, uint32_t> poolIds;
+		// counters of the pools evicted
+		uint64_t poolHits;
+		uint64_t poolMisses;
+		uint64_t poolEvictions;
+		size_t capacity;
+	};
+
+	// never destroyed, reports may be printed by atexit() handlers registered
+	// before the caches are first used
+	static Caches& getCaches()
+	{
+		static Caches* _caches = new Caches;
+		return *_caches;
+	}
+
+	// generation of the module table, see ModuleMap
+	static std::atomic<uint64_t>& getGeneration()
+	{
+		static std::atomic<uint64_t> _generation(0);
+		return _generation;
+	}
+
+	// protects the caches and the modules
+	static pthread_mutex_t& getMutex()
+	{
+		static pthread_mutex_t _mutex = PTHREAD_MUTEX_INITIALIZER;
+		return _mutex;
+	}
+
+	// the lock may be held by the thread a signal handler interrupted, so it
+	// is only waited for a while
+	static bool lock(int64_t deadline)
+	{
+		if(pthread_mutex_trylock(&getMutex()) == 0)
+			return true;
+		int64_t wait = std::min<int64_t>(deadline - now(), 100000000);
+		if(wait <= 0)
+			return false;
+
+		timespec until;
+		clock_gettime(CLOCK_REALTIME, &until);
+		int64_t nanoseconds = until.tv_nsec + wait;
+		until.tv_sec += nanoseconds / 1000000000;
+		until.tv_nsec = nanoseconds % 1000000000;
+		return pthread_mutex_timedlock(&getMutex(), &until) == 0;
+	}
+
+	template <typename Key, typename Value, typename Hash>
+	static void getCacheStats(ClockCache<Key, Value, Hash> const& cache,
+	                          SymbolizerCacheStats* stats)
+	{
+		stats->hits      = cache.getHits();
+		stats->misses    = cache.getMisses();
+		stats->evictions = cache.getEvictions();
+		stats->entries   = cache.size();
+		stats->bytes     = cache.getCost();
+	}
+
+	// evicts from the cache using the most memory until cost more bytes fit,
+	// returns false if they can't
+	static bool makeRoom(size_t cost)
+	{
+		Caches& caches = getCaches();
+		if(cost > caches.capacity)
+			return false;
+
+		for(;;)
+		{
+			size_t frames = caches.frames.getCost();
+			size_t names  = caches.names.getCost();
+			size_t pools  = getPoolBytes();
+			size_t units = caches.units.getCost();
+			if(frames + units + names + pools + cost <= caches.capacity)
+				return true;
+
+			// the pools can only be emptied along with the frames
+			if(pools >= frames && pools >= units && pools >= names)
+				clearPools();
+			else if(units >= frames && units >= names)
+				caches.units.evict();
+			else if(frames >= names)
+				caches.frames.evict();
+			else
+				caches.names.evict();
+		}
+	}
+
+	static size_t getPoolBytes()
+	{
+		Caches& caches = getCaches();
+		size_t bytes   = 0;
+		for(size_t i = 0; i < caches.pools.size(); ++i)
+			bytes += caches.pools[i].getBytes();
+		return bytes;
+	}
+
+	static void clearPools()
+	{
+		Caches& caches = getCaches();
+		for(size_t i = 0; i < caches.pools.size(); ++i)
+		{
+			caches.poolHits += caches.pools[i].getHits();
+			caches.poolMisses += caches.pools[i].getMisses();
+		}
+		caches.frames.clear();
+		caches.pools.clear();
+		caches.poolIds.clear();
+		++caches.poolEvictions;
+	}
+
+	static StringPool& getPool(std::string const& path, uint32_t* id)
+	{
+		Caches& caches = getCaches();
+		std::unordered_map<std::string, uint32_t>::iterator it
+		    = caches.poolIds.find(path);
+		if(it == caches.poolIds.end())
+		{
+			it = caches.poolIds
+			         .insert(std::make_pair(
+			             path, static_cast<uint32_t>(caches.pools.size())))
+			         .first;
+			caches.pools.push_back(StringPool());
+		}
+		*id = it->second;
+		return caches.pools[it->second];
+	}
+
+	// estimated memory of a cached frame, with the table and the key
+	static size_t frameCost() { return sizeof(FrameEntry) + 64; }
+
+	static bool lookupCache(void* addr, ResolvedFrame* frame)
+	{
+		if(addr == NULL)
+			return false;
+
+		FrameEntry* entry = getCaches().frames.find(addr);
+		if(entry == NULL || entry->generation != getGeneration().load())
+			return false;
+
+		StringPool const& pool = getCaches().pools[entry->pool];
+		frame->resolved        = entry->resolved;
+		frame->offset          = entry->offset;
+		copyString(frame->function, sizeof(frame->function),
+		           pool.get(entry->function));
+		copyString(frame->module, sizeof(frame->module),
+		           pool.get(entry->module));
+		if(entry->line == NO_LINE)
+			copyString(frame->location, sizeof(frame->location),
+			           pool.get(entry->file));
+		else
+			setLocation(frame, pool.get(entry->file), entry->line);
+		return true;
+	}
+
+	static void storeCache(void* addr, std::string const& path,
+	                       ResolvedFrame const& frame)
+	{
+		// room for the strings too, if they aren't in the pool yet
+		size_t cost = frameCost() + strlen(frame.function)
+		              + strlen(frame.location) + strlen(frame.module) + 3;
+		if(!makeRoom(cost))
+			return;
+
+		FrameEntry entry;
+		StringPool& pool = getPool(path, &entry.pool);
+		entry.generation = getGeneration().load();
+		entry.offset     = frame.offset;
+		entry.resolved   = frame.resolved;
+		entry.function   = pool.intern(frame.function);
+		entry.module     = pool.intern(frame.module);
+
+		// "file:line", as most locations are, shares the file
+		char const* location = frame.location;
+		char const* colon    = strrchr(location, ':');
+		char* end            = NULL;
+		unsigned long line   = 0;
+		if(colon != NULL && colon[1] >= '0' && colon[1] <= '9')
+			line = strtoul(colon + 1, &end, 10);
+		if(end != NULL && *end == '\0' && line < NO_LINE)
+		{
+			entry.file = pool.intern(location, colon - location);
+			entry.line = static_cast<uint32_t>(line);
+		}
+		else
+		{
+			entry.file = pool.intern(location);
+			entry.line = NO_LINE;
+		}
+
+		getCaches().frames.insert(addr, entry, frameCost());
+	}
+
+	// copies at most size - 1 characters, always terminated
+	static void copyString(char* destination, size_t size, char const* source)
+	{
+		size_t length = strnlen(source, size - 1);
+		memcpy(destination, source, length);
+		destination[length] = '\0';
+	}
+
+	// groups the addresses left for addr2line by module
+	static bool byPath(Pending const& a, Pending const& b)
+	{
+		if(a.path != b.path)
+			return a.path < b.path;
+		return a.answered < b.answered;
+	}
+
+	static ModuleMap& getModules()
+	{
+		static ModuleMap* _modules = new ModuleMap;
+		return *_modules;
+	}
+
+	// never destroyed, like the caches
+	static PerfMap& getPerfMap()
+	{
+		static PerfMap* _perfMap = new PerfMap;
+		return *_perfMap;
+	}
+
+	// updates the modules, with the lock held; the decoded line programs
+	// are dropped as their modules may have been unloaded
+	static void refreshModules()
+	{
+		uint64_t generation = getModules().update();
+		if(generation != getGeneration().load())
+			getCaches().units.clear();
+		getGeneration() = generation;
+	}
+
+	// looks the addresses up in the debug information of their module, with
+	// the lock held
+	static void resolveDwarf(std::vector<Pending>* pending, int64_t deadline)
+	{
+		for(size_t i = 0; i < pending->size() && now() < deadline; ++i)
+		{
+			Pending& p = (*pending)[i];
+			ModuleMap::Module* loaded
+			    = getModules().find(reinterpret_cast<uintptr_t>(p.addr));
+			if(loaded == NULL)
+				continue;
+			DwarfModule* module = getModules().getDwarf(*loaded);
+			if(module == NULL)
+				continue;
+			uintptr_t fileAddr
+			    = reinterpret_cast<uintptr_t>(p.addr) - loaded->base;
+
+			p.answered = true;
+			if(p.frame->function[0] == '\0')
+				setFunction(p.frame, module->findFunction(fileAddr), true);
+
+			char const* file;
+			int line;
+			if(!findLine(module, fileAddr, &file, &line))
+				continue;
+
+			setLocation(p.frame, file, line);
+			if(p.frame->function[0] == '\0')
+				setFunction(p.frame, "??", false);
+			p.frame->resolved = true;
+		}
+	}
+
+	// finds a line in the index of the module if there is one, else in the
+	// cached line programs of its units
+	static bool findLine(DwarfModule* module, uintptr_t addr, char const** file,
+	                     int* line)
+	{
+		if(module->hasLineIndex())
+			return module->findLine(addr, file, line);
+
+		Caches& caches = getCaches();
+		uint64_t units[16];
+		int count = module->findUnits(addr, units, 16);
+		for(int i = 0; i < count; ++i)
+		{
+			UnitKey key        = {module, units[i]};
+			DwarfLineRows* rows = caches.units.find(key);
+			if(rows != NULL)
+			{
+				if(module->findLineInRows(*rows, units[i], addr, file, line))
+					return true;
+				continue;
+			}
+
+			// units too large for a quarter of the budget are run without
+			// keeping their rows
+			DwarfLineRows decoded;
+			if(!module->decodeLines(units[i], &decoded,
+			                        caches.capacity / 4 / rowCost()))
+				return module->findLine(addr, file, line);
+
+			bool found
+			    = module->findLineInRows(decoded, units[i], addr, file, line);
+			size_t cost = decoded.size() * rowCost() + 128;
+			if(makeRoom(cost))
+				caches.units.insert(key, std::move(decoded), cost);
+			if(found)
+				return true;
+		}
+		return false;
+	}
+
+	static size_t rowCost()
+	{
+		return sizeof(uint64_t) + 2 * sizeof(uint32_t) + sizeof(uint8_t);
+	}
+
+	// writes "file:line" as the location of the frame
+	static void setLocation(ResolvedFrame* frame, char const* file,
+	                        uint32_t line)
+	{
+		char digits[12];
+		int count = 0;
+		do
+		{
+			digits[sizeof(digits) - ++count] = '0' + line % 10;
+			line /= 10;
+		} while(line > 0 && count < static_cast<int>(sizeof(digits)) - 1);
+		digits[sizeof(digits) - ++count] = ':';
+
+		size_t length = std::min(strlen(file), sizeof(frame->location) - 1
+		                                           - static_cast<size_t>(count));
+		memcpy(frame->location, file, length);
+		memcpy(frame->location + length, digits + sizeof(digits) - count, count);
+		frame->location[length + count] = '\0';
+	}
+
+	// demangles name into the frame, through the cache if the lock is held
+	static void setFunction(ResolvedFrame* frame, char const* name,
+	                        bool locked)
+	{
+		if(name == NULL)
+			return;
+
+		std::string mangled(name);
+		std::string* cached = locked ? getCaches().names.find(mangled) : NULL;
+		std::string demangledName;
+		if(cached == NULL)
+		{
+			int status;
+			char* demangled = abi::__cxa_demangle(name, NULL, NULL, &status);
+			demangledName   = status == 0 ? demangled : name;
+			free(demangled);
+
+			size_t cost = mangled.size() + demangledName.size() + 128;
+			if(locked && makeRoom(cost))
+				getCaches().names.insert(mangled, demangledName, cost);
+			cached = &demangledName;
+		}
+
+		copyString(frame->function, sizeof(frame->function), cached->c_str());
+	}
+
+	// fills the function name, module and offset from the symbol table, and
+	// gives the module path and the address as addr2line expects it
+	static void resolveSymbol(void* addr, ResolvedFrame* frame,
+	                          std::string* path, uintptr_t* fileAddr,
+	                          bool locked)
+	{
+		frame->resolved    = false;
+		frame->function[0] = '\0';
+		frame->location[0] = '\0';
+		frame->module[0]   = '\0';
+		frame->offset      = 0;
+		*fileAddr          = reinterpret_cast<uintptr_t>(addr);
+
+		Dl_info info;
+		link_map* map = NULL;
+		if(dladdr1(addr, &info, reinterpret_cast<void**>(&map),
+		           RTLD_DL_LINKMAP)
+		       == 0
+		   || info.dli_fname == NULL)
+			return;
+
+		// addresses in the debug information are relative to the load bias
+		if(map != NULL)
+			*fileAddr -= map->l_addr;
+
+		*path = info.dli_fname;
+		// the main program is named as it was run, which may be relative to
+		// another working directory
+		if(map != NULL && map->l_name[0] == '\0')
+			*path = "/proc/self/exe";
+
+		char const* module = strrchr(info.dli_fname, '/');
+		module             = module != NULL ? module + 1 : info.dli_fname;
+		copyString(frame->module, sizeof(frame->module), module);
+
+		frame->offset
+		    = static_cast<char*>(addr) - static_cast<char*>(info.dli_fbase);
+
+		setFunction(frame, info.dli_sname, locked);
+	}
+
+	// names code generated at run time, from the registered ranges or the
+	// perf map, which is read once per resolve() and only with the lock held
+	static bool resolveJit(void* addr, ResolvedFrame* frame, bool locked,
+	                       bool* perfMapRead)
+	{
+		uintptr_t pc = reinterpret_cast<uintptr_t>(addr);
+		uintptr_t start;
+		char name[JIT_NAME_SIZE];
+		char const* found = NULL;
+		if(JitRegistry::find(pc, name, &start))
+			found = name;
+		else if(locked)
+		{
+			if(!*perfMapRead)
+				getPerfMap().update();
+			*perfMapRead = true;
+			found        = getPerfMap().find(pc, &start);
+		}
+		if(found == NULL)
+			return false;
+
+		setFunction(frame, found, locked);
+		copyString(frame->module, sizeof(frame->module), "[jit]");
+		frame->offset = pc - start;
+		return true;
+	}
+
+	// runs addr2line on addresses of the same module, reading its answers
+	// until they are all there or the deadline is reached
+	static void runAddr2line(Pending* pending, size_t count, int64_t deadline)
+	{
+		char addresses[64][2 + 2 * sizeof(uintptr_t) + 1];
+		char const* argv[6 + 64 + 1];
+		int argc = 0;
+
+/* have addr2line map the address to the relent line in the code */
+		argv[argc++] = "addr2line";
+		argv[argc++] = "-C";
+		argv[argc++] = "-f";
+		argv[argc++] = "-e";
+		argv[argc++] = pending[0].path.c_str();
+		for(size_t i = 0; i < count; ++i)
+		{
+			snprintf(addresses[i], sizeof(addresses[i]), "%#lx",
+			         static_cast<unsigned long>(pending[i].fileAddr));
+			argv[argc++] = addresses[i];
+		}
+		argv[argc] = NULL;
+
+		int fds[2];
+		if(pipe(fds) != 0)
+			return;
+
+		posix_spawn_file_actions_t actions;
+		posix_spawn_file_actions_init(&actions);
+		posix_spawn_file_actions_adddup2(&actions, fds[1], STDOUT_FILENO);
+		posix_spawn_file_actions_addclose(&actions, fds[0]);
+		posix_spawn_file_actions_addclose(&actions, fds[1]);
+		posix_spawn_file_actions_addopen(&actions, STDERR_FILENO, "/dev/null",
+		                                 O_WRONLY, 0);
+
+		pid_t pid;
+		int error = posix_spawnp(&pid, argv[0], &actions, NULL,
+		                         const_cast<char* const*>(argv), environ);
+		posix_spawn_file_actions_destroy(&actions);
+		close(fds[1]);
+
+		if(error != 0)
+		{
+			close(fds[0]);
+			return;
+		}
+
+		std::string output;
+		size_t answers = 0;
+		while(answers < count)
+		{
+			int64_t remaining = deadline - now();
+			if(remaining <= 0)
+				break;
+
+			pollfd pfd = {fds[0], POLLIN, 0};
+			int ready  = poll(&pfd, 1, static_cast<int>(remaining / 1000000) + 1);
+			if(ready < 0 && errno == EINTR)
+				continue;
+			if(ready <= 0)
+				break;
+
+			char chunk[4096];
+			ssize_t n = read(fds[0], chunk, sizeof(chunk));
+			if(n < 0 && errno == EINTR)
+				continue;
+			if(n <= 0)
+				break;
+			output.append(chunk, n);
+
+			answers += parseAnswers(&output, pending + answers, count - answers);
+		}
+
+		close(fds[0]);
+		if(answers < count)
+			kill(pid, SIGKILL);
+		while(waitpid(pid, NULL, 0) < 0 && errno == EINTR)
+		{
+		}
+	}
+
+	// consumes the complete pairs of lines of output, returns their number
+	static size_t parseAnswers(std::string* output, Pending* pending,
+	                           size_t count)
+	{
+		size_t answers = 0;
+		size_t begin   = 0;
+
+		while(answers < count)
+		{
+			size_t first = output->find('\n', begin);
+			if(first == std::string::npos)
+				break;
+			size_t second = output->find('\n', first + 1);
+			if(second == std::string::npos)
+				break;
+
+			std::string function = output->substr(begin, first - begin);
+			std::string location
+			    = output->substr(first + 1, second - first - 1);
+			begin = second + 1;
+
+			ResolvedFrame* frame = pending[answers].frame;
+
+			pending[answers].answered = true;
+			++answers;
+
+			// if symbols aren't readable
+			if(location.empty() || location[0] == '?')
+				continue;
+
+			if(!function.empty() && function[function.size() - 1] == '\r')
+				function.erase(function.size() - 1);
+			if(!location.empty() && location[location.size() - 1] == '\r')
+				location.erase(location.size() - 1);
+
+			// don't display the whole path
+			size_t lastSlash = location.rfind('/');
+			if(lastSlash != std::string::npos)
+				location.erase(0, lastSlash + 1);
+
+			copyString(frame->function, sizeof(frame->function),
+			           function.c_str());
+			copyString(frame->location, sizeof(frame->location),
+			           location.c_str());
+			frame->resolved = true;
+		}
+
+		output->erase(0, begin);
+		return answers;
+	}
+};
+
+#endif